@@ -44,7 +44,7 @@ extern "C" {
     }
 
     void *kmalloc(u32 size) {
-        return unified_allocator.alloc(size, ALLOC_FLAG_KERNEL);
+        return unified_allocator.alloc(size, ALLOC_FLAG_KERNEL, __builtin_return_address(0));
     }
 
     void kfree(void *ptr) {
@@ -52,11 +52,11 @@ extern "C" {
     }
     
     void *krealloc(void *ptr, u32 new_size) {
-        return unified_allocator.realloc(ptr, new_size);
+        return unified_allocator.realloc(ptr, new_size, __builtin_return_address(0));
     }
     
     void *kcalloc(u32 count, u32 size) {
-        return unified_allocator.calloc(count, size);
+        return unified_allocator.calloc(count, size, __builtin_return_address(0));
     }
     
     void init_unified_allocator(int mode) {
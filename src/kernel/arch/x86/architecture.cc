@@ -3,6 +3,8 @@
 #include <vmm.h>
 #include <pit.h>
 #include <runtime/alloc.h>
+#include <runtime/compaction.h>
+#include <hugepage.h>
 
 extern "C" {
     void *memset(void *s, int c, int n);
@@ -28,10 +30,13 @@ static void serial_print(const char *str)
     }
 }
 
+/* The idle task doubles as the background compactor; compact_proactive() rate-limits itself. */
 static void idle_thread()
 {
     while (1)
     {
+        compact_proactive();
+        hugepage_scan();
         asm volatile("hlt");
     }
 }
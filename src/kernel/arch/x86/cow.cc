@@ -1,5 +1,6 @@
 #include <os.h>
 #include <cow.h>
+#include <hugepage.h>
 #include <runtime/slab.h>
 
 COWManager cow_manager;
@@ -13,9 +14,9 @@ void COWManager::init() {
     total_cow_pages = 0;
     total_cow_mappings = 0;
     
-    cow_page_cache = kmem_cache_create("cow_pages", sizeof(struct cow_page), 8, 0);
-    cow_mapping_cache = kmem_cache_create("cow_mappings", sizeof(struct cow_mapping), 8, 0);
-    vma_cache = kmem_cache_create("vm_areas", sizeof(struct vm_area), 8, 0);
+    cow_page_cache = kmem_cache_create("cow_pages", sizeof(struct cow_page), 8, SLAB_HWCACHE);
+    cow_mapping_cache = kmem_cache_create("cow_mappings", sizeof(struct cow_mapping), 8, SLAB_HWCACHE);
+    vma_cache = kmem_cache_create("vm_areas", sizeof(struct vm_area), 8, SLAB_HWCACHE);
     
     if (!cow_page_cache || !cow_mapping_cache || !vma_cache) {
         io.print("[COW] Failed to create slab caches\n");
@@ -44,7 +45,7 @@ int COWManager::handle_cow_fault(struct page_directory *pd, u32 virtual_addr, u3
             u32 page_idx = VADDR_PT_OFFSET(page_addr);
             table[page_idx].writable = 1;
             
-            asm volatile("mov %0, %%cr3" :: "r"(pd->physical_address));
+            flush_tlb_page(pd, page_addr);
             return 0;
         }
         return -1;
@@ -63,7 +64,7 @@ int COWManager::break_cow(struct page_directory *pd, u32 virtual_addr) {
         if (table) {
             u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
             table[page_idx].writable = 1;
-            asm volatile("mov %0, %%cr3" :: "r"(pd->physical_address));
+            flush_tlb_page(pd, virtual_addr);
             return 0;
         }
         return -1;
@@ -75,7 +76,7 @@ int COWManager::break_cow(struct page_directory *pd, u32 virtual_addr) {
             u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
             table[page_idx].writable = 1;
             dec_cow_ref(cow_page);
-            asm volatile("mov %0, %%cr3" :: "r"(pd->physical_address));
+            flush_tlb_page(pd, virtual_addr);
             return 0;
         }
         return -1;
@@ -93,7 +94,6 @@ int COWManager::break_cow(struct page_directory *pd, u32 virtual_addr) {
     
     if (result == 0) {
         dec_cow_ref(cow_page);
-        asm volatile("mov %0, %%cr3" :: "r"(pd->physical_address));
     } else {
         vmm.free_frame(new_physical);
     }
@@ -103,10 +103,20 @@ int COWManager::break_cow(struct page_directory *pd, u32 virtual_addr) {
 
 int COWManager::cow_copy_page_range(struct page_directory *dst_pd, struct page_directory *src_pd,
                                    u32 start_addr, u32 end_addr) {
+    struct mmu_gather tlb;
+    tlb_gather_mmu(&tlb, src_pd);
+    int result = 0;
+    
     for (u32 addr = start_addr; addr < end_addr; addr += 4096) {
         u32 physical_addr = vmm.get_physical_addr(src_pd, addr);
         if (!physical_addr) continue;
         
+        /* Sharing is tracked per 4 KiB frame, so a huge page goes back to small ones first. */
+        if (vmm.is_huge(src_pd, addr) && split_huge_page(src_pd, addr) != 0) {
+            result = -1;
+            break;
+        }
+        
         struct page_table_entry *src_table = vmm.get_page_table(src_pd, addr, 0);
         if (!src_table) continue;
         
@@ -119,25 +129,32 @@ int COWManager::cow_copy_page_range(struct page_directory *dst_pd, struct page_d
         
         if (src_table[page_idx].writable) {
             src_table[page_idx].writable = 0;
+            tlb_flush_pte(&tlb, addr);
             flags &= ~PG_WRITE;
             
             struct cow_page *cow_page = find_cow_page(physical_addr);
             if (!cow_page) {
                 cow_page = alloc_cow_page(physical_addr);
-                if (!cow_page) return -1;
+                if (!cow_page) {
+                    result = -1;
+                    break;
+                }
             }
             inc_cow_ref(cow_page);
         }
         
-        int result = vmm.map_page(dst_pd, addr, physical_addr, flags);
-        if (result != 0) return result;
+        result = vmm.map_page(dst_pd, addr, physical_addr, flags);
+        if (result != 0) break;
     }
     
-    asm volatile("mov %0, %%cr3" :: "r"(src_pd->physical_address));
-    return 0;
+    tlb_finish_mmu(&tlb);
+    return result;
 }
 
 void COWManager::cow_free_page_range(struct page_directory *pd, u32 start_addr, u32 end_addr) {
+    struct mmu_gather tlb;
+    tlb_gather_mmu(&tlb, pd);
+    
     for (u32 addr = start_addr; addr < end_addr; addr += 4096) {
         u32 physical_addr = vmm.get_physical_addr(pd, addr);
         if (!physical_addr) continue;
@@ -147,8 +164,10 @@ void COWManager::cow_free_page_range(struct page_directory *pd, u32 start_addr,
             dec_cow_ref(cow_page);
         }
         
-        vmm.unmap_page(pd, addr);
+        vmm.unmap_page(&tlb, addr);
     }
+    
+    tlb_finish_mmu(&tlb);
 }
 
 struct vm_area *COWManager::create_vma(u32 start, u32 end, u32 flags) {
@@ -171,6 +190,70 @@ void COWManager::destroy_vma(struct vm_area *vma) {
     slab_allocator.cache_free(vma_cache, vma);
 }
 
+/*
+ * Record [start, end) as mapped in pd, rounded out to whole pages. A range
+ * that touches or overlaps an area with the same flags grows that area,
+ * so a heap extended a little at a time stays one VMA. The list is not
+ * kept sorted; an address space only has a handful of areas.
+ */
+struct vm_area *COWManager::add_vma(struct page_directory *pd, u32 start, u32 end, u32 flags) {
+    start &= ~0xFFF;
+    end = (end + 0xFFF) & ~0xFFF;
+    if (start >= end) return nullptr;
+    
+    struct vm_area *vma;
+    for (vma = pd->vmas; vma; vma = vma->vm_next) {
+        if (vma->vm_flags == flags && vma->vm_start <= end && start <= vma->vm_end) {
+            if (start < vma->vm_start) vma->vm_start = start;
+            if (end > vma->vm_end) vma->vm_end = end;
+            break;
+        }
+    }
+    
+    if (!vma) {
+        vma = create_vma(start, end, flags);
+        if (!vma) return nullptr;
+        
+        vma->vm_pd = pd;
+        vma->vm_next = pd->vmas;
+        if (pd->vmas) {
+            pd->vmas->vm_prev = vma;
+        }
+        pd->vmas = vma;
+    }
+    
+    hugepage_enter(pd, vma);
+    return vma;
+}
+
+struct vm_area *COWManager::find_vma(struct page_directory *pd, u32 addr) {
+    for (struct vm_area *vma = pd->vmas; vma; vma = vma->vm_next) {
+        if (addr >= vma->vm_start && addr < vma->vm_end) {
+            return vma;
+        }
+    }
+    return nullptr;
+}
+
+int COWManager::copy_vmas(struct page_directory *dst_pd, struct page_directory *src_pd) {
+    for (struct vm_area *vma = src_pd->vmas; vma; vma = vma->vm_next) {
+        if (!add_vma(dst_pd, vma->vm_start, vma->vm_end, vma->vm_flags)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void COWManager::free_vmas(struct page_directory *pd) {
+    struct vm_area *vma = pd->vmas;
+    while (vma) {
+        struct vm_area *next = vma->vm_next;
+        destroy_vma(vma);
+        vma = next;
+    }
+    pd->vmas = nullptr;
+}
+
 struct cow_page *COWManager::alloc_cow_page(u32 physical_addr) {
     struct cow_page *page = (struct cow_page*)slab_allocator.cache_alloc(cow_page_cache);
     if (!page) return nullptr;
@@ -252,9 +335,14 @@ int COWManager::map_pages(struct page_directory *pd, u32 start_addr, u32 end_add
 }
 
 int COWManager::unmap_pages(struct page_directory *pd, u32 start_addr, u32 end_addr) {
+    struct mmu_gather tlb;
+    tlb_gather_mmu(&tlb, pd);
+    
     for (u32 addr = start_addr; addr < end_addr; addr += 4096) {
-        vmm.unmap_page(pd, addr);
+        vmm.unmap_page(&tlb, addr);
     }
+    
+    tlb_finish_mmu(&tlb);
     return 0;
 }
 
@@ -324,6 +412,10 @@ void COWManager::cleanup_process_cow(struct page_directory *pd) {
     }
 }
 
+bool COWManager::is_cow_page(u32 physical_addr) {
+    return find_cow_page(physical_addr) != nullptr;
+}
+
 void COWManager::optimize_cow_pages() {
     struct cow_page *page = cow_pages;
     struct cow_page *next;
@@ -392,9 +484,18 @@ void init_cow_manager() {
 
 extern "C" {
     int cow_fork_mm(struct page_directory *child_pd, struct page_directory *parent_pd) {
+        if (cow_manager.copy_vmas(child_pd, parent_pd) != 0) {
+            return -1;
+        }
         return cow_manager.cow_copy_page_range(child_pd, parent_pd, USER_OFFSET, USER_STACK);
     }
     
+    /* Anonymous, private, read-write memory, populated on first touch. */
+    int vma_map_anon(struct page_directory *pd, u32 start, u32 end) {
+        if (!pd || start < USER_OFFSET || end > USER_STACK) return -1;
+        return cow_manager.add_vma(pd, start, end, VM_READ | VM_WRITE | VM_MAYREAD | VM_MAYWRITE) ? 0 : -1;
+    }
+    
     int cow_handle_page_fault(u32 fault_addr, u32 error_code) {
         return cow_manager.handle_cow_fault(current_directory, fault_addr, error_code);
     }
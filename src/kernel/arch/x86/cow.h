@@ -56,10 +56,15 @@ public:
     void cow_free_page_range(struct page_directory *pd, u32 start_addr, u32 end_addr);
     struct vm_area *create_vma(u32 start, u32 end, u32 flags);
     void destroy_vma(struct vm_area *vma);
+    struct vm_area *add_vma(struct page_directory *pd, u32 start, u32 end, u32 flags);
+    struct vm_area *find_vma(struct page_directory *pd, u32 addr);
+    int copy_vmas(struct page_directory *dst_pd, struct page_directory *src_pd);
+    void free_vmas(struct page_directory *pd);
     int map_pages(struct page_directory *pd, u32 start_addr, u32 end_addr, u32 flags);
     int unmap_pages(struct page_directory *pd, u32 start_addr, u32 end_addr);
     
     void cleanup_process_cow(struct page_directory *pd);
+    bool is_cow_page(u32 physical_addr);
     void optimize_cow_pages();
     int validate_cow_integrity();
     void print_stats();
@@ -90,6 +95,7 @@ extern COWManager cow_manager;
 extern "C" {
     void init_cow_manager();
     int cow_fork_mm(struct page_directory *child_pd, struct page_directory *parent_pd);
+    int vma_map_anon(struct page_directory *pd, u32 start, u32 end);
     int cow_handle_page_fault(u32 fault_addr, u32 error_code);
     void cow_cleanup_process(struct page_directory *pd);
     void cow_optimize();
@@ -0,0 +1,313 @@
+#include <os.h>
+#include <hugepage.h>
+#include <cow.h>
+#include <runtime/percpu.h>
+
+extern "C" {
+    void *memcpy(void *dest, const void *src, int n);
+    void *memset(void *s, int c, int n);
+    u64 get_system_ticks();
+}
+
+static_assert((MIN_BLOCK_SIZE << HUGEPAGE_ORDER) == LARGE_PAGESIZE,
+              "A huge page must be exactly one buddy block");
+
+static struct hugepage_stats stats;
+
+/* Address spaces with an area big enough for a huge page, and where the collapse pass left off. */
+static struct page_directory *slots[HUGEPAGE_MAX_SLOTS];
+static u32 scan_slot;
+static u32 scan_addr;
+static u32 last_scan;
+
+/*
+ * A huge page saves TLB entries and page walks, neither of which exist
+ * before enable_paging(); until then user memory stays 4 KiB.
+ */
+static bool thp_enabled() {
+    return vmm.large_pages() && vmm.paging_enabled();
+}
+
+static u32 huge_base(u32 virtual_addr) {
+    return virtual_addr & ~(LARGE_PAGESIZE - 1);
+}
+
+/* Only private, writable anonymous memory covering the whole aligned region is ever backed by a huge page. */
+static bool vma_suitable(struct vm_area *vma, u32 base) {
+    if (!vma || (vma->vm_flags & VM_SHARED) || !(vma->vm_flags & VM_WRITE)) return false;
+    return vma->vm_start <= base && base + LARGE_PAGESIZE <= vma->vm_end;
+}
+
+static struct page_directory_entry *huge_pde(struct page_directory *pd, u32 base) {
+    return &vmm.directory_entries(pd)[VADDR_PD_OFFSET(base)];
+}
+
+static void *alloc_huge_block(struct page_directory *pd) {
+    void *block = buddy_allocator.alloc_order(HUGEPAGE_ORDER);
+    if (!block) return nullptr;
+    
+    /* Blocks are aligned to their size by PFN; a PSE entry needs the physical address aligned too. */
+    if ((u32)block & (LARGE_PAGESIZE - 1)) {
+        buddy_allocator.free_order(block, HUGEPAGE_ORDER);
+        return nullptr;
+    }
+    
+    buddy_allocator.set_page_owner(block, PAGE_OWNER_ANON, pd);
+    return block;
+}
+
+/*
+ * First touch of an aligned 4 MiB region that a suitable area covers and
+ * that has no page table yet: back all of it with one zeroed block and a
+ * single directory entry. Returns 0 if it did, -1 to fall back to 4 KiB.
+ */
+int huge_fault(struct page_directory *pd, struct vm_area *vma, u32 fault_addr) {
+    if (!thp_enabled()) return -1;
+    
+    u32 base = huge_base(fault_addr);
+    if (!vma_suitable(vma, base) || huge_pde(pd, base)->present) return -1;
+    
+    void *block = alloc_huge_block(pd);
+    if (!block) {
+        stats.fault_fallback++;
+        return -1;
+    }
+    memset(block, 0, LARGE_PAGESIZE);
+    
+    if (vmm.map_large_page(pd, base, (u32)block, PG_PRESENT | PG_WRITE | PG_USER) != 0) {
+        buddy_allocator.free_order(block, HUGEPAGE_ORDER);
+        stats.fault_fallback++;
+        return -1;
+    }
+    
+    stats.fault_alloc++;
+    return 0;
+}
+
+/*
+ * Replace the huge page around virtual_addr by a page table mapping the
+ * same frames, which from then on are allocated, shared and freed one by
+ * one. Kernel large pages are never split.
+ */
+int split_huge_page(struct page_directory *pd, u32 virtual_addr) {
+    u32 base = huge_base(virtual_addr);
+    struct page_directory_entry *pde = huge_pde(pd, base);
+    if (!pde->present || !pde->page_size || !pde->user) return -1;
+    
+    u32 table_phys = vmm.alloc_frame();
+    if (!table_phys) return -1;
+    
+    u32 block = pde->frame << 12;
+    struct page_table_entry *table = (struct page_table_entry *)table_phys;
+    for (u32 i = 0; i < HUGEPAGE_PTES; i++) {
+        *(u32 *)&table[i] = 0;
+        table[i].present = 1;
+        table[i].writable = pde->writable;
+        table[i].user = 1;
+        table[i].frame = (block >> 12) + i;
+    }
+    
+    u32 irq = local_irq_save();
+    
+    buddy_allocator.split_page((void *)block);
+    for (u32 i = 0; i < HUGEPAGE_PTES; i++) {
+        struct buddy_page *page = buddy_allocator.virt_to_page((void *)(block + i * PAGESIZE));
+        page->index = base + i * PAGESIZE;
+    }
+    
+    pde->page_size = 0;
+    pde->global = 0;
+    pde->frame = table_phys >> 12;
+    flush_tlb_range(pd, base, base + LARGE_PAGESIZE);
+    flush_tlb_page(pd, (u32)vmm.table_entries(pd, VADDR_PD_OFFSET(base)));
+    
+    local_irq_restore(irq);
+    
+    stats.split++;
+    return 0;
+}
+
+static bool pd_registered(struct page_directory *pd) {
+    for (u32 i = 0; i < HUGEPAGE_MAX_SLOTS; i++) {
+        if (slots[i] == pd) return true;
+    }
+    return false;
+}
+
+/*
+ * The page table behind the region at base if it may be collapsed: the
+ * region is still covered by a suitable area, at least
+ * HUGEPAGE_COLLAPSE_MIN_PTES pages are populated, every one of them
+ * belongs to this address space alone and none of the region is out on
+ * swap. nullptr otherwise.
+ */
+static struct page_table_entry *collapse_table(struct page_directory *pd, u32 base) {
+    if (!vma_suitable(cow_manager.find_vma(pd, base), base)) return nullptr;
+    
+    struct page_directory_entry *pde = huge_pde(pd, base);
+    if (!pde->present || pde->page_size) return nullptr;
+    
+    struct page_table_entry *table = vmm.table_entries(pd, VADDR_PD_OFFSET(base));
+    u32 populated = 0;
+    
+    for (u32 i = 0; i < HUGEPAGE_PTES; i++) {
+        if (!table[i].present) continue;
+        
+        u32 frame = table[i].frame << 12;
+        struct buddy_page *page = buddy_allocator.virt_to_page((void *)frame);
+        if (!page || page->owner != PAGE_OWNER_ANON || page->owner_data != pd || cow_manager.is_cow_page(frame)) {
+            return nullptr;
+        }
+        populated++;
+    }
+    if (populated < HUGEPAGE_COLLAPSE_MIN_PTES) return nullptr;
+    
+    for (struct swapped_page_entry *entry = pd->swapped_pages; entry; entry = entry->next) {
+        if (huge_base(entry->virtual_addr) == base) return nullptr;
+    }
+    
+    return table;
+}
+
+/*
+ * Promote the page table around virtual_addr to a huge page if
+ * collapse_table() allows it. Populated pages are copied, holes are zero
+ * filled and the old frames freed once the TLB has let go. Allocating the
+ * block can compact and be preempted, so the address space may have
+ * forked, swapped or exited in the meantime: everything is checked again
+ * with interrupts off before anything is touched.
+ */
+bool collapse_huge_page(struct page_directory *pd, u32 virtual_addr) {
+    if (!thp_enabled()) return false;
+    
+    u32 base = huge_base(virtual_addr);
+    u32 table_idx = VADDR_PD_OFFSET(base);
+    if (!collapse_table(pd, base)) return false;
+    
+    void *block = alloc_huge_block(pd);
+    if (!block) {
+        stats.collapse_failed++;
+        return false;
+    }
+    
+    u32 irq = local_irq_save();
+    
+    struct page_table_entry *table = pd_registered(pd) ? collapse_table(pd, base) : nullptr;
+    if (!table) {
+        local_irq_restore(irq);
+        buddy_allocator.free_order(block, HUGEPAGE_ORDER);
+        return false;
+    }
+    
+    for (u32 i = 0; i < HUGEPAGE_PTES; i++) {
+        char *dst = (char *)block + i * PAGESIZE;
+        if (table[i].present) {
+            memcpy(dst, (void *)(table[i].frame << 12), PAGESIZE);
+        } else {
+            memset(dst, 0, PAGESIZE);
+        }
+    }
+    
+    struct page_directory_entry *pde = huge_pde(pd, base);
+    u32 table_phys = pde->frame << 12;
+    *(u32 *)pde = 0;
+    vmm.map_large_page(pd, base, (u32)block, PG_PRESENT | PG_WRITE | PG_USER);
+    flush_tlb_range(pd, base, base + LARGE_PAGESIZE);
+    flush_tlb_page(pd, (u32)vmm.table_entries(pd, table_idx));
+    
+    struct page_table_entry *old = (struct page_table_entry *)table_phys;
+    for (u32 i = 0; i < HUGEPAGE_PTES; i++) {
+        if (old[i].present) {
+            vmm.free_frame(old[i].frame << 12);
+        }
+    }
+    vmm.free_frame(table_phys);
+    
+    local_irq_restore(irq);
+    
+    stats.collapse_alloc++;
+    return true;
+}
+
+/* An area now spans a whole aligned region; let the collapse pass look at its address space. */
+void hugepage_enter(struct page_directory *pd, struct vm_area *vma) {
+    u32 base = (vma->vm_start + LARGE_PAGESIZE - 1) & ~(LARGE_PAGESIZE - 1);
+    if (base + LARGE_PAGESIZE > vma->vm_end) return;
+    
+    int free_slot = -1;
+    for (u32 i = 0; i < HUGEPAGE_MAX_SLOTS; i++) {
+        if (slots[i] == pd) return;
+        if (!slots[i] && free_slot < 0) free_slot = i;
+    }
+    if (free_slot >= 0) {
+        slots[free_slot] = pd;
+    }
+}
+
+void hugepage_exit(struct page_directory *pd) {
+    for (u32 i = 0; i < HUGEPAGE_MAX_SLOTS; i++) {
+        if (slots[i] == pd) {
+            slots[i] = nullptr;
+            if (scan_slot == i) scan_addr = 0;
+        }
+    }
+}
+
+/* Lowest aligned region at or above from that one of pd's areas covers entirely, 0 if none. */
+static u32 next_region(struct page_directory *pd, u32 from) {
+    u32 best = 0;
+    
+    for (struct vm_area *vma = pd->vmas; vma; vma = vma->vm_next) {
+        u32 start = vma->vm_start > from ? vma->vm_start : from;
+        u32 base = (start + LARGE_PAGESIZE - 1) & ~(LARGE_PAGESIZE - 1);
+        if (base + LARGE_PAGESIZE <= vma->vm_end && (!best || base < best)) {
+            best = base;
+        }
+    }
+    
+    return best;
+}
+
+/*
+ * Background collapse, called from the idle task. Every interval it
+ * examines up to HUGEPAGE_SCAN_REGIONS regions, carrying on through the
+ * registered address spaces in turn from where the last round stopped.
+ */
+void hugepage_scan() {
+    if (!thp_enabled()) return;
+    
+    u32 now = (u32)get_system_ticks();
+    if (now - last_scan < HUGEPAGE_SCAN_INTERVAL) return;
+    last_scan = now;
+    
+    for (u32 n = 0; n < HUGEPAGE_SCAN_REGIONS; n++) {
+        struct page_directory *pd = slots[scan_slot];
+        u32 base = pd ? next_region(pd, scan_addr) : 0;
+        
+        if (!base) {
+            scan_slot = (scan_slot + 1) % HUGEPAGE_MAX_SLOTS;
+            scan_addr = 0;
+            continue;
+        }
+        
+        stats.scanned++;
+        collapse_huge_page(pd, base);
+        scan_addr = base + LARGE_PAGESIZE;
+    }
+}
+
+struct hugepage_stats *hugepage_get_stats() {
+    return &stats;
+}
+
+void print_hugepage_stats() {
+    if (!vmm.large_pages()) {
+        io.print("[THP] Huge pages: unavailable\n");
+    } else {
+        io.print("[THP] Huge pages: %s\n", thp_enabled() ? "enabled" : "off until paging is enabled");
+    }
+    io.print("  Faults: %d huge, %d fell back to 4 KiB\n", stats.fault_alloc, stats.fault_fallback);
+    io.print("  Collapses: %d done, %d failed for memory, %d regions scanned\n",
+             stats.collapse_alloc, stats.collapse_failed, stats.scanned);
+    io.print("  Splits: %d\n", stats.split);
+}
@@ -0,0 +1,42 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <runtime/types.h>
+#include <runtime/buddy.h>
+#include <vmm.h>
+
+/* A huge page is one 4 MiB directory entry backed by one buddy block. */
+#define HUGEPAGE_ORDER  10
+#define HUGEPAGE_PTES   (1U << HUGEPAGE_ORDER)
+
+/* Address spaces the background collapse pass keeps an eye on. */
+#define HUGEPAGE_MAX_SLOTS  16
+
+/* Background collapse: how often the idle task looks, and how many 4 MiB regions it examines per round. */
+#define HUGEPAGE_SCAN_INTERVAL  1000
+#define HUGEPAGE_SCAN_REGIONS   8
+
+/* A region is collapsed once at least this many of its 4 KiB pages are populated. */
+#define HUGEPAGE_COLLAPSE_MIN_PTES  (HUGEPAGE_PTES / 2)
+
+struct hugepage_stats {
+    u32 fault_alloc;
+    u32 fault_fallback;
+    u32 collapse_alloc;
+    u32 collapse_failed;
+    u32 split;
+    u32 scanned;
+};
+
+int huge_fault(struct page_directory *pd, struct vm_area *vma, u32 fault_addr);
+int split_huge_page(struct page_directory *pd, u32 virtual_addr);
+bool collapse_huge_page(struct page_directory *pd, u32 virtual_addr);
+
+void hugepage_enter(struct page_directory *pd, struct vm_area *vma);
+void hugepage_exit(struct page_directory *pd);
+void hugepage_scan();
+
+struct hugepage_stats *hugepage_get_stats();
+void print_hugepage_stats();
+
+#endif
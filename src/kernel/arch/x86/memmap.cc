@@ -0,0 +1,275 @@
+#include <os.h>
+#include <memmap.h>
+#include <x86.h>
+#include <runtime/buddy.h>
+
+extern "C" char ebss[];
+
+MemoryMap memmap;
+
+static const char *region_type_name(u32 type) {
+    switch (type) {
+        case E820_RAM: return "usable";
+        case E820_RESERVED: return "reserved";
+        case E820_ACPI: return "ACPI";
+        case E820_NVS: return "ACPI NVS";
+        case E820_UNUSABLE: return "unusable";
+        default: return "unknown";
+    }
+}
+
+void MemoryMap::init(struct multiboot_info *mbi) {
+    nr_regions = 0;
+    nr_reserved = 0;
+    max_pfn = 0;
+    usable_pages = 0;
+    
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        u32 entry_addr = mbi->mmap_addr;
+        u32 end = mbi->mmap_addr + mbi->mmap_length;
+        
+        while (entry_addr < end) {
+            struct multiboot_mmap_entry *entry = (struct multiboot_mmap_entry *)entry_addr;
+            add_region(entry->addr, entry->len, entry->type);
+            entry_addr += entry->size + sizeof(entry->size);
+        }
+    } else if (mbi && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        add_region(0, (u64)mbi->low_mem * 1024, E820_RAM);
+        add_region(KERN_BASE, (u64)mbi->high_mem * 1024, E820_RAM);
+    } else {
+        io.print("[MEMMAP] No memory information from bootloader, assuming 32 MB\n");
+        add_region(0, 0xA0000, E820_RAM);
+        add_region(KERN_BASE, 0x2000000 - KERN_BASE, E820_RAM);
+    }
+    
+    /* Firmware lists entries in address order in practice, but nothing guarantees it. */
+    for (u32 i = 1; i < nr_regions; i++) {
+        struct memmap_region tmp = regions[i];
+        u32 j = i;
+        while (j > 0 && regions[j - 1].start_pfn > tmp.start_pfn) {
+            regions[j] = regions[j - 1];
+            j--;
+        }
+        regions[j] = tmp;
+    }
+    
+    /* Real-mode IVT, BIOS data, boot stack and the descriptor tables all live below 1 MB. */
+    reserve(0, KERN_BASE >> 12);
+    reserve(KERN_BASE >> 12, ((u32)ebss + PAGESIZE - 1) >> 12);
+    
+    if (mbi && (mbi->flags & MULTIBOOT_INFO_MODS)) {
+        struct multiboot_module *mods = (struct multiboot_module *)mbi->mods_addr;
+        for (u32 i = 0; i < mbi->mods_count; i++) {
+            reserve(mods[i].mod_start >> 12, (mods[i].mod_end + PAGESIZE - 1) >> 12);
+        }
+    }
+    
+    print();
+}
+
+void MemoryMap::add_region(u64 addr, u64 len, u32 type) {
+    u64 end = addr + len;
+    
+    if (len == 0 || addr >= ((u64)MEMMAP_LIMIT_PFN << 12)) {
+        return;
+    }
+    if (end > ((u64)MEMMAP_LIMIT_PFN << 12)) {
+        end = (u64)MEMMAP_LIMIT_PFN << 12;
+    }
+    
+    if (nr_regions >= MEMMAP_MAX_REGIONS) {
+        io.print("[MEMMAP] Too many regions, ignoring %x\n", (u32)addr);
+        return;
+    }
+    
+    struct memmap_region *region = &regions[nr_regions];
+    region->type = type;
+    
+    /* Usable ranges shrink to whole pages, everything else grows to cover partial pages. */
+    if (type == E820_RAM) {
+        region->start_pfn = (u32)((addr + PAGESIZE - 1) >> 12);
+        region->end_pfn = (u32)(end >> 12);
+        if (region->end_pfn <= region->start_pfn) {
+            return;
+        }
+        usable_pages += region->end_pfn - region->start_pfn;
+        if (region->end_pfn > max_pfn) {
+            max_pfn = region->end_pfn;
+        }
+    } else {
+        region->start_pfn = (u32)(addr >> 12);
+        region->end_pfn = (u32)((end + PAGESIZE - 1) >> 12);
+    }
+    
+    nr_regions++;
+}
+
+void MemoryMap::reserve(u32 start_pfn, u32 end_pfn) {
+    if (end_pfn <= start_pfn) return;
+    
+    if (nr_reserved >= MEMMAP_MAX_RESERVED) {
+        io.print("[MEMMAP] Error: reserved range table full\n");
+        return;
+    }
+    
+    reserved[nr_reserved].start_pfn = start_pfn;
+    reserved[nr_reserved].end_pfn = end_pfn;
+    reserved[nr_reserved].type = E820_RESERVED;
+    nr_reserved++;
+}
+
+/* Index of the first range overlapping [start_pfn, end_pfn), -1 if none. */
+static int find_overlap(const struct memmap_region *ranges, u32 count, bool skip_ram, u32 start_pfn, u32 end_pfn) {
+    for (u32 i = 0; i < count; i++) {
+        if (skip_ram && ranges[i].type == E820_RAM) continue;
+        
+        if (ranges[i].start_pfn < end_pfn && start_pfn < ranges[i].end_pfn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int MemoryMap::find_reserved(u32 start_pfn, u32 end_pfn) {
+    return find_overlap(reserved, nr_reserved, false, start_pfn, end_pfn);
+}
+
+/*
+ * Early page-granular allocation for allocator metadata. Carves from the
+ * top of low memory so the DMA zone is the last thing to be eaten into,
+ * stepping below reserved ranges and the non-RAM entries (typically ACPI
+ * tables) that firmware lets overlap RAM up there.
+ */
+void *MemoryMap::boot_alloc(u32 size) {
+    u32 pages = (size + PAGESIZE - 1) / PAGESIZE;
+    
+    for (int i = nr_regions - 1; i >= 0; i--) {
+        struct memmap_region *region = &regions[i];
+        if (region->type != E820_RAM) continue;
+        
+        u32 end = region->end_pfn;
+        if (end > ZONE_NORMAL_END_PFN) {
+            end = ZONE_NORMAL_END_PFN;
+        }
+        
+        while (end >= region->start_pfn + pages) {
+            int conflict = find_reserved(end - pages, end);
+            if (conflict >= 0) {
+                end = reserved[conflict].start_pfn;
+                continue;
+            }
+            
+            conflict = find_overlap(regions, nr_regions, true, end - pages, end);
+            if (conflict >= 0) {
+                end = regions[conflict].start_pfn;
+                continue;
+            }
+            
+            reserve(end - pages, end);
+            return (void*)((end - pages) << 12);
+        }
+    }
+    
+    io.print("[MEMMAP] Error: boot allocation of %d bytes failed\n", size);
+    return nullptr;
+}
+
+/*
+ * Clip pfn against a list of ranges that must not be freed. If one covers
+ * pfn, returns true with pfn moved past it; otherwise lowers next to the
+ * start of the nearest range above pfn.
+ */
+static bool clip_range(const struct memmap_region *ranges, u32 count, bool skip_ram, u32 *pfn, u32 *next) {
+    for (u32 r = 0; r < count; r++) {
+        if (skip_ram && ranges[r].type == E820_RAM) continue;
+        
+        if (ranges[r].start_pfn <= *pfn && *pfn < ranges[r].end_pfn) {
+            *pfn = ranges[r].end_pfn;
+            return true;
+        }
+        if (ranges[r].start_pfn > *pfn && ranges[r].start_pfn < *next) {
+            *next = ranges[r].start_pfn;
+        }
+    }
+    return false;
+}
+
+/*
+ * Hand every page of RAM to fn that is neither on the reserved list nor
+ * claimed by an overlapping non-RAM entry; firmware maps do overlap, and
+ * the stricter type wins.
+ */
+void MemoryMap::for_each_free_range(void (*fn)(u32 start_pfn, u32 end_pfn)) {
+    for (u32 i = 0; i < nr_regions; i++) {
+        if (regions[i].type != E820_RAM) continue;
+        
+        u32 pfn = regions[i].start_pfn;
+        u32 end = regions[i].end_pfn;
+        
+        while (pfn < end) {
+            u32 next = end;
+            
+            if (clip_range(reserved, nr_reserved, false, &pfn, &next)) continue;
+            if (clip_range(regions, nr_regions, true, &pfn, &next)) continue;
+            
+            fn(pfn, next);
+            pfn = next;
+        }
+    }
+}
+
+static void buddy_free_range(u32 start_pfn, u32 end_pfn) {
+    buddy_allocator.free_range(start_pfn, end_pfn);
+}
+
+/*
+ * One buddy zone per populated PFN band: DMA below 16 MB, Normal up to
+ * 896 MB and HighMem above. All descriptor arrays are carved before any
+ * page is released so the zones never hand out their own metadata.
+ */
+void MemoryMap::setup_zones() {
+    static const u32 zone_bounds[MAX_NR_ZONES + 1] = {
+        0, ZONE_DMA_END_PFN, ZONE_NORMAL_END_PFN, MEMMAP_LIMIT_PFN
+    };
+    
+    buddy_allocator.reset();
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        u32 lo = zone_bounds[z + 1];
+        u32 hi = zone_bounds[z];
+        
+        for (u32 i = 0; i < nr_regions; i++) {
+            if (regions[i].type != E820_RAM) continue;
+            
+            u32 start = regions[i].start_pfn > zone_bounds[z] ? regions[i].start_pfn : zone_bounds[z];
+            u32 end = regions[i].end_pfn < zone_bounds[z + 1] ? regions[i].end_pfn : zone_bounds[z + 1];
+            if (start >= end) continue;
+            
+            if (start < lo) lo = start;
+            if (end > hi) hi = end;
+        }
+        
+        if (lo >= hi) continue;
+        
+        void *meta = boot_alloc(buddy_allocator.zone_meta_size(lo, hi));
+        if (!meta) {
+            io.print("[MEMMAP] Error: no room for zone %d descriptors\n", z);
+            continue;
+        }
+        
+        buddy_allocator.init_zone(z, lo, hi, meta);
+    }
+    
+    for_each_free_range(buddy_free_range);
+    buddy_allocator.setup_watermarks();
+    
+    io.print("[MEMMAP] %d KB usable, highest pfn %x\n", usable_pages * 4, max_pfn);
+}
+
+void MemoryMap::print() {
+    io.print("[MEMMAP] Physical memory map:\n");
+    for (u32 i = 0; i < nr_regions; i++) {
+        io.print("  %x - %x %s\n", regions[i].start_pfn << 12, (regions[i].end_pfn << 12) - 1,
+                 region_type_name(regions[i].type));
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <runtime/types.h>
+#include <core/boot.h>
+
+#define MULTIBOOT_INFO_MEMORY   0x00000001
+#define MULTIBOOT_INFO_MODS     0x00000008
+#define MULTIBOOT_INFO_MEM_MAP  0x00000040
+
+#define E820_RAM        1
+#define E820_RESERVED   2
+#define E820_ACPI       3
+#define E820_NVS        4
+#define E820_UNUSABLE   5
+
+#define MEMMAP_MAX_REGIONS  32
+#define MEMMAP_MAX_RESERVED 16
+
+/* Highest PFN reachable without PAE. */
+#define MEMMAP_LIMIT_PFN    0x100000
+
+struct multiboot_mmap_entry {
+    u32 size;
+    u64 addr;
+    u64 len;
+    u32 type;
+} __attribute__((packed));
+
+struct multiboot_module {
+    u32 mod_start;
+    u32 mod_end;
+    u32 string;
+    u32 reserved;
+};
+
+struct memmap_region {
+    u32 start_pfn;
+    u32 end_pfn;
+    u32 type;
+};
+
+/*
+ * Physical memory layout as reported by the bootloader, plus a small list
+ * of ranges (low memory, kernel image, modules, boot allocations) that must
+ * never reach the page allocator. The map is copied out of the multiboot
+ * info at boot so nothing depends on that memory staying intact.
+ */
+class MemoryMap {
+public:
+    void init(struct multiboot_info *mbi);
+    void reserve(u32 start_pfn, u32 end_pfn);
+    void *boot_alloc(u32 size);
+    void for_each_free_range(void (*fn)(u32 start_pfn, u32 end_pfn));
+    void setup_zones();
+    void print();
+    
+    u32 max_pfn;
+    u32 usable_pages;
+
+private:
+    struct memmap_region regions[MEMMAP_MAX_REGIONS];
+    struct memmap_region reserved[MEMMAP_MAX_RESERVED];
+    u32 nr_regions;
+    u32 nr_reserved;
+    
+    void add_region(u64 addr, u64 len, u32 type);
+    int find_reserved(u32 start_pfn, u32 end_pfn);
+};
+
+extern MemoryMap memmap;
+
+#endif
@@ -2,6 +2,7 @@
 #include <page_replacement.h>
 #include <vmm.h>
 #include <runtime/alloc.h>
+#include <runtime/object_pool.h>
 #include <architecture.h>
 
 extern "C" {
@@ -12,6 +13,17 @@ extern "C" {
 
 PageReplacementManager page_replacement_manager;
 
+/* One descriptor per tracked page, created and destroyed on every fault and eviction. */
+static ObjectPool<struct page_descriptor> page_descriptor_pool("page_descriptor");
+
+void *page_descriptor::operator new(size_t size) noexcept {
+    return page_descriptor_pool.alloc(size);
+}
+
+void page_descriptor::operator delete(void *ptr) {
+    PoolBase::release(ptr);
+}
+
 static const char* algorithm_names[] = {
     "LRU", "FIFO", "Clock", "Enhanced LRU"
 };
@@ -25,7 +37,7 @@ static u32 get_memory_pressure() {
     }
     
 
-    return (vmm.frames_used * 100) / vmm.frame_count;
+    return (vmm.used_frames() * 100) / vmm.frame_count;
 }
 
 void PageReplacementManager::init() {
@@ -156,7 +168,7 @@ struct page_descriptor* PageReplacementManager::find_victim_page() {
 }
 
 void PageReplacementManager::add_page(u32 virtual_addr, u32 physical_addr, u32 flags) {
-    struct page_descriptor *page = (struct page_descriptor *)kmalloc(sizeof(struct page_descriptor));
+    struct page_descriptor *page = new struct page_descriptor;
     if (!page) {
         io.print("[PAGE_REPL] Failed to allocate page descriptor\n");
         return;
@@ -243,7 +255,7 @@ void PageReplacementManager::remove_page(u32 virtual_addr) {
         page_list_tail = page->prev;
     }
     
-    kfree(page);
+    delete page;
     total_pages--;
 }
 
@@ -44,6 +44,9 @@ struct page_descriptor {
             u32 reference_bit;
         } clock_data;
     };
+    
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *ptr);
 };
 
 struct replacement_stats {
@@ -3,6 +3,7 @@
 #include <vmm.h>
 #include <page_replacement.h>
 #include <runtime/alloc.h>
+#include <runtime/object_pool.h>
 
 extern "C" {
     int strlen(const char *s);
@@ -12,6 +13,16 @@ extern "C" {
 
 SwapManager swap_manager;
 
+static ObjectPool<struct page_lru> page_lru_pool("page_lru");
+
+void *page_lru::operator new(size_t size) noexcept {
+    return page_lru_pool.alloc(size);
+}
+
+void page_lru::operator delete(void *ptr) {
+    PoolBase::release(ptr);
+}
+
 static int swap_file_read_page(struct swap_device *dev, u32 offset, void *buffer);
 static int swap_file_write_page(struct swap_device *dev, u32 offset, void *buffer);
 static int swap_file_activate(struct swap_device *dev);
@@ -157,7 +168,7 @@ u32 SwapManager::swap_out_page(u32 virtual_addr) {
     
     u32 swap_entry_id = ((u32)(dev - swap_devices) << 24) | offset;
     vmm.add_swapped_page(current_directory, virtual_addr, swap_entry_id);
-    vmm.unmap_page(current_directory, virtual_addr);
+    vmm.unmap_page(current_directory, virtual_addr, true);
     remove_from_lru(virtual_addr);
     
     swap_out_count++;
@@ -288,7 +299,7 @@ void SwapManager::update_page_access(u32 virtual_addr) {
 }
 
 void SwapManager::add_to_lru(u32 virtual_addr) {
-    struct page_lru *page = (struct page_lru *)kmalloc(sizeof(struct page_lru));
+    struct page_lru *page = new struct page_lru;
     if (!page) return;
     
     page->virtual_addr = virtual_addr;
@@ -316,7 +327,7 @@ void SwapManager::remove_from_lru(u32 virtual_addr) {
             if (page == lru_head) lru_head = page->next;
             if (page == lru_tail) lru_tail = page->prev;
             
-            kfree(page);
+            delete page;
             lru_count--;
             return;
         }
@@ -379,7 +390,7 @@ struct swap_device *SwapManager::find_swap_device(const char *path) {
 
 void SwapManager::get_memory_stats(struct memory_stats *stats) {
     stats->total_pages = vmm.frame_count;
-    stats->used_pages = vmm.frames_used;
+    stats->used_pages = vmm.used_frames();
     stats->free_pages = stats->total_pages - stats->used_pages;
     stats->cached_pages = 0;
     stats->swap_total = total_swap_pages;
@@ -485,7 +496,7 @@ struct page_descriptor* SwapManager::get_optimal_victim_page() {
         io.print("[SWAP] Legacy LRU selected victim page %x\n", lru_victim->virtual_addr);
         
 
-        struct page_descriptor *desc = (struct page_descriptor *)kmalloc(sizeof(struct page_descriptor));
+        struct page_descriptor *desc = new struct page_descriptor;
         if (desc) {
             desc->virtual_addr = lru_victim->virtual_addr;
             desc->physical_addr = vmm.get_physical_addr(current_directory, lru_victim->virtual_addr);
@@ -55,6 +55,9 @@ struct page_lru {
     u32 flags;
     struct page_lru *next;
     struct page_lru *prev;
+    
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *ptr);
 };
 
 struct memory_stats {
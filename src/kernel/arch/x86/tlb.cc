@@ -0,0 +1,140 @@
+#include <os.h>
+#include <tlb.h>
+#include <vmm.h>
+
+static struct tlb_stats stats;
+static bool global_pages = false;
+
+/* Turn on global pages if the CPU has them; the kernel's mappings then survive CR3 reloads. */
+void tlb_init() {
+    if (!(cpu_features() & CPUID_PGE)) {
+        io.print("[TLB] No global page support, kernel mappings are flushed on every switch\n");
+        return;
+    }
+    
+    u32 cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= PGE_FLAG;
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+    global_pages = true;
+}
+
+bool tlb_global_pages() {
+    return global_pages;
+}
+
+/*
+ * Only the loaded address space can have entries in the TLB, plus the
+ * kernel's global ones, which stay cached whatever is loaded. Any other
+ * address space is flushed wholesale when it is switched to.
+ */
+static bool tlb_live(struct page_directory *pd) {
+    return pd == current_directory || pd == kernel_directory;
+}
+
+void flush_tlb_page(struct page_directory *pd, u32 virtual_addr) {
+    if (!tlb_live(pd)) return;
+    
+    asm volatile("invlpg (%0)" :: "r"(virtual_addr) : "memory");
+    stats.page_flushes++;
+}
+
+/* Drops every entry except global ones. */
+void flush_tlb_all() {
+    u32 cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    stats.full_flushes++;
+}
+
+/* Drops global entries as well, by toggling CR4.PGE. */
+void flush_tlb_global() {
+    if (!global_pages) {
+        flush_tlb_all();
+        return;
+    }
+    
+    u32 cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~PGE_FLAG) : "memory");
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    stats.global_flushes++;
+}
+
+/*
+ * Invalidate [start, end). Short ranges get an invlpg per page; past
+ * TLB_FLUSH_ALL_THRESHOLD pages the whole TLB goes, which for a range
+ * below USER_OFFSET has to include the global kernel entries.
+ */
+void flush_tlb_range(struct page_directory *pd, u32 start, u32 end) {
+    if (!tlb_live(pd) || start >= end) return;
+    
+    start &= ~0xFFF;
+    if ((end - start) >> 12 > TLB_FLUSH_ALL_THRESHOLD) {
+        if (start >= USER_OFFSET) {
+            flush_tlb_all();
+        } else {
+            flush_tlb_global();
+        }
+        return;
+    }
+    
+    for (u32 addr = start; addr < end; addr += 4096) {
+        asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+        stats.page_flushes++;
+    }
+}
+
+void tlb_gather_mmu(struct mmu_gather *tlb, struct page_directory *pd) {
+    tlb->pd = pd;
+    tlb->start = 0xFFFFFFFF;
+    tlb->end = 0;
+    tlb->nr_frames = 0;
+    stats.gathers++;
+}
+
+/* A PTE of the gathered address space changed; its page joins the range flushed later. */
+void tlb_flush_pte(struct mmu_gather *tlb, u32 virtual_addr) {
+    virtual_addr &= ~0xFFF;
+    if (virtual_addr < tlb->start) tlb->start = virtual_addr;
+    if (virtual_addr + 4096 > tlb->end) tlb->end = virtual_addr + 4096;
+    stats.gathered_pages++;
+}
+
+/* The mapping of frame_addr at virtual_addr is gone; free the frame once the TLB cannot reach it. */
+void tlb_remove_page(struct mmu_gather *tlb, u32 virtual_addr, u32 frame_addr) {
+    tlb_flush_pte(tlb, virtual_addr);
+    
+    tlb->frames[tlb->nr_frames++] = frame_addr;
+    if (tlb->nr_frames == TLB_GATHER_FRAMES) {
+        tlb_flush_mmu(tlb);
+    }
+}
+
+void tlb_flush_mmu(struct mmu_gather *tlb) {
+    if (tlb->start < tlb->end) {
+        flush_tlb_range(tlb->pd, tlb->start, tlb->end);
+    }
+    tlb->start = 0xFFFFFFFF;
+    tlb->end = 0;
+    
+    for (u32 i = 0; i < tlb->nr_frames; i++) {
+        vmm.free_frame(tlb->frames[i]);
+    }
+    tlb->nr_frames = 0;
+}
+
+void tlb_finish_mmu(struct mmu_gather *tlb) {
+    tlb_flush_mmu(tlb);
+}
+
+struct tlb_stats *tlb_get_stats() {
+    return &stats;
+}
+
+void print_tlb_stats() {
+    io.print("[TLB] Global pages: %s\n", global_pages ? "on" : "off");
+    io.print("  Page invalidations: %d, full flushes: %d, global flushes: %d\n",
+             stats.page_flushes, stats.full_flushes, stats.global_flushes);
+    io.print("  Gathers: %d covering %d pages\n", stats.gathers, stats.gathered_pages);
+}
@@ -0,0 +1,54 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <runtime/types.h>
+
+struct page_directory;
+
+/* Past this many pages one CR3 reload is cheaper than an invlpg each. */
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+/* Frames an mmu_gather holds back before it has to flush and free them. */
+#define TLB_GATHER_FRAMES 32
+
+/*
+ * Batches the TLB work of one pass over an address space (fork write-
+ * protecting the parent, munmap tearing pages down). PTE changes only
+ * widen the pending range; frames whose mapping was removed are kept
+ * until the range has been flushed, so no stale entry can reach a frame
+ * that has already been handed out again.
+ */
+struct mmu_gather {
+    struct page_directory *pd;
+    u32 start;
+    u32 end;
+    u32 nr_frames;
+    u32 frames[TLB_GATHER_FRAMES];
+};
+
+struct tlb_stats {
+    u32 page_flushes;
+    u32 full_flushes;
+    u32 global_flushes;
+    u32 gathers;
+    u32 gathered_pages;
+};
+
+void tlb_init();
+bool tlb_global_pages();
+
+void flush_tlb_page(struct page_directory *pd, u32 virtual_addr);
+void flush_tlb_range(struct page_directory *pd, u32 start, u32 end);
+void flush_tlb_all();
+void flush_tlb_global();
+
+void tlb_gather_mmu(struct mmu_gather *tlb, struct page_directory *pd);
+void tlb_flush_pte(struct mmu_gather *tlb, u32 virtual_addr);
+void tlb_remove_page(struct mmu_gather *tlb, u32 virtual_addr, u32 frame_addr);
+void tlb_flush_mmu(struct mmu_gather *tlb);
+void tlb_finish_mmu(struct mmu_gather *tlb);
+
+struct tlb_stats *tlb_get_stats();
+void print_tlb_stats();
+
+#endif
@@ -1,22 +1,209 @@
 #include <os.h>
 #include <vmm.h>
 #include <swap.h>
+#include <memmap.h>
 #include <runtime/buddy.h>
 #include <runtime/slab.h>
 #include <runtime/slob.h>
 #include <runtime/slub.h>
 #include <runtime/unified_alloc.h>
+#include <runtime/shrinker.h>
+#include <runtime/object_pool.h>
+#include <runtime/compaction.h>
 #include <cow.h>
+#include <hugepage.h>
 
 VMM vmm;
 struct page_directory *kernel_directory = 0;
 struct page_directory *current_directory = 0;
 
-#define PHYS_MEM_START 0x100000
 #define FRAME_SIZE 4096
-#define MAX_FRAMES 0x100000
+#define SHRINK_BATCH 32
 
-static u32 static_frame_bitmap[MAX_FRAMES / 32];
+extern "C" {
+    void *memset(void *s, int c, int n);
+}
+
+/* Set by enable_paging(); until then the recursive window is not there and frames are reached by their physical address. */
+static bool paging_on = false;
+
+static ObjectPool<struct swapped_page_entry> swapped_page_pool("swapped_page");
+static struct fault_around_stats fault_stats;
+
+void *swapped_page_entry::operator new(size_t size) noexcept {
+    return swapped_page_pool.alloc(size);
+}
+
+void swapped_page_entry::operator delete(void *ptr) {
+    PoolBase::release(ptr);
+}
+
+/*
+ * Reverse map for user frames: the first user mapping of a frame records
+ * its page directory and address in the frame's descriptor. A frame mapped
+ * a second time (fork sharing it copy-on-write, or an alias) loses its
+ * page directory and is never moved.
+ */
+static void anon_page_add_rmap(struct page_directory *pd, u32 virtual_addr, u32 physical_addr) {
+    struct buddy_page *page = buddy_allocator.virt_to_page((void *)physical_addr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page->order != 0) return;
+    
+    if (page->owner == PAGE_OWNER_NONE) {
+        page->owner = PAGE_OWNER_ANON;
+        page->owner_data = pd;
+        page->index = virtual_addr;
+    } else if (page->owner == PAGE_OWNER_ANON && (page->owner_data != pd || page->index != virtual_addr)) {
+        page->owner_data = nullptr;
+    }
+}
+
+/* Compaction moving a user frame: point its one PTE at the copy. */
+static int anon_page_migrate(struct buddy_page *page, void *from, void *to) {
+    struct page_directory *pd = (struct page_directory *)page->owner_data;
+    u32 virtual_addr = page->index;
+    if (!pd) return -1;
+    
+    /* cow_manager tracks shared frames by physical address; moving one would orphan its count. */
+    if (cow_manager.is_cow_page((u32)from)) return -1;
+    
+    struct page_table_entry *table = vmm.get_page_table(pd, virtual_addr, 0);
+    if (!table) return -1;
+    
+    u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
+    if (!table[page_idx].present || table[page_idx].frame != ((u32)from >> 12)) return -1;
+    
+    table[page_idx].frame = (u32)to >> 12;
+    flush_tlb_page(pd, virtual_addr);
+    
+    return 0;
+}
+
+/*
+ * Settle the window the last fault opened: count its speculative pages
+ * that were touched since, and resize the window for this fault.
+ */
+static void fault_window_update(struct page_directory *pd) {
+    struct fault_window *w = &pd->fault_window;
+    if (!w->nr_spec) return;
+    
+    u32 hits = 0;
+    for (u32 i = 0; i < w->nr_spec; i++) {
+        struct page_table_entry *table = vmm.get_page_table(pd, w->spec[i], 0);
+        u32 page_idx = VADDR_PT_OFFSET(w->spec[i]);
+        if (table && table[page_idx].present && table[page_idx].accessed) {
+            hits++;
+        }
+    }
+    fault_stats.hits += hits;
+    fault_stats.misses += w->nr_spec - hits;
+    
+    if (hits * 2 >= w->nr_spec) {
+        if (w->pages < FAULT_AROUND_MAX) {
+            w->pages <<= 1;
+            fault_stats.grown++;
+        }
+    } else if (hits * 4 < w->nr_spec && w->pages > 1) {
+        w->pages >>= 1;
+        fault_stats.shrunk++;
+    }
+    w->nr_spec = 0;
+}
+
+/* A page mapped ahead of need starts out untouched, so the next fault can tell whether it was used. */
+static void fault_window_add(struct page_directory *pd, u32 virtual_addr) {
+    struct fault_window *w = &pd->fault_window;
+    struct page_table_entry *table = vmm.get_page_table(pd, virtual_addr, 0);
+    if (!table || w->nr_spec >= FAULT_AROUND_MAX) return;
+    
+    table[VADDR_PT_OFFSET(virtual_addr)].accessed = 0;
+    w->spec[w->nr_spec++] = virtual_addr;
+}
+
+/*
+ * Speculation spends frames; it stops as soon as memory is anything but
+ * plentiful. Without paging there is no later fault for it to save, so
+ * until enable_paging() it does not run at all.
+ */
+static bool fault_window_allowed() {
+    if (!paging_on) return false;
+    return swap_manager.check_memory_pressure() < MEMORY_PRESSURE_MEDIUM;
+}
+
+static int anon_map_zeroed(struct page_directory *pd, struct vm_area *vma, u32 page_addr) {
+    u32 frame = vmm.alloc_frame();
+    if (!frame) return -1;
+    memset((void *)frame, 0, FRAME_SIZE);
+    
+    u32 flags = PG_PRESENT | PG_USER | ((vma->vm_flags & VM_WRITE) ? PG_WRITE : 0);
+    if (vmm.map_page(pd, page_addr, frame, flags) != 0) {
+        vmm.free_frame(frame);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/*
+ * First touch of a page in an anonymous area: a huge page if the whole
+ * region qualifies, else one zeroed frame plus, fault-around, the
+ * unpopulated pages of the window-aligned block around it that the area
+ * covers. The block is aligned to its size, so it never leaves the page
+ * table the faulting page is in.
+ */
+static int anon_fault(struct page_directory *pd, struct vm_area *vma, u32 fault_addr) {
+    if (huge_fault(pd, vma, fault_addr) == 0) return 0;
+    
+    u32 page_addr = fault_addr & ~0xFFF;
+    if (anon_map_zeroed(pd, vma, page_addr) != 0) return -1;
+    fault_stats.faults++;
+    
+    u32 span = pd->fault_window.pages * FRAME_SIZE;
+    if (span <= FRAME_SIZE || !fault_window_allowed()) return 0;
+    
+    u32 start = page_addr & ~(span - 1);
+    for (u32 addr = start; addr < start + span; addr += FRAME_SIZE) {
+        if (addr == page_addr || addr < vma->vm_start || addr >= vma->vm_end) continue;
+        if (vmm.get_physical_addr(pd, addr) || vmm.get_swap_entry(pd, addr)) continue;
+        
+        if (anon_map_zeroed(pd, vma, addr) != 0) break;
+        fault_window_add(pd, addr);
+        fault_stats.mapped++;
+    }
+    
+    return 0;
+}
+
+/*
+ * Swap read-ahead after a swap-in: pages swapped out together sit in
+ * consecutive slots, so bring back those whose slots follow this one on
+ * the same device, up to the address space's window.
+ */
+static void swap_readahead(struct page_directory *pd, u32 swap_entry) {
+    u32 window = pd->fault_window.pages;
+    if (window <= 1 || !fault_window_allowed()) return;
+    
+    u32 candidates[FAULT_AROUND_MAX];
+    u32 entries[FAULT_AROUND_MAX];
+    u32 count = 0;
+    
+    for (struct swapped_page_entry *entry = pd->swapped_pages; entry && count < window - 1; entry = entry->next) {
+        if ((entry->swap_entry >> 24) != (swap_entry >> 24)) continue;
+        
+        u32 distance = (entry->swap_entry & 0xFFFFFF) - (swap_entry & 0xFFFFFF);
+        if (distance == 0 || distance >= window) continue;
+        
+        candidates[count] = entry->virtual_addr;
+        entries[count] = entry->swap_entry;
+        count++;
+    }
+    
+    for (u32 i = 0; i < count; i++) {
+        if (swap_manager.swap_in_page(candidates[i], entries[i]) != 0) break;
+        vmm.remove_swapped_page(pd, candidates[i]);
+        fault_window_add(pd, candidates[i]);
+        fault_stats.readahead++;
+    }
+}
 
 static void serial_outb_vmm(unsigned short port, unsigned char data) {
     asm volatile("outb %0, %1" : : "a"(data), "Nd"(port));
@@ -33,80 +220,95 @@ void VMM::init() {
     serial_print_vmm("[VMM] Starting VMM initialization\n");
     io.print("[VMM] Initializing virtual memory manager\n");
     
-    frame_bitmap = static_frame_bitmap;
-    serial_print_vmm("[VMM] Frame bitmap assigned\n");
+    /* The kernel heap is linear: its frames sit at their own addresses and never reach the page allocator. */
+    memmap.reserve(PAGE(KERN_HEAP), PAGE(KERN_HEAP_LIM));
     
-    for (int i = 0; i < MAX_FRAMES / 32; i++) {
-        frame_bitmap[i] = 0;
-    }
+    /* The buddy allocator is the only source of physical frames. */
+    memmap.setup_zones();
+    frame_count = buddy_allocator.nr_managed_pages();
+    serial_print_vmm("[VMM] Page allocator zones ready\n");
     
-    for (u32 i = 0; i < PHYS_MEM_START / FRAME_SIZE / 32; i++) {
-        frame_bitmap[i] = 0xFFFFFFFF;
+    init_slab_allocator();
+    init_slob_allocator();
+    init_slub_allocator();
+    init_stack_allocator();
+    init_unified_allocator(SYS_MODE_DESKTOP);
+    init_cow_manager();
+    register_movable(PAGE_OWNER_ANON, anon_page_migrate);
+    tlb_init();
+    
+    pse_enabled = false;
+    if (cpu_features() & CPUID_PSE) {
+        u32 cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= PSE_FLAG;
+        asm volatile("mov %0, %%cr4" :: "r"(cr4));
+        pse_enabled = true;
     }
     
-    frame_count = MAX_FRAMES;
-    frames_used = PHYS_MEM_START / FRAME_SIZE;
-    
     kernel_directory = create_page_directory();
     
-    for (u32 i = 0; i < 0x400000; i += FRAME_SIZE) {
-        map_page(kernel_directory, i, i, PG_PRESENT | PG_WRITE);
-    }
-    
-    for (u32 i = KERN_HEAP; i < KERN_HEAP_LIM; i += FRAME_SIZE) {
-        u32 frame = alloc_frame();
-        if (frame != 0) {
-            map_page(kernel_directory, i, frame, PG_PRESENT | PG_WRITE);
+    /*
+     * Identity map the kernel image and the heap behind it. With PSE that
+     * is two 4 MiB directory entries and no page tables at all. Kernel
+     * mappings are global: no address space switch needs to drop them.
+     */
+    if (pse_enabled) {
+        for (u32 i = 0; i < KERN_HEAP_LIM; i += LARGE_PAGESIZE) {
+            map_large_page(kernel_directory, i, i, PG_PRESENT | PG_WRITE | PG_GLOBAL);
+        }
+    } else {
+        for (u32 i = 0; i < KERN_HEAP_LIM; i += FRAME_SIZE) {
+            map_page(kernel_directory, i, i, PG_PRESENT | PG_WRITE | PG_GLOBAL);
         }
     }
+    io.print("[VMM] Kernel mapped with %s pages\n", pse_enabled ? "4 MiB" : "4 KiB");
     
     current_directory = kernel_directory;
     switch_page_directory(kernel_directory);
     
-    init_buddy_allocator();
-    init_slab_allocator();
-    init_slob_allocator();
-    init_slub_allocator();
-    init_stack_allocator();
-    init_unified_allocator(SYS_MODE_DESKTOP);
-    init_cow_manager();
-    
-    io.print("[VMM] Paging enabled with %d frames available\n", frame_count - frames_used);
+    io.print("[VMM] Paging enabled with %d frames available\n", frame_count - used_frames());
 }
 
 struct page_directory *VMM::create_page_directory() {
     struct page_directory *pd = (struct page_directory *)kmalloc(sizeof(struct page_directory));
     if (!pd) return 0;
     
-    for (int i = 0; i < 1024; i++) {
-        pd->tables[i].present = 0;
-        pd->tables[i].writable = 1;
-        pd->tables[i].user = 0;
-        pd->tables[i].frame = 0;
-        pd->page_tables[i] = 0;
+    u32 phys_addr = alloc_frame();
+    if (!phys_addr) {
+        kfree(pd);
+        return 0;
     }
-    pd->swapped_pages = nullptr;
     
-    u32 phys_addr = alloc_frame();
     pd->physical_address = phys_addr;
+    pd->tables = (struct page_directory_entry *)phys_addr;
+    pd->swapped_pages = nullptr;
+    pd->vmas = nullptr;
+    pd->fault_window.pages = FAULT_AROUND_DEFAULT;
+    pd->fault_window.nr_spec = 0;
+    
+    for (int i = 0; i < 1024; i++) {
+        *(u32 *)&pd->tables[i] = 0;
+    }
+    
+    pd->tables[PD_RECURSIVE_SLOT].present = 1;
+    pd->tables[PD_RECURSIVE_SLOT].writable = 1;
+    pd->tables[PD_RECURSIVE_SLOT].frame = phys_addr >> 12;
     
     return pd;
 }
 
 u32 VMM::alloc_frame() {
-    u32 frame_idx = 0;
-    u32 bitmap_idx = 0;
-    
-    for (bitmap_idx = 0; bitmap_idx < MAX_FRAMES / 32; bitmap_idx++) {
-        if (frame_bitmap[bitmap_idx] != 0xFFFFFFFF) {
-            for (int bit = 0; bit < 32; bit++) {
-                if (!(frame_bitmap[bitmap_idx] & (1 << bit))) {
-                    frame_idx = bitmap_idx * 32 + bit;
-                    frame_bitmap[bitmap_idx] |= (1 << bit);
-                    frames_used++;
-                    return frame_idx * FRAME_SIZE;
-                }
-            }
+    void *frame = buddy_allocator.alloc_page();
+    if (frame) {
+        return (u32)frame;
+    }
+    
+    /* Empty slabs and per-CPU caches cost nothing to give back; swapping costs I/O. */
+    if (shrink_slab(SHRINK_BATCH) > 0) {
+        frame = buddy_allocator.alloc_page();
+        if (frame) {
+            return (u32)frame;
         }
     }
     
@@ -122,75 +324,171 @@ u32 VMM::alloc_frame() {
     return 0;
 }
 
-void VMM::free_frame(u32 frame_addr) {
-    u32 frame_idx = frame_addr / FRAME_SIZE;
-    u32 bitmap_idx = frame_idx / 32;
-    u32 bit = frame_idx % 32;
-    
-    if (frame_idx < MAX_FRAMES) {
-        frame_bitmap[bitmap_idx] &= ~(1 << bit);
-        frames_used--;
+void VMM::free_frame(u32 frame_addr, bool cold) {
+    buddy_allocator.free_page((void *)frame_addr, cold);
+}
+
+bool VMM::paging_enabled() const {
+    return paging_on;
+}
+
+u32 VMM::used_frames() {
+    return frame_count - buddy_allocator.nr_free_pages();
+}
+
+/* The current directory is reached through the recursive window once paging is on, any other through its kernel mapping. */
+struct page_directory_entry *VMM::directory_entries(struct page_directory *pd) {
+    if (paging_on && pd == current_directory) {
+        return (struct page_directory_entry *)PD_WINDOW;
+    }
+    return pd->tables;
+}
+
+struct page_table_entry *VMM::table_entries(struct page_directory *pd, u32 table_idx) {
+    if (paging_on && pd == current_directory) {
+        return (struct page_table_entry *)(PT_WINDOW + (table_idx << 12));
     }
+    return (struct page_table_entry *)(pd->tables[table_idx].frame << 12);
 }
 
 struct page_table_entry *VMM::get_page_table(struct page_directory *pd, u32 virtual_addr, int create) {
     u32 table_idx = VADDR_PD_OFFSET(virtual_addr);
+    if (table_idx == PD_RECURSIVE_SLOT) return 0;
+    
+    struct page_directory_entry *dir = directory_entries(pd);
+    
+    /* A 4 MiB page has no table behind it. */
+    if (dir[table_idx].present && dir[table_idx].page_size) return 0;
     
-    if (!pd->tables[table_idx].present) {
+    if (!dir[table_idx].present) {
         if (!create) return 0;
         
         u32 phys_addr = alloc_frame();
         if (!phys_addr) return 0;
         
-        pd->page_tables[table_idx] = (struct page_table_entry *)kmalloc(sizeof(struct page_table_entry) * 1024);
-        if (!pd->page_tables[table_idx]) {
-            free_frame(phys_addr);
-            return 0;
+        dir[table_idx].present = 1;
+        dir[table_idx].writable = 1;
+        dir[table_idx].user = (virtual_addr >= USER_OFFSET && virtual_addr < USER_STACK) ? 1 : 0;
+        dir[table_idx].frame = phys_addr >> 12;
+        
+        struct page_table_entry *table = table_entries(pd, table_idx);
+        if (paging_on) {
+            flush_tlb_page(pd, (u32)table);
         }
         
         for (int i = 0; i < 1024; i++) {
-            pd->page_tables[table_idx][i].present = 0;
-            pd->page_tables[table_idx][i].writable = 1;
-            pd->page_tables[table_idx][i].user = 0;
-            pd->page_tables[table_idx][i].frame = 0;
+            *(u32 *)&table[i] = 0;
         }
-        
-        pd->tables[table_idx].present = 1;
-        pd->tables[table_idx].writable = 1;
-        pd->tables[table_idx].user = 0;
-        pd->tables[table_idx].frame = phys_addr >> 12;
+        return table;
     }
     
-    return pd->page_tables[table_idx];
+    return table_entries(pd, table_idx);
 }
 
 int VMM::map_page(struct page_directory *pd, u32 virtual_addr, u32 physical_addr, u32 flags) {
+    if (is_huge(pd, virtual_addr)) {
+        split_huge_page(pd, virtual_addr);
+    }
+    
     struct page_table_entry *table = get_page_table(pd, virtual_addr, 1);
     if (!table) return -1;
     
     u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
+    bool was_present = table[page_idx].present;
     
     table[page_idx].present = (flags & PG_PRESENT) ? 1 : 0;
     table[page_idx].writable = (flags & PG_WRITE) ? 1 : 0;
     table[page_idx].user = (flags & PG_USER) ? 1 : 0;
+    table[page_idx].global = (flags & PG_GLOBAL) ? 1 : 0;
     table[page_idx].frame = physical_addr >> 12;
     
+    /* The TLB never caches a not-present entry, so only a replaced mapping needs invalidating. */
+    if (was_present) {
+        flush_tlb_page(pd, virtual_addr);
+    }
+    
+    if ((flags & (PG_PRESENT | PG_USER)) == (PG_PRESENT | PG_USER)) {
+        anon_page_add_rmap(pd, virtual_addr, physical_addr);
+    }
+    
     return 0;
 }
 
-void VMM::unmap_page(struct page_directory *pd, u32 virtual_addr) {
+void VMM::unmap_page(struct page_directory *pd, u32 virtual_addr, bool cold) {
+    /* Unmapping part of a huge page leaves the rest mapped 4 KiB at a time. */
+    if (is_huge(pd, virtual_addr)) {
+        split_huge_page(pd, virtual_addr);
+    }
+    
     struct page_table_entry *table = get_page_table(pd, virtual_addr, 0);
     if (!table) return;
     
     u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
     if (table[page_idx].present) {
         u32 frame_addr = table[page_idx].frame << 12;
-        free_frame(frame_addr);
         table[page_idx].present = 0;
+        flush_tlb_page(pd, virtual_addr);
+        free_frame(frame_addr, cold);
+    }
+}
+
+/*
+ * Map one 4 MiB page straight from the directory. Both addresses must be
+ * 4 MiB aligned and the slot must not already hold a page table.
+ */
+int VMM::map_large_page(struct page_directory *pd, u32 virtual_addr, u32 physical_addr, u32 flags) {
+    if (!pse_enabled) return -1;
+    if ((virtual_addr | physical_addr) & (LARGE_PAGESIZE - 1)) return -1;
+    
+    u32 table_idx = VADDR_PD_OFFSET(virtual_addr);
+    if (table_idx == PD_RECURSIVE_SLOT) return -1;
+    
+    struct page_directory_entry *dir = directory_entries(pd);
+    if (dir[table_idx].present && !dir[table_idx].page_size) return -1;
+    bool was_present = dir[table_idx].present;
+    
+    dir[table_idx].present = (flags & PG_PRESENT) ? 1 : 0;
+    dir[table_idx].writable = (flags & PG_WRITE) ? 1 : 0;
+    dir[table_idx].user = (flags & PG_USER) ? 1 : 0;
+    dir[table_idx].global = (flags & PG_GLOBAL) ? 1 : 0;
+    dir[table_idx].page_size = 1;
+    dir[table_idx].frame = physical_addr >> 12;
+    
+    if (was_present) {
+        flush_tlb_page(pd, virtual_addr);
+    }
+    
+    return 0;
+}
+
+/* Batched unmap: the flush and the frame's release wait for the gather. */
+void VMM::unmap_page(struct mmu_gather *tlb, u32 virtual_addr) {
+    if (is_huge(tlb->pd, virtual_addr)) {
+        split_huge_page(tlb->pd, virtual_addr);
+    }
+    
+    struct page_table_entry *table = get_page_table(tlb->pd, virtual_addr, 0);
+    if (!table) return;
+    
+    u32 page_idx = VADDR_PT_OFFSET(virtual_addr);
+    if (table[page_idx].present) {
+        u32 frame_addr = table[page_idx].frame << 12;
+        table[page_idx].present = 0;
+        tlb_remove_page(tlb, virtual_addr, frame_addr);
     }
 }
 
+bool VMM::is_huge(struct page_directory *pd, u32 virtual_addr) {
+    struct page_directory_entry *pde = &directory_entries(pd)[VADDR_PD_OFFSET(virtual_addr)];
+    return pde->present && pde->page_size;
+}
+
 u32 VMM::get_physical_addr(struct page_directory *pd, u32 virtual_addr) {
+    struct page_directory_entry *pde = &directory_entries(pd)[VADDR_PD_OFFSET(virtual_addr)];
+    if (pde->present && pde->page_size) {
+        return (pde->frame << 12) + (virtual_addr & (LARGE_PAGESIZE - 1));
+    }
+    
     struct page_table_entry *table = get_page_table(pd, virtual_addr, 0);
     if (!table) return 0;
     
@@ -203,11 +501,14 @@ u32 VMM::get_physical_addr(struct page_directory *pd, u32 virtual_addr) {
 int VMM::handle_page_fault(u32 fault_addr, u32 error_code) {
     u32 page_addr = fault_addr & ~0xFFF;
     
+    fault_window_update(current_directory);
+    
     u32 swap_entry = get_swap_entry(current_directory, page_addr);
     if (swap_entry != 0) {
         if (swap_manager.swap_in_page(page_addr, swap_entry) == 0) {
             remove_swapped_page(current_directory, page_addr);
             swap_manager.update_page_access(page_addr);
+            swap_readahead(current_directory, swap_entry);
             return 0;
         }
     }
@@ -218,23 +519,11 @@ int VMM::handle_page_fault(u32 fault_addr, u32 error_code) {
             swap_manager.update_page_access(page_addr);
             return 0;
         }
-    }
-    
-    if (fault_addr >= KERN_HEAP && fault_addr < KERN_HEAP_LIM) {
-        u32 frame = alloc_frame();
-        if (frame == 0) {
-            io.print("[VMM] Page fault: Out of memory for kernel heap\n");
-            return -1;
-        }
         
-        if (map_page(current_directory, page_addr, frame, PG_PRESENT | PG_WRITE) != 0) {
-            io.print("[VMM] Page fault: Failed to map page\n");
-            free_frame(frame);
-            return -1;
+        struct vm_area *vma = cow_manager.find_vma(current_directory, fault_addr);
+        if (vma && !(error_code & 0x1) && anon_fault(current_directory, vma, fault_addr) == 0) {
+            return 0;
         }
-        
-        swap_manager.add_to_lru(page_addr);
-        return 0;
     }
     
     io.print("[VMM] Page fault at %x, error %x\n", fault_addr, error_code);
@@ -249,23 +538,34 @@ void VMM::switch_page_directory(struct page_directory *pd) {
 void VMM::destroy_page_directory(struct page_directory *pd) {
     if (!pd) return;
     
-    for (int i = 0; i < 1024; i++) {
-        if (pd->tables[i].present && pd->page_tables[i]) {
-            for (int j = 0; j < 1024; j++) {
-                if (pd->page_tables[i][j].present) {
-                    u32 frame_addr = pd->page_tables[i][j].frame << 12;
-                    free_frame(frame_addr);
-                }
+    hugepage_exit(pd);
+    cow_manager.free_vmas(pd);
+    
+    for (int i = 0; i < PD_RECURSIVE_SLOT; i++) {
+        if (!pd->tables[i].present) continue;
+        
+        /* Kernel large pages are shared by every address space; only user ones are this one's to free. */
+        if (pd->tables[i].page_size) {
+            if (pd->tables[i].user) {
+                buddy_allocator.free_order((void *)(pd->tables[i].frame << 12), HUGEPAGE_ORDER);
             }
-            kfree(pd->page_tables[i]);
+            continue;
         }
+        
+        struct page_table_entry *table = (struct page_table_entry *)(pd->tables[i].frame << 12);
+        for (int j = 0; j < 1024; j++) {
+            if (table[j].present) {
+                free_frame(table[j].frame << 12);
+            }
+        }
+        free_frame(pd->tables[i].frame << 12);
     }
     
     struct swapped_page_entry *swapped = pd->swapped_pages;
     while (swapped) {
         struct swapped_page_entry *next = swapped->next;
         swap_manager.free_swap_entry(swapped->swap_entry);
-        kfree(swapped);
+        delete swapped;
         swapped = next;
     }
     
@@ -277,7 +577,7 @@ void VMM::destroy_page_directory(struct page_directory *pd) {
 }
 
 int VMM::add_swapped_page(struct page_directory *pd, u32 virtual_addr, u32 swap_entry) {
-    struct swapped_page_entry *entry = (struct swapped_page_entry *)kmalloc(sizeof(struct swapped_page_entry));
+    struct swapped_page_entry *entry = new struct swapped_page_entry;
     if (!entry) return -1;
     
     entry->virtual_addr = virtual_addr;
@@ -308,7 +608,7 @@ void VMM::remove_swapped_page(struct page_directory *pd, u32 virtual_addr) {
         if ((*entry)->virtual_addr == virtual_addr) {
             struct swapped_page_entry *to_remove = *entry;
             *entry = (*entry)->next;
-            kfree(to_remove);
+            delete to_remove;
             return;
         }
         entry = &(*entry)->next;
@@ -316,7 +616,26 @@ void VMM::remove_swapped_page(struct page_directory *pd, u32 virtual_addr) {
 }
 
 int VMM::try_reclaim_memory(u32 pages_needed) {
-    return swap_manager.reclaim_pages(pages_needed);
+    u32 freed = shrink_slab(pages_needed);
+    if (freed >= pages_needed) {
+        return freed;
+    }
+    
+    int swapped = swap_manager.reclaim_pages(pages_needed - freed);
+    return freed + (swapped > 0 ? swapped : 0);
+}
+
+void VMM::print_fault_stats() {
+    if (!paging_on) {
+        io.print("[VMM] Fault-around and swap read-ahead: off until paging is enabled\n");
+        return;
+    }
+    io.print("[VMM] Fault-around: window %d pages in the current address space\n",
+             current_directory ? current_directory->fault_window.pages : 0);
+    io.print("  Anonymous faults: %d, pages mapped around them: %d, swap read-ahead: %d\n",
+             fault_stats.faults, fault_stats.mapped, fault_stats.readahead);
+    io.print("  Speculative pages used: %d, unused: %d; window grown %d times, shrunk %d times\n",
+             fault_stats.hits, fault_stats.misses, fault_stats.grown, fault_stats.shrunk);
 }
 
 void init_vmm() {
@@ -353,6 +672,7 @@ void page_fault_handler(regs_t *regs) {
 }
 
 void enable_paging() {
+    paging_on = true;
     u32 cr0;
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     cr0 |= PAGING_FLAG;
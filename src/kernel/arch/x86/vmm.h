@@ -6,6 +6,7 @@
 #include <runtime/alloc.h>
 #include <x86.h>
 #include <archprocess.h>
+#include <tlb.h>
 
 
 struct page_directory_entry {
@@ -42,14 +43,61 @@ struct swapped_page_entry {
     u32 virtual_addr;
     u32 swap_entry;
     struct swapped_page_entry *next;
+    
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *ptr);
+};
+
+
+/*
+ * The last directory entry points at the directory itself, so once paging
+ * is on the current address space's page tables show up as a 4 MiB array
+ * at PT_WINDOW (table i at PT_WINDOW + i * 4096) and the directory as the
+ * last page of it.
+ */
+#define PD_RECURSIVE_SLOT   1023
+#define PT_WINDOW           0xFFC00000
+#define PD_WINDOW           (PT_WINDOW + (PD_RECURSIVE_SLOT << 12))
+
+/* Pages a fault may map ahead of need: the window starts here and adapts between 1 and the maximum. */
+#define FAULT_AROUND_DEFAULT    4
+#define FAULT_AROUND_MAX        16
+
+/*
+ * What the last fault in an address space mapped beyond the page it was
+ * for (zero-filled neighbours, swap read-ahead) and how many pages the
+ * next one may map. The next fault checks the accessed bits of those
+ * pages: if most were used the window doubles, if few were it halves.
+ */
+struct fault_window {
+    u32 pages;
+    u32 nr_spec;
+    u32 spec[FAULT_AROUND_MAX];
+};
+
+struct fault_around_stats {
+    u32 faults;
+    u32 mapped;
+    u32 readahead;
+    u32 hits;
+    u32 misses;
+    u32 grown;
+    u32 shrunk;
 };
 
+/*
+ * An address space. The directory and its page tables are whole frames,
+ * the same memory the MMU walks; tables is the kernel's mapping of the
+ * directory frame at physical_address.
+ */
+struct vm_area;
 
 struct page_directory {
-    struct page_directory_entry tables[1024];
-    struct page_table_entry *page_tables[1024];
+    struct page_directory_entry *tables;
     u32 physical_address;
     struct swapped_page_entry *swapped_pages;
+    struct vm_area *vmas;
+    struct fault_window fault_window;
 };
 
 
@@ -66,25 +114,33 @@ public:
     struct page_directory *create_page_directory();
     void destroy_page_directory(struct page_directory *pd);
     int map_page(struct page_directory *pd, u32 virtual_addr, u32 physical_addr, u32 flags);
-    void unmap_page(struct page_directory *pd, u32 virtual_addr);
+    int map_large_page(struct page_directory *pd, u32 virtual_addr, u32 physical_addr, u32 flags);
+    bool large_pages() const { return pse_enabled; }
+    bool paging_enabled() const;
+    bool is_huge(struct page_directory *pd, u32 virtual_addr);
+    void unmap_page(struct page_directory *pd, u32 virtual_addr, bool cold = false);
+    void unmap_page(struct mmu_gather *tlb, u32 virtual_addr);
     u32 get_physical_addr(struct page_directory *pd, u32 virtual_addr);
     int handle_page_fault(u32 fault_addr, u32 error_code);
     void switch_page_directory(struct page_directory *pd);
     u32 alloc_frame();
-    void free_frame(u32 frame_addr);
+    void free_frame(u32 frame_addr, bool cold = false);
+    u32 used_frames();
     struct page_table_entry *get_page_table(struct page_directory *pd, u32 virtual_addr, int create);
+    struct page_directory_entry *directory_entries(struct page_directory *pd);
+    struct page_table_entry *table_entries(struct page_directory *pd, u32 table_idx);
     
     int add_swapped_page(struct page_directory *pd, u32 virtual_addr, u32 swap_entry);
     u32 get_swap_entry(struct page_directory *pd, u32 virtual_addr);
     void remove_swapped_page(struct page_directory *pd, u32 virtual_addr);
     int try_reclaim_memory(u32 pages_needed);
+    void print_fault_stats();
     
     u32 frame_count;
-    u32 frames_used;
-    
+
 private:
     struct page_frame *free_frames;
-    u32 *frame_bitmap;
+    bool pse_enabled;
 };
 
 extern VMM vmm;
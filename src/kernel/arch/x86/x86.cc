@@ -42,6 +42,14 @@ extern "C"
     return 15;
   }
 
+  /* Feature flags from cpuid leaf 1, edx */
+  u32 cpu_features(void)
+  {
+    u32 eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return edx;
+  }
+
   void schedule();
 
   idtdesc kidt[IDTSIZE];
@@ -39,14 +39,21 @@
 /* control register flags */
 #define PAGING_FLAG 0x80000000
 #define PSE_FLAG 0x00000010
+#define PGE_FLAG 0x00000080
 
 /* page table and directory flags */
 #define PG_PRESENT 0x00000001
 #define PG_WRITE 0x00000002
 #define PG_USER 0x00000004
 #define PG_4MB 0x00000080
+#define PG_GLOBAL 0x00000100
+
+/* cpuid leaf 1 edx feature bits */
+#define CPUID_PSE 0x00000008
+#define CPUID_PGE 0x00002000
 
 #define PAGESIZE 4096
+#define LARGE_PAGESIZE 0x400000
 #define RAM_MAXSIZE 0x100000000
 #define RAM_MAXPAGE 0x100000
 
@@ -129,6 +136,7 @@ extern "C"
     void switch_to_task(struct process_st *current, int mode);
     extern tss default_tss;
     u32 cpu_vendor_name(char *name);
+    u32 cpu_features(void);
     int dequeue_signal(int);
     int handle_signal(int);
 }
@@ -7,6 +7,7 @@
 extern "C" {
     char *strncpy(char *destString, const char *sourceString, int maxLength);
     void *memcpy(void *dest, const void *src, int n);
+    int vma_map_anon(struct page_directory *pd, u32 start, u32 end);
 }
 
 extern Filesystem fsm;
@@ -151,6 +152,10 @@ void call_sbrk()
   process_st *current = p->getPInfo();
   ret = current->e_heap;
 
+  /* The new break is backed on first touch, so a large heap can be given huge pages. */
+  if (size > 0 && current->pd != NULL)
+    vma_map_anon(current->pd, (u32)ret, (u32)ret + size);
+
   current->e_heap += size;
 
   arch.setRet((u32)ret);
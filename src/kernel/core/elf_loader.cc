@@ -11,6 +11,7 @@
 extern "C" {
     void *memcpy(void *dest, const void *src, int n);
     void *memset(void *s, int c, int n);
+    int vma_map_anon(struct page_directory *pd, u32 start, u32 end);
 }
 
 
@@ -62,6 +63,8 @@ u32 load_elf(char *file, process_st *proc)
       {
         proc->b_bss = (char *)v_begin;
         proc->e_bss = (char *)v_end;
+        if (proc->pd != NULL)
+          vma_map_anon(proc->pd, v_begin, v_end);
       }
 
       memcpy((char *)v_begin, (char *)(file + p_entry->p_offset), p_entry->p_filesz);
@@ -85,7 +88,22 @@ int execv(char *file, int argc, char **argv)
   if (!fp)
     return ERROR_PARAM;
 
-  char *map_elf = (char *)kmalloc(fp->getSize());
+  /*
+   * The image is only needed until it has been copied into the new address
+   * space. Small ones go on the arena; anything bigger than half of it goes
+   * to the heap, since growing the arena for it would leave a large spare
+   * frame attached to the task for good.
+   */
+  ScopedStackAllocator scratch(current_arena());
+  char *map_elf = NULL;
+  if (fp->getSize() <= TASK_ARENA_SIZE / 2)
+    map_elf = (char *)scratch.alloc(fp->getSize());
+  bool on_heap = (map_elf == NULL);
+  if (on_heap)
+    map_elf = (char *)kmalloc(fp->getSize());
+  if (!map_elf)
+    return ERROR_MEMORY;
+
   fp->open(NO_FLAG);
   fp->read(0, (u8 *)map_elf, fp->getSize());
   fp->close();
@@ -94,7 +112,8 @@ int execv(char *file, int argc, char **argv)
   Process *proc = new Process(name);
   proc->create(map_elf, argc, argv);
 
-  kfree(map_elf);
+  if (on_heap)
+    kfree(map_elf);
   return (int)proc->getPid();
 }
 
@@ -2,6 +2,8 @@
 #include <core/ext2.h>
 #include <core/block_device.h>
 #include <runtime/alloc.h>
+#include <runtime/object_pool.h>
+#include <core/process.h>
 
 extern "C" {
     void *memcpy(void *dest, const void *src, int n);
@@ -90,17 +92,15 @@ public:
         u32 offset = index_in_group * inode_size_;
         u64 byte_offset = (u64)inode_table_block * block_size_ + offset;
 
-        u8 *temp = (u8 *)kmalloc(inode_size_);
+        ScopedStackAllocator scratch(current_arena());
+        u8 *temp = (u8 *)scratch.alloc(inode_size_);
         if (!temp)
             return false;
 
-        if (device_->read((u32)byte_offset, temp, inode_size_) != RETURN_OK) {
-            kfree(temp);
+        if (device_->read((u32)byte_offset, temp, inode_size_) != RETURN_OK)
             return false;
-        }
 
         memcpy(out, temp, sizeof(ext2_inode));
-        kfree(temp);
         return true;
     }
 
@@ -116,17 +116,15 @@ public:
             if (indirect == 0)
                 return false;
 
-            u32 *entries = (u32 *)kmalloc(block_size_);
+            ScopedStackAllocator scratch(current_arena());
+            u32 *entries = (u32 *)scratch.alloc(block_size_);
             if (!entries)
                 return false;
 
-            if (device_->read(indirect * block_size_, (u8 *)entries, block_size_) != RETURN_OK) {
-                kfree(entries);
+            if (device_->read(indirect * block_size_, (u8 *)entries, block_size_) != RETURN_OK)
                 return false;
-            }
 
             block_number = entries[block_index];
-            kfree(entries);
             return block_number != 0;
         }
 
@@ -148,7 +146,8 @@ public:
         u32 block_index = offset / block_size_;
         u32 block_offset = offset % block_size_;
 
-        u8 *block_buffer = (u8 *)kmalloc(block_size_);
+        ScopedStackAllocator scratch(current_arena());
+        u8 *block_buffer = (u8 *)scratch.alloc(block_size_);
         if (!block_buffer)
             return 0;
 
@@ -172,7 +171,6 @@ public:
             block_offset = 0;
         }
 
-        kfree(block_buffer);
         return total_read;
     }
 
@@ -199,63 +197,88 @@ bool Ext2Mount::load_directory(Ext2Directory *dir) {
     dir->setSize(inode.i_size);
 
     u32 total = inode.i_size;
-    u32 processed = 0;
-    u32 block_index = 0;
+    u32 loaded = 0;
+    u8 *data = nullptr;
 
-    u8 *block_buffer = (u8 *)kmalloc(block_size_);
-    if (!block_buffer)
-        return false;
-
-    while (processed < total) {
+    /* Pull the whole directory into one buffer; krealloc extends it in place
+       block by block whenever the allocation behind it has room. */
+    for (u32 block_index = 0; loaded < total; block_index++) {
         u32 block_number;
         if (!get_block(inode, block_index, block_number))
             break;
 
-        if (device_->read(block_number * block_size_, block_buffer, block_size_) != RETURN_OK)
+        u8 *grown = (u8 *)krealloc(data, loaded + block_size_);
+        if (!grown)
             break;
+        data = grown;
 
-        u32 offset = 0;
-        while (offset < block_size_ && processed < total) {
-            ext2_dir_entry *entry = (ext2_dir_entry *)(block_buffer + offset);
-            if (entry->rec_len == 0)
-                break;
+        if (device_->read(block_number * block_size_, data + loaded, block_size_) != RETURN_OK)
+            break;
+
+        loaded += block_size_;
+    }
+
+    if (!data)
+        return false;
 
-            if (entry->inode != 0 && entry->name_len > 0) {
-                char name[256];
-                u32 name_len = entry->name_len;
-                if (name_len >= sizeof(name))
-                    name_len = sizeof(name) - 1;
-                memcpy(name, entry->name, name_len);
-                name[name_len] = '\0';
-
-                if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
-                    ext2_inode child_inode;
-                    if (read_inode(entry->inode, &child_inode)) {
-                        if (entry->file_type == EXT2_FT_DIR) {
-                            Ext2Directory *child = new Ext2Directory(name, dir->mount(), entry->inode, false);
-                            child->setSize(child_inode.i_size);
-                            dir->addChild(child);
-                        } else if (entry->file_type == EXT2_FT_REG_FILE || entry->file_type == 0) {
-                            Ext2RegularFile *child = new Ext2RegularFile(name, dir->mount(), entry->inode, child_inode.i_size);
-                            dir->addChild(child);
-                        }
+    if (loaded > total)
+        loaded = total;
+
+    u32 offset = 0;
+    while (offset < loaded) {
+        ext2_dir_entry *entry = (ext2_dir_entry *)(data + offset);
+        if (entry->rec_len == 0) {
+            offset = (offset / block_size_ + 1) * block_size_;
+            continue;
+        }
+
+        if (entry->inode != 0 && entry->name_len > 0) {
+            char name[256];
+            u32 name_len = entry->name_len;
+            if (name_len >= sizeof(name))
+                name_len = sizeof(name) - 1;
+            memcpy(name, entry->name, name_len);
+            name[name_len] = '\0';
+
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                ext2_inode child_inode;
+                if (read_inode(entry->inode, &child_inode)) {
+                    if (entry->file_type == EXT2_FT_DIR) {
+                        Ext2Directory *child = new Ext2Directory(name, dir->mount(), entry->inode, false);
+                        child->setSize(child_inode.i_size);
+                        dir->addChild(child);
+                    } else if (entry->file_type == EXT2_FT_REG_FILE || entry->file_type == 0) {
+                        Ext2RegularFile *child = new Ext2RegularFile(name, dir->mount(), entry->inode, child_inode.i_size);
+                        dir->addChild(child);
                     }
                 }
             }
-
-            processed += entry->rec_len;
-            offset += entry->rec_len;
         }
 
-        block_index++;
+        offset += entry->rec_len;
     }
 
-    kfree(block_buffer);
+    kfree(data);
     return true;
 }
 
 Ext2Filesystem ext2_driver;
 
+/* Every node is one of the two leaf types; each gets a pool sized for it. */
+static ObjectPool<Ext2Directory> ext2_dir_pool("ext2_dir");
+static ObjectPool<Ext2RegularFile> ext2_file_pool("ext2_file");
+
+void *Ext2Node::operator new(size_t size) noexcept {
+    if (size <= sizeof(Ext2RegularFile)) {
+        return ext2_file_pool.alloc(size);
+    }
+    return ext2_dir_pool.alloc(size);
+}
+
+void Ext2Node::operator delete(void *ptr) {
+    PoolBase::release(ptr);
+}
+
 Ext2Node::Ext2Node(const char *name, u8 type, Ext2Mount *mount, u32 inode)
     : File(name, type), mount_(mount), inode_(inode) {
 }
@@ -103,6 +103,9 @@ public:
     Ext2Node(const char* name, u8 type, Ext2Mount* mount, u32 inode);
     virtual ~Ext2Node();
 
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* ptr);
+
     Ext2Mount* mount() const { return mount_; }
     u32 inode() const { return inode_; }
 
@@ -1,6 +1,7 @@
 #include <os.h>
 #include <file.h>
 #include <runtime/alloc.h>
+#include <runtime/object_pool.h>
 #include <arch/x86/architecture.h>
 
 extern "C" {
@@ -37,6 +38,19 @@ static void strreplace(char *s, char a, char to)
 
 u32 File::inode_system = 0;
 
+/* Subclasses without a pool of their own are larger than a slot and fall back to kmalloc. */
+static ObjectPool<File> file_pool("file");
+
+void *File::operator new(size_t size) noexcept
+{
+  return file_pool.alloc(size);
+}
+
+void File::operator delete(void *ptr)
+{
+  PoolBase::release(ptr);
+}
+
 File::File(const char *n, u8 t)
 {
   name = (char *)kmalloc(strlen(n) + 1);
@@ -18,6 +18,9 @@ public:
   File(const char *n, u8 t);
   virtual ~File();
 
+  static void *operator new(size_t size) noexcept;
+  static void operator delete(void *ptr);
+
   virtual u32 open(u32 flag);
   virtual u32 close();
   virtual u32 read(u32 pos, u8 *buffer, u32 size);
@@ -11,6 +11,7 @@ extern "C" {
 }
 
 #include <arch/x86/architecture.h>
+#include <process.h>
 
 Filesystem::Filesystem()
   : driver_count(0), mount_count(0), root(nullptr), dev(nullptr), var(nullptr) {
@@ -62,6 +63,7 @@ File *Filesystem::path(const char *p)
   if (!p)
     return NULL;
 
+  ScopedStackAllocator scratch(current_arena());
   File *fp = root;
   char *name = NULL;
   const char *beg_p = p;
@@ -84,7 +86,9 @@ File *Filesystem::path(const char *p)
     while (*end_p != '\0' && *end_p != '/')
       end_p++;
 
-    name = (char *)kmalloc(end_p - beg_p + 1);
+    name = (char *)scratch.alloc(end_p - beg_p + 1, 1);
+    if (!name)
+      return NULL;
     memcpy(name, beg_p, end_p - beg_p);
     name[end_p - beg_p] = '\0';
 
@@ -96,7 +100,6 @@ File *Filesystem::path(const char *p)
     {
       fp->scan();
       File *found = fp->find(name);
-      kfree(name);
 
       if (!found)
         return NULL;
@@ -142,6 +145,7 @@ File *Filesystem::path_parent(const char *p, char *fname)
   if (!p)
     return NULL;
 
+  ScopedStackAllocator scratch(current_arena());
   File *fp = root;
   char *name = NULL;
   const char *beg_p = p;
@@ -159,7 +163,9 @@ File *Filesystem::path_parent(const char *p, char *fname)
     while (*end_p != '\0' && *end_p != '/')
       end_p++;
 
-    name = (char *)kmalloc(end_p - beg_p + 1);
+    name = (char *)scratch.alloc(end_p - beg_p + 1, 1);
+    if (!name)
+      return NULL;
     memcpy(name, beg_p, end_p - beg_p);
     name[end_p - beg_p] = '\0';
 
@@ -170,7 +176,6 @@ File *Filesystem::path_parent(const char *p, char *fname)
     else if (strcmp(".", name) != 0)
     {
       File *found = fp->find(name);
-      kfree(name);
 
       if (!found)
       {
@@ -196,7 +201,10 @@ u32 Filesystem::link(const char *fname, const char *newf)
   if (!tolink)
     return -1;
 
-  char *nname = (char *)kmalloc(255);
+  ScopedStackAllocator scratch(current_arena());
+  char *nname = (char *)scratch.alloc(255, 1);
+  if (!nname)
+    return ERROR_MEMORY;
   File *parent = path_parent(newf, nname);
   File *linkFile = new File(nname, TYPE_LINK);
   linkFile->setLink(tolink);
@@ -4,6 +4,7 @@
 #include <arch/x86/keyboard.h>
 #include <arch/x86/pit.h>
 #include <arch/x86/ata.h>
+#include <arch/x86/memmap.h>
 #include <core/system.h>
 #include <core/filesystem.h>
 #include <core/syscalls.h>
@@ -38,11 +39,13 @@ static void serial_print(const char* str) {
     }
 }
 
-extern "C" void kmain()
+extern "C" void kmain(struct multiboot_info *mbi)
 {
     init_serial();
     serial_print("KMAIN: Serial port initialized\n");
     
+    memmap.init(mbi);
+    
     volatile unsigned short *video_memory = (volatile unsigned short*)0xB8000;
     const char *message = "KMAIN REACHED - SERIAL WORKS";
     
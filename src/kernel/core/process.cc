@@ -3,6 +3,7 @@
 #include <elf_loader.h>
 #include <arch/x86/vmm.h>
 #include <runtime/alloc.h>
+#include <runtime/object_pool.h>
 #include <arch/x86/architecture.h>
 #include <filesystem.h>
 
@@ -27,6 +28,19 @@ extern Filesystem fsm;
 char *Process::default_tty = const_cast<char*>("/dev/tty");
 u32 Process::proc_pid = 0;
 
+static ObjectPool<Process> process_pool("process");
+static StackAllocator kernel_arena;
+
+void *Process::operator new(size_t size) noexcept
+{
+  return process_pool.alloc(size);
+}
+
+void Process::operator delete(void *ptr)
+{
+  PoolBase::release(ptr);
+}
+
 /* Destructor */
 Process::~Process()
 {
@@ -36,6 +50,7 @@ Process::~Process()
   }
   
   delete ipc;
+  arena.destroy();
   arch.change_process_father(this, pparent);
 }
 
@@ -49,6 +64,7 @@ Process::Process(char *n) : File(n, TYPE_PROCESS)
   time_slice = 0;
   total_runtime = 0;
   last_scheduled = 0;
+  arena = StackAllocator();
 
   for (int i = 0; i < CONFIG_MAX_FILE; i++)
   {
@@ -375,6 +391,29 @@ void Process::setCurrentDir(File *f)
   cdir = f;
 }
 
+/* The arena's first frame is allocated on first use, so tasks that never need one do not pay for it. */
+StackAllocator *Process::getArena()
+{
+  if (!arena.is_initialized())
+    arena.init(TASK_ARENA_SIZE);
+  return &arena;
+}
+
+void Process::resetArena()
+{
+  arena.reset();
+}
+
+StackAllocator *current_arena()
+{
+  if (arch.pcurrent != NULL)
+    return arch.pcurrent->getArena();
+
+  if (!kernel_arena.is_initialized())
+    kernel_arena.init(TASK_ARENA_SIZE);
+  return &kernel_arena;
+}
+
 void Process::setPNext(Process *p)
 {
   pnext = p;
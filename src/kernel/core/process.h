@@ -6,6 +6,7 @@
 #include <archprocess.h>
 #include <core/signal.h>
 #include <runtime/buffer.h>
+#include <runtime/stack.h>
 #include <api/dev/proc.h>
 
 #define ZOMBIE PROC_STATE_ZOMBIE
@@ -14,6 +15,9 @@
 #define SLEEPING 2
 #define READY 4
 
+/* First frame of a task's scratch arena; it grows on demand up to MAX_STACK_SIZE. */
+#define TASK_ARENA_SIZE (16 * 1024)
+
 struct openfile
 {
   u32 mode;
@@ -29,6 +33,9 @@ public:
   Process(char *n);
   ~Process();
 
+  static void *operator new(size_t size) noexcept;
+  static void operator delete(void *ptr);
+
   u32 open(u32 flag) override;
   u32 close() override;
   u32 read(u32 pos, u8 *buffer, u32 size) override;
@@ -65,6 +72,9 @@ public:
 
   File *getCurrentDir();
   void setCurrentDir(File *f);
+
+  StackAllocator *getArena();
+  void resetArena();
   
   u64 get_total_runtime();
   u32 get_time_slice_count();
@@ -81,6 +91,7 @@ protected:
   process_st info;
   File *cdir;
   Buffer *ipc;
+  StackAllocator arena;
   
   u64 total_runtime;
   u64 last_scheduled;
@@ -89,4 +100,11 @@ protected:
   static char *default_tty;
 };
 
+/*
+ * Scratch memory for the running task, or for the kernel when no task is
+ * running: temporaries go through a ScopedStackAllocator on it instead of
+ * kmalloc, and whatever a syscall leaves behind is dropped when it returns.
+ */
+StackAllocator *current_arena();
+
 #endif
@@ -7,7 +7,14 @@
 #include <arch/x86/pit.h>
 #include <arch/x86/vmm.h>
 #include <arch/x86/swap.h>
+#include <arch/x86/hugepage.h>
 #include <runtime/alloc.h>
+#include <runtime/memtest.h>
+#include <runtime/shrinker.h>
+#include <runtime/object_pool.h>
+#include <runtime/heapprof.h>
+#include <runtime/unified_alloc.h>
+#include <runtime/compaction.h>
 
 extern "C" {
     int strlen(const char *s);
@@ -409,12 +416,140 @@ int Shell::cmd_ps(int argc, char** argv) {
 }
 
 int Shell::cmd_mem(int argc, char** argv) {
-    (void)argc; (void)argv;
+    u32 iterations = 0;
+    if (argc > 3) {
+        for (int i = 0; argv[3][i]; i++) {
+            if (argv[3][i] >= '0' && argv[3][i] <= '9') {
+                iterations = iterations * 10 + (argv[3][i] - '0');
+            }
+        }
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "shrink") == 0) {
+        u32 pages = 0;
+        if (argc > 2) {
+            for (int i = 0; argv[2][i]; i++) {
+                if (argv[2][i] >= '0' && argv[2][i] <= '9') {
+                    pages = pages * 10 + (argv[2][i] - '0');
+                }
+            }
+        }
+        if (pages == 0) pages = shrinker_reclaimable();
+        
+        io.print("[SHRINK] Freed %d of %d pages requested\n", shrink_slab(pages), pages);
+        print_shrinker_stats();
+        return 0;
+    }
+    
+    /* mem profile [on [rate] | off | reset | dump]; the rate is parsed as iterations above, dump goes to serial. */
+    if (argc > 1 && strcmp(argv[1], "profile") == 0) {
+        if (argc > 2 && strcmp(argv[2], "on") == 0) {
+            return heap_profiler.enable(iterations) ? 0 : 1;
+        }
+        if (argc > 2 && strcmp(argv[2], "off") == 0) {
+            heap_profiler.disable();
+        } else if (argc > 2 && strcmp(argv[2], "reset") == 0) {
+            heap_profiler.reset();
+        } else if (argc > 2 && strcmp(argv[2], "dump") == 0) {
+            heap_profiler.dump(serial_print_shell);
+            io.print("[HEAPPROF] Dump written to serial\n");
+            return 0;
+        }
+        heap_profiler.print();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "pools") == 0) {
+        PoolBase::print_stats();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "frag") == 0) {
+        unified_allocator.print_fragmentation();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "optimize") == 0) {
+        unified_allocator.optimize_for_workload();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "tlb") == 0) {
+        print_tlb_stats();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "faults") == 0) {
+        vmm.print_fault_stats();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "thp") == 0) {
+        print_hugepage_stats();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "compact") == 0) {
+        io.print("[COMPACT] Moved %d pages\n", compact_memory());
+        print_compaction_stats();
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "validate") == 0) {
+        if (!unified_allocator.validate_heap()) {
+            return 1;
+        }
+        io.print("[UNIFIED] Heap is consistent\n");
+        return 0;
+    }
+    
+    if (argc > 2 && strcmp(argv[1], "test") == 0) {
+        if (strcmp(argv[2], "kfree") == 0) {
+            return memtest_kfree(iterations) ? 1 : 0;
+        }
+        
+        io.print("mem: unknown test '%s'\n", argv[2]);
+        return 1;
+    }
+    
+    if (argc > 2 && strcmp(argv[1], "bench") == 0) {
+        if (strcmp(argv[2], "buddy") == 0) {
+            membench_buddy(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "pages") == 0) {
+            membench_pages(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "realloc") == 0) {
+            membench_realloc(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "slub") == 0) {
+            membench_slub_free(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "slob") == 0) {
+            membench_slob(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "color") == 0) {
+            membench_slab_color(iterations);
+            return 0;
+        }
+        if (strcmp(argv[2], "magazine") == 0) {
+            membench_magazine(iterations);
+            return 0;
+        }
+        
+        io.print("mem: unknown benchmark '%s'\n", argv[2]);
+        return 1;
+    }
     
     extern VMM vmm;
     
     u32 total_frames = vmm.frame_count;
-    u32 used_frames = vmm.frames_used;
+    u32 used_frames = vmm.used_frames();
     u32 free_frames = total_frames - used_frames;
     
     u32 total_kb = total_frames * 4;
@@ -568,13 +703,16 @@ void Shell::add_to_history(const char* command) {
             state.history_count++;
         }
     } else {
-        kfree(state.command_history[0]);
+        /* Recycle the oldest entry; krealloc keeps it in place when it fits. */
+        char* oldest = state.command_history[0];
         for (int i = 0; i < MAX_HISTORY - 1; i++) {
             state.command_history[i] = state.command_history[i + 1];
         }
-        state.command_history[MAX_HISTORY - 1] = (char*)kmalloc(strlen(command) + 1);
+        state.command_history[MAX_HISTORY - 1] = (char*)krealloc(oldest, strlen(command) + 1);
         if (state.command_history[MAX_HISTORY - 1]) {
             strcpy(state.command_history[MAX_HISTORY - 1], command);
+        } else {
+            kfree(oldest);
         }
     }
 }
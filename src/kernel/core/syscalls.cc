@@ -2,6 +2,8 @@
 #include <api.h>
 #include <api/kernel/syscall_table.h>
 #include <syscalls.h>
+#include <process.h>
+#include <arch/x86/architecture.h>
 
 #define sysc(a, h) add(a, (syscall_handler)h)
 
@@ -38,10 +40,14 @@ void Syscalls::add(u32 num, syscall_handler h)
 }
 
 
+/* Scratch memory never outlives the syscall that took it; a caller that exited or was switched out keeps its arena as is. */
 void Syscalls::call(u32 num)
 {
   if (calls[num] != NULL)
   {
+    Process *caller = arch.pcurrent;
     calls[num]();
+    if (caller != NULL && caller == arch.pcurrent && caller->getState() != ZOMBIE)
+      caller->resetArena();
   }
 }
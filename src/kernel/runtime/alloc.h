@@ -9,6 +9,7 @@ extern "C" {
     void kfree(void *);
     void *krealloc(void *ptr, u32 new_size);
     void *kcalloc(u32 count, u32 size);
+    u32 ksize(void *ptr);
     void init_unified_allocator(int mode);
     
     void *kstack_alloc(u32 size);
@@ -1,50 +1,243 @@
 #include <os.h>
 #include <runtime/buddy.h>
+#include <runtime/shrinker.h>
+#include <runtime/compaction.h>
 
 BuddyAllocator buddy_allocator;
 
+#define ZONELIST_END 0xFF
+
+static const char *zone_names[MAX_NR_ZONES] = { "DMA", "Normal", "HighMem" };
+
+/* Fallback order per request type: a zone is only raided once the preferred ones are exhausted. */
+static const u8 zonelist_dma[] = { ZONE_DMA, ZONELIST_END };
+static const u8 zonelist_normal[] = { ZONE_NORMAL, ZONE_DMA, ZONELIST_END };
+static const u8 zonelist_highmem[] = { ZONE_HIGHMEM, ZONE_NORMAL, ZONE_DMA, ZONELIST_END };
+
+/* Per-CPU page lists are the cheapest thing to give back: the pages are already free. */
+static u32 pcp_shrink_count(struct shrinker * /*shrinker*/) {
+    return buddy_allocator.nr_pcp_pages();
+}
+
+static u32 pcp_shrink_scan(struct shrinker * /*shrinker*/, u32 /*nr_to_scan*/) {
+    u32 pages = buddy_allocator.nr_pcp_pages();
+    buddy_allocator.drain_pages();
+    return pages;
+}
+
+static struct shrinker pcp_shrinker = {
+    "pcp", pcp_shrink_count, pcp_shrink_scan, SHRINKER_SEEKS_CHEAP, nullptr, 0, 0
+};
+
+static u32 int_sqrt(u32 x) {
+    u32 r = 0;
+    while ((r + 1) * (r + 1) <= x) {
+        r++;
+    }
+    return r;
+}
+
+static u32 pair_words(u32 start_pfn, u32 end_pfn, u32 order) {
+    u32 pairs = ((end_pfn - 1) >> (order + 1)) - (start_pfn >> (order + 1)) + 1;
+    return (pairs + 31) / 32;
+}
+
+void BuddyAllocator::reset() {
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = &zones[z];
+        zone->name = zone_names[z];
+        zone->free_area_mask = 0;
+        zone->page_map = nullptr;
+        zone->memory_start = nullptr;
+        zone->memory_size = 0;
+        zone->start_pfn = 0;
+        zone->nr_pages = 0;
+        zone->total_blocks = 0;
+        zone->allocated_blocks = 0;
+        zone->free_pages = 0;
+        zone->compact_considered = 0;
+        zone->compact_defer_shift = 0;
+        zone->compact_order_failed = 0;
+        
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            zone->free_lists[i] = nullptr;
+            zone->free_blocks[i] = 0;
+        }
+        for (int w = 0; w < NR_WMARK; w++) {
+            zone->watermark[w] = 0;
+        }
+        for (int cpu = 0; cpu < NR_CPUS; cpu++) {
+            struct per_cpu_pages *pcp = &zone->pcp[cpu];
+            pcp->head = nullptr;
+            pcp->tail = nullptr;
+            pcp->count = 0;
+            pcp->low = 0;
+            pcp->high = 0;
+            pcp->batch = 1;
+            pcp->hits = 0;
+            pcp->refills = 0;
+            pcp->drains = 0;
+        }
+    }
+    
+    register_shrinker(&pcp_shrinker);
+}
+
+/*
+ * Single-region setup used when no memory map is available: the region
+ * becomes one zone whose descriptors are carved from its own head.
+ */
 void BuddyAllocator::init(void *memory_start, u32 memory_size) {
-    zone.memory_start = memory_start;
-    zone.memory_size = memory_size;
-    zone.total_blocks = memory_size / MIN_BLOCK_SIZE;
-    zone.allocated_blocks = 0;
+    u32 start = ((u32)memory_start + MIN_BLOCK_SIZE - 1) & ~(MIN_BLOCK_SIZE - 1);
+    u32 end = ((u32)memory_start + memory_size) & ~(MIN_BLOCK_SIZE - 1);
+    u32 start_pfn = start >> BUDDY_PAGE_SHIFT;
+    u32 end_pfn = end >> BUDDY_PAGE_SHIFT;
     
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        zone.free_lists[i] = nullptr;
-        zone.free_blocks[i] = 0;
+    u32 zone_id = ZONE_HIGHMEM;
+    if (start_pfn < ZONE_DMA_END_PFN) {
+        zone_id = ZONE_DMA;
+    } else if (start_pfn < ZONE_NORMAL_END_PFN) {
+        zone_id = ZONE_NORMAL;
     }
     
-    u32 max_order = 0;
-    u32 remaining_size = memory_size;
+    reset();
+    init_zone(zone_id, start_pfn, end_pfn, (void*)start);
+    free_range(start_pfn + zone_meta_size(start_pfn, end_pfn) / MIN_BLOCK_SIZE, end_pfn);
+    setup_watermarks();
+    
+    io.print("[BUDDY] Initialized with %d KB available\n", zones[zone_id].free_pages * (MIN_BLOCK_SIZE / 1024));
+}
+
+u32 BuddyAllocator::zone_meta_size(u32 start_pfn, u32 end_pfn) {
+    u32 bytes = (end_pfn - start_pfn) * sizeof(struct buddy_page);
     
-    while ((1U << (max_order + 1)) * MIN_BLOCK_SIZE <= remaining_size && max_order < MAX_ORDER) {
-        max_order++;
+    for (u32 k = 0; k < MAX_ORDER; k++) {
+        bytes += pair_words(start_pfn, end_pfn, k) * sizeof(u32);
     }
     
-    u8 *current_addr = (u8*)memory_start;
-    u32 current_size = memory_size;
+    return (bytes + MIN_BLOCK_SIZE - 1) & ~(MIN_BLOCK_SIZE - 1);
+}
+
+/*
+ * Describe the PFN span [start_pfn, end_pfn) of a zone. Every page starts
+ * out reserved; free_range() later releases the usable parts, so holes in
+ * the span simply never reach a free list. meta must hold zone_meta_size().
+ */
+void BuddyAllocator::init_zone(u32 zone_id, u32 start_pfn, u32 end_pfn, void *meta) {
+    struct buddy_zone *zone = &zones[zone_id];
     
-    while (current_size >= MIN_BLOCK_SIZE) {
+    zone->start_pfn = start_pfn;
+    zone->nr_pages = end_pfn - start_pfn;
+    zone->memory_start = (void*)(start_pfn << BUDDY_PAGE_SHIFT);
+    zone->memory_size = zone->nr_pages << BUDDY_PAGE_SHIFT;
+    zone->page_map = (struct buddy_page*)meta;
+    
+    for (u32 i = 0; i < zone->nr_pages; i++) {
+        struct buddy_page *page = &zone->page_map[i];
+        page->next = nullptr;
+        page->prev = nullptr;
+        page->owner_data = nullptr;
+        page->order = 0;
+        page->flags = BUDDY_PAGE_RESERVED;
+        page->zone = zone_id;
+        page->owner = PAGE_OWNER_NONE;
+    }
+    
+    u32 *words = (u32*)(zone->page_map + zone->nr_pages);
+    for (u32 k = 0; k < MAX_ORDER; k++) {
+        u32 count = pair_words(start_pfn, end_pfn, k);
+        zone->pair_map[k] = words;
+        for (u32 i = 0; i < count; i++) {
+            words[i] = 0;
+        }
+        words += count;
+    }
+}
+
+void BuddyAllocator::free_range(u32 start_pfn, u32 end_pfn) {
+    u32 pfn = start_pfn;
+    
+    while (pfn < end_pfn) {
+        struct buddy_zone *zone = pfn_to_zone(pfn);
+        if (!zone) {
+            pfn++;
+            continue;
+        }
+        
+        u32 limit = zone->start_pfn + zone->nr_pages;
+        if (limit > end_pfn) {
+            limit = end_pfn;
+        }
+        
         u32 order = 0;
-        while ((1U << (order + 1)) * MIN_BLOCK_SIZE <= current_size && order < MAX_ORDER) {
+        while (order < MAX_ORDER &&
+               (pfn & ((1U << (order + 1)) - 1)) == 0 &&
+               pfn + (1U << (order + 1)) <= limit) {
             order++;
         }
         
-        struct buddy_block *block = (struct buddy_block*)current_addr;
-        block->next = nullptr;
-        block->prev = nullptr;
-        block->order = order;
-        block->magic = BUDDY_MAGIC;
-        block->allocated = 0;
-        
-        add_to_free_list(block, order);
+        struct buddy_page *page = pfn_to_page(pfn);
+        for (u32 i = 0; i < (1U << order); i++) {
+            page[i].flags = 0;
+        }
         
-        u32 block_size = (1U << order) * MIN_BLOCK_SIZE;
-        current_addr += block_size;
-        current_size -= block_size;
+        add_to_free_list(zone, page, order);
+        if (order < MAX_ORDER) {
+            toggle_pair_bit(zone, pfn, order);
+        }
+        zone->free_pages += 1U << order;
+        zone->total_blocks += 1U << order;
+        pfn += 1U << order;
     }
+}
+
+/*
+ * min_free_kbytes-style reserve: sqrt(16 * lowmem KB), split between the
+ * lowmem zones in proportion to their size. HighMem keeps a token reserve
+ * since nothing allocates from it that cannot fall back.
+ */
+void BuddyAllocator::setup_watermarks() {
+    u32 lowmem_pages = zones[ZONE_DMA].total_blocks + zones[ZONE_NORMAL].total_blocks;
+    u32 min_kb = int_sqrt(lowmem_pages * (MIN_BLOCK_SIZE / 1024) * 16);
     
-    io.print("[BUDDY] Initialized with %d KB available\n", memory_size / 1024);
+    if (min_kb < 128) min_kb = 128;
+    if (min_kb > 65536) min_kb = 65536;
+    
+    u32 min_pages = min_kb / (MIN_BLOCK_SIZE / 1024);
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = &zones[z];
+        u32 min;
+        
+        if (z == ZONE_HIGHMEM) {
+            min = zone->total_blocks / 1024;
+            if (min < 32) min = 32;
+            if (min > 128) min = 128;
+        } else if (lowmem_pages > 0) {
+            min = (u32)(((u64)min_pages * zone->total_blocks) / lowmem_pages);
+        } else {
+            min = 0;
+        }
+        
+        if (zone->total_blocks == 0) {
+            min = 0;
+        }
+        
+        zone->watermark[WMARK_MIN] = min;
+        zone->watermark[WMARK_LOW] = min + min / 4;
+        zone->watermark[WMARK_HIGH] = min + min / 2;
+        
+        /* Roughly one batch per 4 MB of zone, capped so a drain stays short. */
+        u32 batch = zone->total_blocks / 1024;
+        if (batch < 1) batch = 1;
+        if (batch > PCP_MAX_BATCH) batch = PCP_MAX_BATCH;
+        
+        for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+            zone->pcp[cpu].batch = batch;
+            zone->pcp[cpu].low = 0;
+            zone->pcp[cpu].high = batch * 6;
+        }
+    }
 }
 
 u32 BuddyAllocator::get_order(u32 size) {
@@ -60,163 +253,775 @@ u32 BuddyAllocator::get_order(u32 size) {
 }
 
 void *BuddyAllocator::alloc(u32 size) {
-    if (size == 0) return nullptr;
+    if (size == 0 || size > (MIN_BLOCK_SIZE << MAX_ORDER)) return nullptr;
     
     u32 order = get_order(size);
     return alloc_order(order);
 }
 
-void *BuddyAllocator::alloc_order(u32 order) {
+struct buddy_zone *BuddyAllocator::get_zone(u32 zone_id) {
+    if (zone_id >= MAX_NR_ZONES) return nullptr;
+    return &zones[zone_id];
+}
+
+bool BuddyAllocator::zone_watermark_ok(struct buddy_zone *zone, u32 order, u32 mark) {
+    return zone->free_pages >= (1U << order) + zone->watermark[mark];
+}
+
+const u8 *BuddyAllocator::zonelist(u32 flags) {
+    if (flags & BUDDY_ZONE_DMA) return zonelist_dma;
+    if (flags & BUDDY_ZONE_HIGHMEM) return zonelist_highmem;
+    return zonelist_normal;
+}
+
+/*
+ * Walk the zonelist twice: first keeping every zone above its low
+ * watermark, then letting it dip to min. BUDDY_ALLOC_HARDER ignores
+ * the watermarks altogether. A multi-page request that still fails in a
+ * zone with enough free memory compacts that zone and tries once more,
+ * unless the caller is BUDDY_ALLOC_ATOMIC. Magazine refills reach the
+ * free lists from interrupt handlers, so every path that changes them
+ * runs with interrupts off.
+ */
+void *BuddyAllocator::alloc_order(u32 order, u32 flags) {
     if (order > MAX_ORDER) return nullptr;
     
-    u32 current_order = order;
+    const u8 *list = zonelist(flags);
+    const u32 passes[2] = { WMARK_LOW, WMARK_MIN };
     
-    while (current_order <= MAX_ORDER && zone.free_lists[current_order] == nullptr) {
-        current_order++;
+    for (u32 attempt = 0; attempt < 2; attempt++) {
+        for (u32 pass = 0; pass < 2; pass++) {
+            for (const u8 *z = list; *z != ZONELIST_END; z++) {
+                struct buddy_zone *zone = &zones[*z];
+                
+                if (zone->nr_pages == 0) continue;
+                
+                u32 irq = local_irq_save();
+                void *ptr = nullptr;
+                if ((flags & BUDDY_ALLOC_HARDER) || zone_watermark_ok(zone, order, passes[pass])) {
+                    ptr = alloc_from_zone(zone, order);
+                }
+                local_irq_restore(irq);
+                
+                if (ptr) return ptr;
+            }
+        }
+        
+        /* Pages parked on per-CPU lists may be the buddies we are missing. */
+        drain_pages();
+    }
+    
+    if (order == 0 || (flags & BUDDY_ALLOC_ATOMIC)) return nullptr;
+    
+    for (const u8 *z = list; *z != ZONELIST_END; z++) {
+        struct buddy_zone *zone = &zones[*z];
+        
+        if (zone->nr_pages == 0) continue;
+        if (!(flags & BUDDY_ALLOC_HARDER) && !zone_watermark_ok(zone, order, WMARK_MIN)) continue;
+        
+        if (try_to_compact(zone, order)) {
+            u32 irq = local_irq_save();
+            void *ptr = alloc_from_zone(zone, order);
+            local_irq_restore(irq);
+            if (ptr) return ptr;
+        }
     }
     
-    if (current_order > MAX_ORDER) {
+    return nullptr;
+}
+
+void *BuddyAllocator::alloc_from_zone(struct buddy_zone *zone, u32 order) {
+    u32 mask = zone->free_area_mask & ~((1U << order) - 1);
+    if (mask == 0) {
         return nullptr;
     }
     
-    struct buddy_block *block = zone.free_lists[current_order];
-    remove_from_free_list(block, current_order);
+    u32 current_order = __builtin_ctz(mask);
+    struct buddy_page *page = zone->free_lists[current_order];
+    remove_from_free_list(zone, page, current_order);
+    if (current_order < MAX_ORDER) {
+        toggle_pair_bit(zone, page_to_pfn(page), current_order);
+    }
     
     if (current_order > order) {
-        split_block(block, current_order, order);
+        split_block(zone, page, current_order, order);
     }
     
-    block->allocated = 1;
-    zone.allocated_blocks++;
+    page->order = order;
+    page->flags = BUDDY_PAGE_HEAD;
+    zone->allocated_blocks++;
+    zone->free_pages -= 1U << order;
     
-    return (void*)((u8*)block + sizeof(struct buddy_block));
+    return page_to_virt(page);
 }
 
 void BuddyAllocator::free(void *ptr) {
     if (!ptr) return;
     
-    struct buddy_block *block = (struct buddy_block*)((u8*)ptr - sizeof(struct buddy_block));
+    struct buddy_page *page = virt_to_page(ptr);
     
-    if (block->magic != BUDDY_MAGIC || !block->allocated) {
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page_to_virt(page) != ptr) {
         io.print("[BUDDY] Error: Invalid block or double free\n");
         return;
     }
     
-    free_order(ptr, block->order);
+    free_order(ptr, page->order);
 }
 
 void BuddyAllocator::free_order(void *ptr, u32 order) {
     if (!ptr || order > MAX_ORDER) return;
     
-    struct buddy_block *block = (struct buddy_block*)((u8*)ptr - sizeof(struct buddy_block));
-    block->allocated = 0;
-    zone.allocated_blocks--;
+    u32 irq = local_irq_save();
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page->order != order) {
+        local_irq_restore(irq);
+        io.print("[BUDDY] Error: Invalid block or double free\n");
+        return;
+    }
+    
+    struct buddy_zone *zone = &zones[page->zone];
+    
+    for (u32 i = 0; i < (1U << order); i++) {
+        page[i].owner = PAGE_OWNER_NONE;
+        page[i].owner_data = nullptr;
+    }
+    
+    page->flags = 0;
+    zone->allocated_blocks--;
+    zone->free_pages += 1U << order;
+    
+    coalesce_block(zone, page, order);
+    local_irq_restore(irq);
+}
+
+/*
+ * Resize an allocated block without moving it. Shrinking hands the upper
+ * halves back one order at a time; growing absorbs the buddy above at each
+ * order, which only works while the block is the lower half and every one
+ * of those buddies is free as a whole. Fails without side effects.
+ */
+bool BuddyAllocator::resize(void *ptr, u32 new_order) {
+    if (!ptr || new_order > MAX_ORDER) return false;
+    
+    u32 irq = local_irq_save();
+    bool ok = resize_locked(ptr, new_order);
+    local_irq_restore(irq);
+    return ok;
+}
+
+bool BuddyAllocator::resize_locked(void *ptr, u32 new_order) {
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page_to_virt(page) != ptr) {
+        return false;
+    }
+    
+    struct buddy_zone *zone = &zones[page->zone];
+    u32 pfn = page_to_pfn(page);
+    u32 order = page->order;
+    
+    if (new_order == order) return true;
+    
+    if (new_order < order) {
+        for (u32 o = order; o > new_order; o--) {
+            struct buddy_page *upper = page + (1U << (o - 1));
+            upper->order = o - 1;
+            upper->flags = BUDDY_PAGE_HEAD;
+            zone->allocated_blocks++;
+            free_order(page_to_virt(upper), o - 1);
+        }
+        page->order = new_order;
+        return true;
+    }
+    
+    if (pfn & ((1U << new_order) - 1)) return false;
+    if (pfn + (1U << new_order) > zone->start_pfn + zone->nr_pages) return false;
+    
+    for (u32 o = order; o < new_order; o++) {
+        struct buddy_page *buddy = page + (1U << o);
+        if (!(buddy->flags & BUDDY_PAGE_FREE) || buddy->order != o) return false;
+    }
+    
+    for (u32 o = order; o < new_order; o++) {
+        struct buddy_page *buddy = page + (1U << o);
+        remove_from_free_list(zone, buddy, o);
+        toggle_pair_bit(zone, pfn, o);
+        zone->free_pages -= 1U << o;
+        
+        for (u32 i = 0; i < (1U << o); i++) {
+            buddy[i].owner = page->owner;
+            buddy[i].owner_data = page->owner_data;
+        }
+    }
+    
+    page->order = new_order;
+    return true;
+}
+
+/*
+ * Take the free block headed at ptr off the free lists and hand it out as
+ * separately allocated frames, for compaction to copy pages into. Pair
+ * bits inside a free block are all clear, which is also right for pairs
+ * of allocated frames, so only the block's own bit changes. Returns the
+ * number of frames, 0 if ptr does not head a free block.
+ */
+u32 BuddyAllocator::isolate_free_block(void *ptr) {
+    u32 irq = local_irq_save();
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_FREE) || page_to_virt(page) != ptr) {
+        local_irq_restore(irq);
+        return 0;
+    }
+    
+    struct buddy_zone *zone = &zones[page->zone];
+    u32 order = page->order;
+    
+    remove_from_free_list(zone, page, order);
+    if (order < MAX_ORDER) {
+        toggle_pair_bit(zone, page_to_pfn(page), order);
+    }
+    
+    for (u32 i = 0; i < (1U << order); i++) {
+        page[i].order = 0;
+        page[i].flags = BUDDY_PAGE_HEAD;
+    }
+    zone->allocated_blocks += 1U << order;
+    zone->free_pages -= 1U << order;
     
-    coalesce_block(block, order);
+    local_irq_restore(irq);
+    return 1U << order;
 }
 
-void BuddyAllocator::add_to_free_list(struct buddy_block *block, u32 order) {
-    block->next = zone.free_lists[order];
-    block->prev = nullptr;
+/*
+ * Break an allocated block into separately allocated frames that are freed
+ * one at a time, keeping their owner. Pairs inside an allocated block
+ * already have their bits clear, as pairs of allocated frames do, so no
+ * bit changes.
+ */
+bool BuddyAllocator::split_page(void *ptr) {
+    u32 irq = local_irq_save();
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page_to_virt(page) != ptr) {
+        local_irq_restore(irq);
+        return false;
+    }
     
-    if (zone.free_lists[order]) {
-        zone.free_lists[order]->prev = block;
+    struct buddy_zone *zone = &zones[page->zone];
+    u32 order = page->order;
+    
+    for (u32 i = 0; i < (1U << order); i++) {
+        page[i].order = 0;
+        page[i].flags = BUDDY_PAGE_HEAD;
     }
+    zone->allocated_blocks += (1U << order) - 1;
     
-    zone.free_lists[order] = block;
-    zone.free_blocks[order]++;
+    local_irq_restore(irq);
+    return true;
 }
 
-void BuddyAllocator::remove_from_free_list(struct buddy_block *block, u32 order) {
-    if (block->prev) {
-        block->prev->next = block->next;
+/*
+ * Single-frame fast path. Each zone in the fallback list is tried through
+ * its per-CPU list, refilling it from the free lists while the zone is
+ * above its low watermark; only if all of them come up empty do we take
+ * the full alloc_order() path.
+ */
+void *BuddyAllocator::alloc_page(u32 flags) {
+    const u8 *list = zonelist(flags);
+    u32 irq = local_irq_save();
+    
+    for (const u8 *z = list; *z != ZONELIST_END; z++) {
+        struct buddy_zone *zone = &zones[*z];
+        if (zone->nr_pages == 0) continue;
+        
+        struct per_cpu_pages *pcp = &zone->pcp[smp_processor_id()];
+        if (pcp->count <= pcp->low) {
+            pcp_refill(zone, pcp);
+        } else {
+            pcp->hits++;
+        }
+        
+        struct buddy_page *page = pcp->head;
+        if (page) {
+            pcp->head = page->next;
+            if (pcp->head) {
+                pcp->head->prev = nullptr;
+            } else {
+                pcp->tail = nullptr;
+            }
+            pcp->count--;
+            page->next = nullptr;
+            page->prev = nullptr;
+            page->flags = BUDDY_PAGE_HEAD;
+            local_irq_restore(irq);
+            return page_to_virt(page);
+        }
+    }
+    
+    local_irq_restore(irq);
+    return alloc_order(0, flags);
+}
+
+/*
+ * Return a single frame to this CPU's list. Pages the caller has just
+ * touched go to the head; cold pages (e.g. written out by reclaim) go to
+ * the tail so they are the first to be drained back to the buddy.
+ */
+void BuddyAllocator::free_page(void *ptr, bool cold) {
+    if (!ptr) return;
+    
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD) || page->order != 0 || page_to_virt(page) != ptr) {
+        io.print("[BUDDY] Error: Invalid page or double free\n");
+        return;
+    }
+    
+    struct buddy_zone *zone = &zones[page->zone];
+    u32 irq = local_irq_save();
+    struct per_cpu_pages *pcp = &zone->pcp[smp_processor_id()];
+    
+    page->owner = PAGE_OWNER_NONE;
+    page->owner_data = nullptr;
+    pcp_add(pcp, page, cold);
+    
+    if (pcp->count > pcp->high) {
+        pcp_drain(pcp, pcp->batch);
+    }
+    
+    local_irq_restore(irq);
+}
+
+void BuddyAllocator::pcp_add(struct per_cpu_pages *pcp, struct buddy_page *page, bool cold) {
+    page->flags = BUDDY_PAGE_PCP;
+    
+    if (cold) {
+        page->next = nullptr;
+        page->prev = pcp->tail;
+        if (pcp->tail) {
+            pcp->tail->next = page;
+        } else {
+            pcp->head = page;
+        }
+        pcp->tail = page;
     } else {
-        zone.free_lists[order] = block->next;
+        page->prev = nullptr;
+        page->next = pcp->head;
+        if (pcp->head) {
+            pcp->head->prev = page;
+        } else {
+            pcp->tail = page;
+        }
+        pcp->head = page;
+    }
+    
+    pcp->count++;
+}
+
+void BuddyAllocator::pcp_refill(struct buddy_zone *zone, struct per_cpu_pages *pcp) {
+    u32 added = 0;
+    
+    while (added < pcp->batch && zone_watermark_ok(zone, 0, WMARK_LOW)) {
+        void *ptr = alloc_from_zone(zone, 0);
+        if (!ptr) break;
+        
+        pcp_add(pcp, virt_to_page(ptr), true);
+        added++;
     }
     
-    if (block->next) {
-        block->next->prev = block->prev;
+    if (added > 0) {
+        pcp->refills++;
+    }
+}
+
+void BuddyAllocator::pcp_drain(struct per_cpu_pages *pcp, u32 count) {
+    while (count > 0 && pcp->tail) {
+        struct buddy_page *page = pcp->tail;
+        
+        pcp->tail = page->prev;
+        if (pcp->tail) {
+            pcp->tail->next = nullptr;
+        } else {
+            pcp->head = nullptr;
+        }
+        pcp->count--;
+        count--;
+        
+        page->next = nullptr;
+        page->prev = nullptr;
+        page->flags = BUDDY_PAGE_HEAD;
+        free_order(page_to_virt(page), 0);
     }
     
-    zone.free_blocks[order]--;
+    pcp->drains++;
 }
 
-struct buddy_block *BuddyAllocator::find_buddy(struct buddy_block *block, u32 order) {
-    u32 block_size = (1U << order) * MIN_BLOCK_SIZE;
-    u32 block_index = ((u8*)block - (u8*)zone.memory_start) / block_size;
-    u32 buddy_index = block_index ^ 1;
-    u8 *buddy_addr = (u8*)zone.memory_start + (buddy_index * block_size);
+/* Give every cached page back to the free lists so it can coalesce. */
+void BuddyAllocator::drain_pages() {
+    u32 irq = local_irq_save();
     
-    if (buddy_addr >= (u8*)zone.memory_start + zone.memory_size) {
-        return nullptr;
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+            struct per_cpu_pages *pcp = &zones[z].pcp[cpu];
+            if (pcp->count > 0) {
+                pcp_drain(pcp, pcp->count);
+            }
+        }
     }
     
-    struct buddy_block *buddy = (struct buddy_block*)buddy_addr;
+    local_irq_restore(irq);
+}
+
+u32 BuddyAllocator::nr_pcp_pages() {
+    u32 total = 0;
     
-    if (buddy->magic == BUDDY_MAGIC && !buddy->allocated && buddy->order == order) {
-        return buddy;
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+            total += zones[z].pcp[cpu].count;
+        }
     }
     
-    return nullptr;
+    return total;
 }
 
-void BuddyAllocator::split_block(struct buddy_block *block, u32 order, u32 target_order) {
-    while (order > target_order) {
-        order--;
-        u32 half_size = (1U << order) * MIN_BLOCK_SIZE;
+u32 BuddyAllocator::nr_free_pages() {
+    u32 total = 0;
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        total += zones[z].free_pages;
+        for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+            total += zones[z].pcp[cpu].count;
+        }
+    }
+    
+    return total;
+}
+
+u32 BuddyAllocator::nr_managed_pages() {
+    u32 total = 0;
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        total += zones[z].total_blocks;
+    }
+    
+    return total;
+}
+
+/*
+ * The "unusable free space index" for an order: the share of free pages
+ * sitting in blocks too small to satisfy it, in thousandths. 0 means any
+ * free page could serve the request; a high value with plenty of memory
+ * free means the request fails on fragmentation, not on exhaustion. With
+ * no zone every zone is counted together.
+ */
+u32 BuddyAllocator::unusable_index(u32 order, struct buddy_zone *zone) {
+    u32 free_pages = 0;
+    u32 usable = 0;
+    
+    if (order > MAX_ORDER) return FRAG_INDEX_SCALE;
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        if (zone && zone != &zones[z]) continue;
+        
+        free_pages += zones[z].free_pages;
+        for (u32 j = order; j <= MAX_ORDER; j++) {
+            usable += zones[z].free_blocks[j] << j;
+        }
+    }
+    
+    if (free_pages == 0) return FRAG_INDEX_SCALE;
+    return (free_pages - usable) * FRAG_INDEX_SCALE / free_pages;
+}
+
+/* Check every free list, pair bit and per-CPU list against the page map. */
+bool BuddyAllocator::validate() {
+    bool ok = true;
+    u32 irq = local_irq_save();
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        if (zones[z].nr_pages == 0) continue;
+        if (!validate_zone(&zones[z])) {
+            ok = false;
+        }
+    }
+    
+    local_irq_restore(irq);
+    return ok;
+}
+
+bool BuddyAllocator::validate_zone(struct buddy_zone *zone) {
+    bool ok = true;
+    u32 end_pfn = zone->start_pfn + zone->nr_pages;
+    u32 listed_blocks = 0;
+    u32 listed_pages = 0;
+    
+    for (u32 o = 0; o <= MAX_ORDER; o++) {
+        u32 count = 0;
+        struct buddy_page *prev = nullptr;
         
-        struct buddy_block *buddy = (struct buddy_block*)((u8*)block + half_size);
-        buddy->next = nullptr;
-        buddy->prev = nullptr;
-        buddy->order = order;
-        buddy->magic = BUDDY_MAGIC;
-        buddy->allocated = 0;
+        for (struct buddy_page *page = zone->free_lists[o]; page; page = page->next) {
+            u32 pfn = page_to_pfn(page);
+            
+            if (page < zone->page_map || page >= zone->page_map + zone->nr_pages) {
+                io.print("[BUDDY] Validate: %s order %d list points outside the zone\n", zone->name, o);
+                ok = false;
+                break;
+            }
+            if (page->prev != prev) {
+                io.print("[BUDDY] Validate: %s pfn %x has a broken back link\n", zone->name, pfn);
+                ok = false;
+            }
+            if (page->flags != BUDDY_PAGE_FREE || page->order != o) {
+                io.print("[BUDDY] Validate: %s pfn %x on order %d list has flags %x order %d\n",
+                         zone->name, pfn, o, page->flags, page->order);
+                ok = false;
+            }
+            if ((pfn & ((1U << o) - 1)) || pfn + (1U << o) > end_pfn) {
+                io.print("[BUDDY] Validate: %s pfn %x is not an order %d block of the zone\n", zone->name, pfn, o);
+                ok = false;
+                break;
+            }
+            for (u32 i = 1; i < (1U << o); i++) {
+                if (page[i].flags) {
+                    io.print("[BUDDY] Validate: %s pfn %x inside free block %x has flags %x\n",
+                             zone->name, pfn + i, pfn, page[i].flags);
+                    ok = false;
+                    break;
+                }
+            }
+            
+            /* The pair bit is clear only while both halves are free; free_range() can leave such pairs. */
+            if (o < MAX_ORDER) {
+                u32 buddy_pfn = pfn ^ (1U << o);
+                bool buddy_free = false;
+                if (buddy_pfn >= zone->start_pfn && buddy_pfn < end_pfn) {
+                    struct buddy_page *buddy = &zone->page_map[buddy_pfn - zone->start_pfn];
+                    buddy_free = buddy->flags == BUDDY_PAGE_FREE && buddy->order == o;
+                }
+                u32 index = (pfn >> (o + 1)) - (zone->start_pfn >> (o + 1));
+                bool bit = zone->pair_map[o][index >> 5] & (1U << (index & 31));
+                if (bit == buddy_free) {
+                    io.print("[BUDDY] Validate: %s pair bit for pfn %x order %d is stale\n", zone->name, pfn, o);
+                    ok = false;
+                }
+            }
+            
+            prev = page;
+            listed_pages += 1U << o;
+            if (++count > zone->nr_pages) {
+                io.print("[BUDDY] Validate: %s order %d list loops\n", zone->name, o);
+                ok = false;
+                break;
+            }
+        }
+        
+        if (count != zone->free_blocks[o]) {
+            io.print("[BUDDY] Validate: %s order %d lists %d blocks, counter says %d\n",
+                     zone->name, o, count, zone->free_blocks[o]);
+            ok = false;
+        }
+        if (((zone->free_area_mask >> o) & 1) != (zone->free_lists[o] ? 1U : 0U)) {
+            io.print("[BUDDY] Validate: %s free_area_mask bit %d is wrong\n", zone->name, o);
+            ok = false;
+        }
+        listed_blocks += count;
+    }
+    
+    if (listed_pages != zone->free_pages) {
+        io.print("[BUDDY] Validate: %s free lists hold %d pages, counter says %d\n",
+                 zone->name, listed_pages, zone->free_pages);
+        ok = false;
+    }
+    
+    /* A page flagged free but missing from every list is lost to the allocator. */
+    u32 flagged = 0;
+    for (u32 i = 0; i < zone->nr_pages; i++) {
+        if (zone->page_map[i].flags == BUDDY_PAGE_FREE) {
+            flagged++;
+        }
+    }
+    if (flagged != listed_blocks) {
+        io.print("[BUDDY] Validate: %s has %d free heads but %d listed blocks\n", zone->name, flagged, listed_blocks);
+        ok = false;
+    }
+    
+    for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct per_cpu_pages *pcp = &zone->pcp[cpu];
+        u32 count = 0;
         
-        add_to_free_list(buddy, order);
+        for (struct buddy_page *page = pcp->head; page; page = page->next) {
+            if (page < zone->page_map || page >= zone->page_map + zone->nr_pages || page->flags != BUDDY_PAGE_PCP) {
+                io.print("[BUDDY] Validate: %s CPU %d pcp list holds a bad page\n", zone->name, cpu);
+                ok = false;
+                break;
+            }
+            if (++count > pcp->count) break;
+        }
         
-        block->order = order;
+        if (count != pcp->count) {
+            io.print("[BUDDY] Validate: %s CPU %d pcp lists %d pages, counter says %d\n",
+                     zone->name, cpu, count, pcp->count);
+            ok = false;
+        }
+    }
+    
+    return ok;
+}
+
+struct buddy_page *BuddyAllocator::virt_to_page(void *ptr) {
+    u32 pfn = (u32)ptr >> BUDDY_PAGE_SHIFT;
+    return pfn_to_page(pfn);
+}
+
+void BuddyAllocator::set_page_owner(void *ptr, u8 owner, void *owner_data) {
+    struct buddy_page *page = virt_to_page(ptr);
+    if (!page || !(page->flags & BUDDY_PAGE_HEAD)) return;
+    
+    for (u32 i = 0; i < (1U << page->order); i++) {
+        page[i].owner = owner;
+        page[i].owner_data = owner_data;
+    }
+}
+
+void *BuddyAllocator::page_to_virt(struct buddy_page *page) {
+    return (void*)(page_to_pfn(page) << BUDDY_PAGE_SHIFT);
+}
+
+u32 BuddyAllocator::page_to_pfn(struct buddy_page *page) {
+    struct buddy_zone *zone = &zones[page->zone];
+    return zone->start_pfn + (u32)(page - zone->page_map);
+}
+
+struct buddy_zone *BuddyAllocator::pfn_to_zone(u32 pfn) {
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = &zones[z];
+        if (pfn >= zone->start_pfn && pfn < zone->start_pfn + zone->nr_pages) {
+            return zone;
+        }
+    }
+    return nullptr;
+}
+
+struct buddy_page *BuddyAllocator::pfn_to_page(u32 pfn) {
+    struct buddy_zone *zone = pfn_to_zone(pfn);
+    if (!zone) {
+        return nullptr;
+    }
+    return &zone->page_map[pfn - zone->start_pfn];
+}
+
+void BuddyAllocator::add_to_free_list(struct buddy_zone *zone, struct buddy_page *page, u32 order) {
+    page->order = order;
+    page->flags = BUDDY_PAGE_FREE;
+    page->next = zone->free_lists[order];
+    page->prev = nullptr;
+    
+    if (zone->free_lists[order]) {
+        zone->free_lists[order]->prev = page;
+    }
+    
+    zone->free_lists[order] = page;
+    zone->free_blocks[order]++;
+    zone->free_area_mask |= 1U << order;
+}
+
+void BuddyAllocator::remove_from_free_list(struct buddy_zone *zone, struct buddy_page *page, u32 order) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        zone->free_lists[order] = page->next;
+    }
+    
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    
+    page->next = nullptr;
+    page->prev = nullptr;
+    page->flags = 0;
+    zone->free_blocks[order]--;
+    if (!zone->free_lists[order]) {
+        zone->free_area_mask &= ~(1U << order);
+    }
+}
+
+/*
+ * Flip the pair bit covering pfn at this order and return its new value.
+ * A buddy outside the zone or inside a reserved range is never free, so
+ * its pair bit just mirrors the state of the half that is in range.
+ */
+u32 BuddyAllocator::toggle_pair_bit(struct buddy_zone *zone, u32 pfn, u32 order) {
+    u32 index = (pfn >> (order + 1)) - (zone->start_pfn >> (order + 1));
+    u32 bit = 1U << (index & 31);
+    
+    zone->pair_map[order][index >> 5] ^= bit;
+    return (zone->pair_map[order][index >> 5] & bit) ? 1 : 0;
+}
+
+void BuddyAllocator::split_block(struct buddy_zone *zone, struct buddy_page *page, u32 order, u32 target_order) {
+    while (order > target_order) {
+        order--;
+        struct buddy_page *half = page + (1U << order);
+        add_to_free_list(zone, half, order);
+        toggle_pair_bit(zone, page_to_pfn(half), order);
     }
 }
 
-void BuddyAllocator::coalesce_block(struct buddy_block *block, u32 order) {
+void BuddyAllocator::coalesce_block(struct buddy_zone *zone, struct buddy_page *page, u32 order) {
     while (order < MAX_ORDER) {
-        struct buddy_block *buddy = find_buddy(block, order);
+        u32 pfn = page_to_pfn(page);
         
-        if (!buddy) {
+        /* Bit still set after our toggle means the buddy is in use. */
+        if (toggle_pair_bit(zone, pfn, order)) {
             break;
         }
         
-        remove_from_free_list(buddy, order);
+        struct buddy_page *buddy = &zone->page_map[(pfn ^ (1U << order)) - zone->start_pfn];
+        remove_from_free_list(zone, buddy, order);
         
-        if (buddy < block) {
-            block = buddy;
+        if (buddy < page) {
+            page = buddy;
         }
         
         order++;
-        block->order = order;
     }
     
-    add_to_free_list(block, order);
+    add_to_free_list(zone, page, order);
 }
 
 void BuddyAllocator::print_stats() {
     io.print("[BUDDY] Memory Statistics:\n");
-    io.print("  Total blocks: %d\n", zone.total_blocks);
-    io.print("  Allocated blocks: %d\n", zone.allocated_blocks);
+    io.print("  Fallback: HighMem -> Normal -> DMA, Normal -> DMA, DMA only\n");
     
-    for (u32 i = 0; i <= MAX_ORDER; i++) {
-        if (zone.free_blocks[i] > 0) {
-            u32 block_size = (1U << i) * MIN_BLOCK_SIZE;
-            io.print("  Order %d (%d KB): %d free blocks\n", 
-                     i, block_size / 1024, zone.free_blocks[i]);
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = &zones[z];
+        if (zone->nr_pages == 0) continue;
+        
+        io.print("  Zone %s: pfn %x-%x\n", zone->name, zone->start_pfn, zone->start_pfn + zone->nr_pages);
+        io.print("    Total blocks: %d\n", zone->total_blocks);
+        io.print("    Allocated blocks: %d\n", zone->allocated_blocks);
+        io.print("    Free pages: %d\n", zone->free_pages);
+        io.print("    Watermarks: min %d low %d high %d\n",
+                 zone->watermark[WMARK_MIN], zone->watermark[WMARK_LOW], zone->watermark[WMARK_HIGH]);
+        for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+            struct per_cpu_pages *pcp = &zone->pcp[cpu];
+            io.print("    CPU %d pcp: %d pages (low %d high %d batch %d), %d hits, %d refills, %d drains\n",
+                     cpu, pcp->count, pcp->low, pcp->high, pcp->batch, pcp->hits, pcp->refills, pcp->drains);
         }
+        
+        for (u32 i = 0; i <= MAX_ORDER; i++) {
+            if (zone->free_blocks[i] > 0) {
+                u32 block_size = (1U << i) * MIN_BLOCK_SIZE;
+                io.print("    Order %d (%d KB): %d free blocks\n",
+                         i, block_size / 1024, zone->free_blocks[i]);
+            }
+        }
+        
+        io.print("    Unusable free space index (of %d) by order:", FRAG_INDEX_SCALE);
+        for (u32 i = 0; i <= MAX_ORDER; i++) {
+            io.print(" %d", unusable_index(i, zone));
+        }
+        io.print("\n");
     }
 }
 
-void init_buddy_allocator() {
-    buddy_allocator.init((void*)0x1000000, 0x1000000);
-}
-
 extern "C" {
     void *buddy_alloc(u32 size) {
         return buddy_allocator.alloc(size);
@@ -225,4 +1030,4 @@ extern "C" {
     void buddy_free(void *ptr) {
         buddy_allocator.free(ptr);
     }
-}
\ No newline at end of file
+}
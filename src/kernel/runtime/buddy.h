@@ -3,54 +3,184 @@
 
 #include <runtime/types.h>
 #include <runtime/list.h>
+#include <runtime/percpu.h>
 
 #define MAX_ORDER 11
 #define MIN_BLOCK_SIZE 4096
-#define BUDDY_MAGIC 0xBDD1234
-
-struct buddy_block {
-    struct buddy_block *next;
-    struct buddy_block *prev;
-    u32 order;
-    u32 magic;
-    u8 allocated;
+#define BUDDY_PAGE_SHIFT 12
+
+#define BUDDY_PAGE_FREE     0x01
+#define BUDDY_PAGE_HEAD     0x02
+#define BUDDY_PAGE_RESERVED 0x04
+#define BUDDY_PAGE_PCP      0x08
+
+#define ZONE_DMA        0
+#define ZONE_NORMAL     1
+#define ZONE_HIGHMEM    2
+#define MAX_NR_ZONES    3
+
+#define ZONE_DMA_END_PFN     (0x01000000 >> BUDDY_PAGE_SHIFT)
+#define ZONE_NORMAL_END_PFN  (0x38000000 >> BUDDY_PAGE_SHIFT)
+
+#define WMARK_MIN   0
+#define WMARK_LOW   1
+#define WMARK_HIGH  2
+#define NR_WMARK    3
+
+/* Zone selection for alloc_order; without either flag allocations come from NORMAL, then DMA. */
+#define BUDDY_ZONE_DMA      0x01
+#define BUDDY_ZONE_HIGHMEM  0x02
+#define BUDDY_ALLOC_HARDER  0x04
+/* Never compacts; for callers that may be in an interrupt handler or have interrupts off. */
+#define BUDDY_ALLOC_ATOMIC  0x08
+
+#define PCP_MAX_BATCH   31
+
+/* unusable_index() is in thousandths: 0 means every free page can serve the order, 1000 none can. */
+#define FRAG_INDEX_SCALE    1000
+
+/* Which allocator a page was handed to; kfree() dispatches on this. */
+#define PAGE_OWNER_NONE     0
+#define PAGE_OWNER_BUDDY    1
+#define PAGE_OWNER_SLAB     2
+#define PAGE_OWNER_SLUB     3
+#define PAGE_OWNER_SLOB     4
+#define PAGE_OWNER_STACK    5
+#define PAGE_OWNER_POOL     6
+#define PAGE_OWNER_ANON     7
+#define PAGE_OWNER_NR       8
+
+/*
+ * One descriptor per 4 KiB frame, indexed by PFN. Block state lives here
+ * rather than inside the block, so blocks are naturally aligned and exactly
+ * (MIN_BLOCK_SIZE << order) bytes. Only the first page of a block (the head)
+ * carries a meaningful order. owner says which allocator the block was
+ * handed to and owner_data is that allocator's (e.g. the slab that lives in
+ * it); set_page_owner() stamps both on every page of a block and both are
+ * reset when the block goes back to the buddy. Only free and per-CPU pages
+ * are linked through next, so an allocated page reuses the word as index:
+ * for PAGE_OWNER_ANON, whose owner_data is the page directory, the user
+ * address the frame is mapped at.
+ */
+struct buddy_page {
+    union {
+        struct buddy_page *next;
+        u32 index;
+    };
+    struct buddy_page *prev;
+    void *owner_data;
+    u8 order;
+    u8 flags;
+    u8 zone;
+    u8 owner;
+};
+
+/*
+ * Order-0 pages cached per CPU so single-frame allocations rarely touch
+ * the free lists. Hot (recently freed, cache-warm) pages sit at the head
+ * and are handed out first; cold pages are queued at the tail. The list
+ * is refilled from the buddy in batches once it falls to low and drained
+ * back, coldest first, once it rises above high. The buddy counts cached
+ * pages as allocated.
+ */
+struct per_cpu_pages {
+    struct buddy_page *head;
+    struct buddy_page *tail;
+    u32 count;
+    u32 low;
+    u32 high;
+    u32 batch;
+    
+    u32 hits;
+    u32 refills;
+    u32 drains;
 };
 
+/*
+ * free_area_mask has bit N set while free_lists[N] is non-empty. pair_map[N]
+ * holds one bit per pair of order-N buddies, toggled whenever either half is
+ * allocated or freed, so a set bit means exactly one half is free.
+ */
 struct buddy_zone {
-    struct buddy_block *free_lists[MAX_ORDER + 1];
+    const char *name;
+    struct buddy_page *free_lists[MAX_ORDER + 1];
     u32 free_blocks[MAX_ORDER + 1];
+    u32 free_area_mask;
+    u32 *pair_map[MAX_ORDER];
+    struct buddy_page *page_map;
     void *memory_start;
     u32 memory_size;
+    u32 start_pfn;
+    u32 nr_pages;
     u32 total_blocks;
     u32 allocated_blocks;
+    u32 free_pages;
+    u32 watermark[NR_WMARK];
+    struct per_cpu_pages pcp[NR_CPUS];
+    
+    u32 compact_considered;
+    u32 compact_defer_shift;
+    u32 compact_order_failed;
 };
 
 class BuddyAllocator {
 public:
+    void reset();
     void init(void *memory_start, u32 memory_size);
+    u32 zone_meta_size(u32 start_pfn, u32 end_pfn);
+    void init_zone(u32 zone_id, u32 start_pfn, u32 end_pfn, void *meta);
+    void free_range(u32 start_pfn, u32 end_pfn);
+    void setup_watermarks();
+    
     void *alloc(u32 size);
     void free(void *ptr);
     u32 get_order(u32 size);
-    void *alloc_order(u32 order);
+    void *alloc_order(u32 order, u32 flags = 0);
     void free_order(void *ptr, u32 order);
+    bool resize(void *ptr, u32 new_order);
+    u32 isolate_free_block(void *ptr);
+    bool split_page(void *ptr);
+    void *alloc_page(u32 flags = 0);
+    void free_page(void *ptr, bool cold = false);
+    void drain_pages();
+    u32 nr_pcp_pages();
+    u32 nr_free_pages();
+    u32 nr_managed_pages();
+    u32 unusable_index(u32 order, struct buddy_zone *zone = nullptr);
+    bool validate();
     void print_stats();
     
+    struct buddy_page *virt_to_page(void *ptr);
+    void set_page_owner(void *ptr, u8 owner, void *owner_data = nullptr);
+    void *page_to_virt(struct buddy_page *page);
+    struct buddy_zone *get_zone(u32 zone_id);
+    bool zone_watermark_ok(struct buddy_zone *zone, u32 order, u32 mark);
+
 private:
-    struct buddy_zone zone;
+    struct buddy_zone zones[MAX_NR_ZONES];
     
-    void add_to_free_list(struct buddy_block *block, u32 order);
-    void remove_from_free_list(struct buddy_block *block, u32 order);
-    struct buddy_block *find_buddy(struct buddy_block *block, u32 order);
-    void split_block(struct buddy_block *block, u32 order, u32 target_order);
-    void coalesce_block(struct buddy_block *block, u32 order);
+    u32 page_to_pfn(struct buddy_page *page);
+    struct buddy_page *pfn_to_page(u32 pfn);
+    struct buddy_zone *pfn_to_zone(u32 pfn);
+    const u8 *zonelist(u32 flags);
+    void *alloc_from_zone(struct buddy_zone *zone, u32 order);
+    bool resize_locked(void *ptr, u32 new_order);
+    void pcp_add(struct per_cpu_pages *pcp, struct buddy_page *page, bool cold);
+    void pcp_refill(struct buddy_zone *zone, struct per_cpu_pages *pcp);
+    void pcp_drain(struct per_cpu_pages *pcp, u32 count);
+    void add_to_free_list(struct buddy_zone *zone, struct buddy_page *page, u32 order);
+    void remove_from_free_list(struct buddy_zone *zone, struct buddy_page *page, u32 order);
+    u32 toggle_pair_bit(struct buddy_zone *zone, u32 pfn, u32 order);
+    void split_block(struct buddy_zone *zone, struct buddy_page *page, u32 order, u32 target_order);
+    void coalesce_block(struct buddy_zone *zone, struct buddy_page *page, u32 order);
+    bool validate_zone(struct buddy_zone *zone);
 };
 
 extern BuddyAllocator buddy_allocator;
 
 extern "C" {
-    void init_buddy_allocator();
     void *buddy_alloc(u32 size);
     void buddy_free(void *ptr);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,14 +1,20 @@
 #include <os.h>
 #include <runtime/buffer.h>
 
+extern "C" {
+    void *memcpy(void *dest, const void *src, int n);
+}
+
 Buffer::Buffer(char* n, u32 siz) {
     map = n;
     size = siz;
+    head = 0;
 }
 
 Buffer::Buffer() {
     map = nullptr;
     size = 0;
+    head = 0;
 }
 
 Buffer::~Buffer() {
@@ -17,25 +23,79 @@ Buffer::~Buffer() {
     }
 }
 
+/*
+ * Append to the queue. Bytes already read are dropped first, moving the
+ * unread ones to the front, and the backing store then grows through
+ * krealloc, which extends it in place while its size class or buddy
+ * block has room.
+ */
 void Buffer::add(u8* c, u32 s) {
-    (void)c;
-    (void)s;
+    if (!c || s == 0) {
+        return;
+    }
+    
+    if (head > 0) {
+        for (u32 i = head; i < size; i++) {
+            map[i - head] = map[i];
+        }
+        size -= head;
+        head = 0;
+    }
+    
+    char* grown = (char*)krealloc(map, size + s);
+    if (!grown) {
+        return;
+    }
+    
+    map = grown;
+    memcpy(map + size, c, s);
+    size += s;
 }
 
+/* Reads only advance head; nothing is moved until the next add. */
 u32 Buffer::get(u8* c, u32 s) {
-    (void)c;
-    (void)s;
-    return 0;
+    if (!c || head == size) {
+        return 0;
+    }
+    
+    u32 n = s < size - head ? s : size - head;
+    memcpy(c, map + head, n);
+    head += n;
+    
+    if (head == size) {
+        head = 0;
+        size = 0;
+    }
+    
+    return n;
+}
+
+/* Read at most len - 1 bytes into c and terminate them; returns the number of bytes read. */
+u32 Buffer::getString(char* c, u32 len) {
+    if (!c || len == 0) {
+        return 0;
+    }
+    
+    u32 n = get((u8*)c, len - 1);
+    c[n] = '\0';
+    return n;
 }
 
 void Buffer::clear() {
+    size = 0;
+    head = 0;
 }
 
 u32 Buffer::isEmpty() {
-    return 1;
+    return head == size;
 }
 
+u32 Buffer::available() {
+    return size - head;
+}
+
+/* Drains the whole queue, so c must hold available() + 1 bytes; use getString() when it may not. */
 Buffer& Buffer::operator>>(char* c) {
-    (void)c;
+    getString(c, available() + 1);
     return *this;
-}
\ No newline at end of file
+}
@@ -10,12 +10,16 @@ public:
 
   void add(u8 *c, u32 s);
   u32 get(u8 *c, u32 s);
+  u32 getString(char *c, u32 len);
   void clear();
   u32 isEmpty();
+  u32 available();
 
   Buffer &operator>>(char *c);
 
+  /* map holds size bytes, of which the first head have been read. */
   u32 size;
+  u32 head;
   char *map;
 };
 
@@ -0,0 +1,306 @@
+#include <os.h>
+#include <runtime/compaction.h>
+#include <runtime/percpu.h>
+
+extern "C" {
+    void *memcpy(void *dest, const void *src, int n);
+    u64 get_system_ticks();
+}
+
+static migrate_page_fn movable_ops[PAGE_OWNER_NR];
+static struct compact_stats stats;
+static u32 last_proactive;
+static u32 proactive_backoff;
+
+/*
+ * One pass over a zone. The migrate scanner climbs from the bottom looking
+ * for movable frames; the free scanner comes down from the top a window
+ * at a time, isolating free blocks to move them into. The pass ends where
+ * the two meet, with used frames packed at the top and the frames they
+ * left coalescing at the bottom. Isolated frames are linked through next.
+ */
+struct compact_control {
+    struct buddy_zone *zone;
+    u32 order;
+    u32 migrate_pfn;
+    u32 free_pfn;
+    struct buddy_page *freepages;
+};
+
+/* Owners call this from their init; a frame is only ever moved if its owner registered. */
+void register_movable(u8 owner, migrate_page_fn migrate) {
+    if (owner < PAGE_OWNER_NR) {
+        movable_ops[owner] = migrate;
+    }
+}
+
+static struct buddy_page *zone_page(struct buddy_zone *zone, u32 pfn) {
+    return &zone->page_map[pfn - zone->start_pfn];
+}
+
+static bool zone_has_order(struct buddy_zone *zone, u32 order) {
+    return order <= MAX_ORDER && (zone->free_area_mask >> order) != 0;
+}
+
+/*
+ * Scan the next window below the free scanner. Blocks already big enough
+ * for the request are left alone; breaking them up would undo the work.
+ * Stops short of any window the migrate scanner has reached.
+ */
+static void isolate_freepages(struct compact_control *cc) {
+    if (cc->free_pfn <= cc->migrate_pfn) return;
+    
+    u32 end = cc->free_pfn;
+    u32 start = (end - 1) & ~(COMPACT_WINDOW - 1);
+    if (start <= cc->migrate_pfn) {
+        cc->free_pfn = cc->migrate_pfn;
+        return;
+    }
+    cc->free_pfn = start;
+    
+    for (u32 pfn = start; pfn < end; ) {
+        struct buddy_page *page = zone_page(cc->zone, pfn);
+        stats.free_scanned++;
+        
+        if (!(page->flags & (BUDDY_PAGE_FREE | BUDDY_PAGE_HEAD))) {
+            pfn++;
+            continue;
+        }
+        
+        u32 span = 1U << page->order;
+        if ((page->flags & BUDDY_PAGE_FREE) && page->order < cc->order) {
+            u32 frames = buddy_allocator.isolate_free_block(buddy_allocator.page_to_virt(page));
+            for (u32 i = frames; i > 0; i--) {
+                page[i - 1].next = cc->freepages;
+                cc->freepages = &page[i - 1];
+            }
+            stats.isolated += frames;
+        }
+        pfn += span;
+    }
+}
+
+/* Let pending interrupts in; isolated frames count as allocated, so nothing the pass holds can be taken meanwhile. */
+static u32 compact_relax(u32 irq) {
+    local_irq_restore(irq);
+    return local_irq_save();
+}
+
+/* Copy one frame into an isolated one and let its owner repoint itself; a refusal puts the target back. */
+static bool migrate_one(struct compact_control *cc, struct buddy_page *page, migrate_page_fn migrate) {
+    struct buddy_page *target = cc->freepages;
+    cc->freepages = target->next;
+    
+    void *from = buddy_allocator.page_to_virt(page);
+    void *to = buddy_allocator.page_to_virt(target);
+    
+    memcpy(to, from, MIN_BLOCK_SIZE);
+    target->index = page->index;
+    target->owner = page->owner;
+    target->owner_data = page->owner_data;
+    
+    if (migrate(page, from, to) != 0) {
+        target->owner = PAGE_OWNER_NONE;
+        target->owner_data = nullptr;
+        target->next = cc->freepages;
+        cc->freepages = target;
+        stats.migrate_failed++;
+        return false;
+    }
+    
+    buddy_allocator.free_order(from, 0);
+    stats.migrated++;
+    return true;
+}
+
+/*
+ * Compact one zone until a free block of the given order appears, or with
+ * COMPACT_ORDER_ALL until the scanners meet. Interrupts are off while a
+ * frame is looked at or moved, and let in again after every migration,
+ * every free window and every COMPACT_IRQ_BATCH frames scanned, so the
+ * state under the migrate scanner is always read afresh. Returns
+ * COMPACT_SKIPPED if the zone already had such a block, COMPACT_SUCCESS if
+ * the pass made one and COMPACT_COMPLETE if it ran out of zone.
+ */
+u32 compact_zone(struct buddy_zone *zone, u32 order) {
+    if (!zone || zone->nr_pages == 0) return COMPACT_SKIPPED;
+    
+    buddy_allocator.drain_pages();
+    
+    u32 irq = local_irq_save();
+    
+    if (zone_has_order(zone, order)) {
+        local_irq_restore(irq);
+        return COMPACT_SKIPPED;
+    }
+    
+    struct compact_control cc;
+    cc.zone = zone;
+    cc.order = order;
+    cc.migrate_pfn = zone->start_pfn;
+    cc.free_pfn = zone->start_pfn + zone->nr_pages;
+    cc.freepages = nullptr;
+    
+    u32 result = COMPACT_COMPLETE;
+    u32 scanned = 0;
+    
+    while (cc.migrate_pfn < cc.free_pfn) {
+        if (++scanned == COMPACT_IRQ_BATCH) {
+            irq = compact_relax(irq);
+            scanned = 0;
+        }
+        
+        if (zone_has_order(zone, order)) {
+            result = COMPACT_SUCCESS;
+            break;
+        }
+        
+        struct buddy_page *page = zone_page(zone, cc.migrate_pfn);
+        stats.migrate_scanned++;
+        
+        if (!(page->flags & (BUDDY_PAGE_FREE | BUDDY_PAGE_HEAD))) {
+            cc.migrate_pfn++;
+            continue;
+        }
+        
+        u32 span = 1U << page->order;
+        migrate_page_fn migrate = nullptr;
+        if ((page->flags & BUDDY_PAGE_HEAD) && page->order == 0 && page->owner < PAGE_OWNER_NR) {
+            migrate = movable_ops[page->owner];
+        }
+        
+        if (migrate) {
+            if (!cc.freepages) {
+                isolate_freepages(&cc);
+                if (!cc.freepages) {
+                    if (cc.free_pfn <= cc.migrate_pfn) break;
+                    irq = compact_relax(irq);
+                    scanned = 0;
+                    continue;
+                }
+            }
+            migrate_one(&cc, page, migrate);
+            irq = compact_relax(irq);
+            scanned = 0;
+        }
+        cc.migrate_pfn += span;
+    }
+    
+    while (cc.freepages) {
+        struct buddy_page *page = cc.freepages;
+        cc.freepages = page->next;
+        page->next = nullptr;
+        buddy_allocator.free_order(buddy_allocator.page_to_virt(page), 0);
+    }
+    
+    if (result == COMPACT_COMPLETE && zone_has_order(zone, order)) {
+        result = COMPACT_SUCCESS;
+    }
+    
+    local_irq_restore(irq);
+    return result;
+}
+
+/*
+ * Direct compaction for an allocation that just failed. After a failure
+ * the zone skips 1, 2, 4 ... up to 1 << COMPACT_MAX_DEFER_SHIFT further
+ * attempts at that order or above, so a workload that keeps asking for
+ * what cannot be built does not rescan the zone every time.
+ */
+bool try_to_compact(struct buddy_zone *zone, u32 order) {
+    if (zone->compact_defer_shift && order >= zone->compact_order_failed) {
+        if (++zone->compact_considered < (1U << zone->compact_defer_shift)) {
+            stats.deferred++;
+            return false;
+        }
+    }
+    
+    stats.stalls++;
+    u32 result = compact_zone(zone, order);
+    
+    if (result == COMPACT_SUCCESS) {
+        stats.success++;
+        zone->compact_considered = 0;
+        zone->compact_defer_shift = 0;
+        if (order >= zone->compact_order_failed) {
+            zone->compact_order_failed = order + 1;
+        }
+        return true;
+    }
+    
+    if (result == COMPACT_COMPLETE) {
+        stats.fail++;
+        zone->compact_considered = 0;
+        if (zone->compact_defer_shift < COMPACT_MAX_DEFER_SHIFT) {
+            zone->compact_defer_shift++;
+        }
+        if (order < zone->compact_order_failed || zone->compact_defer_shift == 1) {
+            zone->compact_order_failed = order;
+        }
+    }
+    
+    return false;
+}
+
+/* Compact every zone completely; returns the number of frames moved. */
+u32 compact_memory() {
+    u32 before = stats.migrated;
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = buddy_allocator.get_zone(z);
+        if (zone->nr_pages == 0) continue;
+        
+        compact_zone(zone, COMPACT_ORDER_ALL);
+        zone->compact_considered = 0;
+        zone->compact_defer_shift = 0;
+    }
+    
+    return stats.migrated - before;
+}
+
+/*
+ * Background compaction, called from the idle task. Every interval it
+ * compacts each zone whose free memory is mostly unusable for
+ * COMPACT_PROACTIVE_ORDER. A round that moves nothing doubles the
+ * interval, up to 64 times, until one moves something again.
+ */
+void compact_proactive() {
+    u32 now = (u32)get_system_ticks();
+    if (now - last_proactive < ((u32)COMPACT_PROACTIVE_INTERVAL << proactive_backoff)) return;
+    last_proactive = now;
+    
+    u32 before = stats.migrated;
+    bool ran = false;
+    
+    for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+        struct buddy_zone *zone = buddy_allocator.get_zone(z);
+        if (zone->nr_pages == 0) continue;
+        if (buddy_allocator.unusable_index(COMPACT_PROACTIVE_ORDER, zone) <= COMPACT_PROACTIVE_INDEX) continue;
+        
+        stats.proactive++;
+        compact_zone(zone, COMPACT_ORDER_ALL);
+        ran = true;
+    }
+    
+    if (!ran) return;
+    if (stats.migrated != before) {
+        proactive_backoff = 0;
+    } else if (proactive_backoff < COMPACT_MAX_DEFER_SHIFT) {
+        proactive_backoff++;
+    }
+}
+
+struct compact_stats *compaction_stats() {
+    return &stats;
+}
+
+void print_compaction_stats() {
+    io.print("[COMPACT] Compaction statistics:\n");
+    io.print("  Direct: %d stalls, %d success, %d fail, %d deferred\n",
+             stats.stalls, stats.success, stats.fail, stats.deferred);
+    io.print("  Background passes: %d\n", stats.proactive);
+    io.print("  Pages migrated: %d, migration failures: %d, free frames isolated: %d\n",
+             stats.migrated, stats.migrate_failed, stats.isolated);
+    io.print("  Scanned: %d by the migrate scanner, %d by the free scanner\n",
+             stats.migrate_scanned, stats.free_scanned);
+}
@@ -0,0 +1,58 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include <runtime/types.h>
+#include <runtime/buddy.h>
+
+/* The free scanner works through the zone in windows of this many pages, top down. */
+#define COMPACT_WINDOW_ORDER    5
+#define COMPACT_WINDOW          (1U << COMPACT_WINDOW_ORDER)
+
+/* Frames the migrate scanner may look at before compact_zone() lets interrupts in. */
+#define COMPACT_IRQ_BATCH       64
+
+/* compact_zone() with this order runs until the scanners meet instead of stopping at the first big enough block. */
+#define COMPACT_ORDER_ALL       (MAX_ORDER + 1)
+
+/* A failed direct compaction skips the next 1 << shift attempts at that order, up to this shift. */
+#define COMPACT_MAX_DEFER_SHIFT 6
+
+/* Background compaction: how often the idle task looks, and at what it aims. */
+#define COMPACT_PROACTIVE_INTERVAL  500
+#define COMPACT_PROACTIVE_ORDER     3
+#define COMPACT_PROACTIVE_INDEX     500
+
+#define COMPACT_SKIPPED     0
+#define COMPACT_SUCCESS     1
+#define COMPACT_COMPLETE    2
+
+/*
+ * Moves one frame of a movable owner. The contents and the owner fields
+ * have already been copied to the new frame; the handler rewrites every
+ * reference to the old one (a PTE for user pages) and returns 0, or
+ * returns non-zero and leaves everything pointing at the old frame.
+ */
+typedef int (*migrate_page_fn)(struct buddy_page *page, void *from, void *to);
+
+struct compact_stats {
+    u32 stalls;
+    u32 success;
+    u32 fail;
+    u32 deferred;
+    u32 proactive;
+    u32 migrated;
+    u32 migrate_failed;
+    u32 migrate_scanned;
+    u32 free_scanned;
+    u32 isolated;
+};
+
+void register_movable(u8 owner, migrate_page_fn migrate);
+u32 compact_zone(struct buddy_zone *zone, u32 order);
+bool try_to_compact(struct buddy_zone *zone, u32 order);
+u32 compact_memory();
+void compact_proactive();
+struct compact_stats *compaction_stats();
+void print_compaction_stats();
+
+#endif
@@ -0,0 +1,318 @@
+#include <os.h>
+#include <runtime/heapprof.h>
+#include <runtime/buddy.h>
+#include <runtime/percpu.h>
+
+extern "C" {
+    void itoa(char *buf, unsigned long int n, int base);
+    u64 get_system_ticks();
+}
+
+HeapProfiler heap_profiler;
+
+static_assert(sizeof(struct heapprof_entry) * HEAPPROF_TABLE_SIZE <= (MIN_BLOCK_SIZE << HEAPPROF_TABLE_ORDER),
+              "Profiler table does not fit its buddy block");
+
+static u32 prof_hash(void *ptr, u32 bits) {
+    return (((u32)ptr >> 3) * 2654435761u) >> (32 - bits);
+}
+
+bool HeapProfiler::enable(u32 rate) {
+    if (!table) {
+        table = (struct heapprof_entry*)buddy_allocator.alloc_order(HEAPPROF_TABLE_ORDER);
+        if (!table) {
+            io.print("[HEAPPROF] Error: no memory for the allocation table\n");
+            return false;
+        }
+        for (u32 i = 0; i < HEAPPROF_TABLE_SIZE; i++) {
+            table[i].ptr = nullptr;
+        }
+    }
+    
+    reset();
+    sample_rate = rate ? rate : 1;
+    rand_state = 2463534242u;
+    countdown = next_interval();
+    active = true;
+    
+    io.print("[HEAPPROF] Profiling every %d allocation(s) on average\n", sample_rate);
+    return true;
+}
+
+/* Stop recording; what was collected stays until the next enable(). */
+void HeapProfiler::disable() {
+    active = false;
+}
+
+void HeapProfiler::reset() {
+    u32 irq = local_irq_save();
+    
+    if (table) {
+        for (u32 i = 0; i < HEAPPROF_TABLE_SIZE; i++) {
+            table[i].ptr = nullptr;
+        }
+    }
+    for (u32 i = 0; i <= HEAPPROF_SITES; i++) {
+        sites[i].caller = nullptr;
+        sites[i].live_count = 0;
+        sites[i].live_bytes = 0;
+        sites[i].peak_bytes = 0;
+        sites[i].allocs = 0;
+        sites[i].total_bytes = 0;
+        sites[i].last_tick = 0;
+    }
+    entries = 0;
+    sites_used = 0;
+    sampled = 0;
+    dropped = 0;
+    
+    local_irq_restore(irq);
+}
+
+/* Uniform on [1, 2 * rate - 1], so one allocation in rate is sampled on average. */
+u32 HeapProfiler::next_interval() {
+    if (sample_rate <= 1) return 1;
+    
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return 1 + rand_state % (2 * sample_rate - 1);
+}
+
+/* Call sites are never evicted; once the table is three quarters full new ones share one bucket. */
+u16 HeapProfiler::site_index(void *caller) {
+    if (!caller) return HEAPPROF_SITE_OTHER;
+    
+    u32 i = prof_hash(caller, HEAPPROF_SITE_BITS);
+    while (sites[i].caller) {
+        if (sites[i].caller == caller) return i;
+        i = (i + 1) & (HEAPPROF_SITES - 1);
+    }
+    
+    if (sites_used >= HEAPPROF_SITES * 3 / 4) return HEAPPROF_SITE_OTHER;
+    
+    sites[i].caller = caller;
+    sites_used++;
+    return i;
+}
+
+struct heapprof_entry *HeapProfiler::find(void *ptr) {
+    u32 i = prof_hash(ptr, HEAPPROF_TABLE_BITS);
+    while (table[i].ptr) {
+        if (table[i].ptr == ptr) return &table[i];
+        i = (i + 1) & (HEAPPROF_TABLE_SIZE - 1);
+    }
+    return nullptr;
+}
+
+/*
+ * Linear-probing delete without tombstones: pull later entries of the
+ * same run back into the hole unless their home slot lies after it.
+ */
+void HeapProfiler::remove(struct heapprof_entry *entry) {
+    u32 hole = entry - table;
+    u32 i = hole;
+    
+    for (;;) {
+        i = (i + 1) & (HEAPPROF_TABLE_SIZE - 1);
+        if (!table[i].ptr) break;
+        
+        u32 home = prof_hash(table[i].ptr, HEAPPROF_TABLE_BITS);
+        bool stays = (hole <= i) ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    
+    table[hole].ptr = nullptr;
+    entries--;
+}
+
+void HeapProfiler::record_alloc(void *ptr, u32 size, void *caller) {
+    if (!active || !ptr) return;
+    
+    u32 irq = local_irq_save();
+    
+    if (--countdown) {
+        local_irq_restore(irq);
+        return;
+    }
+    countdown = next_interval();
+    sampled++;
+    
+    /* Memory released behind kfree()'s back, e.g. a stack frame reset, can come back at the same address. */
+    struct heapprof_entry *stale = find(ptr);
+    if (stale) {
+        struct heapprof_site *site = &sites[stale->site];
+        site->live_count -= sample_rate;
+        site->live_bytes -= stale->size * sample_rate;
+        remove(stale);
+    }
+    
+    if (entries >= HEAPPROF_TABLE_LIMIT) {
+        dropped++;
+        local_irq_restore(irq);
+        return;
+    }
+    
+    u32 i = prof_hash(ptr, HEAPPROF_TABLE_BITS);
+    while (table[i].ptr) {
+        i = (i + 1) & (HEAPPROF_TABLE_SIZE - 1);
+    }
+    
+    u16 index = site_index(caller);
+    u32 tick = (u32)get_system_ticks();
+    table[i].ptr = ptr;
+    table[i].size = size;
+    table[i].tick = tick;
+    table[i].site = index;
+    entries++;
+    
+    struct heapprof_site *site = &sites[index];
+    site->live_count += sample_rate;
+    site->live_bytes += size * sample_rate;
+    if (site->live_bytes > site->peak_bytes) {
+        site->peak_bytes = site->live_bytes;
+    }
+    site->allocs += sample_rate;
+    site->total_bytes += size * sample_rate;
+    site->last_tick = tick;
+    
+    local_irq_restore(irq);
+}
+
+void HeapProfiler::record_free(void *ptr) {
+    if (!active || !ptr) return;
+    
+    u32 irq = local_irq_save();
+    
+    struct heapprof_entry *entry = find(ptr);
+    if (entry) {
+        struct heapprof_site *site = &sites[entry->site];
+        site->live_count -= sample_rate;
+        site->live_bytes -= entry->size * sample_rate;
+        remove(entry);
+    }
+    
+    local_irq_restore(irq);
+}
+
+/* krealloc() grew or shrank a block in place. */
+void HeapProfiler::record_resize(void *ptr, u32 new_size) {
+    if (!active || !ptr) return;
+    
+    u32 irq = local_irq_save();
+    
+    struct heapprof_entry *entry = find(ptr);
+    if (entry) {
+        struct heapprof_site *site = &sites[entry->site];
+        site->live_bytes += (new_size - entry->size) * sample_rate;
+        if (site->live_bytes > site->peak_bytes) {
+            site->peak_bytes = site->live_bytes;
+        }
+        entry->size = new_size;
+    }
+    
+    local_irq_restore(irq);
+}
+
+/* Indices of the sites holding the most live bytes, largest first. */
+u32 HeapProfiler::top_sites(u16 *order, u32 max) {
+    u32 count = 0;
+    
+    for (u32 i = 0; i <= HEAPPROF_SITES; i++) {
+        if (!sites[i].allocs) continue;
+        
+        u32 pos = count < max ? count++ : max;
+        while (pos > 0 && sites[order[pos - 1]].live_bytes < sites[i].live_bytes) {
+            if (pos < max) order[pos] = order[pos - 1];
+            pos--;
+        }
+        if (pos < max) order[pos] = i;
+    }
+    
+    return count;
+}
+
+void HeapProfiler::print() {
+    u16 order[HEAPPROF_TOP_SITES];
+    u32 count = top_sites(order, HEAPPROF_TOP_SITES);
+    
+    io.print("[HEAPPROF] %s, 1 in %d sampled: %d samples, %d live, %d dropped, %d sites\n",
+             active ? "running" : "stopped", sample_rate, sampled, entries, dropped, sites_used);
+    
+    for (u32 i = 0; i < count; i++) {
+        struct heapprof_site *site = &sites[order[i]];
+        if (order[i] == HEAPPROF_SITE_OTHER) {
+            io.print("  other     ");
+        } else {
+            io.print("  %p", site->caller);
+        }
+        io.print(": %d live, %d bytes, peak %d, %d allocs, %d bytes total\n",
+                 site->live_count, site->live_bytes, site->peak_bytes, site->allocs, site->total_bytes);
+    }
+}
+
+static char *prof_put(char *p, const char *s) {
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *prof_put_field(char *p, const char *key, u32 value, int base) {
+    p = prof_put(p, key);
+    if (base == 16) p = prof_put(p, "0x");
+    itoa(p, value, base);
+    while (*p) p++;
+    return p;
+}
+
+/*
+ * Machine-readable dump, one record per line of space-separated key=value
+ * fields: a "heapprof" header, a "site" line per call site and an "alloc"
+ * line per sampled live allocation, closed by "heapprof end". Counts and
+ * bytes are already scaled by rate.
+ */
+void HeapProfiler::dump(void (*emit)(const char *line)) {
+    char line[160];
+    char *p;
+    
+    p = prof_put(line, "heapprof version=1");
+    p = prof_put_field(p, " rate=", sample_rate, 10);
+    p = prof_put_field(p, " tick=", (u32)get_system_ticks(), 10);
+    p = prof_put_field(p, " sampled=", sampled, 10);
+    p = prof_put_field(p, " dropped=", dropped, 10);
+    p = prof_put_field(p, " live=", entries, 10);
+    p = prof_put_field(p, " sites=", sites_used, 10);
+    prof_put(p, "\n")[0] = 0;
+    emit(line);
+    
+    for (u32 i = 0; i <= HEAPPROF_SITES; i++) {
+        struct heapprof_site *site = &sites[i];
+        if (!site->allocs) continue;
+        
+        p = prof_put_field(line, "site addr=", (u32)site->caller, 16);
+        p = prof_put_field(p, " live_count=", site->live_count, 10);
+        p = prof_put_field(p, " live_bytes=", site->live_bytes, 10);
+        p = prof_put_field(p, " peak_bytes=", site->peak_bytes, 10);
+        p = prof_put_field(p, " allocs=", site->allocs, 10);
+        p = prof_put_field(p, " total_bytes=", site->total_bytes, 10);
+        p = prof_put_field(p, " last_tick=", site->last_tick, 10);
+        prof_put(p, "\n")[0] = 0;
+        emit(line);
+    }
+    
+    for (u32 i = 0; table && i < HEAPPROF_TABLE_SIZE; i++) {
+        struct heapprof_entry *entry = &table[i];
+        if (!entry->ptr) continue;
+        
+        p = prof_put_field(line, "alloc ptr=", (u32)entry->ptr, 16);
+        p = prof_put_field(p, " size=", entry->size, 10);
+        p = prof_put_field(p, " site=", (u32)sites[entry->site].caller, 16);
+        p = prof_put_field(p, " tick=", entry->tick, 10);
+        prof_put(p, "\n")[0] = 0;
+        emit(line);
+    }
+    
+    emit("heapprof end\n");
+}
@@ -0,0 +1,81 @@
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <runtime/types.h>
+
+#define HEAPPROF_TABLE_ORDER 4
+#define HEAPPROF_TABLE_BITS  12
+#define HEAPPROF_TABLE_SIZE  (1 << HEAPPROF_TABLE_BITS)
+#define HEAPPROF_TABLE_LIMIT (HEAPPROF_TABLE_SIZE * 3 / 4)
+#define HEAPPROF_SITE_BITS   8
+#define HEAPPROF_SITES       (1 << HEAPPROF_SITE_BITS)
+#define HEAPPROF_SITE_OTHER  HEAPPROF_SITES
+#define HEAPPROF_TOP_SITES   16
+
+/* One sampled live allocation, in an open-addressed table keyed by ptr. */
+struct heapprof_entry {
+    void *ptr;
+    u32 size;
+    u32 tick;
+    u16 site;
+};
+
+/*
+ * Everything allocated from one call site. Byte and object counts are
+ * scaled by the sampling rate when recorded, so they estimate the whole
+ * heap rather than the sample.
+ */
+struct heapprof_site {
+    void *caller;
+    u32 live_count;
+    u32 live_bytes;
+    u32 peak_bytes;
+    u32 allocs;
+    u32 total_bytes;
+    u32 last_tick;
+};
+
+/*
+ * Heap profiler behind kmalloc and friends. Every allocation (or, with a
+ * sampling rate of N, one in N on average, picked at random so periodic
+ * allocation patterns do not alias) is recorded against its caller and
+ * the PIT tick, and dropped again when it is freed. Allocations that do
+ * not fit in the table are counted as dropped, not silently lost.
+ */
+class HeapProfiler {
+public:
+    bool enable(u32 sample_rate);
+    void disable();
+    void reset();
+    bool enabled() const { return active; }
+    u32 rate() const { return sample_rate; }
+    
+    void record_alloc(void *ptr, u32 size, void *caller);
+    void record_free(void *ptr);
+    void record_resize(void *ptr, u32 new_size);
+    
+    void print();
+    void dump(void (*emit)(const char *line));
+
+private:
+    bool active;
+    u32 sample_rate;
+    u32 countdown;
+    u32 rand_state;
+    struct heapprof_entry *table;
+    u32 entries;
+    u32 sites_used;
+    u32 sampled;
+    u32 dropped;
+    struct heapprof_site sites[HEAPPROF_SITES + 1];
+    
+    u32 next_interval();
+    u16 site_index(void *caller);
+    struct heapprof_entry *find(void *ptr);
+    void remove(struct heapprof_entry *entry);
+    u32 top_sites(u16 *order, u32 max);
+};
+
+extern HeapProfiler heap_profiler;
+
+#endif
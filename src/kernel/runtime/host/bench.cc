@@ -0,0 +1,1121 @@
+#include <os.h>
+#include <runtime/alloc.h>
+#include <runtime/unified_alloc.h>
+#include <runtime/memtest.h>
+#include <runtime/shrinker.h>
+#include <runtime/object_pool.h>
+#include <runtime/heapprof.h>
+#include <runtime/compaction.h>
+#include <runtime/stack.h>
+#include <runtime/host/host.h>
+
+extern "C" {
+    void *memset(void *s, int c, int n);
+}
+
+/*
+ * Host-side benchmark and fuzz driver for the runtime allocators, built by
+ * `make -C src/kernel/runtime bench`. The allocators are the kernel's own
+ * objects running on a mmap'd arena; nothing here is compiled into the
+ * kernel. Returns the number of fuzz failures so make fails with it.
+ */
+
+#define BENCH_ARENA_SIZE    (64 << 20)
+#define BENCH_BATCH         256
+#define BENCH_ROUNDS        200
+#define BENCH_LAT_OPS       100000
+#define BENCH_LAT_BUCKETS   32
+#define BENCH_SLOTS         1024
+#define BENCH_TRACE_OPS     32768
+#define BENCH_TRACE_SAMPLE  64
+#define BENCH_FUZZ_OPS      200000
+#define BENCH_FUZZ_ROUNDS   4
+#define BENCH_FUZZ_VALIDATE 25000
+#define BENCH_FRAG_OBJECTS  16384
+#define BENCH_COMPACT_ORDER 4
+#define BENCH_ARENA_ROUNDS  1000
+#define BENCH_SPLIT_ORDER   10
+#define BENCH_NO_MODE       -1
+
+struct bench_backend {
+    const char *name;
+    int mode;
+    u32 max_size;
+    void *(*alloc)(u32 size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, u32 size);
+    u32 (*usable)(void *ptr);
+};
+
+struct bench_slot {
+    u8 *ptr;
+    u32 size;
+    u8 seed;
+};
+
+/* One replayed allocator call: size 0 frees the slot, anything else fills it. */
+struct bench_trace_op {
+    u32 slot;
+    u32 size;
+};
+
+struct bench_trace {
+    const char *name;
+    void (*generate)();
+};
+
+static void *bench_slab_alloc(u32 size) {
+    return slab_allocator.kmem_cache_alloc(size);
+}
+
+static void bench_slab_free(void *ptr) {
+    slab_allocator.kmem_cache_free(ptr);
+}
+
+static const u32 bench_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 16384 };
+#define BENCH_NR_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+static const struct bench_backend bench_backends[] = {
+    { "buddy",            BENCH_NO_MODE,      65536, buddy_alloc, buddy_free, 0, 0 },
+    { "slab",             BENCH_NO_MODE,      SLAB_MAX_CLASS_SIZE, bench_slab_alloc, bench_slab_free, 0, 0 },
+    { "slub",             BENCH_NO_MODE,      65536, slub_alloc, slub_free, 0, 0 },
+    { "slob",             BENCH_NO_MODE,      SLOB_MAX_ALLOC, slob_alloc, slob_free, 0, 0 },
+    { "kmalloc/embedded", SYS_MODE_EMBEDDED,  65536, kmalloc, kfree, krealloc, ksize },
+    { "kmalloc/desktop",  SYS_MODE_DESKTOP,   65536, kmalloc, kfree, krealloc, ksize },
+    { "kmalloc/server",   SYS_MODE_SERVER,    65536, kmalloc, kfree, krealloc, ksize },
+    { "kmalloc/realtime", SYS_MODE_REALTIME,  65536, kmalloc, kfree, krealloc, ksize },
+};
+#define BENCH_NR_BACKENDS (sizeof(bench_backends) / sizeof(bench_backends[0]))
+
+static void *bench_ptrs[BENCH_BATCH];
+static struct bench_slot bench_slots[BENCH_SLOTS];
+static struct bench_trace_op trace_ops[BENCH_TRACE_OPS];
+static u32 trace_len;
+static u32 lat_alloc[BENCH_LAT_BUCKETS];
+static u32 lat_free[BENCH_LAT_BUCKETS];
+static u32 bench_rand_state;
+static u32 bench_failures;
+
+static u32 bench_rand() {
+    bench_rand_state = bench_rand_state * 1103515245 + 12345;
+    return bench_rand_state >> 16;
+}
+
+/* Log-uniform between 16 bytes and max: as many 16-31 byte requests as 2-4 KiB ones. */
+static u32 bench_size(u32 max) {
+    u32 shift = 4 + bench_rand() % 12;
+    u32 size = (1 << shift) + bench_rand() % (1 << shift);
+    return size > max ? max : size;
+}
+
+static void bench_use(const struct bench_backend *backend) {
+    if (backend->mode != BENCH_NO_MODE) {
+        unified_allocator.init((enum system_mode)backend->mode);
+    }
+}
+
+/* Hand every cached object and page back so page counts only show live data. */
+static void bench_flush() {
+    mag_purge_all();
+    slub_allocator.flush_cpu_caches();
+    slab_allocator.cache_reap();
+    buddy_allocator.drain_pages();
+}
+
+static u32 bench_pages_used() {
+    buddy_allocator.drain_pages();
+    return buddy_allocator.nr_managed_pages() - buddy_allocator.nr_free_pages();
+}
+
+static u32 bench_fail(const struct bench_backend *backend, const char *what, void *ptr, u32 op) {
+    io.print("[BENCH] FAIL %s: %s at %p, op %d\n", backend->name, what, ptr, op);
+    bench_failures++;
+    return 1;
+}
+
+/*
+ * Throughput: allocate a batch of one size, free it oldest first, and
+ * repeat. Reported as thousands of alloc+free pairs per second of wall
+ * clock, so rdtsc frequency scaling does not skew the comparison.
+ */
+static void bench_throughput() {
+    io.print("\n[BENCH] Throughput, kops/s (alloc+free pairs), %d x %d per size\n", BENCH_ROUNDS, BENCH_BATCH);
+    
+    for (u32 b = 0; b < BENCH_NR_BACKENDS; b++) {
+        const struct bench_backend *backend = &bench_backends[b];
+        bench_use(backend);
+        io.print("  %s:", backend->name);
+        
+        for (u32 s = 0; s < BENCH_NR_SIZES; s++) {
+            u32 size = bench_sizes[s];
+            if (size > backend->max_size) break;
+            
+            u32 pairs = 0;
+            u64 start = host_nsec();
+            for (u32 round = 0; round < BENCH_ROUNDS; round++) {
+                u32 count = 0;
+                for (u32 i = 0; i < BENCH_BATCH; i++) {
+                    void *ptr = backend->alloc(size);
+                    if (!ptr) break;
+                    bench_ptrs[count++] = ptr;
+                }
+                for (u32 i = 0; i < count; i++) {
+                    backend->free(bench_ptrs[i]);
+                }
+                pairs += count;
+            }
+            u64 elapsed = host_nsec() - start;
+            
+            io.print(" %d=%d", size, elapsed ? (u32)((u64)pairs * 1000000 / elapsed) : 0);
+        }
+        io.print("\n");
+        bench_flush();
+    }
+}
+
+static u32 lat_bucket(u64 cycles) {
+    u32 bucket = 0;
+    while (bucket < BENCH_LAT_BUCKETS - 1 && (1ull << bucket) < cycles) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Upper bound, in cycles, of the bucket holding the given fraction (per mille) of samples. */
+static u32 lat_percentile(u32 *hist, u32 total, u32 per_mille) {
+    u32 want = (u32)((u64)total * per_mille / 1000);
+    u32 seen = 0;
+    
+    for (u32 i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > want) return 1 << i;
+    }
+    return 1u << (BENCH_LAT_BUCKETS - 1);
+}
+
+static void lat_print(const char *what, u32 *hist, u32 total) {
+    u32 max = 0;
+    
+    for (u32 i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        if (hist[i]) max = i;
+    }
+    io.print("    %s: p50 <=%d p99 <=%d p99.9 <=%d max <=%d cyc |", what,
+             lat_percentile(hist, total, 500), lat_percentile(hist, total, 990),
+             lat_percentile(hist, total, 999), 1 << max);
+    for (u32 i = 0; i <= max; i++) {
+        if (hist[i]) io.print(" %d:%d", 1 << i, hist[i]);
+    }
+    io.print("\n");
+}
+
+/*
+ * Latency: a random mix of allocs and frees over the slot table with
+ * log-uniform sizes, each call timed on its own into power-of-two cycle
+ * buckets. The tail is what the throughput numbers average away: slab
+ * refills, partial list walks and buddy splits.
+ */
+static void bench_latency() {
+    io.print("\n[BENCH] Latency histograms, %d random ops\n", BENCH_LAT_OPS);
+    
+    for (u32 b = 0; b < BENCH_NR_BACKENDS; b++) {
+        const struct bench_backend *backend = &bench_backends[b];
+        u32 allocs = 0;
+        u32 frees = 0;
+        
+        bench_use(backend);
+        bench_rand_state = 1;
+        memset(lat_alloc, 0, sizeof(lat_alloc));
+        memset(lat_free, 0, sizeof(lat_free));
+        
+        for (u32 op = 0; op < BENCH_LAT_OPS; op++) {
+            struct bench_slot *slot = &bench_slots[bench_rand() % BENCH_SLOTS];
+            
+            if (slot->ptr) {
+                u64 start = membench_rdtsc();
+                backend->free(slot->ptr);
+                lat_free[lat_bucket(membench_rdtsc() - start)]++;
+                frees++;
+                slot->ptr = 0;
+            } else {
+                u32 size = bench_size(backend->max_size);
+                u64 start = membench_rdtsc();
+                slot->ptr = (u8 *)backend->alloc(size);
+                lat_alloc[lat_bucket(membench_rdtsc() - start)]++;
+                allocs++;
+            }
+        }
+        
+        for (u32 i = 0; i < BENCH_SLOTS; i++) {
+            if (bench_slots[i].ptr) backend->free(bench_slots[i].ptr);
+            bench_slots[i].ptr = 0;
+        }
+        bench_flush();
+        
+        io.print("  %s:\n", backend->name);
+        lat_print("alloc", lat_alloc, allocs);
+        lat_print("free ", lat_free, frees);
+    }
+}
+
+static void trace_push(u32 slot, u32 size) {
+    if (trace_len < BENCH_TRACE_OPS) {
+        trace_ops[trace_len].slot = slot;
+        trace_ops[trace_len].size = size;
+        trace_len++;
+    }
+}
+
+/* Steady state: each op frees a random live slot or fills a random empty one. */
+static void trace_steady() {
+    static u8 live[BENCH_SLOTS];
+    
+    memset(live, 0, sizeof(live));
+    while (trace_len < BENCH_TRACE_OPS) {
+        u32 slot = bench_rand() % BENCH_SLOTS;
+        trace_push(slot, live[slot] ? 0 : bench_size(65536));
+        live[slot] = !live[slot];
+    }
+}
+
+/*
+ * Ramp: fill every slot, then free all but every eighth object. The
+ * survivors are scattered over the pages the ramp used, so the end state
+ * shows how well each allocator gives back memory that is mostly empty.
+ */
+static void trace_ramp() {
+    while (trace_len + 2 * BENCH_SLOTS <= BENCH_TRACE_OPS) {
+        for (u32 slot = 0; slot < BENCH_SLOTS; slot++) {
+            trace_push(slot, bench_size(4096));
+        }
+        for (u32 slot = 0; slot < BENCH_SLOTS; slot++) {
+            if (slot & 7) trace_push(slot, 0);
+        }
+    }
+}
+
+/*
+ * Phased: alternate bursts of small and large objects, each burst freeing
+ * the previous one except for one object in sixteen, the pattern of a
+ * parser building a tree and then handing out buffers.
+ */
+static void trace_phased() {
+    static u8 live[BENCH_SLOTS];
+    u32 phase = 0;
+    
+    memset(live, 0, sizeof(live));
+    while (trace_len < BENCH_TRACE_OPS) {
+        u32 base = (phase & 1) * (BENCH_SLOTS / 2);
+        u32 other = BENCH_SLOTS / 2 - base;
+        
+        for (u32 i = 0; i < BENCH_SLOTS / 2; i++) {
+            if (live[other + i] && (i & 15)) {
+                trace_push(other + i, 0);
+                live[other + i] = 0;
+            }
+        }
+        for (u32 i = 0; i < BENCH_SLOTS / 2; i++) {
+            if (live[base + i]) continue;
+            trace_push(base + i, (phase & 1) ? 512 + bench_size(4096) : 16 + bench_rand() % 112);
+            live[base + i] = 1;
+        }
+        phase++;
+    }
+}
+
+static const struct bench_trace bench_traces[] = {
+    { "steady", trace_steady },
+    { "ramp",   trace_ramp },
+    { "phased", trace_phased },
+};
+#define BENCH_NR_TRACES (sizeof(bench_traces) / sizeof(bench_traces[0]))
+
+static u32 frag_percent(u32 pages, u32 live) {
+    u32 bytes = pages * PAGE_SIZE;
+    if (bytes <= live) return 0;
+    return (u32)((u64)(bytes - live) * 100 / bytes);
+}
+
+/*
+ * Fragmentation: replay the same recorded trace against every backend
+ * and sample pages taken from the buddy against bytes the trace has live.
+ * Sizes above a backend's limit are clamped, so live bytes differ a little
+ * between backends; the percentages are what to compare. Pages a backend
+ * already held before the replay (SLUB keeps a few empty ones per cache)
+ * are not counted, which can put the peak below the live bytes.
+ */
+static void bench_fragmentation() {
+    io.print("\n[BENCH] Fragmentation over replayed traces, %d ops each\n", BENCH_TRACE_OPS);
+    
+    for (u32 t = 0; t < BENCH_NR_TRACES; t++) {
+        trace_len = 0;
+        bench_rand_state = 7 + t;
+        bench_traces[t].generate();
+        io.print("  trace %s:\n", bench_traces[t].name);
+        
+        for (u32 b = 0; b < BENCH_NR_BACKENDS; b++) {
+            const struct bench_backend *backend = &bench_backends[b];
+            u32 live = 0;
+            u32 peak_pages = 0;
+            u32 peak_live = 0;
+            
+            bench_use(backend);
+            bench_flush();
+            u32 base = bench_pages_used();
+            
+            for (u32 op = 0; op < trace_len; op++) {
+                struct bench_slot *slot = &bench_slots[trace_ops[op].slot];
+                
+                if (trace_ops[op].size == 0) {
+                    if (slot->ptr) {
+                        backend->free(slot->ptr);
+                        live -= slot->size;
+                        slot->ptr = 0;
+                    }
+                } else if (!slot->ptr) {
+                    u32 size = trace_ops[op].size;
+                    if (size > backend->max_size) size = backend->max_size;
+                    slot->ptr = (u8 *)backend->alloc(size);
+                    slot->size = slot->ptr ? size : 0;
+                    live += slot->size;
+                }
+                
+                if (op % BENCH_TRACE_SAMPLE == 0) {
+                    u32 pages = bench_pages_used() - base;
+                    if (pages > peak_pages) {
+                        peak_pages = pages;
+                        peak_live = live;
+                    }
+                }
+            }
+            
+            u32 end_pages = bench_pages_used() - base;
+            u32 end_live = live;
+            
+            for (u32 i = 0; i < BENCH_SLOTS; i++) {
+                if (bench_slots[i].ptr) backend->free(bench_slots[i].ptr);
+                bench_slots[i].ptr = 0;
+            }
+            bench_flush();
+            u32 left = bench_pages_used() - base;
+            
+            io.print("    %s: peak %d pages for %d KB live (%d pct waste), end %d pages for %d KB live (%d pct waste), %d pages kept\n",
+                     backend->name, peak_pages, peak_live / 1024, frag_percent(peak_pages, peak_live),
+                     end_pages, end_live / 1024, frag_percent(end_pages, end_live), left);
+        }
+    }
+}
+
+static void frag_check(bool ok, const char *what) {
+    if (!ok) {
+        io.print("[BENCH] FAIL fragmentation metrics: %s\n", what);
+        bench_failures++;
+    }
+}
+
+/*
+ * Fragmentation metrics on layouts whose answer is known: the buddy with
+ * every other page free, slabs pinned by one object in 32, SLOB with
+ * every other block free, and the auto policy leaving a backend whose
+ * waste it measured as too high.
+ */
+static void bench_frag_metrics() {
+    io.print("\n[BENCH] Fragmentation metrics\n");
+    
+    bench_flush();
+    u32 before = buddy_allocator.unusable_index(MAX_ORDER);
+    
+    /* Exhaust every zone a page at a time, chaining the pages through themselves, then free the even PFNs. */
+    void *chain = 0;
+    u32 pages = 0;
+    for (void *page; (page = buddy_allocator.alloc_order(0, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER)); pages++) {
+        *(void **)page = chain;
+        chain = page;
+    }
+    void *odd = 0;
+    while (chain) {
+        void *next = *(void **)chain;
+        if (((u32)chain >> BUDDY_PAGE_SHIFT) & 1) {
+            *(void **)chain = odd;
+            odd = chain;
+        } else {
+            buddy_allocator.free_order(chain, 0);
+        }
+        chain = next;
+    }
+    
+    u32 index0 = buddy_allocator.unusable_index(0);
+    u32 index1 = buddy_allocator.unusable_index(1);
+    bool checkerboard_valid = buddy_allocator.validate();
+    
+    while (odd) {
+        void *next = *(void **)odd;
+        buddy_allocator.free_order(odd, 0);
+        odd = next;
+    }
+    u32 after = buddy_allocator.unusable_index(MAX_ORDER);
+    
+    io.print("  buddy: %d pages, every other page free: index %d at order 0, %d at order 1; order %d index %d before, %d after\n",
+             pages, index0, index1, MAX_ORDER, before, after);
+    frag_check(index0 == 0 && index1 == FRAG_INDEX_SCALE, "buddy index on a checkerboard");
+    frag_check(checkerboard_valid && buddy_allocator.validate(), "buddy validation");
+    frag_check(after <= before, "buddy did not coalesce back");
+    
+    /* One object in 32 kept: the slabs stay, almost all of them waste. Full magazines are live objects too. */
+    u32 footprint0, used0, footprint1, used1;
+    slab_allocator.usage(&footprint0, &used0);
+    for (u32 i = 0; i < BENCH_FRAG_OBJECTS; i++) {
+        void *obj = slab_allocator.kmem_cache_alloc(64);
+        *(void **)obj = chain;
+        chain = obj;
+    }
+    for (u32 i = 0; chain; i++) {
+        void *next = *(void **)chain;
+        if (i % 32 == 0) {
+            bench_slots[i / 32].ptr = (u8 *)chain;
+        } else {
+            slab_allocator.kmem_cache_free(chain);
+        }
+        chain = next;
+    }
+    slab_allocator.usage(&footprint1, &used1);
+    u32 held = footprint1 - footprint0;
+    u32 live = used1 - used0;
+    io.print("  slab: %d KB held for %d KB live after freeing 31 of every 32 objects\n", held / 1024, live / 1024);
+    frag_check(live >= BENCH_FRAG_OBJECTS / 32 * 64 && held - live > held / 10 * 9, "slab waste");
+    frag_check(slab_allocator.validate(), "slab validation");
+    for (u32 i = 0; i < BENCH_FRAG_OBJECTS / 32; i++) {
+        slab_allocator.kmem_cache_free(bench_slots[i].ptr);
+        bench_slots[i].ptr = 0;
+    }
+    
+    /* SLOB: 100-byte blocks with every other one freed leave 120-byte holes that cannot merge. */
+    struct slob_free_stats free_stats;
+    for (u32 i = 0; i < BENCH_SLOTS; i++) {
+        bench_slots[i].ptr = (u8 *)slob_alloc(100);
+    }
+    for (u32 i = 0; i < BENCH_SLOTS; i += 2) {
+        slob_free(bench_slots[i].ptr);
+        bench_slots[i].ptr = 0;
+    }
+    slob_allocator.free_distribution(&free_stats);
+    io.print("  slob: %d free blocks under 128 bytes, %d bytes too small for %d, largest %d\n",
+             free_stats.blocks[1], free_stats.unusable, SLOB_MAX_ALLOC, free_stats.largest);
+    frag_check(free_stats.blocks[1] >= BENCH_SLOTS / 2 - 1 && free_stats.unusable >= free_stats.blocks[1] * 120,
+               "SLOB free distribution");
+    frag_check(slob_allocator.validate(), "SLOB validation");
+    for (u32 i = 1; i < BENCH_SLOTS; i += 2) {
+        slob_free(bench_slots[i].ptr);
+        bench_slots[i].ptr = 0;
+    }
+    
+    /* Desktop kmalloc starts on slab; pinned slabs must push small objects elsewhere within a check interval. */
+    unified_allocator.init(SYS_MODE_DESKTOP);
+    bench_flush();
+    void *probe = kmalloc(48);
+    bool slab_before = buddy_allocator.virt_to_page(probe)->owner == PAGE_OWNER_SLAB;
+    kfree(probe);
+    for (u32 i = 0; i < BENCH_FRAG_OBJECTS; i++) {
+        void *obj = kmalloc(48);
+        *(void **)obj = chain;
+        chain = obj;
+    }
+    for (u32 i = 0; chain; i++) {
+        void *next = *(void **)chain;
+        if (i % 32 == 0) {
+            bench_slots[i / 32].ptr = (u8 *)chain;
+        } else {
+            kfree(chain);
+        }
+        chain = next;
+    }
+    for (u32 i = 0; i < FRAG_CHECK_INTERVAL; i++) {
+        kfree(kmalloc(48));
+    }
+    probe = kmalloc(48);
+    u8 owner = buddy_allocator.virt_to_page(probe)->owner;
+    kfree(probe);
+    io.print("  auto policy: small objects moved from slab to owner %d\n", owner);
+    frag_check(slab_before && owner != PAGE_OWNER_SLAB, "auto policy ignored slab waste");
+    for (u32 i = 0; i < BENCH_FRAG_OBJECTS / 32; i++) {
+        kfree(bench_slots[i].ptr);
+        bench_slots[i].ptr = 0;
+    }
+    frag_check(unified_allocator.validate_heap(), "heap validation");
+}
+
+static void fuzz_fill(u8 *ptr, u32 size, u8 seed) {
+    for (u32 i = 0; i < size; i++) {
+        ptr[i] = (u8)(seed + i * 7);
+    }
+}
+
+static bool fuzz_check(u8 *ptr, u32 size, u8 seed) {
+    for (u32 i = 0; i < size; i++) {
+        if (ptr[i] != (u8)(seed + i * 7)) return false;
+    }
+    return true;
+}
+
+/* A fresh block must not overlap any block the model still holds. */
+static bool fuzz_overlaps(struct bench_slot *self, u8 *ptr, u32 size) {
+    for (u32 i = 0; i < BENCH_SLOTS; i++) {
+        struct bench_slot *slot = &bench_slots[i];
+        if (slot == self || !slot->ptr) continue;
+        if (ptr < slot->ptr + slot->size && slot->ptr < ptr + size) return true;
+    }
+    return false;
+}
+
+static u32 fuzz_placed(const struct bench_backend *backend, struct bench_slot *slot, u32 op) {
+    u32 errors = 0;
+    
+    if (fuzz_overlaps(slot, slot->ptr, slot->size)) {
+        errors += bench_fail(backend, "overlapping block", slot->ptr, op);
+    }
+    if (backend->usable && backend->usable(slot->ptr) < slot->size) {
+        errors += bench_fail(backend, "usable size below request", slot->ptr, op);
+    }
+    return errors;
+}
+
+/*
+ * One fuzz round: a seeded stream of alloc, free and (where the backend
+ * has one) realloc against a shadow model of what each slot should hold.
+ * Every block is checked for overlap with live blocks when it is handed
+ * out and for its pattern before it is freed or resized.
+ */
+static u32 fuzz_round(const struct bench_backend *backend, u32 seed) {
+    u32 errors = 0;
+    
+    bench_rand_state = seed;
+    
+    for (u32 op = 0; op < BENCH_FUZZ_OPS && errors < 8; op++) {
+        struct bench_slot *slot = &bench_slots[bench_rand() % BENCH_SLOTS];
+        u32 action = bench_rand() % 8;
+        
+        if (op % BENCH_FUZZ_VALIDATE == 0 && !unified_allocator.validate_heap()) {
+            errors += bench_fail(backend, "heap inconsistent", 0, op);
+        }
+        
+        if (slot->ptr && !fuzz_check(slot->ptr, slot->size, slot->seed)) {
+            errors += bench_fail(backend, "corrupted block", slot->ptr, op);
+            slot->ptr = 0;
+            continue;
+        }
+        
+        if (slot->ptr && action < 2 && backend->realloc) {
+            u32 size = bench_size(backend->max_size);
+            u8 *ptr = (u8 *)backend->realloc(slot->ptr, size);
+            if (!ptr) {
+                errors += bench_fail(backend, "realloc failed", slot->ptr, op);
+                continue;
+            }
+            u32 kept = size < slot->size ? size : slot->size;
+            if (!fuzz_check(ptr, kept, slot->seed)) {
+                errors += bench_fail(backend, "realloc lost contents", ptr, op);
+            }
+            slot->ptr = ptr;
+            slot->size = size;
+            errors += fuzz_placed(backend, slot, op);
+            fuzz_fill(slot->ptr, slot->size, slot->seed);
+        } else if (slot->ptr) {
+            backend->free(slot->ptr);
+            slot->ptr = 0;
+        } else {
+            u32 size = bench_size(backend->max_size);
+            slot->ptr = (u8 *)backend->alloc(size);
+            if (!slot->ptr) {
+                errors += bench_fail(backend, "alloc failed", 0, op);
+                continue;
+            }
+            slot->size = size;
+            slot->seed = (u8)bench_rand();
+            errors += fuzz_placed(backend, slot, op);
+            fuzz_fill(slot->ptr, slot->size, slot->seed);
+        }
+    }
+    
+    for (u32 i = 0; i < BENCH_SLOTS; i++) {
+        struct bench_slot *slot = &bench_slots[i];
+        if (!slot->ptr) continue;
+        if (!fuzz_check(slot->ptr, slot->size, slot->seed)) {
+            errors += bench_fail(backend, "corrupted block", slot->ptr, BENCH_FUZZ_OPS);
+        }
+        backend->free(slot->ptr);
+        slot->ptr = 0;
+    }
+    
+    if (!unified_allocator.validate_heap()) {
+        errors += bench_fail(backend, "heap inconsistent after free", 0, BENCH_FUZZ_OPS);
+    }
+    
+    return errors;
+}
+
+/* Stands in for the VMM: owner_data is the one slot that refers to the frame. */
+static int bench_migrate(struct buddy_page *page, void *from, void *to) {
+    void **ref = (void **)page->owner_data;
+    if (*ref != from) return -1;
+    *ref = to;
+    return 0;
+}
+
+static void compact_check(bool ok, const char *what) {
+    if (!ok) {
+        io.print("[BENCH] FAIL compaction: %s\n", what);
+        bench_failures++;
+    }
+}
+
+/*
+ * Compaction on a checkerboard: every other page of the arena held by a
+ * movable owner, so no order-1 block exists. A direct attempt with the
+ * owner not yet registered must fail and defer the next one; once it is
+ * registered the allocation must succeed with every page's contents and
+ * reference intact, and a full pass must leave the free memory in large
+ * blocks.
+ */
+static void bench_compaction() {
+    io.print("\n[BENCH] Compaction\n");
+    
+    bench_flush();
+    struct compact_stats *stats = compaction_stats();
+    struct compact_stats start = *stats;
+    u32 before = buddy_allocator.unusable_index(BENCH_COMPACT_ORDER);
+    
+    void **refs = (void **)buddy_allocator.alloc_order(4, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER);
+    void *chain = 0;
+    for (void *page; (page = buddy_allocator.alloc_order(0, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER)); ) {
+        *(void **)page = chain;
+        chain = page;
+    }
+    u32 kept = 0;
+    while (chain) {
+        void *next = *(void **)chain;
+        if ((((u32)chain >> BUDDY_PAGE_SHIFT) & 1) && kept < (MIN_BLOCK_SIZE << 4) / sizeof(void *)) {
+            u32 *words = (u32 *)chain;
+            words[0] = kept;
+            words[MIN_BLOCK_SIZE / sizeof(u32) - 1] = ~kept;
+            refs[kept] = chain;
+            buddy_allocator.set_page_owner(chain, PAGE_OWNER_ANON, &refs[kept]);
+            buddy_allocator.virt_to_page(chain)->index = kept;
+            kept++;
+        } else {
+            buddy_allocator.free_order(chain, 0);
+        }
+        chain = next;
+    }
+    
+    void *unmovable = buddy_allocator.alloc_order(BENCH_COMPACT_ORDER, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER);
+    void *deferred = buddy_allocator.alloc_order(BENCH_COMPACT_ORDER, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER);
+    register_movable(PAGE_OWNER_ANON, bench_migrate);
+    u64 t0 = host_nsec();
+    void *block = buddy_allocator.alloc_order(BENCH_COMPACT_ORDER, BUDDY_ZONE_HIGHMEM | BUDDY_ALLOC_HARDER);
+    u64 t1 = host_nsec();
+    u32 direct_moved = stats->migrated - start.migrated;
+    
+    u32 full_moved = compact_memory();
+    u32 after = buddy_allocator.unusable_index(BENCH_COMPACT_ORDER);
+    
+    bool intact = true;
+    for (u32 i = 0; i < kept; i++) {
+        u32 *words = (u32 *)refs[i];
+        struct buddy_page *page = buddy_allocator.virt_to_page(refs[i]);
+        if (words[0] != i || words[MIN_BLOCK_SIZE / sizeof(u32) - 1] != ~i ||
+            page->owner != PAGE_OWNER_ANON || page->owner_data != &refs[i] || page->index != i) {
+            intact = false;
+        }
+    }
+    bool valid = buddy_allocator.validate();
+    
+    io.print("  %d movable pages on a checkerboard: order %d allocation %s after moving %d pages in %d us\n",
+             kept, BENCH_COMPACT_ORDER, block ? "succeeded" : "failed", direct_moved, (u32)((t1 - t0) / 1000));
+    io.print("  full pass moved %d more, order %d index %d (was %d before the checkerboard)\n",
+             full_moved, BENCH_COMPACT_ORDER, after, before);
+    compact_check(!unmovable && stats->fail == start.fail + 1, "unmovable pages compacted");
+    compact_check(!deferred && stats->deferred == start.deferred + 1, "failure not deferred");
+    compact_check(block && stats->success == start.success + 1 && direct_moved > 0, "direct compaction failed");
+    compact_check(intact, "page moved without its contents or reference");
+    compact_check(after < FRAG_INDEX_SCALE / 10, "full pass left free memory fragmented");
+    compact_check(valid, "buddy validation");
+    
+    register_movable(PAGE_OWNER_ANON, nullptr);
+    buddy_allocator.free_order(block, BENCH_COMPACT_ORDER);
+    for (u32 i = 0; i < kept; i++) {
+        buddy_allocator.free_order(refs[i], 0);
+    }
+    buddy_allocator.free_order(refs, 4);
+    compact_check(buddy_allocator.unusable_index(BENCH_COMPACT_ORDER) <= before, "buddy did not coalesce back");
+}
+
+/*
+ * A huge page split back into frames: every frame of an order-10 block is
+ * freed on its own, odd ones first so nothing coalesces early, and the
+ * block must come back whole with the free count where it started.
+ */
+static void bench_split_page() {
+    io.print("\n[BENCH] Huge page split\n");
+    
+    bench_flush();
+    u32 free_before = buddy_allocator.nr_free_pages();
+    void *block = buddy_allocator.alloc_order(BENCH_SPLIT_ORDER);
+    if (!block) {
+        compact_check(false, "no order 10 block to split");
+        return;
+    }
+    
+    bool split = buddy_allocator.split_page(block);
+    for (u32 pass = 0; pass < 2; pass++) {
+        for (u32 i = 1 - pass; i < (1U << BENCH_SPLIT_ORDER); i += 2) {
+            buddy_allocator.free_order((char *)block + i * MIN_BLOCK_SIZE, 0);
+        }
+    }
+    
+    u32 free_after = buddy_allocator.nr_free_pages();
+    void *again = buddy_allocator.alloc_order(BENCH_SPLIT_ORDER);
+    io.print("  %d frames freed one by one, %d free pages before, %d after\n",
+             1U << BENCH_SPLIT_ORDER, free_before, free_after);
+    compact_check(split && free_after == free_before, "split frames not all returned");
+    compact_check(again == block, "split block did not coalesce back");
+    compact_check(buddy_allocator.validate(), "buddy validation after split");
+    buddy_allocator.free_order(again, BENCH_SPLIT_ORDER);
+}
+
+/*
+ * Differential fuzz: every backend replays the same op stream against the
+ * same model. Leaks are caught at page granularity: the first round leaves
+ * the caches warm, and once everything is freed and flushed no later round
+ * may end holding more pages than that.
+ */
+static void bench_fuzz() {
+    io.print("\n[BENCH] Differential fuzz, %d rounds x %d ops\n", BENCH_FUZZ_ROUNDS, BENCH_FUZZ_OPS);
+    
+    for (u32 b = 0; b < BENCH_NR_BACKENDS; b++) {
+        const struct bench_backend *backend = &bench_backends[b];
+        u32 errors = 0;
+        u32 warm = 0;
+        u32 pages = 0;
+        
+        bench_use(backend);
+        bench_flush();
+        u32 base = bench_pages_used();
+        
+        for (u32 round = 0; round < BENCH_FUZZ_ROUNDS; round++) {
+            errors += fuzz_round(backend, 1000 + round);
+            bench_flush();
+            pages = bench_pages_used() - base;
+            if (round == 0) {
+                warm = pages;
+            } else if (pages > warm) {
+                errors += bench_fail(backend, "pages leaked", (void *)pages, round);
+                break;
+            }
+        }
+        
+        io.print("  %s: %s, %d errors, %d pages held after free\n",
+                 backend->name, errors ? "FAIL" : "ok", errors, pages);
+    }
+}
+
+/*
+ * Shrinkers: free a large live set without flushing, so the allocators sit
+ * on empty slabs and per-CPU caches, then ask the shrinkers for everything
+ * they claim until they have nothing left. Every page the live set needed
+ * must come back.
+ */
+static void bench_shrink() {
+    io.print("\n[BENCH] Shrinkers after freeing %d objects\n", BENCH_SLOTS * 4);
+    
+    for (u32 b = 0; b < BENCH_NR_BACKENDS; b++) {
+        const struct bench_backend *backend = &bench_backends[b];
+        
+        bench_use(backend);
+        u32 base = bench_pages_used();
+        
+        bench_rand_state = 99;
+        for (u32 i = 0; i < BENCH_SLOTS * 4; i++) {
+            void *ptr = backend->alloc(bench_size(backend->max_size > 4096 ? 4096 : backend->max_size));
+            if (i < BENCH_SLOTS) {
+                bench_slots[i].ptr = (u8 *)ptr;
+            } else {
+                backend->free(ptr);
+            }
+        }
+        u32 peak = bench_pages_used();
+        
+        for (u32 i = 0; i < BENCH_SLOTS; i++) {
+            backend->free(bench_slots[i].ptr);
+            bench_slots[i].ptr = 0;
+        }
+        u32 cached = bench_pages_used();
+        u32 claimed = shrinker_reclaimable();
+        u32 freed = 0;
+        
+        /* Freeing SLUB's page descriptors can empty a slab the first pass already went past. */
+        for (u32 pass = 0; pass < 4 && shrinker_reclaimable() > 0; pass++) {
+            freed += shrink_slab(shrinker_reclaimable());
+        }
+        u32 left = bench_pages_used();
+        
+        io.print("  %s: %d pages live, %d cached after free, %d claimed, %d freed, %d over baseline\n",
+                 backend->name, peak - base, cached > base ? cached - base : 0, claimed, freed,
+                 left > base ? left - base : 0);
+        if (left > base) {
+            bench_fail(backend, "shrinkers left pages behind", (void *)(left - base), 0);
+        }
+    }
+}
+
+/* Shaped like page_descriptor, the hottest pooled type. */
+struct bench_pool_obj {
+    u32 words[10];
+    u64 stamps[2];
+};
+
+static ObjectPool<struct bench_pool_obj> bench_pool("bench");
+
+/*
+ * Fixed-size churn through an ObjectPool against kmalloc of the same
+ * size, then check that the slots were distinct, that kfree routes a pool
+ * object home and that the pool gives back all but one chunk.
+ */
+static void bench_object_pool() {
+    const u32 size = sizeof(struct bench_pool_obj);
+    io.print("\n[BENCH] Object pool vs kmalloc, %d-byte objects, kops/s\n", size);
+    unified_allocator.init(SYS_MODE_SERVER);
+    
+    for (u32 pass = 0; pass < 2; pass++) {
+        u32 pairs = 0;
+        u64 start = host_nsec();
+        for (u32 round = 0; round < BENCH_ROUNDS; round++) {
+            u32 count = 0;
+            for (u32 i = 0; i < BENCH_BATCH; i++) {
+                void *ptr = pass ? kmalloc(size) : bench_pool.alloc(size);
+                if (!ptr) break;
+                bench_ptrs[count++] = ptr;
+            }
+            for (u32 i = 0; i < count; i++) {
+                if (pass) kfree(bench_ptrs[i]);
+                else PoolBase::release(bench_ptrs[i]);
+            }
+            pairs += count;
+        }
+        u64 elapsed = host_nsec() - start;
+        io.print("  %s: %d\n", pass ? "kmalloc" : "pool", elapsed ? (u32)((u64)pairs * 1000000 / elapsed) : 0);
+    }
+    
+    for (u32 i = 0; i < BENCH_BATCH; i++) {
+        bench_ptrs[i] = bench_pool.alloc(size);
+        memset(bench_ptrs[i], (int)i, size);
+    }
+    for (u32 i = 0; i < BENCH_BATCH; i++) {
+        u8 *obj = (u8 *)bench_ptrs[i];
+        for (u32 j = 0; j < size; j++) {
+            if (obj[j] != (u8)i) {
+                io.print("[BENCH] FAIL pool: slot %p overwritten\n", obj);
+                bench_failures++;
+                break;
+            }
+        }
+        kfree(obj);
+    }
+    
+    io.print("  %d chunks of %d slots, %d live after free\n", bench_pool.chunks(), ObjectPool<struct bench_pool_obj>::SLOTS,
+             bench_pool.inuse());
+    if (bench_pool.inuse() != 0 || bench_pool.chunks() > 1) {
+        io.print("[BENCH] FAIL pool: %d chunks held\n", bench_pool.chunks());
+        bench_failures++;
+    }
+}
+
+static u32 prof_alloc_lines;
+static u32 prof_site_lines;
+static u32 prof_live_bytes;
+
+/* Tally a dump: alloc lines, site lines and the sites' live_byte fields. */
+static void prof_scan_line(const char *line) {
+    if (line[0] == 'a') prof_alloc_lines++;
+    if (line[0] != 's') return;
+    
+    prof_site_lines++;
+    const char *key = " live_bytes=";
+    for (const char *p = line; *p; p++) {
+        u32 k = 0;
+        while (key[k] && p[k] == key[k]) k++;
+        if (key[k]) continue;
+        
+        u32 value = 0;
+        for (p += k; *p >= '0' && *p <= '9'; p++) {
+            value = value * 10 + (*p - '0');
+        }
+        prof_live_bytes += value;
+        return;
+    }
+}
+
+static void prof_scan() {
+    prof_alloc_lines = 0;
+    prof_site_lines = 0;
+    prof_live_bytes = 0;
+    heap_profiler.dump(prof_scan_line);
+}
+
+/* Two call sites with distinct bodies, so identical-code folding cannot merge them. */
+static void * __attribute__((noinline)) prof_site_a(u32 size) {
+    return kmalloc(size);
+}
+
+static void * __attribute__((noinline)) prof_site_b(u32 size) {
+    return kcalloc(1, size);
+}
+
+/*
+ * kmalloc/kfree throughput with the profiler off, recording everything
+ * and sampling. Then check through the serial dump format that a full
+ * profile accounts for every live byte at two call sites, that a sampled
+ * one estimates it and that freeing empties both.
+ */
+static void bench_profiler() {
+    static const u32 rates[] = { 0, 1, 64 };
+    io.print("\n[BENCH] Heap profiler, kmalloc/kfree kops/s\n");
+    unified_allocator.init(SYS_MODE_SERVER);
+    
+    for (u32 r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        if (rates[r]) heap_profiler.enable(rates[r]);
+        
+        bench_rand_state = 5;
+        u32 pairs = 0;
+        u64 start = host_nsec();
+        for (u32 round = 0; round < BENCH_ROUNDS; round++) {
+            for (u32 i = 0; i < BENCH_BATCH; i++) {
+                bench_ptrs[i] = kmalloc(bench_size(1024));
+            }
+            for (u32 i = 0; i < BENCH_BATCH; i++) {
+                kfree(bench_ptrs[i]);
+            }
+            pairs += BENCH_BATCH;
+        }
+        u64 elapsed = host_nsec() - start;
+        io.print("  rate %d: %d\n", rates[r], elapsed ? (u32)((u64)pairs * 1000000 / elapsed) : 0);
+        heap_profiler.disable();
+    }
+    
+    for (u32 r = 1; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        heap_profiler.enable(rates[r]);
+        
+        u32 expect = 0;
+        for (u32 i = 0; i < BENCH_SLOTS; i++) {
+            u32 size = 16 + i % 200;
+            bench_slots[i].ptr = (u8 *)((i & 1) ? prof_site_b(size) : prof_site_a(size));
+            expect += size;
+        }
+        prof_scan();
+        u32 sites = prof_site_lines;
+        u32 live = prof_live_bytes;
+        u32 tracked = prof_alloc_lines;
+        
+        for (u32 i = 0; i < BENCH_SLOTS; i++) {
+            kfree(bench_slots[i].ptr);
+            bench_slots[i].ptr = 0;
+        }
+        prof_scan();
+        heap_profiler.disable();
+        
+        io.print("  rate %d: %d sites, %d of %d bytes estimated live, %d tracked, %d bytes left after free\n",
+                 rates[r], sites, live, expect, tracked, prof_live_bytes);
+        
+        bool exact = rates[r] == 1;
+        if (sites != 2 || (exact && (live != expect || tracked != BENCH_SLOTS)) ||
+            live < expect / 2 || live > expect * 2 || prof_live_bytes != 0 || prof_alloc_lines != 0) {
+            io.print("[BENCH] FAIL profiler: rate %d profile does not match the heap\n", rates[r]);
+            bench_failures++;
+        }
+    }
+}
+
+/* One path lookup's worth of scratch: nested scopes, one of them large enough to grow the arena. */
+static bool arena_round(StackAllocator *arena, u32 round) {
+    ScopedStackAllocator outer(arena);
+    u8 *name = (u8 *)outer.alloc(32, 1);
+    if (!name) return false;
+    name[0] = (u8)round;
+    
+    {
+        ScopedStackAllocator inner(arena);
+        u8 *block = (u8 *)inner.alloc(1024);
+        if (!block) return false;
+        memset(block, 0xAB, 1024);
+        
+        ScopedStackAllocator image(arena);
+        u8 *big = (u8 *)image.alloc(48 * 1024);
+        if (!big) return false;
+        big[48 * 1024 - 1] = 1;
+    }
+    
+    u8 *after = (u8 *)outer.alloc(16);
+    return after && after < name + 64 && name[0] == (u8)round;
+}
+
+/*
+ * Scoped arena: scopes unwind in order, a scope that grew the arena
+ * leaves the new frame as a spare, and once warm the arena costs the
+ * page allocator nothing however many rounds run.
+ */
+static void bench_arena() {
+    io.print("\n[BENCH] Scoped arena, %d rounds\n", BENCH_ARENA_ROUNDS);
+    
+    StackAllocator arena = StackAllocator();
+    arena.init(16 * 1024);
+    
+    bool ok = arena_round(&arena, 0);
+    bench_flush();
+    u32 free_before = buddy_allocator.nr_free_pages();
+    
+    u64 t0 = host_nsec();
+    for (u32 round = 1; round <= BENCH_ARENA_ROUNDS && ok; round++) {
+        ok = arena_round(&arena, round);
+    }
+    u64 t1 = host_nsec();
+    
+    bench_flush();
+    u32 free_after = buddy_allocator.nr_free_pages();
+    u32 used = arena.get_used_bytes();
+    
+    io.print("  %d ns per round, %d bytes left in use, %d pages allocated since warm-up\n",
+             (u32)((t1 - t0) / BENCH_ARENA_ROUNDS), used, free_before - free_after);
+    if (!ok || used != 0 || free_after != free_before || !arena.check_integrity()) {
+        io.print("[BENCH] FAIL arena: scopes did not unwind without allocating\n");
+        bench_failures++;
+    }
+    
+    arena.destroy();
+}
+
+int main() {
+    void *arena = host_arena(BENCH_ARENA_SIZE);
+    if (!arena) {
+        io.print("[BENCH] Error: cannot map %d MB arena\n", BENCH_ARENA_SIZE >> 20);
+        return 1;
+    }
+    
+    buddy_allocator.init(arena, BENCH_ARENA_SIZE);
+    slab_allocator.init();
+    init_slub_allocator();
+    init_slob_allocator();
+    init_stack_allocator();
+    
+    bench_throughput();
+    bench_latency();
+    bench_fragmentation();
+    bench_frag_metrics();
+    bench_compaction();
+    bench_split_page();
+    bench_fuzz();
+    bench_shrink();
+    bench_object_pool();
+    bench_arena();
+    bench_profiler();
+    
+    io.print("\n[BENCH] %d failures\n", bench_failures);
+    return bench_failures;
+}
@@ -0,0 +1,184 @@
+#include <os.h>
+#include <io.h>
+#include <runtime/alloc.h>
+#include <runtime/unified_alloc.h>
+#include <runtime/host/host.h>
+
+#define SYS_EXIT            1
+#define SYS_WRITE           4
+#define SYS_MMAP2           192
+#define SYS_CLOCK_GETTIME   265
+
+#define HOST_PROT_RW        0x3
+#define HOST_MAP_ANON_FIXED 0x32
+#define HOST_CLOCK_MONO     1
+
+#define HOST_OUT_SIZE       4096
+
+extern "C" {
+    int strlen(char *s);
+    void itoa(char *buf, unsigned long n, int base);
+    int main();
+}
+
+IO io;
+
+static char host_out[HOST_OUT_SIZE];
+static u32 host_out_len;
+
+static int host_syscall(u32 nr, u32 a1, u32 a2, u32 a3, u32 a4 = 0, u32 a5 = 0, u32 a6 = 0) {
+    int ret;
+    asm volatile("push %%ebp; mov %7, %%ebp; int $0x80; pop %%ebp"
+                 : "=a"(ret)
+                 : "a"(nr), "b"(a1), "c"(a2), "d"(a3), "S"(a4), "D"(a5), "m"(a6)
+                 : "memory");
+    return ret;
+}
+
+static void host_flush() {
+    if (host_out_len) {
+        host_syscall(SYS_WRITE, 1, (u32)host_out, host_out_len);
+    }
+    host_out_len = 0;
+}
+
+static void host_putc(char c) {
+    host_out[host_out_len++] = c;
+    if (c == '\n' || host_out_len == HOST_OUT_SIZE) {
+        host_flush();
+    }
+}
+
+static void host_puts(const char *s) {
+    while (s && *s) {
+        host_putc(*s++);
+    }
+}
+
+/* Left-pad to width with zeros, the way the kernel's io.print does. */
+static void host_putnum(u32 value, int base, int width) {
+    char buf[16];
+    itoa(buf, value, base);
+    for (int len = strlen(buf); len < width; len++) {
+        host_putc('0');
+    }
+    host_puts(buf);
+}
+
+IO::IO() {
+}
+
+/* Same conversions as the kernel's IO::print: %d %u %x %p %s %c with a one-digit width. */
+void IO::print(const char *s, ...) {
+    __builtin_va_list ap;
+    char c;
+    
+    __builtin_va_start(ap, s);
+    
+    while ((c = *s++)) {
+        int width = 0;
+        
+        if (c != '%') {
+            host_putc(c);
+            continue;
+        }
+        
+        c = *s++;
+        if (c >= '0' && c <= '9') {
+            width = c - '0';
+            c = *s++;
+        }
+        
+        if (c == 'd') {
+            int value = __builtin_va_arg(ap, int);
+            if (value < 0) {
+                host_putc('-');
+                value = -value;
+            }
+            host_putnum(value, 10, width);
+        } else if (c == 'u') {
+            host_putnum(__builtin_va_arg(ap, u32), 10, width);
+        } else if (c == 'x' || c == 'X') {
+            host_puts("0x");
+            host_putnum(__builtin_va_arg(ap, u32), 16, width);
+        } else if (c == 'p') {
+            host_puts("0x");
+            host_putnum(__builtin_va_arg(ap, u32), 16, 8);
+        } else if (c == 's') {
+            host_puts(__builtin_va_arg(ap, const char *));
+        } else if (c == 'c') {
+            host_putc((char)__builtin_va_arg(ap, int));
+        } else if (c == 0) {
+            break;
+        }
+    }
+    
+    __builtin_va_end(ap);
+}
+
+/* The kmalloc family as arch/x86/alloc.cc defines it for the kernel. */
+extern "C" {
+    void *ksbrk(int /*n*/) {
+        return unified_allocator.alloc_pages(0);
+    }
+    
+    void *kmalloc(u32 size) {
+        return unified_allocator.alloc(size, ALLOC_FLAG_KERNEL, __builtin_return_address(0));
+    }
+    
+    void kfree(void *ptr) {
+        unified_allocator.free(ptr);
+    }
+    
+    void *krealloc(void *ptr, u32 new_size) {
+        return unified_allocator.realloc(ptr, new_size, __builtin_return_address(0));
+    }
+    
+    void *kcalloc(u32 count, u32 size) {
+        return unified_allocator.calloc(count, size, __builtin_return_address(0));
+    }
+    
+    /*
+     * Map the arena at a fixed address so PFNs, and with them the buddy's
+     * zone split, are the same on every run.
+     */
+    void *host_arena(u32 size) {
+        int ret = host_syscall(SYS_MMAP2, HOST_ARENA_BASE, size, HOST_PROT_RW,
+                               HOST_MAP_ANON_FIXED, (u32)-1, 0);
+        if (ret < 0 && ret > -4096) return 0;
+        return (void *)ret;
+    }
+    
+    u64 host_nsec() {
+        u32 ts[2];
+        host_syscall(SYS_CLOCK_GETTIME, HOST_CLOCK_MONO, (u32)ts, 0);
+        return (u64)ts[0] * 1000000000ull + ts[1];
+    }
+    
+    /*
+     * Stands in for the PIT's 100 Hz tick the heap profiler stamps with.
+     * A system call per allocation would swamp what is being measured, so
+     * read the TSC and assume a clock of about 3 GHz.
+     */
+    u64 get_system_ticks() {
+        u32 lo, hi;
+        asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return (((u64)hi << 32) | lo) >> 25;
+    }
+    
+    void host_exit(int code) {
+        host_flush();
+        host_syscall(SYS_EXIT, code, 0, 0);
+        for (;;) {
+        }
+    }
+    
+    void __attribute__((force_align_arg_pointer)) host_start() {
+        host_exit(main());
+    }
+}
+
+asm(".globl _start\n"
+    "_start:\n"
+    "    and $-16, %esp\n"
+    "    call host_start\n");
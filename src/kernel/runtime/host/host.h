@@ -0,0 +1,20 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <runtime/types.h>
+
+/*
+ * The few Linux services the host bench needs, made with raw i386 system
+ * calls so the allocators can be linked without a libc. io.print is
+ * routed to stdout by host.cc.
+ */
+
+#define HOST_ARENA_BASE 0x10000000
+
+extern "C" {
+    void *host_arena(u32 size);
+    u64 host_nsec();
+    void host_exit(int code);
+}
+
+#endif
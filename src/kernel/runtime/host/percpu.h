@@ -0,0 +1,34 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+/*
+ * Host stand-in for runtime/percpu.h, force-included by the bench build so
+ * the real header is skipped. The host process is a single "CPU" with
+ * nothing to mask, so only cmpxchg_double does real work.
+ */
+
+#include <runtime/types.h>
+
+#define NR_CPUS 1
+
+static inline u32 smp_processor_id() {
+    return 0;
+}
+
+static inline u32 local_irq_save() {
+    return 0;
+}
+
+static inline void local_irq_restore(u32 /*flags*/) {
+}
+
+static inline bool cmpxchg_double(void *ptr, u32 old1, u32 old2, u32 new1, u32 new2) {
+    u8 ok;
+    asm volatile("lock; cmpxchg8b %1; sete %0"
+                 : "=q"(ok), "+m"(*(volatile u64*)ptr), "+a"(old1), "+d"(old2)
+                 : "b"(new1), "c"(new2)
+                 : "memory", "cc");
+    return ok;
+}
+
+#endif
@@ -0,0 +1,290 @@
+#include <os.h>
+#include <runtime/magazine.h>
+#include <runtime/slab.h>
+#include <runtime/shrinker.h>
+
+static struct slab_cache *magazine_cache;
+static struct slab_cache *depot_cache;
+static struct mag_depot *depot_list;
+
+static u32 mag_shrink_count(struct shrinker * /*shrinker*/) {
+    u32 bytes = 0;
+    
+    for (struct mag_depot *depot = depot_list; depot; depot = depot->next) {
+        bytes += mag_cached_objects(depot) * depot->cache->obj_size;
+    }
+    
+    return (bytes + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE;
+}
+
+/*
+ * Purging only hands objects back to their slabs; the slab shrinker, which
+ * runs next, is what frees the slabs that empties.
+ */
+static u32 mag_shrink_scan(struct shrinker * /*shrinker*/, u32 /*nr_to_scan*/) {
+    mag_purge_all();
+    return 0;
+}
+
+static struct shrinker mag_shrinker = {
+    "magazines", mag_shrink_count, mag_shrink_scan, SHRINKER_SEEKS_DEFAULT, nullptr, 0, 0
+};
+
+/* Called from SlabAllocator::init() after the slab shrinker registers, so this one is asked first. */
+void mag_init() {
+    magazine_cache = slab_allocator.cache_create("magazines", sizeof(struct magazine), CACHE_ALIGN, 0, nullptr, nullptr);
+    depot_cache = slab_allocator.cache_create("mag_depots", sizeof(struct mag_depot), CACHE_ALIGN, 0, nullptr, nullptr);
+    depot_list = nullptr;
+    
+    register_shrinker(&mag_shrinker);
+}
+
+struct mag_depot *mag_depot_create(struct slab_cache *cache) {
+    if (!depot_cache) return nullptr;
+    
+    struct mag_depot *depot = (struct mag_depot*)slab_allocator.cache_alloc(depot_cache);
+    if (!depot) return nullptr;
+    
+    depot->cache = cache;
+    depot->full = nullptr;
+    depot->empty = nullptr;
+    depot->nr_full = 0;
+    depot->nr_empty = 0;
+    depot->mag_size = MAG_MIN_ROUNDS;
+    depot->trips = 0;
+    depot->resizes = 0;
+    depot->misses = 0;
+    
+    for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+        depot->cpu[cpu].loaded = nullptr;
+        depot->cpu[cpu].previous = nullptr;
+        depot->cpu[cpu].ops = 0;
+    }
+    
+    u32 irq = local_irq_save();
+    depot->next = depot_list;
+    depot_list = depot;
+    local_irq_restore(irq);
+    
+    return depot;
+}
+
+void mag_depot_destroy(struct mag_depot *depot) {
+    if (!depot) return;
+    
+    mag_purge(depot);
+    
+    u32 irq = local_irq_save();
+    for (struct mag_depot **link = &depot_list; *link; link = &(*link)->next) {
+        if (*link == depot) {
+            *link = depot->next;
+            break;
+        }
+    }
+    local_irq_restore(irq);
+    
+    slab_allocator.cache_free(depot_cache, depot);
+}
+
+/* Every depot visit counts towards the resize check; called with interrupts off. */
+static void depot_trip(struct mag_depot *depot) {
+    if (++depot->trips < MAG_RESIZE_TRIPS) return;
+    
+    u32 ops = 0;
+    for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+        ops += depot->cpu[cpu].ops;
+        depot->cpu[cpu].ops = 0;
+    }
+    
+    if (ops < 2 * MAG_RESIZE_TRIPS * depot->mag_size && depot->mag_size < MAG_MAX_ROUNDS) {
+        depot->mag_size *= 2;
+        depot->resizes++;
+    }
+    depot->trips = 0;
+}
+
+static void depot_put_empty(struct mag_depot *depot, struct magazine *mag) {
+    if (depot->nr_empty >= MAG_DEPOT_MAX_EMPTY) {
+        slab_allocator.cache_free(magazine_cache, mag);
+        return;
+    }
+    
+    mag->next = depot->empty;
+    depot->empty = mag;
+    depot->nr_empty++;
+}
+
+static struct magazine *depot_get_empty(struct mag_depot *depot) {
+    struct magazine *mag = depot->empty;
+    
+    if (mag) {
+        depot->empty = mag->next;
+        depot->nr_empty--;
+        return mag;
+    }
+    
+    mag = (struct magazine*)slab_allocator.cache_alloc(magazine_cache);
+    if (mag) {
+        mag->rounds = 0;
+    }
+    return mag;
+}
+
+void *mag_alloc(struct mag_depot *depot) {
+    u32 irq = local_irq_save();
+    struct mag_cpu *cpu = &depot->cpu[smp_processor_id()];
+    struct magazine *mag = cpu->loaded;
+    void *obj;
+    
+    cpu->ops++;
+    
+    if (mag && mag->rounds) {
+        obj = mag->objs[--mag->rounds];
+        local_irq_restore(irq);
+        return obj;
+    }
+    
+    if (cpu->previous && cpu->previous->rounds) {
+        cpu->loaded = cpu->previous;
+        cpu->previous = mag;
+        obj = cpu->loaded->objs[--cpu->loaded->rounds];
+        local_irq_restore(irq);
+        return obj;
+    }
+    
+    /* Both magazines are empty: trade the previous one for a full one from the depot. */
+    depot_trip(depot);
+    
+    struct magazine *full = depot->full;
+    if (full) {
+        depot->full = full->next;
+        depot->nr_full--;
+        if (cpu->previous) {
+            depot_put_empty(depot, cpu->previous);
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = full;
+        obj = full->objs[--full->rounds];
+    } else {
+        depot->misses++;
+        obj = slab_allocator.cache_alloc_slab(depot->cache);
+    }
+    
+    local_irq_restore(irq);
+    return obj;
+}
+
+void mag_free(struct mag_depot *depot, void *obj) {
+    u32 irq = local_irq_save();
+    struct mag_cpu *cpu = &depot->cpu[smp_processor_id()];
+    struct magazine *mag = cpu->loaded;
+    
+    cpu->ops++;
+    
+    if (mag && mag->rounds < depot->mag_size) {
+        mag->objs[mag->rounds++] = obj;
+        local_irq_restore(irq);
+        return;
+    }
+    
+    if (cpu->previous && cpu->previous->rounds < depot->mag_size) {
+        cpu->loaded = cpu->previous;
+        cpu->previous = mag;
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        local_irq_restore(irq);
+        return;
+    }
+    
+    /* Both magazines are full: trade the previous one for an empty one. */
+    depot_trip(depot);
+    
+    struct magazine *empty = depot_get_empty(depot);
+    if (empty) {
+        if (cpu->previous) {
+            cpu->previous->next = depot->full;
+            depot->full = cpu->previous;
+            depot->nr_full++;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = empty;
+        empty->objs[empty->rounds++] = obj;
+    } else {
+        depot->misses++;
+        slab_allocator.cache_free_slab(depot->cache, obj);
+    }
+    
+    local_irq_restore(irq);
+}
+
+static u32 magazine_drain(struct mag_depot *depot, struct magazine *mag) {
+    u32 rounds = mag->rounds;
+    
+    while (mag->rounds) {
+        slab_allocator.cache_free_slab(depot->cache, mag->objs[--mag->rounds]);
+    }
+    slab_allocator.cache_free(magazine_cache, mag);
+    
+    return rounds;
+}
+
+/*
+ * Return every cached object to the slab layer and free the magazines.
+ * This reaches into other CPUs' magazines, which is only safe while the
+ * kernel runs on one CPU.
+ */
+u32 mag_purge(struct mag_depot *depot) {
+    u32 objects = 0;
+    u32 irq = local_irq_save();
+    
+    for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+        struct mag_cpu *mc = &depot->cpu[cpu];
+        if (mc->loaded) objects += magazine_drain(depot, mc->loaded);
+        if (mc->previous) objects += magazine_drain(depot, mc->previous);
+        mc->loaded = nullptr;
+        mc->previous = nullptr;
+        mc->ops = 0;
+    }
+    
+    while (depot->full) {
+        struct magazine *mag = depot->full;
+        depot->full = mag->next;
+        objects += magazine_drain(depot, mag);
+    }
+    while (depot->empty) {
+        struct magazine *mag = depot->empty;
+        depot->empty = mag->next;
+        magazine_drain(depot, mag);
+    }
+    
+    depot->nr_full = 0;
+    depot->nr_empty = 0;
+    depot->mag_size = MAG_MIN_ROUNDS;
+    depot->trips = 0;
+    
+    local_irq_restore(irq);
+    return objects;
+}
+
+u32 mag_purge_all() {
+    u32 objects = 0;
+    
+    for (struct mag_depot *depot = depot_list; depot; depot = depot->next) {
+        objects += mag_purge(depot);
+    }
+    
+    return objects;
+}
+
+u32 mag_cached_objects(struct mag_depot *depot) {
+    u32 objects = 0;
+    
+    for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (depot->cpu[cpu].loaded) objects += depot->cpu[cpu].loaded->rounds;
+        if (depot->cpu[cpu].previous) objects += depot->cpu[cpu].previous->rounds;
+    }
+    for (struct magazine *mag = depot->full; mag; mag = mag->next) {
+        objects += mag->rounds;
+    }
+    
+    return objects;
+}
@@ -0,0 +1,70 @@
+#ifndef MAGAZINE_H
+#define MAGAZINE_H
+
+#include <runtime/types.h>
+#include <runtime/percpu.h>
+
+#define MAG_MIN_ROUNDS      8
+#define MAG_MAX_ROUNDS      64
+#define MAG_RESIZE_TRIPS    32
+#define MAG_DEPOT_MAX_EMPTY 4
+
+struct slab_cache;
+
+/*
+ * A stack of free objects. Magazines are always allocated for
+ * MAG_MAX_ROUNDS; the depot's mag_size decides how many of those slots
+ * are used, so resizing never has to touch a magazine.
+ */
+struct magazine {
+    struct magazine *next;
+    u32 rounds;
+    void *objs[MAG_MAX_ROUNDS];
+};
+
+/*
+ * Each CPU allocates from and frees into its loaded magazine and keeps the
+ * one it last swapped out as previous. One of the two is always usable for
+ * a run of up to mag_size allocs or frees in either direction, so only
+ * longer runs reach the depot.
+ */
+struct mag_cpu {
+    struct magazine *loaded;
+    struct magazine *previous;
+    u32 ops;
+};
+
+/*
+ * Bonwick's depot: full magazines ready for allocation, empty ones ready
+ * for frees. CPUs only come here when both their magazines are exhausted.
+ * A trip roughly every magazine's worth of operations means bursts outrun
+ * the magazines, and mag_size doubles up to MAG_MAX_ROUNDS; memory
+ * pressure purges the depot and starts it small again.
+ */
+struct mag_depot {
+    struct slab_cache *cache;
+    struct mag_depot *next;
+    
+    struct magazine *full;
+    struct magazine *empty;
+    u32 nr_full;
+    u32 nr_empty;
+    u32 mag_size;
+    u32 trips;
+    
+    u32 resizes;
+    u32 misses;
+    
+    struct mag_cpu cpu[NR_CPUS];
+};
+
+void mag_init();
+struct mag_depot *mag_depot_create(struct slab_cache *cache);
+void mag_depot_destroy(struct mag_depot *depot);
+void *mag_alloc(struct mag_depot *depot);
+void mag_free(struct mag_depot *depot, void *obj);
+u32 mag_purge(struct mag_depot *depot);
+u32 mag_purge_all();
+u32 mag_cached_objects(struct mag_depot *depot);
+
+#endif
@@ -0,0 +1,542 @@
+#include <os.h>
+#include <runtime/memtest.h>
+#include <runtime/buddy.h>
+#include <runtime/alloc.h>
+#include <runtime/unified_alloc.h>
+
+struct memtest_slot {
+    u8 *ptr;
+    u32 size;
+    u8 seed;
+};
+
+static void *bench_ptrs[MEMBENCH_BATCH];
+static struct memtest_slot test_slots[MEMTEST_SLOTS];
+static struct memtest_slot slob_slots[MEMBENCH_SLOB_SLOTS];
+static void *color_objs[MEMBENCH_COLOR_OBJS];
+static u32 test_rand_state = 1;
+
+static u32 test_rand() {
+    test_rand_state = test_rand_state * 1103515245 + 12345;
+    return test_rand_state >> 16;
+}
+
+static u32 cycles_per_op(u64 cycles, u32 ops) {
+    if (ops == 0) return 0;
+    return (u32)(cycles / ops);
+}
+
+/*
+ * Allocate a batch of blocks of one order and free them again, timing each
+ * half with rdtsc. Every other batch is freed front-to-back so both the
+ * "buddy still allocated" and "buddy just freed" coalesce paths are hit.
+ */
+void membench_buddy_order(u32 order, u32 iterations, struct membench_result *result) {
+    u64 alloc_total = 0;
+    u64 free_total = 0;
+    
+    result->ops = 0;
+    result->failures = 0;
+    
+    for (u32 iter = 0; iter < iterations; iter++) {
+        u32 count = 0;
+        
+        u64 start = membench_rdtsc();
+        for (u32 i = 0; i < MEMBENCH_BATCH; i++) {
+            void *ptr = buddy_allocator.alloc_order(order);
+            if (!ptr) {
+                result->failures++;
+                break;
+            }
+            bench_ptrs[count++] = ptr;
+        }
+        alloc_total += membench_rdtsc() - start;
+        
+        start = membench_rdtsc();
+        if (iter & 1) {
+            for (u32 i = 0; i < count; i++) {
+                buddy_allocator.free_order(bench_ptrs[i], order);
+            }
+        } else {
+            for (u32 i = count; i > 0; i--) {
+                buddy_allocator.free_order(bench_ptrs[i - 1], order);
+            }
+        }
+        free_total += membench_rdtsc() - start;
+        
+        result->ops += count;
+    }
+    
+    result->alloc_cycles = cycles_per_op(alloc_total, result->ops);
+    result->free_cycles = cycles_per_op(free_total, result->ops);
+}
+
+void membench_buddy(u32 iterations) {
+    struct membench_result result;
+    
+    if (iterations == 0) iterations = 100;
+    
+    io.print("[MEMBENCH] buddy alloc/free, %d x %d blocks per order\n", iterations, MEMBENCH_BATCH);
+    
+    for (u32 order = 0; order <= MAX_ORDER; order++) {
+        membench_buddy_order(order, iterations, &result);
+        io.print("  Order %d: %d ops, alloc %d cyc/op, free %d cyc/op, %d failures\n",
+                 order, result.ops, result.alloc_cycles, result.free_cycles, result.failures);
+    }
+}
+
+/*
+ * Single-frame alloc/free through the per-CPU lists against plain order-0
+ * buddy calls, using the same batch pattern as the per-order bench.
+ */
+void membench_pages(u32 iterations) {
+    struct membench_result result;
+    u64 alloc_total = 0;
+    u64 free_total = 0;
+    u32 ops = 0;
+    
+    if (iterations == 0) iterations = 100;
+    
+    for (u32 iter = 0; iter < iterations; iter++) {
+        u32 count = 0;
+        
+        u64 start = membench_rdtsc();
+        for (u32 i = 0; i < MEMBENCH_BATCH; i++) {
+            void *ptr = buddy_allocator.alloc_page();
+            if (!ptr) break;
+            bench_ptrs[count++] = ptr;
+        }
+        alloc_total += membench_rdtsc() - start;
+        
+        start = membench_rdtsc();
+        for (u32 i = count; i > 0; i--) {
+            buddy_allocator.free_page(bench_ptrs[i - 1]);
+        }
+        free_total += membench_rdtsc() - start;
+        
+        ops += count;
+    }
+    
+    membench_buddy_order(0, iterations, &result);
+    
+    io.print("[MEMBENCH] single pages, %d x %d per run\n", iterations, MEMBENCH_BATCH);
+    io.print("  pcp:   alloc %d cyc/op, free %d cyc/op\n",
+             cycles_per_op(alloc_total, ops), cycles_per_op(free_total, ops));
+    io.print("  buddy: alloc %d cyc/op, free %d cyc/op\n", result.alloc_cycles, result.free_cycles);
+}
+
+/*
+ * Grow a buffer 64 bytes at a time up to 256 KiB, the way a queue or a
+ * directory load would, and count how often krealloc had to move it.
+ */
+void membench_realloc(u32 iterations) {
+    u64 total = 0;
+    u32 steps = 0;
+    u32 moves = 0;
+    
+    if (iterations == 0) iterations = 10;
+    
+    for (u32 iter = 0; iter < iterations; iter++) {
+        void *buf = nullptr;
+        
+        for (u32 size = 64; size <= 256 * 1024; size += 64) {
+            u64 start = membench_rdtsc();
+            void *grown = krealloc(buf, size);
+            total += membench_rdtsc() - start;
+            
+            if (!grown) break;
+            if (buf && grown != buf) moves++;
+            buf = grown;
+            steps++;
+        }
+        
+        kfree(buf);
+    }
+    
+    io.print("[MEMBENCH] krealloc growth to 256 KB in 64 byte steps, %d runs\n", iterations);
+    io.print("  %d steps, %d moved, %d cyc/step\n", steps, moves, cycles_per_op(total, steps));
+}
+
+/*
+ * kfree latency of 256-byte SLUB objects against the number of live slabs.
+ * Objects are freed in a scattered order, so most frees miss the CPU slab
+ * and need the object-to-slab lookup; cycles per free should stay flat.
+ */
+void membench_slub_free(u32 iterations) {
+    static const u32 slab_counts[] = { 1, 16, 64, 256, 1024 };
+    const u32 objs_per_slab = PAGE_SIZE / 256;
+    const u32 max_objs = 1024 * objs_per_slab;
+    const u32 table_order = buddy_allocator.get_order(max_objs * sizeof(void*));
+    
+    if (iterations == 0) iterations = 100;
+    
+    void **objs = (void**)get_free_pages(table_order);
+    if (!objs) {
+        io.print("[MEMBENCH] no memory for the object table\n");
+        return;
+    }
+    
+    io.print("[MEMBENCH] SLUB kfree vs live slabs, %d x %d frees\n", iterations, MEMBENCH_BATCH);
+    
+    for (u32 c = 0; c < sizeof(slab_counts) / sizeof(slab_counts[0]); c++) {
+        u32 count = 0;
+        while (count < slab_counts[c] * objs_per_slab) {
+            objs[count] = slub_alloc(256);
+            if (!objs[count]) break;
+            count++;
+        }
+        
+        u32 batch = count < MEMBENCH_BATCH ? count : MEMBENCH_BATCH;
+        u64 total = 0;
+        
+        for (u32 iter = 0; iter < iterations && batch > 0; iter++) {
+            /* 7919 is prime, so a batch never visits the same slot twice. */
+            u32 first = test_rand() % count;
+            
+            u64 start = membench_rdtsc();
+            for (u32 i = 0; i < batch; i++) {
+                kfree(objs[(first + i * 7919) % count]);
+            }
+            total += membench_rdtsc() - start;
+            
+            for (u32 i = 0; i < batch; i++) {
+                objs[(first + i * 7919) % count] = slub_alloc(256);
+            }
+        }
+        
+        io.print("  %d slabs: %d cyc/free\n", count / objs_per_slab, cycles_per_op(total, iterations * batch));
+        
+        for (u32 i = 0; i < count; i++) {
+            kfree(objs[i]);
+        }
+    }
+    
+    free_pages(objs, table_order);
+}
+
+/*
+ * Replay the same random trace of SLOB allocations and frees, mostly small
+ * with a tail up to SLOB_MAX_ALLOC, under each fit strategy. Reports cycles
+ * per operation and how many pages the live set ended up spread over.
+ */
+static void membench_slob_fit(u32 mode, u32 iterations) {
+    u64 total = 0;
+    u32 ops = 0;
+    u32 peak_pages = 0;
+    u32 live_bytes = 0;
+    
+    slob_allocator.set_fit(mode);
+    test_rand_state = 12345;
+    
+    for (u32 i = 0; i < MEMBENCH_SLOB_SLOTS; i++) {
+        slob_slots[i].ptr = nullptr;
+    }
+    
+    for (u32 iter = 0; iter < iterations; iter++) {
+        struct memtest_slot *slot = &slob_slots[test_rand() % MEMBENCH_SLOB_SLOTS];
+        u32 r = test_rand();
+        
+        u64 start = membench_rdtsc();
+        if (slot->ptr) {
+            slob_allocator.free(slot->ptr);
+            live_bytes -= slot->size;
+            slot->ptr = nullptr;
+        } else {
+            slot->size = (r & 3) ? 8 + (r >> 2) % 120 : 128 + (r >> 2) % (SLOB_MAX_ALLOC - 127);
+            slot->ptr = (u8*)slob_allocator.alloc(slot->size);
+            if (slot->ptr) live_bytes += slot->size;
+        }
+        total += membench_rdtsc() - start;
+        ops++;
+        
+        if (slob_allocator.get_pages() > peak_pages) {
+            peak_pages = slob_allocator.get_pages();
+        }
+    }
+    
+    io.print("  %s: %d cyc/op, %d pages at end (%d peak), %d%% of them live data\n",
+             mode == SLOB_FIT_LINEAR ? "linear best-fit" : "segregated bins",
+             cycles_per_op(total, ops), slob_allocator.get_pages(), peak_pages,
+             live_bytes * 100 / (slob_allocator.get_pages() * SLOB_BLOCK_SIZE));
+    
+    for (u32 i = 0; i < MEMBENCH_SLOB_SLOTS; i++) {
+        if (slob_slots[i].ptr) {
+            slob_allocator.free(slob_slots[i].ptr);
+            slob_slots[i].ptr = nullptr;
+        }
+    }
+}
+
+void membench_slob(u32 iterations) {
+    if (iterations == 0) iterations = 100000;
+    
+    io.print("[MEMBENCH] SLOB random trace, %d ops over %d slots\n", iterations, MEMBENCH_SLOB_SLOTS);
+    membench_slob_fit(SLOB_FIT_LINEAR, iterations);
+    membench_slob_fit(SLOB_FIT_BINNED, iterations);
+    slob_allocator.set_fit(SLOB_FIT_BINNED);
+}
+
+/*
+ * Chase pointers through the objects at one index of every slab, e.g.
+ * each slab's first object, as a walk over one hot object per slab would.
+ * Without coloring those all sit at the same page offset and compete for
+ * one L1 set; with it they are spread over color_count sets.
+ */
+static u32 membench_color_walk(struct slab_cache *cache, u32 iterations) {
+    const u32 per_slab = cache->num_objs_per_slab;
+    u32 count = 0;
+    
+    while (count < MEMBENCH_COLOR_SLABS * per_slab && count < MEMBENCH_COLOR_OBJS) {
+        color_objs[count] = slab_allocator.cache_alloc(cache);
+        if (!color_objs[count]) break;
+        count++;
+    }
+    
+    /* A fresh cache fills one slab before the next, so slab s holds objects s * per_slab onwards. */
+    u32 slabs = count / per_slab;
+    u64 total = 0;
+    u32 loads = 0;
+    
+    for (u32 index = 0; index < per_slab && slabs > 0; index++) {
+        for (u32 s = 0; s < slabs; s++) {
+            void **obj = (void**)color_objs[s * per_slab + index];
+            *obj = color_objs[((s + 1) % slabs) * per_slab + index];
+        }
+        
+        void **cursor = (void**)color_objs[index];
+        u64 start = membench_rdtsc();
+        for (u32 i = 0; i < iterations * slabs; i++) {
+            cursor = (void**)*cursor;
+        }
+        total += membench_rdtsc() - start;
+        loads += iterations * slabs;
+        
+        /* Keeps the chase from being optimised away. */
+        if (!cursor) io.print("[MEMBENCH] broken chain\n");
+    }
+    
+    for (u32 i = 0; i < count; i++) {
+        slab_allocator.cache_free(cache, color_objs[i]);
+    }
+    
+    return cycles_per_op(total, loads);
+}
+
+void membench_slab_color(u32 iterations) {
+    if (iterations == 0) iterations = 1000;
+    
+    struct slab_cache *plain = slab_allocator.cache_create("bench-nocolor", MEMBENCH_COLOR_SIZE, CACHE_ALIGN,
+                                                           SLAB_HWCACHE | SLAB_NO_COLOR, nullptr, nullptr);
+    struct slab_cache *colored = slab_allocator.cache_create("bench-color", MEMBENCH_COLOR_SIZE, CACHE_ALIGN,
+                                                             SLAB_HWCACHE, nullptr, nullptr);
+    if (!plain || !colored) {
+        io.print("[MEMBENCH] cannot create bench caches\n");
+        if (plain) slab_allocator.cache_destroy(plain);
+        if (colored) slab_allocator.cache_destroy(colored);
+        return;
+    }
+    
+    io.print("[MEMBENCH] slab coloring, %d-byte objects over %d slabs, %d laps\n",
+             MEMBENCH_COLOR_SIZE, MEMBENCH_COLOR_SLABS, iterations);
+    io.print("  uncolored: %d cyc/load\n", membench_color_walk(plain, iterations));
+    io.print("  %d colors: %d cyc/load\n", colored->color_count, membench_color_walk(colored, iterations));
+    
+    slab_allocator.cache_destroy(plain);
+    slab_allocator.cache_destroy(colored);
+}
+
+/*
+ * Time cache_alloc/cache_free in two shapes: a burst of MEMBENCH_BATCH
+ * allocations freed in reverse, which runs past small magazines into the
+ * depot, and alloc/free pairs, which never leave the loaded magazine.
+ */
+static void membench_magazine_run(struct slab_cache *cache, u32 iterations) {
+    u64 burst = 0;
+    u32 burst_ops = 0;
+    
+    for (u32 round = 0; round < iterations; round++) {
+        u32 count = 0;
+        u64 start = membench_rdtsc();
+        while (count < MEMBENCH_BATCH) {
+            bench_ptrs[count] = slab_allocator.cache_alloc(cache);
+            if (!bench_ptrs[count]) break;
+            count++;
+        }
+        for (u32 i = count; i > 0; i--) {
+            slab_allocator.cache_free(cache, bench_ptrs[i - 1]);
+        }
+        burst += membench_rdtsc() - start;
+        burst_ops += 2 * count;
+    }
+    
+    u64 start = membench_rdtsc();
+    for (u32 i = 0; i < iterations * MEMBENCH_BATCH; i++) {
+        void *obj = slab_allocator.cache_alloc(cache);
+        if (obj) slab_allocator.cache_free(cache, obj);
+    }
+    u64 pairs = membench_rdtsc() - start;
+    
+    io.print("  %s: burst %d cyc/op, pairs %d cyc/op", cache->name,
+             cycles_per_op(burst, burst_ops), cycles_per_op(pairs, 2 * iterations * MEMBENCH_BATCH));
+    if (cache->magazines) {
+        io.print(", magazine size %d after %d resizes", cache->magazines->mag_size, cache->magazines->resizes);
+    }
+    io.print("\n");
+}
+
+void membench_magazine(u32 iterations) {
+    if (iterations == 0) iterations = 1000;
+    
+    struct slab_cache *plain = slab_allocator.cache_create("bench-slab", MEMBENCH_MAG_SIZE, CACHE_ALIGN,
+                                                           0, nullptr, nullptr);
+    struct slab_cache *mag = slab_allocator.cache_create("bench-magazine", MEMBENCH_MAG_SIZE, CACHE_ALIGN,
+                                                         SLAB_MAGAZINE, nullptr, nullptr);
+    if (!plain || !mag || !mag->magazines) {
+        io.print("[MEMBENCH] cannot create bench caches\n");
+        if (plain) slab_allocator.cache_destroy(plain);
+        if (mag) slab_allocator.cache_destroy(mag);
+        return;
+    }
+    
+    io.print("[MEMBENCH] magazines, %d-byte objects, %d rounds of %d\n", MEMBENCH_MAG_SIZE, iterations, MEMBENCH_BATCH);
+    membench_magazine_run(plain, iterations);
+    membench_magazine_run(mag, iterations);
+    
+    slab_allocator.cache_destroy(plain);
+    slab_allocator.cache_destroy(mag);
+}
+
+static void test_fill(u8 *ptr, u32 size, u8 seed) {
+    for (u32 i = 0; i < size; i++) {
+        ptr[i] = (u8)(seed + i);
+    }
+}
+
+static bool test_check(u8 *ptr, u32 size, u8 seed) {
+    for (u32 i = 0; i < size; i++) {
+        if (ptr[i] != (u8)(seed + i)) return false;
+    }
+    return true;
+}
+
+/* Mostly small objects, some page-sized and a few multi-page ones. */
+static u32 test_size() {
+    u32 r = test_rand();
+    switch (r & 7) {
+        case 0: case 1: case 2: case 3:
+            return 1 + (r >> 3) % 256;
+        case 4: case 5:
+            return 257 + (r >> 3) % 3840;
+        case 6:
+            return 4097 + (r >> 3) % 28672;
+    }
+    return PAGE_SIZE << ((r >> 3) % 3);
+}
+
+/*
+ * Hand out memory from every backend the way callers do: kmalloc under the
+ * current policy, SLUB and SLOB directly, and whole pages.
+ */
+static u8 *test_alloc(u32 size) {
+    switch (test_rand() % 5) {
+        case 1:
+            if (size <= 8192) return (u8*)slub_alloc(size);
+            break;
+        case 2:
+            if (size <= SLOB_MAX_ALLOC) return (u8*)slob_alloc(size);
+            break;
+        case 3:
+            return (u8*)get_free_pages(buddy_allocator.get_order(size));
+        case 4:
+            return (u8*)kcalloc(1, size);
+    }
+    return (u8*)kmalloc(size);
+}
+
+/*
+ * Random alloc/krealloc/kfree over a table of live objects drawn from all
+ * backends, all released through kfree(). Each object carries a pattern
+ * that is checked before it is freed or after it is moved. Returns the
+ * number of errors found.
+ */
+u32 memtest_kfree(u32 iterations) {
+    u32 errors = 0;
+    u32 allocs = 0;
+    u32 reallocs = 0;
+    u32 frees = 0;
+    u32 free_before = buddy_allocator.nr_free_pages();
+    
+    if (iterations == 0) iterations = 10000;
+    
+    for (u32 i = 0; i < MEMTEST_SLOTS; i++) {
+        test_slots[i].ptr = nullptr;
+    }
+    
+    for (u32 iter = 0; iter < iterations; iter++) {
+        struct memtest_slot *slot = &test_slots[test_rand() % MEMTEST_SLOTS];
+        
+        if (!slot->ptr) {
+            u32 size = test_size();
+            u8 *ptr = test_alloc(size);
+            if (!ptr) continue;
+            
+            if (unified_allocator.usable_size(ptr) < size) {
+                io.print("[MEMTEST] %p: usable size %d < %d\n", ptr, unified_allocator.usable_size(ptr), size);
+                errors++;
+            }
+            
+            slot->ptr = ptr;
+            slot->size = size;
+            slot->seed = (u8)test_rand();
+            test_fill(ptr, size, slot->seed);
+            allocs++;
+            continue;
+        }
+        
+        if (!test_check(slot->ptr, slot->size, slot->seed)) {
+            io.print("[MEMTEST] %p: pattern corrupted (size %d)\n", slot->ptr, slot->size);
+            errors++;
+        }
+        
+        if ((test_rand() & 3) == 0) {
+            u32 size = test_size();
+            u8 *ptr = (u8*)krealloc(slot->ptr, size);
+            if (!ptr) continue;
+            
+            u32 kept = size < slot->size ? size : slot->size;
+            if (!test_check(ptr, kept, slot->seed)) {
+                io.print("[MEMTEST] krealloc %d -> %d lost data\n", slot->size, size);
+                errors++;
+            }
+            
+            slot->ptr = ptr;
+            slot->size = size;
+            test_fill(ptr, size, slot->seed);
+            reallocs++;
+            continue;
+        }
+        
+        kfree(slot->ptr);
+        slot->ptr = nullptr;
+        frees++;
+    }
+    
+    for (u32 i = 0; i < MEMTEST_SLOTS; i++) {
+        if (!test_slots[i].ptr) continue;
+        
+        if (!test_check(test_slots[i].ptr, test_slots[i].size, test_slots[i].seed)) {
+            io.print("[MEMTEST] %p: pattern corrupted (size %d)\n", test_slots[i].ptr, test_slots[i].size);
+            errors++;
+        }
+        kfree(test_slots[i].ptr);
+        test_slots[i].ptr = nullptr;
+        frees++;
+    }
+    
+    io.print("[MEMTEST] kfree: %d allocs, %d reallocs, %d frees, %d errors\n",
+             allocs, reallocs, frees, errors);
+    io.print("  Free pages: %d before, %d after (caches may keep some)\n",
+             free_before, buddy_allocator.nr_free_pages());
+    
+    return errors;
+}
@@ -0,0 +1,38 @@
+#ifndef MEMTEST_H
+#define MEMTEST_H
+
+#include <runtime/types.h>
+
+#define MEMBENCH_BATCH 64
+#define MEMTEST_SLOTS 128
+#define MEMBENCH_SLOB_SLOTS 2048
+#define MEMBENCH_COLOR_SIZE 704
+#define MEMBENCH_COLOR_SLABS 48
+#define MEMBENCH_COLOR_OBJS 1024
+#define MEMBENCH_MAG_SIZE 128
+
+static inline u64 membench_rdtsc() {
+    u32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+struct membench_result {
+    u32 ops;
+    u32 failures;
+    u32 alloc_cycles;
+    u32 free_cycles;
+};
+
+void membench_buddy_order(u32 order, u32 iterations, struct membench_result *result);
+void membench_buddy(u32 iterations);
+void membench_pages(u32 iterations);
+void membench_realloc(u32 iterations);
+void membench_slub_free(u32 iterations);
+void membench_slob(u32 iterations);
+void membench_slab_color(u32 iterations);
+void membench_magazine(u32 iterations);
+
+u32 memtest_kfree(u32 iterations);
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <os.h>
+#include <runtime/types.h>
+#include <runtime/buddy.h>
+#include <runtime/alloc.h>
+#include <runtime/percpu.h>
+
+class PoolBase;
+
+/*
+ * Header at the start of every chunk a pool carves up. A chunk is one
+ * buddy block tagged PAGE_OWNER_POOL with the chunk as owner_data, so a
+ * slot finds its chunk, and through it its pool, from its address alone.
+ */
+struct pool_chunk {
+    struct pool_chunk *next;
+    struct pool_chunk *prev;
+    PoolBase *pool;
+    void *free_list;
+    u32 inuse;
+};
+
+/*
+ * The untyped half of ObjectPool: everything that only needs the layout
+ * ObjectPool computed. Chunks with a free slot sit on partial, full ones
+ * are only reachable through their pages. A chunk that empties is given
+ * back to the buddy unless it is the last one with free slots, so a pool
+ * hovering at a chunk boundary does not bounce pages. Requests larger
+ * than a slot, e.g. a subclass inheriting its base's operator new, fall
+ * back to kmalloc and release() sends them back to kfree.
+ */
+class PoolBase {
+public:
+    constexpr PoolBase(const char *name, u32 slot_size, u32 slots, u32 order, u32 first_slot)
+        : name(name), slot_size(slot_size), slots(slots), order(order), first_slot(first_slot),
+          partial(nullptr), next(nullptr), registered(false),
+          nr_chunks(0), nr_inuse(0), nr_allocs(0), nr_fallbacks(0) {}
+    
+    void *alloc(u32 size) {
+        if (size > slot_size) {
+            nr_fallbacks++;
+            return kmalloc(size);
+        }
+        
+        u32 irq = local_irq_save();
+        struct pool_chunk *chunk = partial ? partial : grow();
+        if (!chunk) {
+            local_irq_restore(irq);
+            return nullptr;
+        }
+        
+        void *obj = chunk->free_list;
+        chunk->free_list = *(void**)obj;
+        if (++chunk->inuse == slots) {
+            unlink(chunk);
+        }
+        nr_inuse++;
+        nr_allocs++;
+        
+        local_irq_restore(irq);
+        return obj;
+    }
+    
+    static void release(void *ptr) {
+        if (!ptr) return;
+        
+        struct buddy_page *page = buddy_allocator.virt_to_page(ptr);
+        if (!page || page->owner != PAGE_OWNER_POOL) {
+            kfree(ptr);
+            return;
+        }
+        
+        struct pool_chunk *chunk = (struct pool_chunk*)page->owner_data;
+        chunk->pool->put(chunk, ptr);
+    }
+    
+    u32 object_size() const { return slot_size; }
+    u32 chunks() const { return nr_chunks; }
+    u32 inuse() const { return nr_inuse; }
+    
+    static void print_stats() {
+        io.print("[POOL] Object pools:\n");
+        for (PoolBase *pool = pools(); pool; pool = pool->next) {
+            io.print("  %s: slot=%d, per_chunk=%d, order=%d, chunks=%d, inuse=%d, allocs=%d, fallbacks=%d\n",
+                     pool->name, pool->slot_size, pool->slots, pool->order, pool->nr_chunks,
+                     pool->nr_inuse, pool->nr_allocs, pool->nr_fallbacks);
+        }
+    }
+
+private:
+    const char *name;
+    u32 slot_size;
+    u32 slots;
+    u32 order;
+    u32 first_slot;
+    struct pool_chunk *partial;
+    PoolBase *next;
+    bool registered;
+    
+    u32 nr_chunks;
+    u32 nr_inuse;
+    u32 nr_allocs;
+    u32 nr_fallbacks;
+    
+    static PoolBase *&pools() {
+        static PoolBase *head = nullptr;
+        return head;
+    }
+    
+    void link(struct pool_chunk *chunk) {
+        chunk->prev = nullptr;
+        chunk->next = partial;
+        if (partial) partial->prev = chunk;
+        partial = chunk;
+    }
+    
+    void unlink(struct pool_chunk *chunk) {
+        if (chunk->prev) chunk->prev->next = chunk->next;
+        else partial = chunk->next;
+        if (chunk->next) chunk->next->prev = chunk->prev;
+        chunk->next = nullptr;
+        chunk->prev = nullptr;
+    }
+    
+    /* Called with interrupts off. */
+    struct pool_chunk *grow() {
+        void *mem = buddy_allocator.alloc_order(order, BUDDY_ALLOC_ATOMIC);
+        if (!mem) return nullptr;
+        buddy_allocator.set_page_owner(mem, PAGE_OWNER_POOL, mem);
+        
+        struct pool_chunk *chunk = (struct pool_chunk*)mem;
+        chunk->pool = this;
+        chunk->inuse = 0;
+        chunk->free_list = nullptr;
+        for (u32 i = slots; i > 0; i--) {
+            void **slot = (void**)((u8*)mem + first_slot + (i - 1) * slot_size);
+            *slot = chunk->free_list;
+            chunk->free_list = slot;
+        }
+        
+        link(chunk);
+        nr_chunks++;
+        
+        if (!registered) {
+            next = pools();
+            pools() = this;
+            registered = true;
+        }
+        
+        return chunk;
+    }
+    
+    void put(struct pool_chunk *chunk, void *obj) {
+        u32 irq = local_irq_save();
+        
+        *(void**)obj = chunk->free_list;
+        chunk->free_list = obj;
+        if (chunk->inuse-- == slots) {
+            link(chunk);
+        }
+        nr_inuse--;
+        
+        if (chunk->inuse == 0 && (partial != chunk || chunk->next)) {
+            unlink(chunk);
+            nr_chunks--;
+            buddy_allocator.free_order(chunk, order);
+        }
+        
+        local_irq_restore(irq);
+    }
+};
+
+/* Smallest buddy order whose block holds bytes. */
+static constexpr u32 pool_chunk_order(u32 bytes, u32 order = 0) {
+    return ((u32)MIN_BLOCK_SIZE << order) >= bytes || order == MAX_ORDER ? order : pool_chunk_order(bytes, order + 1);
+}
+
+/*
+ * Fixed-size slots for T carved out of buddy blocks, with an intrusive
+ * free list threaded through the free slots. The layout is worked out at
+ * compile time: slots are sizeof(T) rounded up to T's alignment (and at
+ * least a pointer), and a chunk is the smallest block that holds the
+ * header plus PerPage slots, or one page when PerPage is 0. Pools are
+ * constant-initialised, so a global pool is usable before constructors
+ * run; its first chunk is allocated on first use.
+ *
+ * Classes opt in with operator new/delete that call alloc() and
+ * PoolBase::release().
+ */
+template<typename T, u32 PerPage = 0>
+class ObjectPool : public PoolBase {
+public:
+    static constexpr u32 SLOT_ALIGN = alignof(T) > sizeof(void*) ? alignof(T) : sizeof(void*);
+    static constexpr u32 SLOT_SIZE = (sizeof(T) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+    static constexpr u32 FIRST_SLOT = (sizeof(struct pool_chunk) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+    static constexpr u32 ORDER = pool_chunk_order(FIRST_SLOT + (PerPage ? PerPage : 1) * SLOT_SIZE);
+    static constexpr u32 SLOTS = ((MIN_BLOCK_SIZE << ORDER) - FIRST_SLOT) / SLOT_SIZE;
+    
+    static_assert(FIRST_SLOT + SLOT_SIZE <= (MIN_BLOCK_SIZE << MAX_ORDER), "Object too large for a pool");
+    
+    constexpr explicit ObjectPool(const char *name)
+        : PoolBase(name, SLOT_SIZE, SLOTS, ORDER, FIRST_SLOT) {}
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <runtime/types.h>
+
+/*
+ * The kernel only runs on the boot CPU for now. Per-CPU data is still
+ * laid out as [NR_CPUS] arrays so bringing up SMP only touches this file.
+ */
+#define NR_CPUS 1
+
+static inline u32 smp_processor_id() {
+    return 0;
+}
+
+static inline u32 local_irq_save() {
+    u32 flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(u32 flags) {
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+/*
+ * Replace the two adjacent words at ptr (8-byte aligned) with new1/new2 if
+ * they still hold old1/old2, in one cmpxchg8b. Atomic against interrupts
+ * on this CPU without disabling them, and against other CPUs via lock.
+ */
+static inline bool cmpxchg_double(void *ptr, u32 old1, u32 old2, u32 new1, u32 new2) {
+    u8 ok;
+    asm volatile("lock; cmpxchg8b %1; sete %0"
+                 : "=q"(ok), "+m"(*(volatile u64*)ptr), "+a"(old1), "+d"(old2)
+                 : "b"(new1), "c"(new2)
+                 : "memory", "cc");
+    return ok;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include <os.h>
+#include <runtime/shrinker.h>
+#include <runtime/percpu.h>
+
+static struct shrinker *shrinker_list;
+
+/* Allocators register from their init, which may run more than once; a second call is a no-op. */
+void register_shrinker(struct shrinker *shrinker) {
+    u32 irq = local_irq_save();
+    
+    for (struct shrinker *s = shrinker_list; s; s = s->next) {
+        if (s == shrinker) {
+            local_irq_restore(irq);
+            return;
+        }
+    }
+    
+    /*
+     * Among equal seeks the newest goes first, so a cache built on top of
+     * another (SLUB keeps its page descriptors in a slab cache) is shrunk
+     * before the one it frees objects into.
+     */
+    struct shrinker **link = &shrinker_list;
+    while (*link && (*link)->seeks < shrinker->seeks) {
+        link = &(*link)->next;
+    }
+    shrinker->next = *link;
+    *link = shrinker;
+    
+    local_irq_restore(irq);
+}
+
+void unregister_shrinker(struct shrinker *shrinker) {
+    u32 irq = local_irq_save();
+    
+    for (struct shrinker **link = &shrinker_list; *link; link = &(*link)->next) {
+        if (*link == shrinker) {
+            *link = shrinker->next;
+            shrinker->next = nullptr;
+            break;
+        }
+    }
+    
+    local_irq_restore(irq);
+}
+
+/*
+ * Ask each shrinker, cheapest first, for what it can give until nr_pages
+ * have been freed. Returns the number of pages handed back to the buddy.
+ */
+u32 shrink_slab(u32 nr_pages) {
+    u32 freed = 0;
+    
+    for (struct shrinker *s = shrinker_list; s && freed < nr_pages; s = s->next) {
+        if (s->count(s) == 0) continue;
+        
+        u32 got = s->scan(s, nr_pages - freed);
+        s->nr_calls++;
+        s->nr_freed += got;
+        freed += got;
+    }
+    
+    return freed;
+}
+
+u32 shrinker_reclaimable() {
+    u32 pages = 0;
+    
+    for (struct shrinker *s = shrinker_list; s; s = s->next) {
+        pages += s->count(s);
+    }
+    
+    return pages;
+}
+
+void print_shrinker_stats() {
+    io.print("[SHRINK] Registered shrinkers:\n");
+    
+    for (struct shrinker *s = shrinker_list; s; s = s->next) {
+        io.print("  %s: seeks=%d, reclaimable=%d pages, scans=%d, freed=%d pages\n",
+                 s->name, s->seeks, s->count(s), s->nr_calls, s->nr_freed);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef SHRINKER_H
+#define SHRINKER_H
+
+#include <runtime/types.h>
+
+#define SHRINKER_SEEKS_CHEAP    1
+#define SHRINKER_SEEKS_DEFAULT  2
+
+/*
+ * A cache that can hand pages back to the buddy under memory pressure.
+ * count() says how many pages a scan could free right now without freeing
+ * anything; scan() frees up to nr_to_scan pages and returns how many it
+ * did. Shrinkers are asked in order of seeks, the relative cost of
+ * rebuilding what they drop, so the cheapest memory goes first and all of
+ * it goes before anything is swapped.
+ */
+struct shrinker {
+    const char *name;
+    u32 (*count)(struct shrinker *shrinker);
+    u32 (*scan)(struct shrinker *shrinker, u32 nr_to_scan);
+    u32 seeks;
+    struct shrinker *next;
+    
+    u32 nr_calls;
+    u32 nr_freed;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+u32 shrink_slab(u32 nr_pages);
+u32 shrinker_reclaimable();
+void print_shrinker_stats();
+
+#endif
@@ -1,20 +1,57 @@
 #include <os.h>
 #include <runtime/slab.h>
+#include <runtime/shrinker.h>
 
 SlabAllocator slab_allocator;
 
-static const u32 size_cache_sizes[] = {
-    8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384
+static u32 slab_shrink_count(struct shrinker * /*shrinker*/) {
+    return slab_allocator.reclaimable_pages();
+}
+
+static u32 slab_shrink_scan(struct shrinker * /*shrinker*/, u32 nr_to_scan) {
+    return slab_allocator.shrink(nr_to_scan);
+}
+
+static struct shrinker slab_shrinker = {
+    "slab", slab_shrink_count, slab_shrink_scan, SHRINKER_SEEKS_DEFAULT, nullptr, 0, 0
+};
+
+static constexpr u32 size_cache_sizes[SLAB_NR_SIZE_CLASSES] = {
+    8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096
+};
+
+/* Smallest size class for every 8-byte step up to SLAB_MAX_CLASS_SIZE, indexed by (size + 7) / 8. */
+struct size_class_table {
+    u8 index[SLAB_MAX_CLASS_SIZE / 8 + 1];
 };
 
+static constexpr struct size_class_table build_size_class_table() {
+    struct size_class_table table = {};
+    u32 cls = 0;
+    
+    for (u32 i = 0; i <= SLAB_MAX_CLASS_SIZE / 8; i++) {
+        while (size_cache_sizes[cls] < i * 8) {
+            cls++;
+        }
+        table.index[i] = cls;
+    }
+    
+    return table;
+}
+
+static constexpr struct size_class_table size_class_table = build_size_class_table();
+
 void SlabAllocator::init() {
     cache_chain = nullptr;
     
-    for (int i = 0; i < 12; i++) {
+    for (int i = 0; i < SLAB_NR_SIZE_CLASSES; i++) {
         size_caches[i] = nullptr;
     }
     
-    for (int i = 0; i < 12; i++) {
+    register_shrinker(&slab_shrinker);
+    mag_init();
+    
+    for (int i = 0; i < SLAB_NR_SIZE_CLASSES; i++) {
         char cache_name[32];
         u32 size = size_cache_sizes[i];
         
@@ -42,10 +79,10 @@ void SlabAllocator::init() {
             temp /= 10;
         }
         
-        size_caches[i] = cache_create(cache_name, size, CACHE_ALIGN, 0, nullptr, nullptr);
+        size_caches[i] = cache_create(cache_name, size, CACHE_ALIGN, SLAB_MAGAZINE, nullptr, nullptr);
     }
     
-    io.print("[SLAB] Initialized with %d size caches\n", 12);
+    io.print("[SLAB] Initialized with %d size caches\n", SLAB_NR_SIZE_CLASSES);
 }
 
 struct slab_cache *SlabAllocator::cache_create(const char *name, u32 size, u32 align, 
@@ -57,6 +94,21 @@ struct slab_cache *SlabAllocator::cache_create(const char *name, u32 size, u32 a
         cache->name[i] = name[i];
     }
     
+    /*
+     * SLAB_HWCACHE: align to a cache line, or to the smallest power-of-two
+     * fraction of one the object fits in, so no object straddles two lines
+     * while small objects still share one.
+     */
+    if (flags & SLAB_HWCACHE) {
+        u32 line_align = L1_CACHE_BYTES;
+        while (size <= line_align / 2) {
+            line_align /= 2;
+        }
+        if (line_align > align) {
+            align = line_align;
+        }
+    }
+    
     cache->obj_size = (size + align - 1) & ~(align - 1);
     cache->align = align;
     cache->flags = flags;
@@ -71,6 +123,11 @@ struct slab_cache *SlabAllocator::cache_create(const char *name, u32 size, u32 a
     cache->gfp_order = buddy_allocator.get_order(slab_size);
     cache->num_objs_per_slab = calculate_num_objs(cache->obj_size, slab_size);
     
+    u32 slack = slab_size - cache->num_objs_per_slab * cache->obj_size;
+    cache->color_off = align > L1_CACHE_BYTES ? align : L1_CACHE_BYTES;
+    cache->color_count = (flags & SLAB_NO_COLOR) ? 1 : slack / cache->color_off + 1;
+    cache->color_next = 0;
+    
     cache->slabs_full = nullptr;
     cache->slabs_partial = nullptr;
     cache->slabs_empty = nullptr;
@@ -79,6 +136,11 @@ struct slab_cache *SlabAllocator::cache_create(const char *name, u32 size, u32 a
     cache->num_active_objs = 0;
     cache->num_free_objs = 0;
     
+    cache->magazines = nullptr;
+    if (flags & SLAB_MAGAZINE) {
+        cache->magazines = mag_depot_create(cache);
+    }
+    
     cache->next = cache_chain;
     cache_chain = cache;
     
@@ -88,6 +150,11 @@ struct slab_cache *SlabAllocator::cache_create(const char *name, u32 size, u32 a
 void SlabAllocator::cache_destroy(struct slab_cache *cache) {
     if (!cache) return;
     
+    if (cache->magazines) {
+        mag_depot_destroy(cache->magazines);
+        cache->magazines = nullptr;
+    }
+    
     while (cache->slabs_full) {
         struct slab *slab = cache->slabs_full;
         cache->slabs_full = slab->next;
@@ -124,6 +191,17 @@ void SlabAllocator::cache_destroy(struct slab_cache *cache) {
 void *SlabAllocator::cache_alloc(struct slab_cache *cache) {
     if (!cache) return nullptr;
     
+    void *obj = cache->magazines ? mag_alloc(cache->magazines) : cache_alloc_slab(cache);
+    
+    if (obj && cache->ctor) {
+        cache->ctor(obj);
+    }
+    
+    return obj;
+}
+
+/* The slab layer proper, below any magazines; no constructor is run. */
+void *SlabAllocator::cache_alloc_slab(struct slab_cache *cache) {
     struct slab *slab = cache->slabs_partial;
     if (!slab) {
         slab = cache->slabs_empty;
@@ -154,47 +232,33 @@ void *SlabAllocator::cache_alloc(struct slab_cache *cache) {
         move_slab(&cache->slabs_partial, &cache->slabs_full, slab);
     }
     
-    if (cache->ctor) {
-        cache->ctor(obj);
-    }
-    
     return obj;
 }
 
 void SlabAllocator::cache_free(struct slab_cache *cache, void *obj) {
     if (!cache || !obj) return;
     
-    struct slab *slab = nullptr;
-    struct slab *current = cache->slabs_full;
-    while (current) {
-        u8 *slab_start = (u8*)current->mem;
-        u8 *slab_end = slab_start + (1 << current->order) * MIN_BLOCK_SIZE;
-        if ((u8*)obj >= slab_start && (u8*)obj < slab_end) {
-            slab = current;
-            break;
-        }
-        current = current->next;
-    }
-    
-    if (!slab) {
-        current = cache->slabs_partial;
-        while (current) {
-            u8 *slab_start = (u8*)current->mem;
-            u8 *slab_end = slab_start + (1 << current->order) * MIN_BLOCK_SIZE;
-            if ((u8*)obj >= slab_start && (u8*)obj < slab_end) {
-                slab = current;
-                break;
-            }
-            current = current->next;
-        }
+    struct slab *slab = virt_to_slab(obj);
+    if (!slab || slab->cache != cache) {
+        io.print("[SLAB] Error: %p does not belong to cache %s\n", obj, cache->name);
+        return;
     }
     
-    if (!slab) return;
-    
     if (cache->dtor) {
         cache->dtor(obj);
     }
     
+    if (cache->magazines) {
+        mag_free(cache->magazines, obj);
+        return;
+    }
+    
+    cache_free_slab(cache, obj);
+}
+
+/* Give an object back to its slab, below any magazines; the caller has already checked it. */
+void SlabAllocator::cache_free_slab(struct slab_cache *cache, void *obj) {
+    struct slab *slab = virt_to_slab(obj);
     bool was_full = (slab->free == 0);
     slab_free_obj(cache, slab, obj);
     
@@ -203,7 +267,9 @@ void SlabAllocator::cache_free(struct slab_cache *cache, void *obj) {
     
     if (was_full) {
         move_slab(&cache->slabs_full, &cache->slabs_partial, slab);
-    } else if (slab->free == cache->num_objs_per_slab) {
+    }
+    /* Not "else": a slab holding one object goes straight from full to empty. */
+    if (slab->free == cache->num_objs_per_slab) {
         move_slab(&cache->slabs_partial, &cache->slabs_empty, slab);
     }
 }
@@ -212,28 +278,40 @@ struct slab *SlabAllocator::slab_create(struct slab_cache *cache) {
     struct slab *slab = (struct slab*)buddy_alloc(sizeof(struct slab));
     if (!slab) return nullptr;
     
-    void *mem = buddy_allocator.alloc_order(cache->gfp_order);
+    /* Magazine refills get here from interrupt handlers. */
+    void *mem = buddy_allocator.alloc_order(cache->gfp_order, BUDDY_ALLOC_ATOMIC);
     if (!mem) {
         buddy_free(slab);
         return nullptr;
     }
     
+    slab->cache = cache;
     slab->mem = mem;
     slab->inuse = 0;
     slab->free = cache->num_objs_per_slab;
     slab->size = cache->obj_size;
     slab->order = cache->gfp_order;
+    slab->color = cache->color_next * cache->color_off;
     slab->magic = SLAB_MAGIC;
+    
+    if (++cache->color_next == cache->color_count) {
+        cache->color_next = 0;
+    }
     slab->next = nullptr;
     slab->prev = nullptr;
     
-    u8 *obj_ptr = (u8*)mem;
+    struct buddy_page *page = buddy_allocator.virt_to_page(mem);
+    for (u32 i = 0; i < (1U << slab->order); i++) {
+        page[i].owner_data = slab;
+        page[i].owner = PAGE_OWNER_SLAB;
+    }
+    
+    u8 *obj_ptr = (u8*)mem + slab->color;
     slab->freelist = nullptr;
     
     for (u32 i = 0; i < cache->num_objs_per_slab; i++) {
         struct slab_obj *obj = (struct slab_obj*)obj_ptr;
         obj->next = slab->freelist;
-        obj->magic = SLAB_MAGIC;
         slab->freelist = obj;
         obj_ptr += cache->obj_size;
     }
@@ -247,6 +325,12 @@ void SlabAllocator::slab_destroy(struct slab_cache *cache, struct slab *slab) {
     if (!slab || slab->magic != SLAB_MAGIC) return;
     
     cache->num_free_objs -= slab->free;
+    
+    struct buddy_page *page = buddy_allocator.virt_to_page(slab->mem);
+    for (u32 i = 0; i < (1U << slab->order); i++) {
+        page[i].owner_data = nullptr;
+    }
+    
     buddy_allocator.free_order(slab->mem, slab->order);
     buddy_free(slab);
     cache->num_slabs--;
@@ -256,10 +340,6 @@ void *SlabAllocator::slab_alloc_obj(struct slab_cache * /*cache*/, struct slab *
     if (!slab->freelist) return nullptr;
     
     struct slab_obj *obj = slab->freelist;
-    if (obj->magic != SLAB_MAGIC) {
-        return nullptr;
-    }
-    
     slab->freelist = obj->next;
     slab->inuse++;
     slab->free--;
@@ -270,7 +350,6 @@ void *SlabAllocator::slab_alloc_obj(struct slab_cache * /*cache*/, struct slab *
 void SlabAllocator::slab_free_obj(struct slab_cache * /*cache*/, struct slab *slab, void *obj) {
     struct slab_obj *slab_obj = (struct slab_obj*)obj;
     slab_obj->next = slab->freelist;
-    slab_obj->magic = SLAB_MAGIC;
     slab->freelist = slab_obj;
     slab->inuse--;
     slab->free++;
@@ -313,26 +392,30 @@ void *SlabAllocator::kmem_cache_alloc(u32 size) {
 void SlabAllocator::kmem_cache_free(void *obj) {
     if (!obj) return;
     
-    struct slab_obj *slab_obj = (struct slab_obj*)obj;
-    if (slab_obj->magic != SLAB_MAGIC) {
+    struct slab *slab = virt_to_slab(obj);
+    if (!slab) {
+        io.print("[SLAB] Error: %p is not a slab object\n", obj);
         return;
     }
     
-    for (int i = 0; i < 12; i++) {
-        if (size_caches[i]) {
-            cache_free(size_caches[i], obj);
-            return;
-        }
-    }
+    cache_free(slab->cache, obj);
+}
+
+struct slab *SlabAllocator::virt_to_slab(void *obj) {
+    struct buddy_page *page = buddy_allocator.virt_to_page(obj);
+    if (!page || !page->owner_data) return nullptr;
+    
+    struct slab *slab = (struct slab*)page->owner_data;
+    if (slab->magic != SLAB_MAGIC) return nullptr;
+    
+    return slab;
 }
 
 struct slab_cache *SlabAllocator::find_size_cache(u32 size) {
-    for (int i = 0; i < 12; i++) {
-        if (size <= size_cache_sizes[i]) {
-            return size_caches[i];
-        }
+    if (size > SLAB_MAX_CLASS_SIZE) {
+        return nullptr;
     }
-    return nullptr;
+    return size_caches[size_class_table.index[(size + 7) >> 3]];
 }
 
 void SlabAllocator::cache_reap() {
@@ -350,16 +433,170 @@ void SlabAllocator::cache_reap() {
     }
 }
 
+/* Pages held by empty slabs, counting the page each slab descriptor takes. */
+u32 SlabAllocator::reclaimable_pages() {
+    u32 pages = 0;
+    
+    for (struct slab_cache *cache = cache_chain; cache; cache = cache->next) {
+        for (struct slab *slab = cache->slabs_empty; slab; slab = slab->next) {
+            pages += (1U << slab->order) + 1;
+        }
+    }
+    
+    return pages;
+}
+
+/*
+ * Unlike cache_reap(), which leaves every cache a slab to start from,
+ * memory pressure takes every empty slab it needs.
+ */
+u32 SlabAllocator::shrink(u32 nr_pages) {
+    u32 freed = 0;
+    
+    for (struct slab_cache *cache = cache_chain; cache && freed < nr_pages; cache = cache->next) {
+        while (cache->slabs_empty && freed < nr_pages) {
+            struct slab *slab = cache->slabs_empty;
+            cache->slabs_empty = slab->next;
+            if (cache->slabs_empty) {
+                cache->slabs_empty->prev = nullptr;
+            }
+            freed += (1U << slab->order) + 1;
+            slab_destroy(cache, slab);
+        }
+    }
+    
+    return freed;
+}
+
+/*
+ * footprint is every byte the caches hold from the buddy, slab descriptor
+ * pages included; used is what live objects occupy. Objects parked in
+ * magazines are free as far as the caller is concerned and count as waste.
+ */
+void SlabAllocator::usage(u32 *footprint, u32 *used) {
+    *footprint = 0;
+    *used = 0;
+    
+    for (struct slab_cache *cache = cache_chain; cache; cache = cache->next) {
+        u32 live = cache->num_active_objs;
+        if (cache->magazines) {
+            live -= mag_cached_objects(cache->magazines);
+        }
+        *footprint += cache->num_slabs * ((MIN_BLOCK_SIZE << cache->gfp_order) + MIN_BLOCK_SIZE);
+        *used += live * cache->obj_size;
+    }
+}
+
+#define SLAB_LIST_FULL      0
+#define SLAB_LIST_PARTIAL   1
+#define SLAB_LIST_EMPTY     2
+
+static const char *slab_list_names[] = { "full", "partial", "empty" };
+
+bool SlabAllocator::validate_list(struct slab_cache *cache, struct slab *list, u32 kind, u32 *slabs, u32 *inuse) {
+    bool ok = true;
+    struct slab *prev = nullptr;
+    
+    for (struct slab *slab = list; slab; slab = slab->next) {
+        if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+            io.print("[SLAB] Validate: %s %s list holds a foreign slab %p\n", cache->name, slab_list_names[kind], slab);
+            return false;
+        }
+        if (slab->prev != prev) {
+            io.print("[SLAB] Validate: %s slab %p has a broken back link\n", cache->name, slab);
+            ok = false;
+        }
+        
+        u32 objs = cache->num_objs_per_slab;
+        bool placed = kind == SLAB_LIST_FULL ? slab->free == 0 :
+                      kind == SLAB_LIST_EMPTY ? slab->free == objs :
+                      slab->free > 0 && slab->free < objs;
+        if (!placed || slab->inuse + slab->free != objs) {
+            io.print("[SLAB] Validate: %s slab %p with %d in use, %d free is on the %s list\n",
+                     cache->name, slab, slab->inuse, slab->free, slab_list_names[kind]);
+            ok = false;
+        }
+        
+        struct buddy_page *page = buddy_allocator.virt_to_page(slab->mem);
+        if (!page || page->owner != PAGE_OWNER_SLAB || page->owner_data != slab) {
+            io.print("[SLAB] Validate: %s slab %p pages are not tagged with it\n", cache->name, slab);
+            ok = false;
+        }
+        
+        u32 first = (u32)slab->mem + slab->color;
+        u32 count = 0;
+        for (struct slab_obj *obj = slab->freelist; obj; obj = obj->next) {
+            if ((u32)obj < first || (u32)obj >= first + objs * cache->obj_size ||
+                ((u32)obj - first) % cache->obj_size) {
+                io.print("[SLAB] Validate: %s slab %p freelist holds stray pointer %p\n", cache->name, slab, obj);
+                ok = false;
+                break;
+            }
+            if (++count > slab->free) break;
+        }
+        if (count != slab->free) {
+            io.print("[SLAB] Validate: %s slab %p freelist has %d objects, counter says %d\n",
+                     cache->name, slab, count, slab->free);
+            ok = false;
+        }
+        
+        (*slabs)++;
+        *inuse += slab->inuse;
+        prev = slab;
+    }
+    
+    return ok;
+}
+
+/* Check each cache's slab lists, freelists and counters; magazines hold objects the slabs count as in use. */
+bool SlabAllocator::validate() {
+    bool ok = true;
+    u32 irq = local_irq_save();
+    
+    for (struct slab_cache *cache = cache_chain; cache; cache = cache->next) {
+        u32 slabs = 0;
+        u32 inuse = 0;
+        
+        if (!validate_list(cache, cache->slabs_full, SLAB_LIST_FULL, &slabs, &inuse)) ok = false;
+        if (!validate_list(cache, cache->slabs_partial, SLAB_LIST_PARTIAL, &slabs, &inuse)) ok = false;
+        if (!validate_list(cache, cache->slabs_empty, SLAB_LIST_EMPTY, &slabs, &inuse)) ok = false;
+        
+        if (slabs != cache->num_slabs || inuse != cache->num_active_objs ||
+            slabs * cache->num_objs_per_slab != cache->num_active_objs + cache->num_free_objs) {
+            io.print("[SLAB] Validate: %s counts %d slabs, %d active, %d free; lists hold %d slabs, %d in use\n",
+                     cache->name, cache->num_slabs, cache->num_active_objs, cache->num_free_objs, slabs, inuse);
+            ok = false;
+        }
+        if (cache->magazines && mag_cached_objects(cache->magazines) > inuse) {
+            io.print("[SLAB] Validate: %s magazines hold more objects than the slabs lent out\n", cache->name);
+            ok = false;
+        }
+    }
+    
+    local_irq_restore(irq);
+    return ok;
+}
+
 void SlabAllocator::print_stats() {
     io.print("[SLAB] Cache Statistics:\n");
     
     struct slab_cache *cache = cache_chain;
     while (cache) {
-        io.print("  %s: obj_size=%d, num_slabs=%d, active_objs=%d, free_objs=%d\n",
+        io.print("  %s: obj_size=%d, num_slabs=%d, active_objs=%d, free_objs=%d, colors=%d\n",
                  cache->name, cache->obj_size, cache->num_slabs, 
-                 cache->num_active_objs, cache->num_free_objs);
+                 cache->num_active_objs, cache->num_free_objs, cache->color_count);
+        if (cache->magazines) {
+            io.print("    magazines: size=%d, cached=%d, full=%d, resizes=%d, misses=%d\n",
+                     cache->magazines->mag_size, mag_cached_objects(cache->magazines),
+                     cache->magazines->nr_full, cache->magazines->resizes, cache->magazines->misses);
+        }
         cache = cache->next;
     }
+    
+    u32 footprint, used;
+    usage(&footprint, &used);
+    io.print("  Footprint: %d KB, live objects %d KB, waste %d KB\n",
+             footprint / 1024, used / 1024, (footprint - used) / 1024);
 }
 
 void init_slab_allocator() {
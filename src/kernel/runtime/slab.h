@@ -4,26 +4,39 @@
 #include <runtime/types.h>
 #include <runtime/list.h>
 #include <runtime/buddy.h>
+#include <runtime/magazine.h>
 
 #define SLAB_MAGIC 0x5AB1234
 #define MAX_SLABS_PER_CACHE 256
 #define CACHE_ALIGN 8
+#define L1_CACHE_BYTES 64
 #define SLAB_MAX_SIZE 4096
 
+#define SLAB_NR_SIZE_CLASSES 12
+#define SLAB_MAX_CLASS_SIZE 4096
+
 struct slab_obj {
     struct slab_obj *next;
-    u32 magic;
 };
 
+struct slab_cache;
+
+/*
+ * Every page backing a slab points back at it through its buddy page
+ * descriptor, so an object's slab and cache are found from its address
+ * alone.
+ */
 struct slab {
     struct slab *next;
     struct slab *prev;
+    struct slab_cache *cache;
     void *mem;
     u32 inuse;
     u32 free;
     struct slab_obj *freelist;
     u32 size;
     u32 order;
+    u32 color;
     u32 magic;
 };
 
@@ -36,6 +49,19 @@ struct slab_cache {
     u32 num_objs_per_slab;
     u32 gfp_order;
     
+    /*
+     * Coloring: the slack left after the last object is spent shifting
+     * each new slab's objects by another color_off bytes, cycling through
+     * color_count offsets, so same-index objects of different slabs fall
+     * in different cache sets instead of all aliasing at one page offset.
+     */
+    u32 color_off;
+    u32 color_count;
+    u32 color_next;
+    
+    /* Per-CPU magazine front end, or null for caches created without SLAB_MAGAZINE. */
+    struct mag_depot *magazines;
+    
     struct slab *slabs_full;
     struct slab *slabs_partial;
     struct slab *slabs_empty;
@@ -51,6 +77,8 @@ struct slab_cache {
 #define SLAB_NO_REAP    0x00000001
 #define SLAB_HWCACHE    0x00000002
 #define SLAB_CACHE_DMA  0x00000004
+#define SLAB_NO_COLOR   0x00000008
+#define SLAB_MAGAZINE   0x00000010
 
 class SlabAllocator {
 public:
@@ -60,15 +88,22 @@ public:
     void cache_destroy(struct slab_cache *cache);
     void *cache_alloc(struct slab_cache *cache);
     void cache_free(struct slab_cache *cache, void *obj);
+    void *cache_alloc_slab(struct slab_cache *cache);
+    void cache_free_slab(struct slab_cache *cache, void *obj);
     void cache_reap();
+    u32 reclaimable_pages();
+    u32 shrink(u32 nr_pages);
+    void usage(u32 *footprint, u32 *used);
+    bool validate();
     void print_stats();
     
     void *kmem_cache_alloc(u32 size);
     void kmem_cache_free(void *obj);
-    
+    struct slab *virt_to_slab(void *obj);
+
 private:
     struct slab_cache *cache_chain;
-    struct slab_cache *size_caches[12];
+    struct slab_cache *size_caches[SLAB_NR_SIZE_CLASSES];
     
     struct slab *slab_create(struct slab_cache *cache);
     void slab_destroy(struct slab_cache *cache, struct slab *slab);
@@ -78,6 +113,7 @@ private:
     u32 calculate_num_objs(u32 obj_size, u32 slab_size);
     u32 get_cache_order(u32 size);
     struct slab_cache *find_size_cache(u32 size);
+    bool validate_list(struct slab_cache *cache, struct slab *list, u32 kind, u32 *slabs, u32 *inuse);
 };
 
 extern SlabAllocator slab_allocator;
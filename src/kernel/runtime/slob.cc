@@ -4,6 +4,10 @@
 
 SLOBAllocator slob_allocator;
 
+static inline struct slob_bin_link *bin_link(struct slob_block *block) {
+    return (struct slob_bin_link*)(block + 1);
+}
+
 void SLOBAllocator::init() {
     io.print("[SLOB] Initializing Simple List Of Blocks allocator\n");
     
@@ -11,7 +15,12 @@ void SLOBAllocator::init() {
     total_pages = 0;
     total_allocated = 0;
     total_free = 0;
-    fragmentation_threshold = 75;
+    fit_mode = SLOB_FIT_BINNED;
+    bin_mask = 0;
+    
+    for (u32 i = 0; i < SLOB_NR_BINS; i++) {
+        bins[i] = 0;
+    }
     
     struct slob_page *initial_page = alloc_page();
     if (!initial_page) {
@@ -19,7 +28,7 @@ void SLOBAllocator::init() {
         return;
     }
     
-    io.print("[SLOB] Initialized with %d bytes available\n", initial_page->total_size);
+    io.print("[SLOB] Initialized with %d bytes available\n", initial_page->free_size);
 }
 
 void *SLOBAllocator::alloc(u32 size) {
@@ -46,25 +55,20 @@ void *SLOBAllocator::alloc(u32 size) {
         }
     }
     
-    if (block->size > aligned_size + sizeof(struct slob_block) + SLOB_MIN_ALLOC) {
-        split_block(block, aligned_size);
-    }
-    
-    struct slob_page *page = 0;
-    for (struct slob_page *p = pages; p; p = p->next) {
-        if ((u32)block >= (u32)p->page_addr && 
-            (u32)block < (u32)p->page_addr + p->total_size) {
-            page = p;
-            break;
-        }
-    }
+    struct slob_page *page = page_of(block);
+    remove_free_block(page, block);
     
-    if (page) {
-        remove_free_block(page, block);
-        page->free_size -= block->size;
+    if (block->size >= aligned_size + sizeof(struct slob_block) + SLOB_MIN_ALLOC) {
+        struct slob_block *rest = (struct slob_block*)((u32)block + aligned_size);
+        rest->size = block->size - aligned_size;
+        rest->magic = 0;
+        block->size = aligned_size;
+        add_free_block(page, rest);
     }
     
     block->magic = SLOB_MAGIC;
+    page->free_size -= block->size;
+    total_free -= block->size;
     total_allocated += block->size;
     
     return (void*)((u32)block + sizeof(struct slob_block));
@@ -80,36 +84,38 @@ void SLOBAllocator::free(void *ptr) {
         return;
     }
     
-    struct slob_page *page = 0;
-    for (struct slob_page *p = pages; p; p = p->next) {
-        if ((u32)block >= (u32)p->page_addr && 
-            (u32)block < (u32)p->page_addr + p->total_size) {
-            page = p;
-            break;
-        }
-    }
-    
-    if (!page) {
-        io.print("[SLOB] Block not found in any page\n");
-        return;
-    }
+    struct slob_page *page = page_of(block);
     
     block->magic = 0;
-    total_allocated -= block->size;
     page->free_size += block->size;
+    total_free += block->size;
+    total_allocated -= block->size;
     
     add_free_block(page, block);
-    merge_free_blocks(page);
     
-    if (page->free_size == page->total_size - sizeof(struct slob_page)) {
-        if (total_pages > 1) {
-            free_page(page);
-        }
+    if (page->free_size == page->total_size - SLOB_PAGE_HEADER && total_pages > 1) {
+        free_page(page);
     }
+}
+
+u32 SLOBAllocator::object_size(void *ptr) {
+    struct slob_block *block = (struct slob_block*)((u32)ptr - sizeof(struct slob_block));
+    if (block->magic != SLOB_MAGIC) return 0;
     
-    if (should_defragment()) {
-        defragment();
-    }
+    return block->size - sizeof(struct slob_block);
+}
+
+/*
+ * SLOB_FIT_LINEAR keeps the original best-fit walk over every page so the
+ * two strategies can be compared on the same heap; bins are maintained in
+ * either mode.
+ */
+void SLOBAllocator::set_fit(u32 mode) {
+    fit_mode = mode;
+}
+
+u32 SLOBAllocator::get_pages() {
+    return total_pages;
 }
 
 struct slob_page *SLOBAllocator::alloc_page() {
@@ -117,12 +123,14 @@ struct slob_page *SLOBAllocator::alloc_page() {
     if (!page_mem) {
         return 0;
     }
+    buddy_allocator.set_page_owner(page_mem, PAGE_OWNER_SLOB);
     
     struct slob_page *page = (struct slob_page*)page_mem;
     page->page_addr = page_mem;
     page->total_size = SLOB_BLOCK_SIZE;
-    page->free_size = SLOB_BLOCK_SIZE - sizeof(struct slob_page);
+    page->free_size = SLOB_BLOCK_SIZE - SLOB_PAGE_HEADER;
     page->fragmentation = 0;
+    page->free_list = 0;
     page->next = pages;
     page->prev = 0;
     
@@ -131,13 +139,11 @@ struct slob_page *SLOBAllocator::alloc_page() {
     }
     pages = page;
     
-    struct slob_block *initial_block = (struct slob_block*)((u32)page_mem + sizeof(struct slob_page));
+    struct slob_block *initial_block = (struct slob_block*)((u32)page_mem + SLOB_PAGE_HEADER);
     initial_block->size = page->free_size;
     initial_block->magic = 0;
-    initial_block->next = 0;
-    initial_block->prev = 0;
+    add_free_block(page, initial_block);
     
-    page->free_list = initial_block;
     total_pages++;
     total_free += page->free_size;
     
@@ -147,6 +153,8 @@ struct slob_page *SLOBAllocator::alloc_page() {
 void SLOBAllocator::free_page(struct slob_page *page) {
     if (!page) return;
     
+    remove_free_block(page, page->free_list);
+    
     if (page->prev) {
         page->prev->next = page->next;
     } else {
@@ -163,7 +171,47 @@ void SLOBAllocator::free_page(struct slob_page *page) {
     buddy_allocator.free(page->page_addr);
 }
 
+struct slob_page *SLOBAllocator::page_of(struct slob_block *block) {
+    return (struct slob_page*)((u32)block & ~(SLOB_BLOCK_SIZE - 1));
+}
+
 struct slob_block *SLOBAllocator::find_free_block(u32 size) {
+    if (fit_mode == SLOB_FIT_LINEAR) {
+        return find_linear(size);
+    }
+    return find_binned(size);
+}
+
+/*
+ * Best fit among the first few blocks of the size's own bin; failing that,
+ * any block from the next non-empty bin is large enough by construction.
+ */
+struct slob_block *SLOBAllocator::find_binned(u32 size) {
+    u32 bin = bin_index(size);
+    struct slob_block *best_fit = 0;
+    u32 scanned = 0;
+    
+    for (struct slob_block *block = bins[bin]; block && scanned < SLOB_BIN_SCAN;
+         block = bin_link(block)->next, scanned++) {
+        if (block->size >= size && (!best_fit || block->size < best_fit->size)) {
+            best_fit = block;
+            if (block->size == size) break;
+        }
+    }
+    
+    if (best_fit) {
+        return best_fit;
+    }
+    
+    u32 mask = bin_mask & ~((2U << bin) - 1);
+    if (mask == 0) {
+        return 0;
+    }
+    
+    return bins[__builtin_ctz(mask)];
+}
+
+struct slob_block *SLOBAllocator::find_linear(u32 size) {
     struct slob_block *best_fit = 0;
     u32 best_size = 0xFFFFFFFF;
     
@@ -183,22 +231,43 @@ struct slob_block *SLOBAllocator::find_free_block(u32 size) {
     return best_fit;
 }
 
-void SLOBAllocator::split_block(struct slob_block *block, u32 size) {
-    if (block->size <= size + sizeof(struct slob_block)) {
-        return;
+u32 SLOBAllocator::bin_index(u32 size) {
+    u32 payload = size - sizeof(struct slob_block);
+    if (payload < 32) return 0;
+    
+    u32 bin = 31 - __builtin_clz(payload) - 4;
+    return bin < SLOB_NR_BINS ? bin : SLOB_NR_BINS - 1;
+}
+
+void SLOBAllocator::bin_insert(struct slob_block *block) {
+    u32 bin = bin_index(block->size);
+    struct slob_bin_link *link = bin_link(block);
+    
+    link->prev = 0;
+    link->next = bins[bin];
+    if (bins[bin]) {
+        bin_link(bins[bin])->prev = block;
     }
+    bins[bin] = block;
+    bin_mask |= 1U << bin;
+}
+
+void SLOBAllocator::bin_remove(struct slob_block *block) {
+    u32 bin = bin_index(block->size);
+    struct slob_bin_link *link = bin_link(block);
     
-    struct slob_block *new_block = (struct slob_block*)((u32)block + size);
-    new_block->size = block->size - size;
-    new_block->magic = 0;
-    new_block->next = block->next;
-    new_block->prev = block;
+    if (link->prev) {
+        bin_link(link->prev)->next = link->next;
+    } else {
+        bins[bin] = link->next;
+    }
+    if (link->next) {
+        bin_link(link->next)->prev = link->prev;
+    }
     
-    if (block->next) {
-        block->next->prev = new_block;
+    if (!bins[bin]) {
+        bin_mask &= ~(1U << bin);
     }
-    block->next = new_block;
-    block->size = size;
 }
 
 void SLOBAllocator::merge_free_blocks(struct slob_page *page) {
@@ -209,11 +278,14 @@ void SLOBAllocator::merge_free_blocks(struct slob_page *page) {
         struct slob_block *next = current->next;
         
         if ((u32)current + current->size == (u32)next) {
+            bin_remove(current);
+            bin_remove(next);
             current->size += next->size;
             current->next = next->next;
             if (next->next) {
                 next->next->prev = current;
             }
+            bin_insert(current);
             page->fragmentation--;
         } else {
             current = current->next;
@@ -221,36 +293,50 @@ void SLOBAllocator::merge_free_blocks(struct slob_page *page) {
     }
 }
 
+/*
+ * Insert a free block in address order and coalesce it with whichever
+ * neighbours are free, then file the result on its bin.
+ */
 void SLOBAllocator::add_free_block(struct slob_page *page, struct slob_block *block) {
     if (!page || !block) return;
     
-    if (!page->free_list) {
-        page->free_list = block;
-        block->next = 0;
-        block->prev = 0;
-        return;
+    struct slob_block *prev = 0;
+    struct slob_block *next = page->free_list;
+    while (next && (u32)next < (u32)block) {
+        prev = next;
+        next = next->next;
     }
     
-    if ((u32)block < (u32)page->free_list) {
-        block->next = page->free_list;
-        block->prev = 0;
-        page->free_list->prev = block;
-        page->free_list = block;
-        return;
+    if (next && (u32)block + block->size == (u32)next) {
+        bin_remove(next);
+        block->size += next->size;
+        next = next->next;
+        page->fragmentation--;
     }
     
-    struct slob_block *current = page->free_list;
-    while (current->next && (u32)current->next < (u32)block) {
-        current = current->next;
+    if (prev && (u32)prev + prev->size == (u32)block) {
+        bin_remove(prev);
+        prev->size += block->size;
+        prev->next = next;
+        if (next) {
+            next->prev = prev;
+        }
+        bin_insert(prev);
+        return;
     }
     
-    block->next = current->next;
-    block->prev = current;
-    if (current->next) {
-        current->next->prev = block;
+    block->prev = prev;
+    block->next = next;
+    if (prev) {
+        prev->next = block;
+    } else {
+        page->free_list = block;
+    }
+    if (next) {
+        next->prev = block;
     }
-    current->next = block;
     
+    bin_insert(block);
     page->fragmentation++;
 }
 
@@ -268,8 +354,10 @@ void SLOBAllocator::remove_free_block(struct slob_page *page, struct slob_block
         block->next->prev = block->prev;
     }
     
+    bin_remove(block);
     block->next = 0;
     block->prev = 0;
+    page->fragmentation--;
 }
 
 void SLOBAllocator::defragment() {
@@ -278,33 +366,162 @@ void SLOBAllocator::defragment() {
         page->fragmentation = 0;
         
         for (struct slob_block *block = page->free_list; block; block = block->next) {
-            if (block->next) {
-                page->fragmentation++;
-            }
+            page->fragmentation++;
         }
     }
 }
 
-bool SLOBAllocator::should_defragment() {
-    u32 total_fragmentation = 0;
+u32 SLOBAllocator::get_efficiency() {
+    if (total_allocated + total_free == 0) return 0;
+    
+    return (total_allocated * 100) / (total_allocated + total_free);
+}
+
+void SLOBAllocator::free_distribution(struct slob_free_stats *stats) {
+    for (u32 i = 0; i < SLOB_FREE_CLASSES; i++) {
+        stats->blocks[i] = 0;
+        stats->bytes[i] = 0;
+    }
+    stats->largest = 0;
+    stats->unusable = 0;
+    
     for (struct slob_page *page = pages; page; page = page->next) {
-        total_fragmentation += page->fragmentation;
+        for (struct slob_block *block = page->free_list; block; block = block->next) {
+            u32 cls = 31 - __builtin_clz(block->size);
+            cls = cls < 6 ? 0 : cls - 5;
+            if (cls >= SLOB_FREE_CLASSES) cls = SLOB_FREE_CLASSES - 1;
+            
+            stats->blocks[cls]++;
+            stats->bytes[cls] += block->size;
+            if (block->size > stats->largest) {
+                stats->largest = block->size;
+            }
+            if (block->size < SLOB_MAX_ALLOC + sizeof(struct slob_block)) {
+                stats->unusable += block->size;
+            }
+        }
+    }
+}
+
+/* Block headers count as used: they are the price of SLOB's packing, not fragmentation. */
+void SLOBAllocator::usage(u32 *footprint, u32 *used) {
+    *footprint = total_pages * SLOB_BLOCK_SIZE;
+    *used = total_allocated;
+}
+
+/*
+ * Blocks must tile the page from the header to the end: every block is
+ * either allocated (SLOB_MAGIC) or the next entry of the address-ordered
+ * free list, and no two free blocks touch.
+ */
+bool SLOBAllocator::validate_page(struct slob_page *page, u32 *free_blocks) {
+    u32 start = (u32)page + SLOB_PAGE_HEADER;
+    u32 end = (u32)page + page->total_size;
+    struct slob_block *expect = page->free_list;
+    struct slob_block *prev_free = 0;
+    u32 free_bytes = 0;
+    u32 allocated = 0;
+    bool last_free = false;
+    
+    struct buddy_page *desc = buddy_allocator.virt_to_page(page);
+    if (((u32)page & (SLOB_BLOCK_SIZE - 1)) || page->page_addr != page || !desc || desc->owner != PAGE_OWNER_SLOB) {
+        io.print("[SLOB] Validate: %p is not a SLOB page\n", page);
+        return false;
     }
     
-    if (total_pages == 0) return false;
+    for (u32 addr = start; addr < end; ) {
+        struct slob_block *block = (struct slob_block*)addr;
+        if (block->size < sizeof(struct slob_block) || block->size > end - addr) {
+            io.print("[SLOB] Validate: block at %x has bad size %d\n", addr, block->size);
+            return false;
+        }
+        
+        if (block == expect) {
+            if (last_free) {
+                io.print("[SLOB] Validate: free blocks at %x and %x were not merged\n", (u32)prev_free, addr);
+                return false;
+            }
+            if (block->prev != prev_free || block->magic != 0) {
+                io.print("[SLOB] Validate: free block at %x has a bad link or magic\n", addr);
+                return false;
+            }
+            free_bytes += block->size;
+            (*free_blocks)++;
+            prev_free = block;
+            expect = block->next;
+            last_free = true;
+        } else {
+            if (block->magic != SLOB_MAGIC) {
+                io.print("[SLOB] Validate: block at %x is neither free nor allocated\n", addr);
+                return false;
+            }
+            allocated += block->size;
+            last_free = false;
+        }
+        
+        addr += block->size;
+    }
+    
+    if (expect) {
+        io.print("[SLOB] Validate: free list of page %p points outside it\n", page);
+        return false;
+    }
+    if (free_bytes != page->free_size || free_bytes + allocated != page->total_size - SLOB_PAGE_HEADER) {
+        io.print("[SLOB] Validate: page %p has %d bytes free, counter says %d\n", page, free_bytes, page->free_size);
+        return false;
+    }
     
-    u32 avg_fragmentation = total_fragmentation / total_pages;
-    return avg_fragmentation > fragmentation_threshold;
+    return true;
 }
 
-u32 SLOBAllocator::get_efficiency() {
-    if (total_allocated + total_free == 0) return 0;
+bool SLOBAllocator::validate() {
+    bool ok = true;
+    u32 irq = local_irq_save();
+    u32 count = 0;
+    u32 free_blocks = 0;
+    u32 free_bytes = 0;
+    u32 binned = 0;
+    
+    for (struct slob_page *page = pages; page && count <= total_pages; page = page->next, count++) {
+        if (!validate_page(page, &free_blocks)) {
+            ok = false;
+        }
+        free_bytes += page->free_size;
+    }
     
-    return (total_allocated * 100) / (total_allocated + total_free);
+    if (count != total_pages || free_bytes != total_free ||
+        count * (SLOB_BLOCK_SIZE - SLOB_PAGE_HEADER) != total_free + total_allocated) {
+        io.print("[SLOB] Validate: counters say %d pages, %d bytes free; found %d pages, %d bytes free\n",
+                 total_pages, total_free, count, free_bytes);
+        ok = false;
+    }
+    
+    for (u32 i = 0; i < SLOB_NR_BINS; i++) {
+        if (((bin_mask >> i) & 1) != (bins[i] ? 1U : 0U)) {
+            io.print("[SLOB] Validate: bin_mask bit %d is wrong\n", i);
+            ok = false;
+        }
+        for (struct slob_block *block = bins[i]; block && binned <= free_blocks; block = bin_link(block)->next) {
+            if (block->magic != 0 || bin_index(block->size) != i) {
+                io.print("[SLOB] Validate: block at %x does not belong in bin %d\n", (u32)block, i);
+                ok = false;
+                break;
+            }
+            binned++;
+        }
+    }
+    if (binned != free_blocks) {
+        io.print("[SLOB] Validate: bins hold %d blocks, free lists %d\n", binned, free_blocks);
+        ok = false;
+    }
+    
+    local_irq_restore(irq);
+    return ok;
 }
 
 void SLOBAllocator::print_stats() {
     io.print("[SLOB] Statistics:\n");
+    io.print("  Fit: %s\n", fit_mode == SLOB_FIT_LINEAR ? "linear best-fit" : "segregated bins");
     io.print("  Pages: %d\n", total_pages);
     io.print("  Total allocated: %d bytes\n", total_allocated);
     io.print("  Total free: %d bytes\n", total_free);
@@ -318,6 +535,26 @@ void SLOBAllocator::print_stats() {
     if (total_pages > 0) {
         io.print("  Average fragmentation: %d blocks/page\n", total_fragmentation / total_pages);
     }
+    
+    for (u32 i = 0; i < SLOB_NR_BINS; i++) {
+        u32 count = 0;
+        for (struct slob_block *block = bins[i]; block; block = bin_link(block)->next) {
+            count++;
+        }
+        if (count > 0) {
+            io.print("  Bin %d (%d+ bytes): %d free blocks\n", i, 16 << i, count);
+        }
+    }
+    
+    struct slob_free_stats free_stats;
+    free_distribution(&free_stats);
+    io.print("  Free blocks by size:");
+    for (u32 i = 0; i < SLOB_FREE_CLASSES; i++) {
+        io.print(" %s%d:%d", i == SLOB_FREE_CLASSES - 1 ? ">=" : "<", 64 << (i == SLOB_FREE_CLASSES - 1 ? i - 1 : i),
+                 free_stats.blocks[i]);
+    }
+    io.print("\n  Largest free block: %d bytes, %d bytes too small for %d\n",
+             free_stats.largest, free_stats.unusable, SLOB_MAX_ALLOC);
 }
 
 extern "C" {
@@ -336,4 +573,4 @@ void slob_free(void *ptr) {
 void slob_stats() {
     slob_allocator.print_stats();
 }
-}
\ No newline at end of file
+}
@@ -10,6 +10,20 @@
 #define SLOB_MIN_ALLOC 16
 #define SLOB_MAX_ALLOC 512
 
+/*
+ * Free blocks are kept on size bins by payload: 16, 32, 64, 128, 256 and
+ * 512 bytes and up, plus one bin for everything from 1 KiB. Only the first
+ * SLOB_BIN_SCAN blocks of the matching bin are searched for a best fit.
+ */
+#define SLOB_NR_BINS 7
+#define SLOB_BIN_SCAN 16
+
+/* Free block size classes for free_distribution(): under 64 bytes, under 128, ... 2 KiB and up. */
+#define SLOB_FREE_CLASSES 7
+
+#define SLOB_FIT_BINNED 0
+#define SLOB_FIT_LINEAR 1
+
 struct slob_block {
     u32 size;
     u32 magic;
@@ -17,6 +31,17 @@ struct slob_block {
     struct slob_block *prev;
 };
 
+/* Bin links of a free block; they live in its otherwise unused payload. */
+struct slob_bin_link {
+    struct slob_block *next;
+    struct slob_block *prev;
+};
+
+/*
+ * Sits at the start of its page, so a block finds its page by masking its
+ * address. free_list is address ordered so neighbours coalesce on free;
+ * free_size is the page's free-space summary.
+ */
 struct slob_page {
     void *page_addr;
     u32 total_size;
@@ -27,31 +52,58 @@ struct slob_page {
     struct slob_page *prev;
 };
 
+/*
+ * Where SLOB's free bytes are. unusable is the bytes in blocks too small
+ * to hold a SLOB_MAX_ALLOC request, i.e. free space only small requests
+ * can still use.
+ */
+struct slob_free_stats {
+    u32 blocks[SLOB_FREE_CLASSES];
+    u32 bytes[SLOB_FREE_CLASSES];
+    u32 largest;
+    u32 unusable;
+};
+
+#define SLOB_PAGE_HEADER ((sizeof(struct slob_page) + SLOB_ALIGN - 1) & ~(SLOB_ALIGN - 1))
+
 class SLOBAllocator {
 public:
     void init();
     void *alloc(u32 size);
     void free(void *ptr);
+    u32 object_size(void *ptr);
     void print_stats();
     void defragment();
     u32 get_efficiency();
-    
+    u32 get_pages();
+    void set_fit(u32 mode);
+    void free_distribution(struct slob_free_stats *stats);
+    void usage(u32 *footprint, u32 *used);
+    bool validate();
+
 private:
     struct slob_page *pages;
     u32 total_pages;
     u32 total_allocated;
     u32 total_free;
-    u32 fragmentation_threshold;
+    u32 fit_mode;
+    
+    struct slob_block *bins[SLOB_NR_BINS];
+    u32 bin_mask;
     
     struct slob_page *alloc_page();
     void free_page(struct slob_page *page);
+    struct slob_page *page_of(struct slob_block *block);
     struct slob_block *find_free_block(u32 size);
-    void split_block(struct slob_block *block, u32 size);
+    struct slob_block *find_binned(u32 size);
+    struct slob_block *find_linear(u32 size);
     void merge_free_blocks(struct slob_page *page);
     void add_free_block(struct slob_page *page, struct slob_block *block);
     void remove_free_block(struct slob_page *page, struct slob_block *block);
-    u32 calculate_overhead(u32 size);
-    bool should_defragment();
+    u32 bin_index(u32 size);
+    void bin_insert(struct slob_block *block);
+    void bin_remove(struct slob_block *block);
+    bool validate_page(struct slob_page *page, u32 *free_blocks);
 };
 
 extern SLOBAllocator slob_allocator;
@@ -63,4 +115,4 @@ extern "C" {
     void slob_stats();
 }
 
-#endif
\ No newline at end of file
+#endif
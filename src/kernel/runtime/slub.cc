@@ -1,19 +1,36 @@
 #include <os.h>
 #include <runtime/slub.h>
 #include <runtime/buddy.h>
+#include <runtime/slab.h>
+#include <runtime/percpu.h>
+#include <runtime/shrinker.h>
 
 extern "C" {
-    char *itoa(int value, char *str, int base);
+    void itoa(char *buf, unsigned long int n, int base);
     int strcpy(char *dst, const char *src);
 }
 
 SLUBAllocator slub_allocator;
 
+static struct slab_cache *slub_page_cache;
+
+static u32 slub_shrink_count(struct shrinker * /*shrinker*/) {
+    return slub_allocator.reclaimable_pages();
+}
+
+static u32 slub_shrink_scan(struct shrinker * /*shrinker*/, u32 nr_to_scan) {
+    return slub_allocator.shrink(nr_to_scan);
+}
+
+static struct shrinker slub_shrinker = {
+    "slub", slub_shrink_count, slub_shrink_scan, SHRINKER_SEEKS_DEFAULT, nullptr, 0, 0
+};
+
 void SLUBAllocator::init() {
     io.print("[SLUB] Initializing SLaB Unqueued allocator\n");
     
     cache_chain = 0;
-    current_cpu = 0;
+    slub_page_cache = slab_allocator.cache_create("slub_pages", sizeof(struct slub_page), 8, 0, 0, 0);
     
     for (int i = 0; i < 16; i++) {
         size_caches[i] = 0;
@@ -25,13 +42,15 @@ void SLUBAllocator::init() {
     
     for (int i = 0; i < 16; i++) {
         char cache_name[32];
-        itoa(cache_sizes[i], cache_name + 5, 10);
+        itoa(cache_name + 5, cache_sizes[i], 10);
         cache_name[0] = 's'; cache_name[1] = 'l'; cache_name[2] = 'u'; 
         cache_name[3] = 'b'; cache_name[4] = '-';
         size_caches[i] = cache_create(cache_name, cache_sizes[i], SLUB_ALIGN, 
                                     SLUB_CACHE_PERCPU, 0, 0);
     }
     
+    register_shrinker(&slub_shrinker);
+    
     io.print("[SLUB] Initialized with %d size caches\n", 16);
 }
 
@@ -56,8 +75,8 @@ struct slub_cache *SLUBAllocator::cache_create(const char *name, u32 size, u32 a
     
     cache->partial_pages = 0;
     cache->full_pages = 0;
+    cache->nr_partial = 0;
     cache->total_pages = 0;
-    cache->active_objects = 0;
     cache->total_objects = 0;
     cache->allocations = 0;
     cache->frees = 0;
@@ -67,15 +86,10 @@ struct slub_cache *SLUBAllocator::cache_create(const char *name, u32 size, u32 a
     cache->ctor = ctor;
     cache->dtor = dtor;
     
-    for (int i = 0; i < SLUB_MAX_CPUS; i++) {
-        cache->cpu_caches[i].freelist = 0;
-        cache->cpu_caches[i].page = 0;
-        cache->cpu_caches[i].batch_count = 0;
-        cache->cpu_caches[i].batchlimit = SLUB_BATCH_SIZE / 2;
-        
-        for (int j = 0; j < SLUB_BATCH_SIZE; j++) {
-            cache->cpu_caches[i].batch_objects[j] = 0;
-        }
+    for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+        cache->cpu_caches[cpu].freelist = 0;
+        cache->cpu_caches[cpu].tid = cpu;
+        cache->cpu_caches[cpu].page = 0;
     }
     
     cache->next = cache_chain;
@@ -87,7 +101,9 @@ struct slub_cache *SLUBAllocator::cache_create(const char *name, u32 size, u32 a
 void SLUBAllocator::cache_destroy(struct slub_cache *cache) {
     if (!cache) return;
     
-    flush_cpu_caches();
+    for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+        drain_cpu_cache(cache, cpu);
+    }
     
     struct slub_page *page = cache->partial_pages;
     while (page) {
@@ -117,42 +133,37 @@ void SLUBAllocator::cache_destroy(struct slub_cache *cache) {
     buddy_allocator.free(cache);
 }
 
+/*
+ * Fast path: pop the head of this CPU's freelist and bump its tid in one
+ * cmpxchg8b, with interrupts left on. If an interrupt allocated or freed
+ * on this CPU after we read the pair, the tid no longer matches and we
+ * simply try again.
+ */
 void *SLUBAllocator::cache_alloc(struct slub_cache *cache) {
     if (!cache) return 0;
     
-    void *obj = 0;
+    void *obj;
     
-    if (cache->flags & SLUB_CACHE_PERCPU) {
-        obj = cpu_cache_alloc(cache);
-        if (obj) {
-            cache->cache_hits++;
-            cache->allocations++;
-            if (cache->ctor) {
-                cache->ctor(obj);
-            }
-            return obj;
+    for (;;) {
+        struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[get_cpu_id()];
+        u32 tid = cpu_cache->tid;
+        asm volatile("" : : : "memory");
+        
+        obj = cpu_cache->freelist;
+        if (!obj) {
+            obj = slow_alloc(cache);
+            break;
         }
-        cache->cache_misses++;
-    }
-    
-    struct slub_page *page = cache->partial_pages;
-    if (!page) {
-        page = alloc_slub_page(cache);
-        if (!page) {
-            return 0;
+        
+        void *next = ((struct slub_object*)obj)->next;
+        if (cmpxchg_double(&cpu_cache->freelist, (u32)obj, tid, (u32)next, tid + SLUB_TID_STEP)) {
+            cache->cache_hits++;
+            break;
         }
     }
     
-    obj = alloc_from_page(cache, page);
     if (obj) {
         cache->allocations++;
-        cache->active_objects++;
-        
-        if (page->inuse == page->objects) {
-            remove_page_from_list(&cache->partial_pages, page);
-            add_page_to_list(&cache->full_pages, page);
-        }
-        
         if (cache->ctor) {
             cache->ctor(obj);
         }
@@ -161,61 +172,44 @@ void *SLUBAllocator::cache_alloc(struct slub_cache *cache) {
     return obj;
 }
 
+/*
+ * Fast path for objects of the CPU's own page: push onto its freelist
+ * with the same tid-checked cmpxchg8b as allocation. Anything else goes
+ * to the page it came from.
+ */
 void SLUBAllocator::cache_free(struct slub_cache *cache, void *obj) {
     if (!cache || !obj) return;
     
-    struct slub_object *slub_obj = (struct slub_object*)obj;
-    if (slub_obj->magic != SLUB_MAGIC) {
-        io.print("[SLUB] Invalid magic in object at %x\n", (u32)obj);
-        return;
-    }
-    
     if (cache->dtor) {
         cache->dtor(obj);
     }
     
-    if (cache->flags & SLUB_CACHE_PERCPU) {
-        cpu_cache_free(cache, obj);
-        cache->frees++;
-        return;
-    }
-    
-    struct slub_page *page = 0;
-    for (struct slub_page *p = cache->full_pages; p; p = p->next) {
-        if ((u32)obj >= (u32)p->page_base && 
-            (u32)obj < (u32)p->page_base + (PAGE_SIZE << p->order)) {
-            page = p;
+    for (;;) {
+        struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[get_cpu_id()];
+        u32 tid = cpu_cache->tid;
+        asm volatile("" : : : "memory");
+        
+        struct slub_page *page = cpu_cache->page;
+        if (!page || (u32)obj - (u32)page->page_base >= (u32)(PAGE_SIZE << page->order)) {
             break;
         }
-    }
-    
-    if (!page) {
-        for (struct slub_page *p = cache->partial_pages; p; p = p->next) {
-            if ((u32)obj >= (u32)p->page_base && 
-                (u32)obj < (u32)p->page_base + (PAGE_SIZE << p->order)) {
-                page = p;
-                break;
-            }
+        
+        void *head = cpu_cache->freelist;
+        ((struct slub_object*)obj)->next = (struct slub_object*)head;
+        if (cmpxchg_double(&cpu_cache->freelist, (u32)head, tid, (u32)obj, tid + SLUB_TID_STEP)) {
+            cache->frees++;
+            return;
         }
     }
     
-    if (page) {
-        bool was_full = (page->inuse == page->objects);
-        
-        free_to_page(cache, page, obj);
-        cache->frees++;
-        cache->active_objects--;
-        
-        if (was_full && page->inuse < page->objects) {
-            remove_page_from_list(&cache->full_pages, page);
-            add_page_to_list(&cache->partial_pages, page);
-        }
-        
-        if (page->inuse == 0 && cache->total_pages > 1) {
-            remove_page_from_list(&cache->partial_pages, page);
-            free_slub_page(cache, page);
-        }
+    struct slub_page *page = find_page(obj);
+    if (!page || page->cache != cache) {
+        io.print("[SLUB] Error: %p does not belong to cache %s\n", obj, cache->name);
+        return;
     }
+    
+    slow_free(cache, page, obj);
+    cache->frees++;
 }
 
 void *SLUBAllocator::alloc(u32 size) {
@@ -223,7 +217,11 @@ void *SLUBAllocator::alloc(u32 size) {
     
     struct slub_cache *cache = find_size_cache(size);
     if (!cache) {
-        return buddy_allocator.alloc(size);
+        void *ptr = buddy_allocator.alloc(size);
+        if (ptr) {
+            buddy_allocator.set_page_owner(ptr, PAGE_OWNER_BUDDY);
+        }
+        return ptr;
     }
     
     return cache_alloc(cache);
@@ -232,38 +230,170 @@ void *SLUBAllocator::alloc(u32 size) {
 void SLUBAllocator::free(void *obj) {
     if (!obj) return;
     
-    for (struct slub_cache *cache = cache_chain; cache; cache = cache->next) {
-        for (struct slub_page *page = cache->partial_pages; page; page = page->next) {
-            if ((u32)obj >= (u32)page->page_base && 
-                (u32)obj < (u32)page->page_base + (PAGE_SIZE << page->order)) {
-                cache_free(cache, obj);
-                return;
+    struct slub_page *page = find_page(obj);
+    if (page) {
+        cache_free(page->cache, obj);
+        return;
+    }
+    
+    buddy_allocator.free(obj);
+}
+
+u32 SLUBAllocator::object_size(void *obj) {
+    struct slub_page *page = find_page(obj);
+    return page ? page->cache->objsize : 0;
+}
+
+/*
+ * Every page of a slab points back at its slub_page through the buddy's
+ * per-PFN descriptor, so finding an object's slab is a single lookup.
+ */
+struct slub_page *SLUBAllocator::find_page(void *obj) {
+    struct buddy_page *page = buddy_allocator.virt_to_page(obj);
+    if (!page || page->owner != PAGE_OWNER_SLUB) return 0;
+    
+    return (struct slub_page*)page->owner_data;
+}
+
+/*
+ * Slow path, interrupts off. Objects other CPUs freed to our frozen page
+ * are reclaimed first; otherwise the exhausted page is retired and the
+ * next one comes from the node's partial list, or fresh from the buddy.
+ */
+void *SLUBAllocator::slow_alloc(struct slub_cache *cache) {
+    u32 irq = local_irq_save();
+    struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[get_cpu_id()];
+    
+    cache->cache_misses++;
+    
+    if (!cpu_cache->freelist) {
+        struct slub_page *page = cpu_cache->page;
+        
+        if (page && page->freelist) {
+            cpu_cache->freelist = page->freelist;
+            page->freelist = 0;
+            page->inuse = page->objects;
+        } else {
+            deactivate_page(cache, cpu_cache);
+            
+            page = get_partial(cache);
+            if (!page) {
+                page = alloc_slub_page(cache);
+            }
+            if (!page) {
+                local_irq_restore(irq);
+                return 0;
             }
+            
+            freeze_page(cpu_cache, page);
+        }
+    }
+    
+    struct slub_object *obj = (struct slub_object*)cpu_cache->freelist;
+    cpu_cache->freelist = obj->next;
+    cpu_cache->tid += SLUB_TID_STEP;
+    
+    local_irq_restore(irq);
+    return obj;
+}
+
+void SLUBAllocator::slow_free(struct slub_cache *cache, struct slub_page *page, void *obj) {
+    u32 irq = local_irq_save();
+    
+    bool was_full = !page->frozen && page->inuse == page->objects;
+    
+    struct slub_object *slub_obj = (struct slub_object*)obj;
+    slub_obj->next = (struct slub_object*)page->freelist;
+    page->freelist = obj;
+    page->inuse--;
+    
+    if (!page->frozen) {
+        if (was_full) {
+            remove_page_from_list(&cache->full_pages, page);
+            add_partial(cache, page);
         }
         
-        for (struct slub_page *page = cache->full_pages; page; page = page->next) {
-            if ((u32)obj >= (u32)page->page_base && 
-                (u32)obj < (u32)page->page_base + (PAGE_SIZE << page->order)) {
-                cache_free(cache, obj);
-                return;
-            }
+        if (page->inuse == 0 && cache->nr_partial > SLUB_MIN_PARTIAL) {
+            remove_partial(cache, page);
+            free_slub_page(cache, page);
         }
     }
     
-    buddy_allocator.free(obj);
+    local_irq_restore(irq);
+}
+
+/* Hand the page's whole freelist to the CPU; called with interrupts off. */
+void SLUBAllocator::freeze_page(struct slub_cpu_cache *cpu_cache, struct slub_page *page) {
+    page->frozen = 1;
+    page->inuse = page->objects;
+    cpu_cache->freelist = page->freelist;
+    cpu_cache->page = page;
+    page->freelist = 0;
+    cpu_cache->tid += SLUB_TID_STEP;
+}
+
+/*
+ * Give the CPU's remaining objects back to its page and put the page on
+ * the partial or full list, or back to the buddy if it is empty and the
+ * node already has enough partial pages. Called with interrupts off.
+ */
+void SLUBAllocator::deactivate_page(struct slub_cache *cache, struct slub_cpu_cache *cpu_cache) {
+    struct slub_page *page = cpu_cache->page;
+    if (!page) return;
+    
+    struct slub_object *obj = (struct slub_object*)cpu_cache->freelist;
+    while (obj) {
+        struct slub_object *next = obj->next;
+        obj->next = (struct slub_object*)page->freelist;
+        page->freelist = obj;
+        page->inuse--;
+        obj = next;
+    }
+    
+    cpu_cache->freelist = 0;
+    cpu_cache->page = 0;
+    cpu_cache->tid += SLUB_TID_STEP;
+    page->frozen = 0;
+    
+    if (page->inuse == 0 && cache->nr_partial >= SLUB_MIN_PARTIAL) {
+        free_slub_page(cache, page);
+    } else if (page->inuse < page->objects) {
+        add_partial(cache, page);
+    } else {
+        add_page_to_list(&cache->full_pages, page);
+    }
+}
+
+struct slub_page *SLUBAllocator::get_partial(struct slub_cache *cache) {
+    struct slub_page *page = cache->partial_pages;
+    if (page) {
+        remove_partial(cache, page);
+    }
+    return page;
+}
+
+void SLUBAllocator::add_partial(struct slub_cache *cache, struct slub_page *page) {
+    add_page_to_list(&cache->partial_pages, page);
+    cache->nr_partial++;
+}
+
+void SLUBAllocator::remove_partial(struct slub_cache *cache, struct slub_page *page) {
+    remove_page_from_list(&cache->partial_pages, page);
+    cache->nr_partial--;
 }
 
 struct slub_page *SLUBAllocator::alloc_slub_page(struct slub_cache *cache) {
-    void *page_mem = buddy_allocator.alloc(PAGE_SIZE << cache->order);
-    if (!page_mem) {
+    struct slub_page *page = (struct slub_page*)slab_allocator.cache_alloc(slub_page_cache);
+    if (!page) {
         return 0;
     }
     
-    struct slub_page *page = (struct slub_page*)buddy_allocator.alloc(sizeof(struct slub_page));
-    if (!page) {
-        buddy_allocator.free(page_mem);
+    void *page_mem = buddy_allocator.alloc(PAGE_SIZE << cache->order);
+    if (!page_mem) {
+        slab_allocator.cache_free(slub_page_cache, page);
         return 0;
     }
+    buddy_allocator.set_page_owner(page_mem, PAGE_OWNER_SLUB, page);
     
     page->page_base = page_mem;
     page->objects = cache->objects_per_page;
@@ -272,9 +402,9 @@ struct slub_page *SLUBAllocator::alloc_slub_page(struct slub_cache *cache) {
     page->cache = cache;
     page->frozen = 0;
     page->next = 0;
+    page->prev = 0;
     
     init_page_objects(cache, page);
-    add_page_to_list(&cache->partial_pages, page);
     
     cache->total_pages++;
     cache->total_objects += page->objects;
@@ -288,7 +418,6 @@ void SLUBAllocator::init_page_objects(struct slub_cache *cache, struct slub_page
     
     for (u32 i = 0; i < page->objects; i++) {
         struct slub_object *obj = (struct slub_object*)obj_ptr;
-        obj->magic = 0;
         obj->next = prev;
         prev = obj;
         obj_ptr = (void*)((u32)obj_ptr + cache->size);
@@ -297,98 +426,6 @@ void SLUBAllocator::init_page_objects(struct slub_cache *cache, struct slub_page
     page->freelist = prev;
 }
 
-void *SLUBAllocator::alloc_from_page(struct slub_cache * /*cache*/, struct slub_page *page) {
-    if (!page->freelist) {
-        return 0;
-    }
-    
-    struct slub_object *obj = (struct slub_object*)page->freelist;
-    page->freelist = obj->next;
-    page->inuse++;
-    
-    obj->magic = SLUB_MAGIC;
-    obj->next = 0;
-    
-    return obj;
-}
-
-void SLUBAllocator::free_to_page(struct slub_cache * /*cache*/, struct slub_page *page, void *obj) {
-    struct slub_object *slub_obj = (struct slub_object*)obj;
-    slub_obj->magic = 0;
-    slub_obj->next = (struct slub_object*)page->freelist;
-    page->freelist = obj;
-    page->inuse--;
-}
-
-void *SLUBAllocator::cpu_cache_alloc(struct slub_cache *cache) {
-    u32 cpu = get_cpu_id();
-    if (cpu >= SLUB_MAX_CPUS) cpu = 0;
-    
-    struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
-    
-    if (cpu_cache->batch_count > 0) {
-        void *obj = cpu_cache->batch_objects[--cpu_cache->batch_count];
-        return obj;
-    }
-    
-    if (cpu_cache->freelist) {
-        struct slub_object *obj = (struct slub_object*)cpu_cache->freelist;
-        cpu_cache->freelist = obj->next;
-        return obj;
-    }
-    
-    refill_cpu_cache(cache);
-    
-    if (cpu_cache->batch_count > 0) {
-        void *obj = cpu_cache->batch_objects[--cpu_cache->batch_count];
-        return obj;
-    }
-    
-    return 0;
-}
-
-void SLUBAllocator::cpu_cache_free(struct slub_cache *cache, void *obj) {
-    u32 cpu = get_cpu_id();
-    if (cpu >= SLUB_MAX_CPUS) cpu = 0;
-    
-    struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
-    
-    if (cpu_cache->batch_count < SLUB_BATCH_SIZE) {
-        cpu_cache->batch_objects[cpu_cache->batch_count++] = obj;
-        return;
-    }
-    
-    struct slub_object *slub_obj = (struct slub_object*)obj;
-    slub_obj->next = (struct slub_object*)cpu_cache->freelist;
-    cpu_cache->freelist = obj;
-}
-
-void SLUBAllocator::refill_cpu_cache(struct slub_cache *cache) {
-    u32 cpu = get_cpu_id();
-    if (cpu >= SLUB_MAX_CPUS) cpu = 0;
-    
-    struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
-    
-    for (u32 i = 0; i < cpu_cache->batchlimit; i++) {
-        struct slub_page *page = cache->partial_pages;
-        if (!page) {
-            page = alloc_slub_page(cache);
-            if (!page) break;
-        }
-        
-        void *obj = alloc_from_page(cache, page);
-        if (obj) {
-            cpu_cache->batch_objects[cpu_cache->batch_count++] = obj;
-            cache->active_objects++;
-            
-            if (page->inuse == page->objects) {
-                remove_page_from_list(&cache->partial_pages, page);
-                add_page_to_list(&cache->full_pages, page);
-            }
-        }
-    }
-}
-
 u32 SLUBAllocator::calculate_order(u32 size) {
     u32 objects_per_page = PAGE_SIZE / size;
     if (objects_per_page >= SLUB_MIN_OBJECTS) {
@@ -425,7 +462,7 @@ struct slub_cache *SLUBAllocator::find_size_cache(u32 size) {
 }
 
 u32 SLUBAllocator::get_cpu_id() {
-    return current_cpu;
+    return smp_processor_id();
 }
 
 void SLUBAllocator::flush_cpu_caches() {
@@ -436,42 +473,92 @@ void SLUBAllocator::flush_cpu_caches() {
     }
 }
 
-void SLUBAllocator::drain_cpu_cache(struct slub_cache *cache, u32 cpu) {
-    if (cpu >= SLUB_MAX_CPUS) return;
+/*
+ * Empty partial pages, plus every CPU slab: a frozen page looks full from
+ * outside, so count it as a candidate and let shrink() find out.
+ */
+u32 SLUBAllocator::reclaimable_pages() {
+    u32 pages = 0;
     
-    struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
-    
-    while (cpu_cache->batch_count > 0) {
-        void *obj = cpu_cache->batch_objects[--cpu_cache->batch_count];
-        cache_free(cache, obj);
+    for (struct slub_cache *cache = cache_chain; cache; cache = cache->next) {
+        for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+            if (cache->cpu_caches[cpu].page) {
+                pages += 1U << cache->order;
+            }
+        }
+        for (struct slub_page *page = cache->partial_pages; page; page = page->next) {
+            if (page->inuse == 0) {
+                pages += 1U << cache->order;
+            }
+        }
     }
     
-    while (cpu_cache->freelist) {
-        struct slub_object *obj = (struct slub_object*)cpu_cache->freelist;
-        cpu_cache->freelist = obj->next;
-        cache_free(cache, obj);
+    return pages;
+}
+
+/*
+ * Trim each cache's CPU slabs back onto the node lists, then free every
+ * empty partial page, ignoring SLUB_MIN_PARTIAL: under pressure the buddy
+ * needs the pages more than the next allocation needs a warm start.
+ */
+u32 SLUBAllocator::shrink(u32 nr_pages) {
+    u32 freed = 0;
+    
+    for (struct slub_cache *cache = cache_chain; cache && freed < nr_pages; cache = cache->next) {
+        u32 before = cache->total_pages;
+        
+        for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+            drain_cpu_cache(cache, cpu);
+        }
+        
+        u32 irq = local_irq_save();
+        struct slub_page *page = cache->partial_pages;
+        while (page) {
+            struct slub_page *next = page->next;
+            if (page->inuse == 0) {
+                remove_partial(cache, page);
+                free_slub_page(cache, page);
+            }
+            page = next;
+        }
+        local_irq_restore(irq);
+        
+        freed += (before - cache->total_pages) << cache->order;
     }
+    
+    return freed;
+}
+
+void SLUBAllocator::drain_cpu_cache(struct slub_cache *cache, u32 cpu) {
+    if (cpu >= SLUB_MAX_CPUS) return;
+    
+    u32 irq = local_irq_save();
+    deactivate_page(cache, &cache->cpu_caches[cpu]);
+    local_irq_restore(irq);
 }
 
 void SLUBAllocator::add_page_to_list(struct slub_page **list, struct slub_page *page) {
+    page->prev = 0;
     page->next = *list;
+    if (*list) {
+        (*list)->prev = page;
+    }
     *list = page;
 }
 
 void SLUBAllocator::remove_page_from_list(struct slub_page **list, struct slub_page *page) {
-    if (*list == page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
         *list = page->next;
-        return;
     }
     
-    struct slub_page *current = *list;
-    while (current && current->next != page) {
-        current = current->next;
+    if (page->next) {
+        page->next->prev = page->prev;
     }
     
-    if (current) {
-        current->next = page->next;
-    }
+    page->next = 0;
+    page->prev = 0;
 }
 
 void SLUBAllocator::free_slub_page(struct slub_cache *cache, struct slub_page *page) {
@@ -479,7 +566,156 @@ void SLUBAllocator::free_slub_page(struct slub_cache *cache, struct slub_page *p
     cache->total_objects -= page->objects;
     
     buddy_allocator.free(page->page_base);
-    buddy_allocator.free(page);
+    slab_allocator.cache_free(slub_page_cache, page);
+}
+
+/*
+ * footprint is the slab pages the caches hold; used is what live objects
+ * occupy. Objects on a CPU freelist are counted in their frozen page's
+ * inuse but are free, so they are taken back out here.
+ */
+void SLUBAllocator::usage(u32 *footprint, u32 *used) {
+    *footprint = 0;
+    *used = 0;
+    
+    u32 irq = local_irq_save();
+    
+    for (struct slub_cache *cache = cache_chain; cache; cache = cache->next) {
+        u32 live = 0;
+        
+        for (struct slub_page *page = cache->partial_pages; page; page = page->next) {
+            live += page->inuse;
+        }
+        for (struct slub_page *page = cache->full_pages; page; page = page->next) {
+            live += page->inuse;
+        }
+        for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+            struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
+            if (!cpu_cache->page) continue;
+            
+            live += cpu_cache->page->inuse;
+            for (struct slub_object *obj = (struct slub_object*)cpu_cache->freelist; obj; obj = obj->next) {
+                live--;
+            }
+        }
+        
+        *footprint += cache->total_pages * (PAGE_SIZE << cache->order);
+        *used += live * cache->size;
+    }
+    
+    local_irq_restore(irq);
+}
+
+/* Length of a freelist whose objects must all be slots of page; a stray pointer clears ok. */
+u32 SLUBAllocator::count_objects(struct slub_cache *cache, struct slub_page *page, void *list, bool *ok) {
+    u32 count = 0;
+    
+    for (struct slub_object *obj = (struct slub_object*)list; obj; obj = obj->next) {
+        u32 offset = (u32)obj - (u32)page->page_base;
+        if (offset >= page->objects * cache->size || offset % cache->size) {
+            io.print("[SLUB] Validate: %s page %p freelist holds stray pointer %p\n", cache->name, page->page_base, obj);
+            *ok = false;
+            break;
+        }
+        if (++count > page->objects) break;
+    }
+    
+    return count;
+}
+
+bool SLUBAllocator::validate_page(struct slub_cache *cache, struct slub_page *page, bool frozen) {
+    bool ok = true;
+    
+    if (page->cache != cache || page->objects != cache->objects_per_page || page->order != cache->order) {
+        io.print("[SLUB] Validate: %s lists a page of another cache\n", cache->name);
+        return false;
+    }
+    if ((page->frozen != 0) != frozen) {
+        io.print("[SLUB] Validate: %s page %p frozen state is wrong\n", cache->name, page->page_base);
+        ok = false;
+    }
+    
+    struct buddy_page *desc = buddy_allocator.virt_to_page(page->page_base);
+    if (!desc || desc->owner != PAGE_OWNER_SLUB || desc->owner_data != page) {
+        io.print("[SLUB] Validate: %s page %p is not tagged with its slub_page\n", cache->name, page->page_base);
+        ok = false;
+    }
+    
+    u32 free = count_objects(cache, page, page->freelist, &ok);
+    if (page->inuse > page->objects || free != page->objects - page->inuse) {
+        io.print("[SLUB] Validate: %s page %p has %d free objects but %d of %d in use\n",
+                 cache->name, page->page_base, free, page->inuse, page->objects);
+        ok = false;
+    }
+    
+    return ok;
+}
+
+/* Check every page on the node lists and every CPU slab against the counters. */
+bool SLUBAllocator::validate() {
+    bool ok = true;
+    u32 irq = local_irq_save();
+    
+    for (struct slub_cache *cache = cache_chain; cache; cache = cache->next) {
+        u32 pages = 0;
+        u32 partial = 0;
+        struct slub_page *prev = 0;
+        
+        for (struct slub_page *page = cache->partial_pages; page; page = page->next) {
+            if (page->prev != prev) {
+                io.print("[SLUB] Validate: %s partial list has a broken back link\n", cache->name);
+                ok = false;
+            }
+            if (!validate_page(cache, page, false)) ok = false;
+            if (page->inuse == page->objects) {
+                io.print("[SLUB] Validate: %s full page %p is on the partial list\n", cache->name, page->page_base);
+                ok = false;
+            }
+            prev = page;
+            partial++;
+            if (++pages > cache->total_pages) break;
+        }
+        
+        prev = 0;
+        for (struct slub_page *page = cache->full_pages; page; page = page->next) {
+            if (page->prev != prev) {
+                io.print("[SLUB] Validate: %s full list has a broken back link\n", cache->name);
+                ok = false;
+            }
+            if (!validate_page(cache, page, false)) ok = false;
+            if (page->inuse != page->objects) {
+                io.print("[SLUB] Validate: %s page %p with free objects is on the full list\n", cache->name, page->page_base);
+                ok = false;
+            }
+            prev = page;
+            if (++pages > cache->total_pages) break;
+        }
+        
+        for (u32 cpu = 0; cpu < SLUB_MAX_CPUS; cpu++) {
+            struct slub_cpu_cache *cpu_cache = &cache->cpu_caches[cpu];
+            if (!cpu_cache->page) {
+                if (cpu_cache->freelist) {
+                    io.print("[SLUB] Validate: %s CPU %d has objects but no page\n", cache->name, cpu);
+                    ok = false;
+                }
+                continue;
+            }
+            
+            if (!validate_page(cache, cpu_cache->page, true)) ok = false;
+            count_objects(cache, cpu_cache->page, cpu_cache->freelist, &ok);
+            pages++;
+        }
+        
+        if (pages != cache->total_pages || partial != cache->nr_partial ||
+            cache->total_objects != cache->total_pages * cache->objects_per_page) {
+            io.print("[SLUB] Validate: %s counts %d pages, %d partial; found %d pages, %d partial\n",
+                     cache->name, cache->total_pages, cache->nr_partial, pages, partial);
+            ok = false;
+        }
+    }
+    
+    local_irq_restore(irq);
+    return ok;
 }
 
 void SLUBAllocator::print_stats() {
@@ -498,7 +734,7 @@ void SLUBAllocator::print_stats() {
         total_caches++;
         total_pages += cache->total_pages;
         total_objects += cache->total_objects;
-        total_allocated += cache->active_objects;
+        total_allocated += cache->allocations - cache->frees;
         total_allocs += cache->allocations;
         total_frees += cache->frees;
         total_hits += cache->cache_hits;
@@ -512,6 +748,11 @@ void SLUBAllocator::print_stats() {
     io.print("  Allocations: %d\n", total_allocs);
     io.print("  Frees: %d\n", total_frees);
     
+    u32 footprint, used;
+    usage(&footprint, &used);
+    io.print("  Footprint: %d KB, live objects %d KB, waste %d KB\n",
+             footprint / 1024, used / 1024, (footprint - used) / 1024);
+    
     if (total_hits + total_misses > 0) {
         u32 hit_rate = (total_hits * 100) / (total_hits + total_misses);
         io.print("  Cache hit rate: %d%%\n", hit_rate);
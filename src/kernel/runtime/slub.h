@@ -8,19 +8,26 @@
 #define PAGE_SIZE 4096
 #endif
 
-#define SLUB_MAGIC 0x51B41234
 #define SLUB_MAX_CPUS 32
 #define SLUB_ALIGN 16
 #define SLUB_MIN_OBJECTS 16
 #define SLUB_MAX_OBJECTS 64
-#define SLUB_BATCH_SIZE 16
 #define SLUB_MAX_ORDER 3
+#define SLUB_MIN_PARTIAL 2
+
+/* tids advance by a power of two >= SLUB_MAX_CPUS, so tid % step names the CPU. */
+#define SLUB_TID_STEP SLUB_MAX_CPUS
 
 struct slub_object {
     struct slub_object *next;
-    u32 magic;
 };
 
+/*
+ * A slab page. While frozen it belongs to one CPU: that CPU allocates from
+ * its own lockless freelist and freelist here only collects objects freed
+ * by anyone else. inuse counts objects not on this page's freelist, so a
+ * frozen page reports the CPU's share as in use.
+ */
 struct slub_page {
     void *page_base;
     void *freelist;
@@ -28,17 +35,22 @@ struct slub_page {
     u32 objects;
     u32 order;
     struct slub_page *next;
+    struct slub_page *prev;
     struct slub_cache *cache;
     u32 frozen;
 };
 
+/*
+ * freelist and tid are replaced together with cmpxchg8b, so they must stay
+ * adjacent and 8-byte aligned. Every change bumps tid, which lets the fast
+ * path detect that an interrupt (or, later, a migration) got in between
+ * reading the freelist and swapping it.
+ */
 struct slub_cpu_cache {
     void *freelist;
+    u32 tid;
     struct slub_page *page;
-    u32 batch_count;
-    u32 batchlimit;
-    void *batch_objects[SLUB_BATCH_SIZE];
-};
+} __attribute__((aligned(8)));
 
 struct slub_cache {
     struct slub_cache *next;
@@ -54,9 +66,9 @@ struct slub_cache {
     
     struct slub_page *partial_pages;
     struct slub_page *full_pages;
+    u32 nr_partial;
     
     u32 total_pages;
-    u32 active_objects;
     u32 total_objects;
     u32 allocations;
     u32 frees;
@@ -82,31 +94,38 @@ public:
     void cache_free(struct slub_cache *cache, void *obj);
     void *alloc(u32 size);
     void free(void *obj);
+    u32 object_size(void *obj);
     void print_stats();
     void flush_cpu_caches();
-    
+    u32 reclaimable_pages();
+    u32 shrink(u32 nr_pages);
+    void usage(u32 *footprint, u32 *used);
+    bool validate();
+
 private:
     struct slub_cache *cache_chain;
     struct slub_cache *size_caches[16];
-    u32 current_cpu;
     
+    struct slub_page *find_page(void *obj);
     struct slub_page *alloc_slub_page(struct slub_cache *cache);
     void free_slub_page(struct slub_cache *cache, struct slub_page *page);
-    void *alloc_from_page(struct slub_cache *cache, struct slub_page *page);
-    void free_to_page(struct slub_cache *cache, struct slub_page *page, void *obj);
     void init_page_objects(struct slub_cache *cache, struct slub_page *page);
-    void move_page_to_full(struct slub_cache *cache, struct slub_page *page);
-    void move_page_to_partial(struct slub_cache *cache, struct slub_page *page);
+    void *slow_alloc(struct slub_cache *cache);
+    void slow_free(struct slub_cache *cache, struct slub_page *page, void *obj);
+    void freeze_page(struct slub_cpu_cache *cpu_cache, struct slub_page *page);
+    void deactivate_page(struct slub_cache *cache, struct slub_cpu_cache *cpu_cache);
+    struct slub_page *get_partial(struct slub_cache *cache);
+    void add_partial(struct slub_cache *cache, struct slub_page *page);
+    void remove_partial(struct slub_cache *cache, struct slub_page *page);
     void remove_page_from_list(struct slub_page **list, struct slub_page *page);
     void add_page_to_list(struct slub_page **list, struct slub_page *page);
     u32 calculate_order(u32 size);
     u32 calculate_objects_per_page(u32 obj_size, u32 order);
     struct slub_cache *find_size_cache(u32 size);
     u32 get_cpu_id();
-    void *cpu_cache_alloc(struct slub_cache *cache);
-    void cpu_cache_free(struct slub_cache *cache, void *obj);
-    void refill_cpu_cache(struct slub_cache *cache);
     void drain_cpu_cache(struct slub_cache *cache, u32 cpu);
+    u32 count_objects(struct slub_cache *cache, struct slub_page *page, void *list, bool *ok);
+    bool validate_page(struct slub_cache *cache, struct slub_page *page, bool frozen);
 };
 
 extern SLUBAllocator slub_allocator;
@@ -1,5 +1,6 @@
 #include <runtime/stack.h>
 #include <runtime/alloc.h>
+#include <runtime/buddy.h>
 #include <runtime/os.h>
 
 extern "C" {
@@ -31,7 +32,7 @@ void StackAllocator::init(u32 initial_size) {
     
     frame_list = current_frame;
     checkpoint_stack = nullptr;
-    total_capacity = initial_size;
+    total_capacity = current_frame->size;
     frame_count = 1;
     overflow_detection = true;
     underflow_detection = true;
@@ -131,12 +132,16 @@ void StackAllocator::free_to_checkpoint(struct stack_checkpoint *checkpoint) {
     }
 }
 
+/* Back to the first frame; frames grown since stay linked and are reused before anything new is allocated. */
 void StackAllocator::reset() {
     if (!initialized) {
         return;
     }
     
-    current_frame->current = current_frame->start;
+    for (struct stack_frame *frame = frame_list; frame; frame = frame->next) {
+        frame->current = frame->start;
+    }
+    current_frame = frame_list;
     stats.total_freed_bytes += stats.current_usage;
     stats.current_usage = 0;
     
@@ -211,6 +216,28 @@ void StackAllocator::destroy_checkpoint(struct stack_checkpoint *checkpoint) {
     }
 }
 
+struct stack_mark StackAllocator::mark() const {
+    struct stack_mark m;
+    m.frame = initialized ? current_frame : nullptr;
+    m.pos = initialized ? current_frame->current : nullptr;
+    return m;
+}
+
+/* Unwind to a mark; frames grown after it become spares, like after reset(). */
+void StackAllocator::release(const struct stack_mark &mark) {
+    if (!initialized || !mark.frame) {
+        return;
+    }
+    
+    u32 before = bytes_in_use();
+    current_frame = mark.frame;
+    current_frame->current = mark.pos;
+    u32 freed = before - bytes_in_use();
+    
+    stats.current_usage = (stats.current_usage > freed) ? stats.current_usage - freed : 0;
+    stats.total_freed_bytes += freed;
+}
+
 void *StackAllocator::get_top() const {
     return initialized ? current_frame->current : nullptr;
 }
@@ -298,6 +325,13 @@ bool StackAllocator::grow(u32 additional_size) {
         return false;
     }
     
+    if (current_frame->next && current_frame->next->size >= additional_size) {
+        current_frame = current_frame->next;
+        current_frame->current = current_frame->start;
+        return true;
+    }
+    free_frames_after(current_frame);
+    
     u32 new_frame_size = additional_size;
     if (new_frame_size < current_frame->size * 2) {
         new_frame_size = current_frame->size * 2;
@@ -314,7 +348,7 @@ bool StackAllocator::grow(u32 additional_size) {
     
     link_frame(new_frame);
     current_frame = new_frame;
-    total_capacity += new_frame_size;
+    total_capacity += new_frame->size;
     frame_count++;
     
     return true;
@@ -341,12 +375,15 @@ bool StackAllocator::shrink_to_fit() {
     return true;
 }
 
+/* The frame gets the whole buddy block, so at least size bytes and often more. */
 struct stack_frame *StackAllocator::allocate_frame(u32 size) {
-    u32 total_size = sizeof(struct stack_frame) + size;
-    void *memory = kmalloc(total_size);
+    u32 order = buddy_allocator.get_order(sizeof(struct stack_frame) + size);
+    void *memory = buddy_allocator.alloc_order(order);
     if (!memory) {
         return nullptr;
     }
+    size = (MIN_BLOCK_SIZE << order) - sizeof(struct stack_frame);
+    buddy_allocator.set_page_owner(memory, PAGE_OWNER_STACK, memory);
     
     struct stack_frame *frame = static_cast<struct stack_frame*>(memory);
     frame->start = static_cast<u8*>(memory) + sizeof(struct stack_frame);
@@ -368,7 +405,7 @@ void StackAllocator::deallocate_frame(struct stack_frame *frame) {
     
     frame->magic = 0;
     frame->canary = 0;
-    kfree(frame);
+    buddy_allocator.free(frame);
 }
 
 bool StackAllocator::validate_frame(struct stack_frame *frame) const {
@@ -427,6 +464,31 @@ void StackAllocator::unlink_frame(struct stack_frame *frame) {
     frame->prev = nullptr;
 }
 
+/* Bytes handed out from the first frame up to the current one, alignment padding included. */
+u32 StackAllocator::bytes_in_use() const {
+    u32 bytes = 0;
+    
+    for (struct stack_frame *frame = frame_list; frame; frame = frame->next) {
+        bytes += static_cast<u8*>(frame->current) - static_cast<u8*>(frame->start);
+        if (frame == current_frame) {
+            break;
+        }
+    }
+    
+    return bytes;
+}
+
+/* Spares too small for the next growth are given back rather than kept alongside a bigger frame. */
+void StackAllocator::free_frames_after(struct stack_frame *frame) {
+    while (frame->next) {
+        struct stack_frame *spare = frame->next;
+        unlink_frame(spare);
+        total_capacity -= spare->size;
+        frame_count--;
+        deallocate_frame(spare);
+    }
+}
+
 void *StackAllocator::align_pointer(void *ptr, u32 alignment) const {
     uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
     return reinterpret_cast<void*>((addr + alignment - 1) & ~(alignment - 1));
@@ -451,17 +513,16 @@ void StackAllocator::detect_corruption() {
 }
 
 ScopedStackAllocator::ScopedStackAllocator(StackAllocator *allocator)
-    : allocator(allocator), checkpoint(nullptr), active(false) {
-    if (allocator) {
-        checkpoint = allocator->create_checkpoint();
-        active = (checkpoint != nullptr);
+    : allocator(allocator), active(false) {
+    if (allocator && allocator->is_initialized()) {
+        saved = allocator->mark();
+        active = true;
     }
 }
 
 ScopedStackAllocator::~ScopedStackAllocator() {
-    if (active && allocator && checkpoint) {
-        allocator->restore_checkpoint(checkpoint);
-        allocator->destroy_checkpoint(checkpoint);
+    if (active) {
+        allocator->release(saved);
     }
 }
 
@@ -28,6 +28,12 @@ struct stack_checkpoint {
     struct stack_checkpoint *prev;
 };
 
+/* A position to unwind to, kept by the caller; taking one allocates nothing. */
+struct stack_mark {
+    struct stack_frame *frame;
+    void *pos;
+};
+
 struct stack_stats {
     u32 total_allocations;
     u32 peak_usage;
@@ -55,6 +61,9 @@ public:
     void restore_checkpoint(struct stack_checkpoint *checkpoint);
     void destroy_checkpoint(struct stack_checkpoint *checkpoint);
     
+    struct stack_mark mark() const;
+    void release(const struct stack_mark &mark);
+    
     void *get_top() const;
     u32 get_used_bytes() const;
     u32 get_free_bytes() const;
@@ -62,6 +71,7 @@ public:
     f32 get_usage_percent() const;
     
     bool is_valid_ptr(void *ptr) const;
+    bool is_initialized() const { return initialized; }
     bool check_integrity() const;
     void print_stats() const;
     void reset_stats();
@@ -96,8 +106,16 @@ private:
     u32 align_size(u32 size, u32 alignment) const;
     void update_peak_usage();
     void detect_corruption();
+    u32 bytes_in_use() const;
+    void free_frames_after(struct stack_frame *frame);
 };
 
+/*
+ * Everything allocated through a scope is released when it goes out of
+ * scope. Scopes nest and need not be the only users of the allocator, as
+ * long as they unwind in order; they cost two words on the C++ stack and
+ * no allocation.
+ */
 class ScopedStackAllocator {
 public:
     explicit ScopedStackAllocator(StackAllocator *allocator);
@@ -108,7 +126,7 @@ public:
     
 private:
     StackAllocator *allocator;
-    struct stack_checkpoint *checkpoint;
+    struct stack_mark saved;
     bool active;
 };
 
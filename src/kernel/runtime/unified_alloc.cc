@@ -1,5 +1,7 @@
 #include <os.h>
 #include <runtime/unified_alloc.h>
+#include <runtime/object_pool.h>
+#include <runtime/heapprof.h>
 
 extern "C" {
     void *memset(void *s, int c, int n);
@@ -8,6 +10,54 @@ extern "C" {
 
 UnifiedAllocator unified_allocator;
 
+static u32 owner_to_policy(u8 owner) {
+    switch (owner) {
+        case PAGE_OWNER_BUDDY: return ALLOC_POLICY_BUDDY;
+        case PAGE_OWNER_SLAB: return ALLOC_POLICY_SLAB;
+        case PAGE_OWNER_SLUB: return ALLOC_POLICY_SLUB;
+        case PAGE_OWNER_SLOB: return ALLOC_POLICY_SLOB;
+        case PAGE_OWNER_STACK: return ALLOC_POLICY_STACK;
+    }
+    return 0;
+}
+
+static const u32 frag_backend_policy[FRAG_NR_BACKENDS] = {
+    ALLOC_POLICY_SLAB, ALLOC_POLICY_SLUB, ALLOC_POLICY_SLOB
+};
+
+static u32 policy_to_backend(u32 policy) {
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        if (frag_backend_policy[b] == policy) return b;
+    }
+    return FRAG_NR_BACKENDS;
+}
+
+static const char *policy_name(u32 policy) {
+    switch (policy) {
+        case ALLOC_POLICY_SLAB: return "slab";
+        case ALLOC_POLICY_SLUB: return "SLUB";
+        case ALLOC_POLICY_SLOB: return "SLOB";
+        case ALLOC_POLICY_STACK: return "stack";
+    }
+    return "buddy";
+}
+
+static void backend_usage(u32 backend, u32 *footprint, u32 *used) {
+    switch (backend) {
+        case FRAG_SLAB: slab_allocator.usage(footprint, used); break;
+        case FRAG_SLUB: slub_allocator.usage(footprint, used); break;
+        default: slob_allocator.usage(footprint, used); break;
+    }
+}
+
+/* Share of footprint not holding live objects, in percent. */
+static u32 waste_of(u32 footprint, u32 used) {
+    if (footprint < 100 || used >= footprint) return 0;
+    
+    u32 waste = (footprint - used) / (footprint / 100);
+    return waste < 100 ? waste : 100;
+}
+
 void UnifiedAllocator::init(enum system_mode mode) {
     io.print("[UNIFIED] Initializing unified allocator in %s mode\n", 
              mode == SYS_MODE_EMBEDDED ? "embedded" :
@@ -15,41 +65,61 @@ void UnifiedAllocator::init(enum system_mode mode) {
              mode == SYS_MODE_SERVER ? "server" : "realtime");
     
     current_mode = mode;
-    debug_tracking = false;
-    debug_table = 0;
-    debug_table_size = 0;
-    debug_entries = 0;
     
     memset(&stats, 0, sizeof(stats));
     
+    /* The mode's table is also where ALLOC_POLICY_AUTO starts from. */
     switch (mode) {
         case SYS_MODE_EMBEDDED:
             policy_mask = ALLOC_POLICY_SLOB | ALLOC_POLICY_BUDDY | ALLOC_POLICY_STACK;
+            small_policy = ALLOC_POLICY_SLOB;
+            medium_policy = ALLOC_POLICY_BUDDY;
             break;
         case SYS_MODE_DESKTOP:
             policy_mask = ALLOC_POLICY_SLAB | ALLOC_POLICY_BUDDY | ALLOC_POLICY_STACK | ALLOC_POLICY_AUTO;
+            small_policy = ALLOC_POLICY_SLAB;
+            medium_policy = ALLOC_POLICY_SLAB;
             break;
         case SYS_MODE_SERVER:
             policy_mask = ALLOC_POLICY_SLUB | ALLOC_POLICY_BUDDY | ALLOC_POLICY_STACK | ALLOC_POLICY_AUTO;
+            small_policy = ALLOC_POLICY_SLUB;
+            medium_policy = ALLOC_POLICY_SLUB;
             break;
         case SYS_MODE_REALTIME:
             policy_mask = ALLOC_POLICY_SLAB | ALLOC_POLICY_BUDDY | ALLOC_POLICY_STACK;
+            small_policy = ALLOC_POLICY_SLAB;
+            medium_policy = ALLOC_POLICY_BUDDY;
             break;
     }
     
+    allocs_since_check = 0;
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        waste_percent[b] = 0;
+    }
+    
     io.print("[UNIFIED] Policy mask: 0x%x\n", policy_mask);
 }
 
-void *UnifiedAllocator::alloc(u32 size, u32 flags) {
+/* caller is who to charge the allocation to in the heap profile; by default our own caller. */
+void *UnifiedAllocator::alloc(u32 size, u32 flags, void *caller) {
     if (size == 0) return 0;
     
+    if ((policy_mask & ALLOC_POLICY_AUTO) && ++allocs_since_check >= FRAG_CHECK_INTERVAL) {
+        allocs_since_check = 0;
+        if (should_switch_policy()) {
+            adjust_policy_for_workload();
+        }
+    }
+    
     u32 allocator = select_allocator(size, flags);
     void *ptr = internal_alloc(size, flags, allocator);
     
     if (ptr) {
-        update_stats(size, allocator, true);
-        if (debug_tracking) {
-            track_allocation(ptr, size, flags, allocator);
+        /* internal_alloc may have fallen back to the buddy; the page knows. */
+        allocator = owner_to_policy(buddy_allocator.virt_to_page(ptr)->owner);
+        update_stats(usable_size(ptr), allocator, true);
+        if (heap_profiler.enabled()) {
+            heap_profiler.record_alloc(ptr, size, caller ? caller : __builtin_return_address(0));
         }
         
         if (flags & ALLOC_FLAG_ZERO) {
@@ -60,27 +130,73 @@ void *UnifiedAllocator::alloc(u32 size, u32 flags) {
     return ptr;
 }
 
+/*
+ * Every page handed out by a backend is tagged with its owner, so kfree()
+ * never has to guess where a pointer came from. Object pool slots are not
+ * kmalloc memory and go straight back to their pool.
+ */
 void UnifiedAllocator::free(void *ptr) {
     if (!ptr) return;
     
-    u32 allocator_hint = 0;
-    struct allocation_metadata *meta = 0;
+    struct buddy_page *page = buddy_allocator.virt_to_page(ptr);
+    if (page && page->owner == PAGE_OWNER_POOL) {
+        PoolBase::release(ptr);
+        return;
+    }
+    
+    u32 allocator = page ? owner_to_policy(page->owner) : 0;
+    if (!allocator) {
+        io.print("[UNIFIED] Error: free of unowned pointer %p\n", ptr);
+        return;
+    }
     
-    if (debug_tracking) {
-        meta = find_allocation(ptr);
-        if (meta) {
-            allocator_hint = meta->allocator_used;
-            update_stats(meta->size, allocator_hint, false);
-            untrack_allocation(ptr);
+    update_stats(usable_size(ptr), allocator, false);
+    if (heap_profiler.enabled()) {
+        heap_profiler.record_free(ptr);
+    }
+    
+    internal_free(ptr, allocator);
+}
+
+/*
+ * Bytes usable at ptr: the object size of its slab/SLUB cache, the SLOB
+ * block size, the whole buddy block, what is left of a stack frame, or
+ * an object pool's slot size.
+ */
+u32 UnifiedAllocator::usable_size(void *ptr) {
+    struct buddy_page *page = buddy_allocator.virt_to_page(ptr);
+    if (!page) return 0;
+    
+    switch (page->owner) {
+        case PAGE_OWNER_SLAB: {
+            struct slab *slab = slab_allocator.virt_to_slab(ptr);
+            return slab ? slab->cache->obj_size : 0;
+        }
+        case PAGE_OWNER_SLUB:
+            return slub_allocator.object_size(ptr);
+        case PAGE_OWNER_SLOB:
+            return slob_allocator.object_size(ptr);
+        case PAGE_OWNER_STACK: {
+            struct stack_frame *frame = (struct stack_frame*)page->owner_data;
+            return (u32)frame->end - (u32)ptr;
         }
+        case PAGE_OWNER_POOL:
+            return ((struct pool_chunk*)page->owner_data)->pool->object_size();
+        case PAGE_OWNER_BUDDY:
+            if (page->flags & BUDDY_PAGE_HEAD) {
+                return PAGE_SIZE << page->order;
+            }
+            return 0;
     }
     
-    internal_free(ptr, allocator_hint);
+    return 0;
 }
 
-void *UnifiedAllocator::realloc(void *ptr, u32 new_size) {
+void *UnifiedAllocator::realloc(void *ptr, u32 new_size, void *caller) {
+    if (!caller) caller = __builtin_return_address(0);
+    
     if (!ptr) {
-        return alloc(new_size);
+        return alloc(new_size, 0, caller);
     }
     
     if (new_size == 0) {
@@ -88,10 +204,26 @@ void *UnifiedAllocator::realloc(void *ptr, u32 new_size) {
         return 0;
     }
     
-    struct allocation_metadata *meta = find_allocation(ptr);
-    u32 old_size = meta ? meta->size : 0;
+    struct buddy_page *page = buddy_allocator.virt_to_page(ptr);
+    u32 old_size = usable_size(ptr);
     
-    void *new_ptr = alloc(new_size);
+    /*
+     * Stay put when the object's size class still fits, or when a buddy
+     * block can split off or absorb free buddies. Scoped memory always moves.
+     */
+    if (page && page->owner == PAGE_OWNER_BUDDY) {
+        if (new_size <= (PAGE_SIZE << MAX_ORDER) &&
+            buddy_allocator.resize(ptr, buddy_allocator.get_order(new_size))) {
+            stats.bytes_freed += old_size;
+            stats.bytes_allocated += usable_size(ptr);
+            heap_profiler.record_resize(ptr, new_size);
+            return ptr;
+        }
+    } else if (page && page->owner != PAGE_OWNER_STACK && new_size <= old_size) {
+        return ptr;
+    }
+    
+    void *new_ptr = alloc(new_size, 0, caller);
     if (!new_ptr) {
         return 0;
     }
@@ -105,13 +237,13 @@ void *UnifiedAllocator::realloc(void *ptr, u32 new_size) {
     return new_ptr;
 }
 
-void *UnifiedAllocator::calloc(u32 count, u32 size) {
+void *UnifiedAllocator::calloc(u32 count, u32 size, void *caller) {
     u32 total_size = count * size;
     if (total_size / count != size) {
         return 0;
     }
     
-    return alloc(total_size, ALLOC_FLAG_ZERO);
+    return alloc(total_size, ALLOC_FLAG_ZERO, caller ? caller : __builtin_return_address(0));
 }
 
 u32 UnifiedAllocator::select_allocator(u32 size, u32 flags) {
@@ -125,25 +257,31 @@ u32 UnifiedAllocator::select_allocator(u32 size, u32 flags) {
         return ALLOC_POLICY_BUDDY;
     }
     
+    if (policy_mask & ALLOC_POLICY_AUTO) {
+        if (type <= ALLOC_SMALL) return small_policy;
+        if (type == ALLOC_MEDIUM) return medium_policy;
+        return ALLOC_POLICY_BUDDY;
+    }
+    
     switch (current_mode) {
         case SYS_MODE_EMBEDDED:
             if (type <= ALLOC_SMALL && (policy_mask & ALLOC_POLICY_SLOB)) {
                 return ALLOC_POLICY_SLOB;
             }
             return ALLOC_POLICY_BUDDY;
-            
+        
         case SYS_MODE_DESKTOP:
             if (type <= ALLOC_MEDIUM && (policy_mask & ALLOC_POLICY_SLAB)) {
                 return ALLOC_POLICY_SLAB;
             }
             return ALLOC_POLICY_BUDDY;
-            
+        
         case SYS_MODE_SERVER:
             if (type <= ALLOC_MEDIUM && (policy_mask & ALLOC_POLICY_SLUB)) {
                 return ALLOC_POLICY_SLUB;
             }
             return ALLOC_POLICY_BUDDY;
-            
+        
         case SYS_MODE_REALTIME:
             if (type <= ALLOC_SMALL && (policy_mask & ALLOC_POLICY_SLAB)) {
                 return ALLOC_POLICY_SLAB;
@@ -161,55 +299,55 @@ void *UnifiedAllocator::internal_alloc(u32 size, u32 /*flags*/, u32 preferred_al
         case ALLOC_POLICY_SLOB:
             ptr = slob_allocator.alloc(size);
             break;
-            
+        
         case ALLOC_POLICY_SLAB:
             ptr = slab_allocator.kmem_cache_alloc(size);
             break;
-            
+        
         case ALLOC_POLICY_SLUB:
             ptr = slub_allocator.alloc(size);
             break;
-            
+        
         case ALLOC_POLICY_STACK:
             ptr = global_stack_allocator.alloc(size);
             break;
-            
+        
         case ALLOC_POLICY_BUDDY:
         default:
-            u32 order = buddy_allocator.get_order(size);
-            ptr = buddy_allocator.alloc(PAGE_SIZE << order);
+            ptr = buddy_allocator.alloc(size);
+            if (ptr) {
+                buddy_allocator.set_page_owner(ptr, PAGE_OWNER_BUDDY);
+            }
             break;
     }
     
     if (!ptr && preferred_allocator != ALLOC_POLICY_BUDDY) {
-        u32 order = buddy_allocator.get_order(size);
-        ptr = buddy_allocator.alloc(PAGE_SIZE << order);
+        ptr = buddy_allocator.alloc(size);
         if (ptr) {
-            preferred_allocator = ALLOC_POLICY_BUDDY;
+            buddy_allocator.set_page_owner(ptr, PAGE_OWNER_BUDDY);
         }
     }
     
     return ptr;
 }
 
-void UnifiedAllocator::internal_free(void *ptr, u32 allocator_hint) {
-    if (allocator_hint == ALLOC_POLICY_SLOB) {
-        slob_allocator.free(ptr);
-    } else if (allocator_hint == ALLOC_POLICY_SLAB) {
-        slab_allocator.kmem_cache_free(ptr);
-    } else if (allocator_hint == ALLOC_POLICY_SLUB) {
-        slub_allocator.free(ptr);
-    } else {
-        slob_allocator.free(ptr);
-        if (!ptr) {
+void UnifiedAllocator::internal_free(void *ptr, u32 allocator) {
+    switch (allocator) {
+        case ALLOC_POLICY_SLOB:
+            slob_allocator.free(ptr);
+            break;
+        case ALLOC_POLICY_SLAB:
             slab_allocator.kmem_cache_free(ptr);
-            if (!ptr) {
-                slub_allocator.free(ptr);
-                if (!ptr) {
-                    buddy_allocator.free(ptr);
-                }
-            }
-        }
+            break;
+        case ALLOC_POLICY_SLUB:
+            slub_allocator.free(ptr);
+            break;
+        case ALLOC_POLICY_STACK:
+            /* Released with its frame by stack_reset()/stack_restore(). */
+            break;
+        case ALLOC_POLICY_BUDDY:
+            buddy_allocator.free(ptr);
+            break;
     }
 }
 
@@ -237,54 +375,25 @@ void UnifiedAllocator::update_stats(u32 size, u32 allocator, bool is_alloc) {
     }
 }
 
-void UnifiedAllocator::track_allocation(void *ptr, u32 size, u32 flags, u32 allocator) {
-    if (!debug_table || debug_entries >= debug_table_size) {
-        return;
-    }
-    
-    struct allocation_metadata *meta = &debug_table[debug_entries++];
-    meta->size = size;
-    meta->flags = flags;
-    meta->allocator_used = allocator;
-    meta->timestamp = 0;
-    meta->original_ptr = ptr;
-}
-
-void UnifiedAllocator::untrack_allocation(void *ptr) {
-    for (u32 i = 0; i < debug_entries; i++) {
-        if (debug_table[i].original_ptr == ptr) {
-            debug_table[i] = debug_table[--debug_entries];
-            return;
-        }
-    }
-}
-
-struct allocation_metadata *UnifiedAllocator::find_allocation(void *ptr) {
-    for (u32 i = 0; i < debug_entries; i++) {
-        if (debug_table[i].original_ptr == ptr) {
-            return &debug_table[i];
-        }
-    }
-    return 0;
-}
-
-void UnifiedAllocator::enable_debug_tracking() {
-    if (!debug_table) {
-        debug_table_size = 1024;
-        debug_table = (struct allocation_metadata*)buddy_allocator.alloc(
-            debug_table_size * sizeof(struct allocation_metadata));
-    }
-    debug_tracking = true;
-    io.print("[UNIFIED] Debug tracking enabled\n");
+void UnifiedAllocator::enable_debug_tracking(u32 sample_rate) {
+    heap_profiler.enable(sample_rate);
 }
 
 void UnifiedAllocator::disable_debug_tracking() {
-    debug_tracking = false;
+    heap_profiler.disable();
     io.print("[UNIFIED] Debug tracking disabled\n");
 }
 
+void UnifiedAllocator::dump_allocations() {
+    heap_profiler.print();
+}
+
 void *UnifiedAllocator::alloc_pages(u32 order, u32 /*flags*/) {
-    return buddy_allocator.alloc(PAGE_SIZE << order);
+    void *ptr = buddy_allocator.alloc_order(order);
+    if (ptr) {
+        buddy_allocator.set_page_owner(ptr, PAGE_OWNER_BUDDY);
+    }
+    return ptr;
 }
 
 void UnifiedAllocator::free_pages(void *ptr, u32 /*order*/) {
@@ -327,12 +436,171 @@ void UnifiedAllocator::print_stats() {
         io.print("  Cache hit rate: %d%%\n", hit_rate);
     }
     
+    if (policy_mask & ALLOC_POLICY_AUTO) {
+        io.print("  Auto policy: small from %s, medium from %s\n", policy_name(small_policy), policy_name(medium_policy));
+    }
+    
     u32 fragmentation = calculate_fragmentation();
     io.print("  Estimated fragmentation: %d%%\n", fragmentation);
 }
 
+/*
+ * Measure every backend. Waste is only recorded for the backends serving
+ * new requests: one that was switched away from keeps the figure it had
+ * while in use, instead of looking worse and worse as its leftovers are
+ * freed.
+ */
+void UnifiedAllocator::measure_fragmentation(struct frag_report *report) {
+    for (u32 order = 0; order <= MAX_ORDER; order++) {
+        report->buddy_index[order] = buddy_allocator.unusable_index(order);
+    }
+    report->buddy_free_pages = buddy_allocator.nr_free_pages() - buddy_allocator.nr_pcp_pages();
+    
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        backend_usage(b, &report->footprint[b], &report->used[b]);
+        
+        bool serving = frag_backend_policy[b] == small_policy || frag_backend_policy[b] == medium_policy;
+        if (serving && report->footprint[b] >= FRAG_MIN_FOOTPRINT) {
+            waste_percent[b] = waste_of(report->footprint[b], report->used[b]);
+        }
+    }
+    
+    slob_allocator.free_distribution(&report->slob_free);
+}
+
+/*
+ * Share of the memory the allocators manage that is neither holding live
+ * objects nor usable for an order FRAG_COSTLY_ORDER block: backend waste
+ * plus the unusable part of the buddy's free pages.
+ */
 u32 UnifiedAllocator::calculate_fragmentation() {
-    return 0;
+    struct frag_report report;
+    measure_fragmentation(&report);
+    
+    u32 total_kb = 0;
+    u32 waste_kb = 0;
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        total_kb += report.footprint[b] / 1024;
+        if (report.used[b] < report.footprint[b]) {
+            waste_kb += (report.footprint[b] - report.used[b]) / 1024;
+        }
+    }
+    
+    u32 free_kb = report.buddy_free_pages * (PAGE_SIZE / 1024);
+    total_kb += free_kb;
+    waste_kb += free_kb * report.buddy_index[FRAG_COSTLY_ORDER] / FRAG_INDEX_SCALE;
+    
+    stats.fragmentation_percent = total_kb ? waste_kb * 100 / total_kb : 0;
+    return stats.fragmentation_percent;
+}
+
+/* Cheap enough for every FRAG_CHECK_INTERVAL allocations: one buddy index and the serving backends' usage. */
+bool UnifiedAllocator::should_switch_policy() {
+    if (buddy_allocator.unusable_index(FRAG_COSTLY_ORDER) > FRAG_INDEX_HIGH) {
+        return true;
+    }
+    
+    u32 serving[2] = { policy_to_backend(small_policy), policy_to_backend(medium_policy) };
+    for (u32 i = 0; i < 2; i++) {
+        if (serving[i] >= FRAG_NR_BACKENDS) continue;
+        
+        u32 footprint, used;
+        backend_usage(serving[i], &footprint, &used);
+        if (footprint >= FRAG_MIN_FOOTPRINT && waste_of(footprint, used) > FRAG_WASTE_HIGH) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/*
+ * The backend in candidates (a mask of FRAG_* bits) that last wasted the
+ * least, staying with current unless another beat it by the margin. A
+ * backend that has never served counts as wasting nothing, so it gets
+ * tried before the policy settles.
+ */
+u32 UnifiedAllocator::pick_backend(u32 current, u32 candidates) {
+    u32 best = policy_to_backend(current);
+    if (best < FRAG_NR_BACKENDS && !(candidates & (1U << best))) {
+        best = FRAG_NR_BACKENDS;
+    }
+    
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        if (!(candidates & (1U << b)) || b == best) continue;
+        if (best == FRAG_NR_BACKENDS || waste_percent[b] + FRAG_WASTE_MARGIN <= waste_percent[best]) {
+            best = b;
+        }
+    }
+    
+    return best < FRAG_NR_BACKENDS ? frag_backend_policy[best] : current;
+}
+
+void UnifiedAllocator::adjust_policy_for_workload() {
+    struct frag_report report;
+    measure_fragmentation(&report);
+    
+    /* Free memory is there but in pieces: hand back what the caches hold so buddies can merge again. */
+    if (report.buddy_index[FRAG_COSTLY_ORDER] > FRAG_INDEX_HIGH) {
+        mag_purge_all();
+        slub_allocator.flush_cpu_caches();
+        slab_allocator.cache_reap();
+        buddy_allocator.drain_pages();
+    }
+    
+    /* SLOB only takes requests up to SLOB_MAX_ALLOC, so medium sizes choose between the caches. */
+    u32 small = pick_backend(small_policy, (1U << FRAG_SLAB) | (1U << FRAG_SLUB) | (1U << FRAG_SLOB));
+    u32 medium = pick_backend(medium_policy, (1U << FRAG_SLAB) | (1U << FRAG_SLUB));
+    
+    if (small != small_policy || medium != medium_policy) {
+        io.print("[UNIFIED] Fragmentation: small objects %s -> %s, medium %s -> %s\n",
+                 policy_name(small_policy), policy_name(small), policy_name(medium_policy), policy_name(medium));
+        small_policy = small;
+        medium_policy = medium;
+        stats.policy_switches++;
+    }
+}
+
+/*
+ * Hand the policy to ALLOC_POLICY_AUTO and act on a fresh measurement now
+ * instead of at the next check interval.
+ */
+void UnifiedAllocator::optimize_for_workload() {
+    if (!(policy_mask & ALLOC_POLICY_AUTO)) {
+        set_policy(policy_mask | ALLOC_POLICY_AUTO);
+    }
+    
+    adjust_policy_for_workload();
+    
+    io.print("[UNIFIED] Small objects from %s, medium from %s; %d percent fragmented\n",
+             policy_name(small_policy), policy_name(medium_policy), calculate_fragmentation());
+}
+
+void UnifiedAllocator::print_fragmentation() {
+    static const char *names[FRAG_NR_BACKENDS] = { "Slab", "SLUB", "SLOB" };
+    struct frag_report report;
+    measure_fragmentation(&report);
+    
+    io.print("[UNIFIED] Fragmentation:\n");
+    io.print("  Buddy: %d free pages, unusable index (of %d) by order:", report.buddy_free_pages, FRAG_INDEX_SCALE);
+    for (u32 order = 0; order <= MAX_ORDER; order++) {
+        io.print(" %d", report.buddy_index[order]);
+    }
+    io.print("\n");
+    
+    for (u32 b = 0; b < FRAG_NR_BACKENDS; b++) {
+        io.print("  %s: %d KB held, %d KB live, %d percent waste (last serving: %d)\n",
+                 names[b], report.footprint[b] / 1024, report.used[b] / 1024,
+                 waste_of(report.footprint[b], report.used[b]), waste_percent[b]);
+    }
+    
+    io.print("  SLOB free blocks:");
+    for (u32 i = 0; i < SLOB_FREE_CLASSES; i++) {
+        io.print(" %d", report.slob_free.blocks[i]);
+    }
+    io.print(", largest %d, %d bytes too small for %d\n",
+             report.slob_free.largest, report.slob_free.unusable, SLOB_MAX_ALLOC);
+    io.print("  Overall: %d percent\n", calculate_fragmentation());
 }
 
 void *UnifiedAllocator::stack_alloc(u32 size, u32 flags) {
@@ -351,13 +619,31 @@ void UnifiedAllocator::stack_restore(void *checkpoint) {
     global_stack_allocator.restore_checkpoint(static_cast<struct stack_checkpoint*>(checkpoint));
 }
 
+/* Walk every backend's structures; each reports what it finds wrong itself. */
 bool UnifiedAllocator::validate_heap() {
-    return true;
+    bool ok = buddy_allocator.validate();
+    
+    if (!slab_allocator.validate()) ok = false;
+    if (!slub_allocator.validate()) ok = false;
+    if (!slob_allocator.validate()) ok = false;
+    if (!global_stack_allocator.check_integrity()) {
+        io.print("[STACK] Validate: current frame is corrupt\n");
+        ok = false;
+    }
+    
+    if (!ok) {
+        io.print("[UNIFIED] Heap validation failed\n");
+    }
+    return ok;
 }
 
 extern "C" {
 void *kmalloc_flags(u32 size, u32 flags) {
-    return unified_allocator.alloc(size, flags);
+    return unified_allocator.alloc(size, flags, __builtin_return_address(0));
+}
+
+u32 ksize(void *ptr) {
+    return ptr ? unified_allocator.usable_size(ptr) : 0;
 }
 
 void *get_free_pages(u32 order) {
@@ -397,10 +683,10 @@ void kstack_restore(void *checkpoint) {
 }
 
 void *kmalloc_temp(u32 size) {
-    return unified_allocator.alloc(size, ALLOC_FLAG_TEMP);
+    return unified_allocator.alloc(size, ALLOC_FLAG_TEMP, __builtin_return_address(0));
 }
 
 void *kmalloc_scoped(u32 size) {
-    return unified_allocator.alloc(size, ALLOC_FLAG_SCOPED);
+    return unified_allocator.alloc(size, ALLOC_FLAG_SCOPED, __builtin_return_address(0));
 }
 }
\ No newline at end of file
@@ -27,6 +27,29 @@
 #define ALLOC_FLAG_TEMP     0x20
 #define ALLOC_FLAG_SCOPED   0x40
 
+/*
+ * ALLOC_POLICY_AUTO re-measures fragmentation every FRAG_CHECK_INTERVAL
+ * allocations. It acts when the backend serving small objects wastes more
+ * than FRAG_WASTE_HIGH percent of its pages, or when more than
+ * FRAG_INDEX_HIGH thousandths of free memory is unusable for an order
+ * FRAG_COSTLY_ORDER block. A backend only replaces another if it wasted at
+ * least FRAG_WASTE_MARGIN points less, and waste is only judged once a
+ * backend holds FRAG_MIN_FOOTPRINT bytes, so an idle heap's fixed
+ * overhead (a slab per cache) does not count against it.
+ */
+#define FRAG_CHECK_INTERVAL 1024
+#define FRAG_COSTLY_ORDER   3
+#define FRAG_INDEX_HIGH     700
+#define FRAG_WASTE_HIGH     40
+#define FRAG_WASTE_MARGIN   10
+#define FRAG_MIN_FOOTPRINT  (256 * PAGE_SIZE)
+
+/* Object backends whose waste the policy compares. */
+#define FRAG_SLAB           0
+#define FRAG_SLUB           1
+#define FRAG_SLOB           2
+#define FRAG_NR_BACKENDS    3
+
 enum alloc_type {
     ALLOC_TINY = 0,
     ALLOC_SMALL = 1,
@@ -61,25 +84,34 @@ struct alloc_stats {
     u32 policy_switches;
 };
 
-struct allocation_metadata {
-    u32 size;
-    u32 flags;
-    u32 allocator_used;
-    u32 timestamp;
-    void *original_ptr;
+/*
+ * One measurement of every backend. footprint is the bytes a backend holds
+ * from the buddy, used the bytes its live objects occupy; the difference
+ * is internal waste. buddy_index is the unusable free space index per
+ * order, in FRAG_INDEX_SCALE.
+ */
+struct frag_report {
+    u32 buddy_index[MAX_ORDER + 1];
+    u32 buddy_free_pages;
+    u32 footprint[FRAG_NR_BACKENDS];
+    u32 used[FRAG_NR_BACKENDS];
+    struct slob_free_stats slob_free;
 };
 
 class UnifiedAllocator {
 public:
     void init(enum system_mode mode);
-    void *alloc(u32 size, u32 flags = 0);
+    void *alloc(u32 size, u32 flags = 0, void *caller = nullptr);
     void free(void *ptr);
-    void *realloc(void *ptr, u32 new_size);
-    void *calloc(u32 count, u32 size);
+    void *realloc(void *ptr, u32 new_size, void *caller = nullptr);
+    void *calloc(u32 count, u32 size, void *caller = nullptr);
+    u32 usable_size(void *ptr);
     
     void set_policy(u32 policy_mask);
     void set_system_mode(enum system_mode mode);
     void optimize_for_workload();
+    void measure_fragmentation(struct frag_report *report);
+    void print_fragmentation();
     void print_stats();
     void reset_stats();
     
@@ -91,38 +123,38 @@ public:
     void *stack_checkpoint();
     void stack_restore(void *checkpoint);
     
-    void enable_debug_tracking();
+    void enable_debug_tracking(u32 sample_rate = 1);
     void disable_debug_tracking();
     bool validate_heap();
     void dump_allocations();
-    
+
 private:
     enum system_mode current_mode;
     u32 policy_mask;
-    bool debug_tracking;
     struct alloc_stats stats;
     
-    struct allocation_metadata *debug_table;
-    u32 debug_table_size;
-    u32 debug_entries;
+    /* What ALLOC_POLICY_AUTO currently routes small and medium requests to. */
+    u32 small_policy;
+    u32 medium_policy;
+    u32 allocs_since_check;
+    u32 waste_percent[FRAG_NR_BACKENDS];
     
     enum alloc_type classify_allocation(u32 size);
     u32 select_allocator(u32 size, u32 flags);
     void update_stats(u32 size, u32 allocator, bool is_alloc);
-    void track_allocation(void *ptr, u32 size, u32 flags, u32 allocator);
-    void untrack_allocation(void *ptr);
-    struct allocation_metadata *find_allocation(void *ptr);
     bool should_switch_policy();
     void adjust_policy_for_workload();
     u32 calculate_fragmentation();
+    u32 pick_backend(u32 current, u32 candidates);
     void *internal_alloc(u32 size, u32 flags, u32 preferred_allocator);
-    void internal_free(void *ptr, u32 allocator_hint);
+    void internal_free(void *ptr, u32 allocator);
 };
 
 extern UnifiedAllocator unified_allocator;
 
 extern "C" {
     void *kmalloc_flags(u32 size, u32 flags);
+    u32 ksize(void *ptr);
     void *get_free_pages(u32 order);
     void free_pages(void *ptr, u32 order);
     void set_alloc_policy(u32 policy);